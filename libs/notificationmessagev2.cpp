@@ -25,11 +25,142 @@
 
 #include <QtCore/QDebug>
 #include <QtCore/QHash>
+#include <QtCore/QReadWriteLock>
 #include <QtDBus/QDBusMetaType>
 #include <qdbusconnection.h>
 
 using namespace Akonadi;
 
+namespace {
+
+/**
+ * Pool of strings shared by all notifications. Strings are never removed,
+ * so only values with few distinct ones (resources, mime types and flag
+ * names) may be interned, and to be safe against unexpected input the pool
+ * stops growing at some point.
+ */
+class StringPool
+{
+  public:
+    enum {
+      MaxSize = 4096
+    };
+
+    template<typename T>
+    T intern( QSet<T> &pool, const T &value )
+    {
+      if ( value.isEmpty() ) {
+        return value;
+      }
+
+      // Almost every value is in the pool already, so lookups only take a
+      // read lock and don't serialize the threads creating notifications
+      {
+        QReadLocker locker( &lock );
+        typename QSet<T>::const_iterator it = pool.constFind( value );
+        if ( it != pool.constEnd() ) {
+          return *it;
+        }
+        if ( pool.size() >= MaxSize ) {
+          return value;
+        }
+      }
+
+      QWriteLocker locker( &lock );
+      // Another thread may have inserted the value in the meantime
+      typename QSet<T>::const_iterator it = pool.constFind( value );
+      if ( it != pool.constEnd() ) {
+        return *it;
+      }
+      if ( pool.size() < MaxSize ) {
+        pool.insert( value );
+      }
+      return value;
+    }
+
+    QReadWriteLock lock;
+    QSet<QByteArray> byteArrays;
+    QSet<QString> strings;
+};
+
+}
+
+Q_GLOBAL_STATIC( StringPool, sStringPool )
+
+QByteArray NotificationMessageV2::Private::intern( const QByteArray &value )
+{
+  StringPool *pool = sStringPool();
+  return pool->intern( pool->byteArrays, value );
+}
+
+QString NotificationMessageV2::Private::intern( const QString &value )
+{
+  StringPool *pool = sStringPool();
+  return pool->intern( pool->strings, value );
+}
+
+QVector<QByteArray> NotificationMessageV2::Private::toSortedVector( const QSet<QByteArray> &set, bool internFlagNames )
+{
+  QVector<QByteArray> vector;
+  vector.reserve( set.size() );
+  Q_FOREACH ( const QByteArray &value, set ) {
+    // Flag names are atoms, the relations passed along with them
+    // ("RELATION type left right") are different for every change
+    if ( internFlagNames && !value.contains( ' ' ) ) {
+      vector.append( intern( value ) );
+    } else {
+      vector.append( value );
+    }
+  }
+  qSort( vector );
+  return vector;
+}
+
+QVector<qint64> NotificationMessageV2::Private::toSortedVector( const QSet<qint64> &set )
+{
+  QVector<qint64> vector;
+  vector.reserve( set.size() );
+  Q_FOREACH ( qint64 value, set ) {
+    vector.append( value );
+  }
+  qSort( vector );
+  return vector;
+}
+
+int NotificationMessageV2::Private::entityPosition( Id id ) const
+{
+  int low = 0;
+  int high = items.size();
+  while ( low < high ) {
+    const int mid = ( low + high ) / 2;
+    if ( items.at( mid ).id < id ) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+void NotificationMessageV2::Private::insertEntity( const NotificationMessageV2::Entity &entity )
+{
+  NotificationMessageV2::Entity copy( entity );
+  copy.mimeType = intern( entity.mimeType );
+
+  // Entities are almost always added in ascending order
+  if ( items.isEmpty() || items.last().id < copy.id ) {
+    items.append( copy );
+    return;
+  }
+
+  const int pos = entityPosition( copy.id );
+  if ( pos < items.size() && items.at( pos ).id == copy.id ) {
+    items[pos] = copy;
+  } else {
+    items.insert( pos, copy );
+  }
+}
+
 NotificationMessageV2::NotificationMessageV2():
   d( new Private )
 {
@@ -56,12 +187,18 @@ NotificationMessageV2 &NotificationMessageV2::operator=( const NotificationMessa
 bool NotificationMessageV2::operator==( const NotificationMessageV2 &other ) const
 {
   return d->operation == other.d->operation
+          && d->items == other.d->items
           && d->parts == other.d->parts
           && d->addedFlags == other.d->addedFlags
           && d->removedFlags == other.d->removedFlags
           && d->addedTags == other.d->addedTags
           && d->removedTags == other.d->removedTags
-          && NotificationMessageHelpers::compareWithoutOpAndParts( *this, other );
+          && d->type == other.d->type
+          && d->sessionId == other.d->sessionId
+          && d->resource == other.d->resource
+          && d->destResource == other.d->destResource
+          && d->parentCollection == other.d->parentCollection
+          && d->parentDestCollection == other.d->parentDestCollection;
 }
 
 void NotificationMessageV2::registerDBusTypes()
@@ -89,14 +226,15 @@ void NotificationMessageV2::addEntity( Id id, const QString &remoteId, const QSt
   item.remoteRevision = remoteRevision;
   item.mimeType = mimeType;
 
-  d->items.insert( id, item );
+  d->insertEntity( item );
 }
 
 void NotificationMessageV2::setEntities( const QList<NotificationMessageV2::Entity> &items )
 {
   clearEntities();
+  d->items.reserve( items.size() );
   Q_FOREACH ( const NotificationMessageV2::Entity &item, items ) {
-    d->items.insert( item.id, item );
+    d->insertEntity( item );
   }
 }
 
@@ -107,17 +245,30 @@ void NotificationMessageV2::clearEntities()
 
 QMap<NotificationMessageV2::Id, NotificationMessageV2::Entity> NotificationMessageV2::entities() const
 {
-  return d->items;
+  QMap<Id, Entity> entities;
+  Q_FOREACH ( const Entity &entity, d->items ) {
+    entities.insert( entity.id, entity );
+  }
+  return entities;
 }
 
 NotificationMessageV2::Entity NotificationMessageV2::entity( NotificationMessageV2::Id id ) const
 {
-  return d->items.value( id );
+  const int pos = d->entityPosition( id );
+  if ( pos < d->items.size() && d->items.at( pos ).id == id ) {
+    return d->items.at( pos );
+  }
+  return Entity();
 }
 
 QList<NotificationMessageV2::Id> NotificationMessageV2::uids() const
 {
-  return d->items.keys();
+  QList<Id> uids;
+  uids.reserve( d->items.size() );
+  Q_FOREACH ( const Entity &entity, d->items ) {
+    uids.append( entity.id );
+  }
+  return uids;
 }
 
 QByteArray NotificationMessageV2::sessionId() const
@@ -127,12 +278,14 @@ QByteArray NotificationMessageV2::sessionId() const
 
 void NotificationMessageV2::setSessionId( const QByteArray &sessionId )
 {
+  // Every connection has its own session ID, they would pile up in the
+  // pool; notifications of one session share the ID anyway
   d->sessionId = sessionId;
 }
 
 NotificationMessageV2::Type NotificationMessageV2::type() const
 {
-  return d->type;
+  return static_cast<Type>( d->type );
 }
 
 void NotificationMessageV2::setType( Type type )
@@ -142,7 +295,7 @@ void NotificationMessageV2::setType( Type type )
 
 NotificationMessageV2::Operation NotificationMessageV2::operation() const
 {
-  return d->operation;
+  return static_cast<Operation>( d->operation );
 }
 
 void NotificationMessageV2::setOperation( Operation operation )
@@ -157,7 +310,7 @@ QByteArray NotificationMessageV2::resource() const
 
 void NotificationMessageV2::setResource( const QByteArray &resource )
 {
-  d->resource = resource;
+  d->resource = Private::intern( resource );
 }
 
 NotificationMessageV2::Id NotificationMessageV2::parentCollection() const
@@ -182,7 +335,7 @@ void NotificationMessageV2::setParentDestCollection( Id parent )
 
 void NotificationMessageV2::setDestinationResource( const QByteArray &destResource )
 {
-  d->destResource = destResource;
+  d->destResource = Private::intern( destResource );
 }
 
 QByteArray NotificationMessageV2::destinationResource() const
@@ -192,59 +345,59 @@ QByteArray NotificationMessageV2::destinationResource() const
 
 QSet<QByteArray> NotificationMessageV2::itemParts() const
 {
-  return d->parts;
+  return Private::toSet( d->parts );
 }
 
 void NotificationMessageV2::setItemParts( const QSet<QByteArray> &parts )
 {
-  d->parts = parts;
+  d->parts = Private::toSortedVector( parts );
 }
 
 QSet<QByteArray> NotificationMessageV2::addedFlags() const
 {
-  return d->addedFlags;
+  return Private::toSet( d->addedFlags );
 }
 
 void NotificationMessageV2::setAddedFlags( const QSet<QByteArray> &addedFlags )
 {
-  d->addedFlags = addedFlags;
+  d->addedFlags = Private::toSortedVector( addedFlags, true );
 }
 
 QSet<QByteArray> NotificationMessageV2::removedFlags() const
 {
-  return d->removedFlags;
+  return Private::toSet( d->removedFlags );
 }
 
 void NotificationMessageV2::setRemovedFlags( const QSet<QByteArray> &removedFlags )
 {
-  d->removedFlags = removedFlags;
+  d->removedFlags = Private::toSortedVector( removedFlags, true );
 }
 
 QSet<qint64> NotificationMessageV2::addedTags() const
 {
-  return d->addedTags;
+  return Private::toSet( d->addedTags );
 }
 
 void NotificationMessageV2::setAddedTags( const QSet<qint64> &addedTags )
 {
-  d->addedTags = addedTags;
+  d->addedTags = Private::toSortedVector( addedTags );
 }
 
 QSet<qint64> NotificationMessageV2::removedTags() const
 {
-  return d->removedTags;
+  return Private::toSet( d->removedTags );
 }
 
 void NotificationMessageV2::setRemovedTags( const QSet<qint64> &removedTags )
 {
-  d->removedTags = removedTags;
+  d->removedTags = Private::toSortedVector( removedTags );
 }
 
 QString NotificationMessageV2::toString() const
 {
   QString rv;
 
-  switch ( d->type ) {
+  switch ( type() ) {
   case Items:
     rv += QLatin1String( "Items " );
     break;
@@ -287,7 +440,7 @@ QString NotificationMessageV2::toString() const
     rv += QLatin1String( "unspecified parent collection " );
   }
 
-  switch ( d->operation ) {
+  switch ( operation() ) {
   case Add:
     rv += QLatin1String( "added" );
     break;
@@ -479,8 +632,8 @@ const QDBusArgument &operator>>( const QDBusArgument &arg, Akonadi::Notification
 uint qHash( const Akonadi::NotificationMessageV2 &msg )
 {
   uint i = 0;
-  Q_FOREACH ( const NotificationMessageV2::Entity &item, msg.entities() ) {
-    i += item.id;
+  Q_FOREACH ( NotificationMessageV2::Id id, msg.uids() ) {
+    i += id;
   }
 
   return qHash( i + ( msg.type() << 31 ) + ( msg.operation() << 28 ) );
@@ -516,7 +669,7 @@ QVector<NotificationMessage> NotificationMessageV2::toNotificationV1() const
     } else if ( d->operation == ModifyFlags ) {
       parts << "FLAGS";
     } else {
-      parts = d->parts;
+      parts = Private::toSet( d->parts );
     }
     msgv1.setItemParts( parts );
 
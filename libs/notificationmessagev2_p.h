@@ -33,13 +33,18 @@
 #include <QtDBus/QDBusArgument>
 #include "notificationmessage_p.h"
 
+class NotificationJournalTest;
+
 namespace Akonadi
 {
 
 namespace Server
 {
 class NotificationCollector;
+class NotificationCompressor;
+class NotificationJournal;
 class NotificationSource;
+class NotificationSubscriptionIndex;
 }
 
 /**
@@ -169,7 +174,11 @@ class AKONADIPROTOCOLINTERNALS_EXPORT NotificationMessageV2
 
     // Grant access to the d-pointer
     friend class Server::NotificationCollector;
+    friend class Server::NotificationCompressor;
+    friend class Server::NotificationJournal;
     friend class Server::NotificationSource;
+    friend class Server::NotificationSubscriptionIndex;
+    friend class ::NotificationJournalTest;
 };
 
 } // namespace Akonadi
@@ -185,6 +194,7 @@ QDBusArgument &operator<<( QDBusArgument &qrg, Akonadi::NotificationMessageV2::T
 uint qHash( const Akonadi::NotificationMessageV2 &msg );
 
 Q_DECLARE_TYPEINFO( Akonadi::NotificationMessageV2, Q_MOVABLE_TYPE );
+Q_DECLARE_TYPEINFO( Akonadi::NotificationMessageV2::Entity, Q_MOVABLE_TYPE );
 
 Q_DECLARE_METATYPE( Akonadi::NotificationMessageV2 )
 Q_DECLARE_METATYPE( Akonadi::NotificationMessageV2::Entity )
@@ -25,6 +25,20 @@
 namespace Akonadi
 {
 
+/**
+ * The server keeps every notification of a transaction in memory until it is
+ * committed, and a single change to a large folder can produce notifications
+ * with hundreds of thousands of entities, so the data is stored compactly:
+ *
+ * - entities are kept in a vector sorted by ID instead of a QMap, which needs
+ *   a separate allocation for every node
+ * - small sets (parts, flags, tags) are sorted vectors instead of QSets
+ * - strings that repeat in almost every notification and have few distinct
+ *   values (resource names, mime types and flag names) are interned, so
+ *   that all notifications share a single copy of them
+ *
+ * The public API still works with QMaps and QSets, they are built on demand.
+ */
 class NotificationMessageV2::Private : public QSharedData
 {
   public:
@@ -37,37 +51,52 @@ class NotificationMessageV2::Private : public QSharedData
     {
     }
 
-    Private( const Private &other )
-      : QSharedData( other )
+    /**
+     * Returns position of entity @p id in items, or the position where it
+     * would have to be inserted if it's not there.
+     */
+    int entityPosition( Id id ) const;
+
+    /**
+     * Inserts @p entity into items, replacing an existing entity with the
+     * same ID.
+     */
+    void insertEntity( const NotificationMessageV2::Entity &entity );
+
+    static QByteArray intern( const QByteArray &value );
+    static QString intern( const QString &value );
+
+    /**
+     * Returns the values of @p set sorted, with flag names interned if
+     * @p internFlagNames is set.
+     */
+    static QVector<QByteArray> toSortedVector( const QSet<QByteArray> &set, bool internFlagNames = false );
+    static QVector<qint64> toSortedVector( const QSet<qint64> &set );
+    template<typename T>
+    static QSet<T> toSet( const QVector<T> &vector )
     {
-      sessionId = other.sessionId;
-      type = other.type;
-      operation = other.operation;
-      items = other.items;
-      resource = other.resource;
-      destResource = other.destResource;
-      parentCollection = other.parentCollection;
-      parentDestCollection = other.parentDestCollection;
-      parts = other.parts;
-      addedFlags = other.addedFlags;
-      removedFlags = other.removedFlags;
-      addedTags = other.addedTags;
-      removedTags = other.removedTags;
+      QSet<T> set;
+      set.reserve( vector.size() );
+      Q_FOREACH ( const T &value, vector ) {
+        set.insert( value );
+      }
+      return set;
     }
 
+    // Small members first, so that they share the alignment padding of QSharedData
+    quint8 type;
+    quint8 operation;
     QByteArray sessionId;
-    NotificationMessageV2::Type type;
-    NotificationMessageV2::Operation operation;
-    QMap<Id, NotificationMessageV2::Entity> items;
+    QVector<NotificationMessageV2::Entity> items;
     QByteArray resource;
     QByteArray destResource;
     Id parentCollection;
     Id parentDestCollection;
-    QSet<QByteArray> parts;
-    QSet<QByteArray> addedFlags;
-    QSet<QByteArray> removedFlags;
-    QSet<qint64> addedTags;
-    QSet<qint64> removedTags;
+    QVector<QByteArray> parts;
+    QVector<QByteArray> addedFlags;
+    QVector<QByteArray> removedFlags;
+    QVector<qint64> addedTags;
+    QVector<qint64> removedTags;
 
     // For internal use only: Akonadi server can add some additional information
     // that might be useful when evaluating the notification for example, but
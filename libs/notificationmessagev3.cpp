@@ -142,6 +142,76 @@ QDBusArgument &operator<<( QDBusArgument &arg, const NotificationMessageV3 &msg
   return arg;
 }
 
+QDataStream &operator>>( QDataStream &stream, NotificationMessageV3 &msg )
+{
+  QByteArray ba;
+  int i;
+  NotificationMessageV2::Id id;
+  QSet<QByteArray> bas;
+  QSet<qint64> ints;
+
+  stream >> ba;
+  msg.setSessionId( ba );
+  stream >> i;
+  msg.setType( static_cast<NotificationMessageV2::Type>( i ) );
+  stream >> i;
+  msg.setOperation( static_cast<NotificationMessageV2::Operation>( i ) );
+
+  stream >> i;
+  msg.clearEntities();
+  for ( ; i > 0 && stream.status() == QDataStream::Ok; --i ) {
+    NotificationMessageV2::Entity entity;
+    stream >> entity.id >> entity.remoteId >> entity.remoteRevision >> entity.mimeType;
+    msg.addEntity( entity.id, entity.remoteId, entity.remoteRevision, entity.mimeType );
+  }
+
+  stream >> ba;
+  msg.setResource( ba );
+  stream >> ba;
+  msg.setDestinationResource( ba );
+  stream >> id;
+  msg.setParentCollection( id );
+  stream >> id;
+  msg.setParentDestCollection( id );
+  stream >> bas;
+  msg.setItemParts( bas );
+  stream >> bas;
+  msg.setAddedFlags( bas );
+  stream >> bas;
+  msg.setRemovedFlags( bas );
+  stream >> ints;
+  msg.setAddedTags( ints );
+  stream >> ints;
+  msg.setRemovedTags( ints );
+
+  return stream;
+}
+
+QDataStream &operator<<( QDataStream &stream, const NotificationMessageV3 &msg )
+{
+  stream << msg.sessionId();
+  stream << static_cast<int>( msg.type() );
+  stream << static_cast<int>( msg.operation() );
+
+  const QMap<NotificationMessageV2::Id, NotificationMessageV2::Entity> entities = msg.entities();
+  stream << entities.count();
+  Q_FOREACH ( const NotificationMessageV2::Entity &entity, entities ) {
+    stream << entity.id << entity.remoteId << entity.remoteRevision << entity.mimeType;
+  }
+
+  stream << msg.resource();
+  stream << msg.destinationResource();
+  stream << msg.parentCollection();
+  stream << msg.parentDestCollection();
+  stream << msg.itemParts();
+  stream << msg.addedFlags();
+  stream << msg.removedFlags();
+  stream << msg.addedTags();
+  stream << msg.removedTags();
+
+  return stream;
+}
+
 QDebug operator<<( QDebug dbg, const NotificationMessageV3 &msg )
 {
   dbg.nospace() << "NotificationMessageV3 {\n";
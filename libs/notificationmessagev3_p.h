@@ -24,6 +24,7 @@
 
 #include "notificationmessagev2_p.h"
 #include <QDBusArgument>
+#include <QDataStream>
 #include <QDebug>
 
 namespace Akonadi
@@ -53,6 +54,13 @@ AKONADIPROTOCOLINTERNALS_EXPORT QDebug operator<<(QDebug dbg, const Akonadi::Not
 const QDBusArgument &operator>>( const QDBusArgument &arg, Akonadi::NotificationMessageV3 &msg );
 QDBusArgument &operator<<( QDBusArgument &arg, const Akonadi::NotificationMessageV3 &msg );
 
+/**
+ * Compact binary serialization, used for in-band notifications sent over
+ * the Akonadi protocol connection instead of D-Bus.
+ */
+AKONADIPROTOCOLINTERNALS_EXPORT QDataStream &operator>>( QDataStream &stream, Akonadi::NotificationMessageV3 &msg );
+AKONADIPROTOCOLINTERNALS_EXPORT QDataStream &operator<<( QDataStream &stream, const Akonadi::NotificationMessageV3 &msg );
+
 Q_DECLARE_TYPEINFO( Akonadi::NotificationMessageV3, Q_MOVABLE_TYPE );
 Q_DECLARE_METATYPE( Akonadi::NotificationMessageV3 )
 Q_DECLARE_METATYPE( Akonadi::NotificationMessageV3::List )
@@ -52,6 +52,7 @@
 #define AKONADI_CMD_COLLECTIONCREATE "CREATE"
 #define AKONADI_CMD_COLLECTIONDELETE "DELETE"
 #define AKONADI_CMD_EXPUNGE          "EXPUNGE"
+#define AKONADI_CMD_EXPORT           "EXPORT"
 #define AKONADI_CMD_ITEMFETCH        "FETCH"
 #define AKONADI_CMD_GID              "GID"
 #define AKONADI_CMD_HRID             "HRID"
@@ -63,6 +64,7 @@
 #define AKONADI_CMD_MERGE            "MERGE"
 #define AKONADI_CMD_COLLECTIONMODIFY "MODIFY"
 #define AKONADI_CMD_ITEMMOVE         "MOVE"
+#define AKONADI_CMD_NOTIFY           "NOTIFY"
 #define AKONADI_CMD_ITEMDELETE       "REMOVE"
 #define AKONADI_CMD_RESOURCESELECT   "RESSELECT"
 #define AKONADI_CMD_RID              "RID"
@@ -90,10 +92,13 @@
 
 // Command parameters
 #define AKONADI_PARAM_CAPABILITY_AKAPPENDSTREAMING "AKAPPENDSTREAMING"
+#define AKONADI_PARAM_AFTER                        "AFTER"
 #define AKONADI_PARAM_ALLATTRIBUTES                "ALLATTR"
 #define AKONADI_PARAM_ANCESTORS                    "ANCESTORS"
 #define AKONADI_PARAM_ANCESTORATTRIBUTE            "ANCESTORATTR"
+#define AKONADI_PARAM_ASCENDING                    "ASC"
 #define AKONADI_PARAM_ATR                          "ATR:"
+#define AKONADI_PARAM_BACKGROUND                   "BACKGROUND"
 #define AKONADI_PARAM_CACHEONLY                    "CACHEONLY"
 #define AKONADI_PARAM_CACHEDPARTS                  "CACHEDPARTS"
 #define AKONADI_PARAM_CACHETIMEOUT                 "CACHETIMEOUT"
@@ -101,10 +106,12 @@
 #define AKONADI_PARAM_CHANGEDSINCE                 "CHANGEDSINCE"
 #define AKONADI_PARAM_CHARSET                      "CHARSET"
 #define AKONADI_PARAM_CHECKCACHEDPARTSONLY         "CHECKCACHEDPARTSONLY"
+#define AKONADI_PARAM_CHUNKSIZE                    "CHUNKSIZE"
 #define AKONADI_PARAM_COLLECTION                   "COLLECTION"
 #define AKONADI_PARAM_COLLECTIONID                 "COLLECTIONID"
 #define AKONADI_PARAM_COLLECTIONS                  "COLLECTIONS"
 #define AKONADI_PARAM_MTIME                        "DATETIME"
+#define AKONADI_PARAM_DESCENDING                   "DESC"
 #define AKONADI_PARAM_CAPABILITY_DIRECTSTREAMING   "DIRECTSTREAMING"
 #define AKONADI_PARAM_UNDIRTY                      "DIRTY"
 #define AKONADI_PARAM_DISPLAY                      "DISPLAY"
@@ -113,21 +120,31 @@
 #define AKONADI_PARAM_FLAGS                        "FLAGS"
 #define AKONADI_PARAM_TAGS                         "TAGS"
 #define AKONADI_PARAM_FULLPAYLOAD                  "FULLPAYLOAD"
+#define AKONADI_PARAM_FULLSYNC                     "FULLSYNC"
 #define AKONADI_PARAM_GID                          "GID"
 #define AKONADI_PARAM_GTAGS                        "GTAGS"
+#define AKONADI_PARAM_HIGHESTMODSEQ                "HIGHESTMODSEQ"
 #define AKONADI_PARAM_IGNOREERRORS                 "IGNOREERRORS"
+#define AKONADI_PARAM_CAPABILITY_INBANDNOTIFY      "INBANDNOTIFY"
 #define AKONADI_PARAM_INDEX                        "INDEX"
 #define AKONADI_PARAM_INHERIT                      "INHERIT"
 #define AKONADI_PARAM_INTERVAL                     "INTERVAL"
+#define AKONADI_PARAM_INVALIDATE                   "INVALIDATE"
 #define AKONADI_PARAM_INVALIDATECACHE              "INVALIDATECACHE"
 #define AKONADI_PARAM_MIMETYPE                     "MIMETYPE"
 #define AKONADI_PARAM_MERGE                        "MERGE"
+#define AKONADI_PARAM_MODSEQ                       "MODSEQ"
 #define AKONADI_PARAM_LEFT                         "LEFT"
+#define AKONADI_PARAM_LIMIT                        "LIMIT"
 #define AKONADI_PARAM_LOCALPARTS                   "LOCALPARTS"
 #define AKONADI_PARAM_NAME                         "NAME"
+#define AKONADI_PARAM_NEXT                         "NEXT"
+#define AKONADI_PARAM_NORMAL                       "NORMAL"
 #define AKONADI_PARAM_CAPABILITY_NOTIFY            "NOTIFY"
 #define AKONADI_PARAM_CAPABILITY_NOPAYLOADPATH     "NOPAYLOADPATH"
+#define AKONADI_PARAM_OFFSET                       "OFFSET"
 #define AKONADI_PARAM_PARENT                       "PARENT"
+#define AKONADI_PARAM_PRIORITY                     "PRIORITY"
 #define AKONADI_PARAM_PERSISTENTSEARCH             "PERSISTENTSEARCH"
 #define AKONADI_PARAM_PARTS                        "PARTS"
 #define AKONADI_PARAM_PLD                          "PLD:"
@@ -151,13 +168,16 @@
 #define AKONADI_PARAM_CAPABILITY_SERVERSEARCH      "SERVERSEARCH"
 #define AKONADI_PARAM_SIDE                         "SIDE"
 #define AKONADI_PARAM_SIZE                         "SIZE"
+#define AKONADI_PARAM_SORT                         "SORT"
 #define AKONADI_PARAM_STATISTICS                   "STATISTICS"
 #define AKONADI_PARAM_SYNC                         "SYNC"
 #define AKONADI_PARAM_SYNCONDEMAND                 "SYNCONDEMAND"
 #define AKONADI_PARAM_TAG                          "TAG"
 #define AKONADI_PARAM_TAGID                        "TAGID"
+#define AKONADI_PARAM_TREEREVISION                 "TREEREVISION"
 #define AKONADI_PARAM_TYPE                         "TYPE"
 #define AKONADI_PARAM_UID                          "UID"
+#define AKONADI_PARAM_VANISHED                     "VANISHED"
 #define AKONADI_PARAM_VIRTREF                      "VIRTREF"
 #define AKONADI_PARAM_VIRTUAL                      "VIRTUAL"
 
@@ -0,0 +1,193 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QtTest/QTest>
+#include <QtCore/QThread>
+#include <QtCore/QtConcurrentMap>
+#include <QtDBus/QDBusArgument>
+#include "../notificationmessagev3_p.h"
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace Akonadi;
+
+/**
+ * Compares the cost of encoding notifications for D-Bus with the
+ * QDataStream encoding used for in-band notifications, and measures how
+ * much memory large notifications take.
+ */
+class NotificationMessageBenchmark : public QObject
+{
+  Q_OBJECT
+  private:
+    static NotificationMessageV3::List createNotifications( int count )
+    {
+      NotificationMessageV3::List list;
+      for ( int i = 0; i < count; ++i ) {
+        NotificationMessageV3 msg;
+        msg.setSessionId( "akonadi_imap_resource_0" );
+        msg.setType( NotificationMessageV2::Items );
+        msg.setOperation( NotificationMessageV2::ModifyFlags );
+        msg.setResource( "akonadi_imap_resource_0" );
+        msg.setParentCollection( 42 );
+        for ( int j = 0; j < 10; ++j ) {
+          msg.addEntity( i * 10 + j, QString::number( 1000 + i * 10 + j ), QLatin1String( "1" ), QLatin1String( "message/rfc822" ) );
+        }
+        msg.setAddedFlags( QSet<QByteArray>() << "\\SEEN" );
+        msg.setRemovedFlags( QSet<QByteArray>() << "$TODO" );
+        list << msg;
+      }
+      return list;
+    }
+
+    static void createBatch( int &count )
+    {
+      count = createNotifications( count ).count();
+    }
+
+    static qint64 allocatedMemory()
+    {
+#ifdef __GLIBC__
+      return mallinfo().uordblks;
+#else
+      return 0;
+#endif
+    }
+
+    static NotificationMessageV3 createLargeNotification( int count )
+    {
+      NotificationMessageV3 msg;
+      msg.setSessionId( "akonadi_imap_resource_0" );
+      msg.setType( NotificationMessageV2::Items );
+      msg.setOperation( NotificationMessageV2::ModifyFlags );
+      msg.setResource( "akonadi_imap_resource_0" );
+      msg.setParentCollection( 42 );
+      for ( int i = 0; i < count; ++i ) {
+        // Every mime type is a separate copy, just like when it comes from the database
+        msg.addEntity( i, QString::number( 1000 + i ), QString(), QString::fromLatin1( "message/rfc822" ) );
+      }
+      msg.setAddedFlags( QSet<QByteArray>() << "\\SEEN" );
+      return msg;
+    }
+
+  private Q_SLOTS:
+    void initTestCase()
+    {
+      NotificationMessageV3::registerDBusTypes();
+    }
+
+    void memory_data()
+    {
+      QTest::addColumn<int>( "count" );
+      QTest::newRow( "1000" ) << 1000;
+      QTest::newRow( "100000" ) << 100000;
+    }
+
+    void memory()
+    {
+      QFETCH( int, count );
+
+      const qint64 before = allocatedMemory();
+      NotificationMessageV3 msg = createLargeNotification( count );
+      const qint64 after = allocatedMemory();
+      if ( after > before ) {
+        qDebug() << count << "entities take" << ( after - before ) << "bytes,"
+                 << ( after - before ) / count << "bytes per entity";
+      }
+      QCOMPARE( msg.uids().count(), count );
+
+      QBENCHMARK {
+        createLargeNotification( count );
+      }
+    }
+
+    void concurrentCreate()
+    {
+      // Interning the strings must not serialize threads that create
+      // notifications at the same time
+      const int threads = qMax( QThread::idealThreadCount(), 2 );
+      QBENCHMARK {
+        QVector<int> batches( threads * 4, 1000 );
+        QtConcurrent::blockingMap( batches, createBatch );
+      }
+    }
+
+    void marshall_data()
+    {
+      QTest::addColumn<NotificationMessageV3::List>( "notifications" );
+      QTest::newRow( "1" ) << createNotifications( 1 );
+      QTest::newRow( "100" ) << createNotifications( 100 );
+      QTest::newRow( "10000" ) << createNotifications( 10000 );
+    }
+
+    void marshall()
+    {
+      QFETCH( NotificationMessageV3::List, notifications );
+      QBENCHMARK {
+        QDBusArgument arg;
+        arg << notifications;
+      }
+    }
+
+    void dataStream_data()
+    {
+      marshall_data();
+    }
+
+    void dataStream()
+    {
+      QFETCH( NotificationMessageV3::List, notifications );
+      QBENCHMARK {
+        QByteArray data;
+        QDataStream stream( &data, QIODevice::WriteOnly );
+        stream.setVersion( QDataStream::Qt_4_6 );
+        stream << notifications;
+      }
+    }
+
+    void dataStreamRead_data()
+    {
+      marshall_data();
+    }
+
+    void dataStreamRead()
+    {
+      QFETCH( NotificationMessageV3::List, notifications );
+      QByteArray data;
+      {
+        QDataStream stream( &data, QIODevice::WriteOnly );
+        stream.setVersion( QDataStream::Qt_4_6 );
+        stream << notifications;
+      }
+      qDebug() << notifications.count() << "notifications take" << data.size() << "bytes";
+
+      QBENCHMARK {
+        QDataStream stream( data );
+        stream.setVersion( QDataStream::Qt_4_6 );
+        NotificationMessageV3::List result;
+        stream >> result;
+      }
+    }
+};
+
+QTEST_MAIN( NotificationMessageBenchmark )
+
+#include "notificationmessagebenchmark.moc"
@@ -20,6 +20,7 @@
 
 #include "notificationmessagev2test.h"
 #include <notificationmessagev2_p.h>
+#include <notificationmessagev3_p.h>
 
 #include <QSet>
 #include <QtTest/QTest>
@@ -221,6 +222,42 @@ void NotificationMessageV2Test::testNoCompress()
   QCOMPARE( list.count(), 2 );
 }
 
+void NotificationMessageV2Test::testDataStream()
+{
+  NotificationMessageV3 msg;
+  msg.setSessionId( "session" );
+  msg.setType( NotificationMessageV2::Items );
+  msg.setOperation( NotificationMessageV2::Move );
+  msg.addEntity( 1, QLatin1String( "rid1" ), QLatin1String( "rev1" ), QLatin1String( "message/rfc822" ) );
+  msg.addEntity( 2, QLatin1String( "rid2" ), QString(), QLatin1String( "message/rfc822" ) );
+  msg.setResource( "resource1" );
+  msg.setDestinationResource( "resource2" );
+  msg.setParentCollection( 10 );
+  msg.setParentDestCollection( 20 );
+  msg.setItemParts( QSet<QByteArray>() << "PLD:RFC822" );
+  msg.setAddedFlags( QSet<QByteArray>() << "\\SEEN" );
+  msg.setRemovedFlags( QSet<QByteArray>() << "$TODO" );
+  msg.setAddedTags( QSet<qint64>() << 3 );
+  msg.setRemovedTags( QSet<qint64>() << 4 );
+
+  NotificationMessageV3::List list;
+  list << msg << NotificationMessageV3();
+
+  QByteArray data;
+  {
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    stream << list;
+  }
+
+  NotificationMessageV3::List result;
+  QDataStream stream( data );
+  stream >> result;
+  QCOMPARE( stream.status(), QDataStream::Ok );
+  QCOMPARE( result.count(), 2 );
+  QVERIFY( result.at( 0 ) == msg );
+  QVERIFY( result.at( 1 ) == NotificationMessageV3() );
+}
+
 // void NotificationMessageV2Test::testPartModificationMerge_data()
 // {
 //   QTest::addColumn<NotificationMessageV2::Type>( "type" );
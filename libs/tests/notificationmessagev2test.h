@@ -36,6 +36,7 @@ class NotificationMessageV2Test : public QObject
     void testCompress7();
     // void testCompressWithItemParts();
     void testNoCompress();
+    void testDataStream();
     // void testPartModificationMerge_data();
     // void testPartModificationMerge();
 };
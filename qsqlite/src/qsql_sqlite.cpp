@@ -115,6 +115,10 @@ public:
     QSQLiteResultPrivate(QSQLiteResult *res);
     void cleanup();
     bool fetchNext(QSqlCachedResult::ValueCache &values, int idx, bool initialFetch);
+    // steps to the next row without copying it, used by forward-only queries
+    bool stepRow();
+    QVariant columnValue(int i) const;
+    void detachRow();
     // initializes the recordInfo and the cache
     void initColumns(bool emptyResultset);
     void finalize();
@@ -128,10 +132,16 @@ public:
     bool skipRow; // skip the next fetchNext()?
     QSqlRecord rInf;
     QVector<QVariant> firstRow;
+    QVector<QByteArray> boundTexts; // UTF-8 copies of bound strings, sqlite keeps pointers to them
+
+    // forward-only queries: copy of the last row made by fetchLast(), the
+    // statement has been reset already
+    bool rowDetached;
+    QVector<QVariant> detachedRow;
 };
 
 QSQLiteResultPrivate::QSQLiteResultPrivate(QSQLiteResult* res) : q(res), access(0),
-    stmt(0), skippedStatus(false), skipRow(false)
+    stmt(0), skippedStatus(false), skipRow(false), rowDetached(false)
 {
 }
 
@@ -141,6 +151,8 @@ void QSQLiteResultPrivate::cleanup()
     rInf.clear();
     skippedStatus = false;
     skipRow = false;
+    rowDetached = false;
+    detachedRow.clear();
     q->setAt(QSql::BeforeFirstRow);
     q->setActive(false);
     q->cleanup();
@@ -153,6 +165,7 @@ void QSQLiteResultPrivate::finalize()
 
     sqlite3_finalize(stmt);
     stmt = 0;
+    boundTexts.clear();
 }
 
 void QSQLiteResultPrivate::initColumns(bool emptyResultset)
@@ -164,13 +177,10 @@ void QSQLiteResultPrivate::initColumns(bool emptyResultset)
     q->init(nCols);
 
     for (int i = 0; i < nCols; ++i) {
-        QString colName = QString::fromUtf16(
-                    static_cast<const ushort *>(sqlite3_column_name16(stmt, i))
-                    ).remove(QLatin1Char('"'));
+        QString colName = QString::fromUtf8(sqlite3_column_name(stmt, i)).remove(QLatin1Char('"'));
 
         // must use typeName for resolving the type to match QSqliteDriver::record
-        QString typeName = QString::fromUtf16(
-                    static_cast<const ushort *>(sqlite3_column_decltype16(stmt, i)));
+        QString typeName = QString::fromUtf8(sqlite3_column_decltype(stmt, i));
 
         int dotIdx = colName.lastIndexOf(QLatin1Char('.'));
         QSqlField fld(colName.mid(dotIdx == -1 ? 0 : dotIdx + 1), qGetColumnType(typeName));
@@ -216,43 +226,11 @@ bool QSQLiteResultPrivate::fetchNext(QSqlCachedResult::ValueCache &values, int i
         if (rInf.isEmpty())
             // must be first call.
             initColumns(false);
-        if (idx < 0 && !initialFetch)
+        // idx < 0: the row stays in the statement, see QSQLiteResult::data()
+        if (idx < 0)
             return true;
-        for (i = 0; i < rInf.count(); ++i) {
-            switch (sqlite3_column_type(stmt, i)) {
-            case SQLITE_BLOB:
-                values[i + idx] = QByteArray(static_cast<const char *>(
-                            sqlite3_column_blob(stmt, i)),
-                            sqlite3_column_bytes(stmt, i));
-                break;
-            case SQLITE_INTEGER:
-                values[i + idx] = sqlite3_column_int64(stmt, i);
-                break;
-            case SQLITE_FLOAT:
-                switch(q->numericalPrecisionPolicy()) {
-                    case QSql::LowPrecisionInt32:
-                        values[i + idx] = sqlite3_column_int(stmt, i);
-                        break;
-                    case QSql::LowPrecisionInt64:
-                        values[i + idx] = sqlite3_column_int64(stmt, i);
-                        break;
-                    case QSql::LowPrecisionDouble:
-                    case QSql::HighPrecision:
-                    default:
-                        values[i + idx] = sqlite3_column_double(stmt, i);
-                        break;
-                };
-                break;
-            case SQLITE_NULL:
-                values[i + idx] = QVariant(QVariant::String);
-                break;
-            default:
-                values[i + idx] = QString::fromUtf16(static_cast<const ushort *>(
-                            sqlite3_column_text16(stmt, i)),
-                            sqlite3_column_bytes16(stmt, i) / sizeof(ushort));
-                break;
-            }
-        }
+        for (i = 0; i < rInf.count(); ++i)
+            values[i + idx] = columnValue(i);
         return true;
     case SQLITE_DONE:
         if (rInf.isEmpty())
@@ -282,6 +260,53 @@ bool QSQLiteResultPrivate::fetchNext(QSqlCachedResult::ValueCache &values, int i
     return false;
 }
 
+bool QSQLiteResultPrivate::stepRow()
+{
+    if (skipRow) {
+        // exec() already stepped onto the first row
+        skipRow = false;
+        return skippedStatus;
+    }
+    QSqlCachedResult::ValueCache noValues;
+    return fetchNext(noValues, -1, false);
+}
+
+QVariant QSQLiteResultPrivate::columnValue(int i) const
+{
+    switch (sqlite3_column_type(stmt, i)) {
+    case SQLITE_BLOB:
+        // the buffer is only valid until the next step, so it has to be copied
+        return QByteArray(static_cast<const char *>(sqlite3_column_blob(stmt, i)),
+                          sqlite3_column_bytes(stmt, i));
+    case SQLITE_INTEGER:
+        return sqlite3_column_int64(stmt, i);
+    case SQLITE_FLOAT:
+        switch(q->numericalPrecisionPolicy()) {
+            case QSql::LowPrecisionInt32:
+                return sqlite3_column_int(stmt, i);
+            case QSql::LowPrecisionInt64:
+                return sqlite3_column_int64(stmt, i);
+            case QSql::LowPrecisionDouble:
+            case QSql::HighPrecision:
+            default:
+                return sqlite3_column_double(stmt, i);
+        };
+    case SQLITE_NULL:
+        return QVariant(QVariant::String);
+    default:
+        // the database is UTF-8 encoded, so this avoids a conversion inside sqlite
+        return QString::fromUtf8(reinterpret_cast<const char *>(sqlite3_column_text(stmt, i)),
+                                 sqlite3_column_bytes(stmt, i));
+    }
+}
+
+void QSQLiteResultPrivate::detachRow()
+{
+    detachedRow.resize(rInf.count());
+    for (int i = 0; i < rInf.count(); ++i)
+        detachedRow[i] = columnValue(i);
+}
+
 QSQLiteResult::QSQLiteResult(const QSQLiteDriver* db)
     : QSqlCachedResult(db)
 {
@@ -324,10 +349,9 @@ bool QSQLiteResult::prepare(const QString &query)
     setSelect(false);
 
 #if (SQLITE_VERSION_NUMBER >= 3003011)
-//    int res = sqlite3_prepare16_v2(d->access, query.constData(), (query.size() + 1) * sizeof(QChar),
-//                                   &d->stmt, 0);
-    int res = sqlite3_blocking_prepare16_v2(d->access, query.constData(), (query.size() + 1) * sizeof(QChar),
-                                            &d->stmt, 0);
+    const QByteArray sql = query.toUtf8();
+    int res = sqlite3_blocking_prepare_v2(d->access, sql.constData(), sql.size() + 1,
+                                          &d->stmt, 0);
 #else
     int res = sqlite3_prepare16(d->access, query.constData(), (query.size() + 1) * sizeof(QChar),
                                 &d->stmt, 0);
@@ -348,6 +372,8 @@ bool QSQLiteResult::exec()
 
     d->skippedStatus = false;
     d->skipRow = false;
+    d->rowDetached = false;
+    d->detachedRow.clear();
     d->rInf.clear();
     clearValues();
     setLastError(QSqlError());
@@ -361,6 +387,8 @@ bool QSQLiteResult::exec()
     }
     int paramCount = sqlite3_bind_parameter_count(d->stmt);
     if (paramCount == values.count()) {
+        d->boundTexts.clear();
+        d->boundTexts.reserve(paramCount);
         for (int i = 0; i < paramCount; ++i) {
             res = SQLITE_OK;
             const QVariant value = values.at(i);
@@ -384,17 +412,14 @@ bool QSQLiteResult::exec()
                 case QVariant::LongLong:
                     res = sqlite3_bind_int64(d->stmt, i + 1, value.toLongLong());
                     break;
-                case QVariant::String: {
-                    // lifetime of string == lifetime of its qvariant
-                    const QString *str = static_cast<const QString*>(value.constData());
-                    res = sqlite3_bind_text16(d->stmt, i + 1, str->utf16(),
-                                              (str->size()) * sizeof(QChar), SQLITE_STATIC);
-                    break; }
+                case QVariant::String:
                 default: {
-                    QString str = value.toString();
-                    // SQLITE_TRANSIENT makes sure that sqlite buffers the data
-                    res = sqlite3_bind_text16(d->stmt, i + 1, str.utf16(),
-                                              (str.size()) * sizeof(QChar), SQLITE_TRANSIENT);
+                    // bind UTF-8, the encoding of the database; the copy lives
+                    // until the statement is executed again or finalized
+                    d->boundTexts.append(value.toString().toUtf8());
+                    const QByteArray &text = d->boundTexts.last();
+                    res = sqlite3_bind_text(d->stmt, i + 1, text.constData(),
+                                            text.size(), SQLITE_STATIC);
                     break; }
                 }
             }
@@ -410,7 +435,8 @@ bool QSQLiteResult::exec()
                         "Parameter count mismatch"), QString(), QSqlError::StatementError));
         return false;
     }
-    d->skippedStatus = d->fetchNext(d->firstRow, 0, true);
+    // forward-only results are not cached, the first row is left in the statement
+    d->skippedStatus = d->fetchNext(d->firstRow, isForwardOnly() ? -1 : 0, true);
     if (lastError().isValid()) {
         setSelect(false);
         setActive(false);
@@ -426,6 +452,98 @@ bool QSQLiteResult::gotoNext(QSqlCachedResult::ValueCache& row, int idx)
     return d->fetchNext(row, idx, false);
 }
 
+bool QSQLiteResult::fetch(int i)
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::fetch(i);
+    if (i < 0 || (at() >= 0 && i < at()))
+        return false;
+    while (at() < i) {
+        if (!fetchNext())
+            return false;
+    }
+    return true;
+}
+
+bool QSQLiteResult::fetchNext()
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::fetchNext();
+    if (at() == QSql::AfterLastRow || d->rowDetached) {
+        // after fetchLast() the statement is reset already, don't run it again
+        d->rowDetached = false;
+        d->detachedRow.clear();
+        setAt(QSql::AfterLastRow);
+        return false;
+    }
+    if (!d->stepRow())
+        return false;
+    setAt(at() < 0 ? 0 : at() + 1);
+    return true;
+}
+
+bool QSQLiteResult::fetchPrevious()
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::fetchPrevious();
+    return false;
+}
+
+bool QSQLiteResult::fetchFirst()
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::fetchFirst();
+    if (at() != QSql::BeforeFirstRow)
+        return false;
+    return fetchNext();
+}
+
+bool QSQLiteResult::fetchLast()
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::fetchLast();
+    if (d->rowDetached)
+        return true;
+    if (at() == QSql::AfterLastRow)
+        return false;
+    if (at() == QSql::BeforeFirstRow && !fetchNext())
+        return false;
+
+    // stepping past the last row resets the statement, so keep a copy of
+    // each row until we know which one was the last
+    int last = at();
+    d->detachRow();
+    while (d->stepRow()) {
+        ++last;
+        d->detachRow();
+    }
+    d->rowDetached = true;
+    setAt(last);
+    return true;
+}
+
+QVariant QSQLiteResult::data(int i)
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::data(i);
+    if (!isValid() || i < 0 || i >= d->rInf.count())
+        return QVariant();
+    if (d->rowDetached)
+        return d->detachedRow.at(i);
+    return d->columnValue(i);
+}
+
+bool QSQLiteResult::isNull(int i)
+{
+    if (!isForwardOnly())
+        return QSqlCachedResult::isNull(i);
+    if (!isValid() || i < 0 || i >= d->rInf.count())
+        return true;
+    if (d->rowDetached)
+        return d->detachedRow.at(i).isNull();
+    return sqlite3_column_type(d->stmt, i) == SQLITE_NULL;
+}
+
 int QSQLiteResult::size()
 {
     return -1;
@@ -71,6 +71,16 @@ public:
     QVariant handle() const;
 
 protected:
+    // Forward-only queries are streamed: rows are not cached, columns are
+    // read from the statement only when asked for.
+    bool fetch(int i);
+    bool fetchNext();
+    bool fetchPrevious();
+    bool fetchFirst();
+    bool fetchLast();
+    QVariant data(int i);
+    bool isNull(int i);
+
     bool gotoNext(QSqlCachedResult::ValueCache& row, int idx);
     bool reset(const QString &query);
     bool prepare(const QString &query);
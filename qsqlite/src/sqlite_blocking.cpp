@@ -104,3 +104,19 @@ int sqlite3_blocking_prepare16_v2(sqlite3 *db, const void *zSql, int nSql,
 
   return rc;
 }
+
+int sqlite3_blocking_prepare_v2(sqlite3 *db, const char *zSql, int nByte,
+                                sqlite3_stmt **ppStmt, const char **pzTail)
+{
+  int rc;
+  while (SQLITE_LOCKED_SHAREDCACHE == (rc = sqlite3_prepare_v2(db, zSql, nByte, ppStmt, pzTail))) {
+    qDebug() << debugString() << "sqlite3_blocking_prepare_v2: Waiting..."; QTime now; now.start();
+    rc = qSqlite3WaitForUnlockNotify(db);
+    qDebug() << debugString() << "sqlite3_blocking_prepare_v2: Waited for " << now.elapsed() << "ms";
+    if (rc != SQLITE_OK) {
+      break;
+    }
+  }
+
+  return rc;
+}
@@ -24,9 +24,11 @@
 #include <akdebug.h>
 #include <akstandarddirs.h>
 
+#include "backgroundtaskexecutor.h"
 #include "cachecleaner.h"
 #include "intervalcheck.h"
 #include "storagejanitor.h"
+#include "vacuumscheduler.h"
 #include "storage/dbconfig.h"
 #include "storage/datastore.h"
 #include "notificationmanager.h"
@@ -49,6 +51,7 @@
 
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QSettings>
 #include <QtCore/QTimer>
 #include <QtDBus/QDBusServiceWatcher>
@@ -73,17 +76,29 @@ AkonadiServer::AkonadiServer( QObject *parent )
     : QLocalServer( parent )
     , mCacheCleaner( 0 )
     , mIntervalChecker( 0 )
-    , mStorageJanitor( 0 )
+    , mBackgroundTaskExecutor( 0 )
     , mItemRetrievalThread( 0 )
     , mDatabaseProcess( 0 )
     , mAlreadyShutdown( false )
 {
 }
 
+/// Records how long the startup phase @p phase took
+static void finishStartupPhase( QStringList &phases, QElapsedTimer &timer, const char *phase )
+{
+    phases << QString::fromLatin1( "%1: %2 ms" ).arg( QLatin1String( phase ) ).arg( timer.restart() );
+}
+
 bool AkonadiServer::init()
 {
     qRegisterMetaType<Akonadi::Server::Response>();
 
+    QElapsedTimer startupTimer;
+    startupTimer.start();
+    QElapsedTimer phaseTimer;
+    phaseTimer.start();
+    QStringList startupPhases;
+
     const QString serverConfigFile = AkStandardDirs::serverConfigFile( XdgBaseDirs::ReadWrite );
     QSettings settings( serverConfigFile, QSettings::IniFormat );
     // Restrict permission to 600, as the file might contain database password in plaintext
@@ -96,6 +111,7 @@ bool AkonadiServer::init()
     }
 
     DbConfig::configuredDatabase()->setup();
+    finishStartupPhase( startupPhases, phaseTimer, "database server" );
 
     s_instance = this;
 
@@ -155,6 +171,8 @@ bool AkonadiServer::init()
     connectionSettings.setValue( QLatin1String( "Data/UnixPath" ), socketFile );
 #endif
 
+    finishStartupPhase( startupPhases, phaseTimer, "socket" );
+
     // initialize the database
     DataStore *db = DataStore::self();
     if ( !db->database().isOpen() ) {
@@ -163,6 +181,7 @@ bool AkonadiServer::init()
     if ( !db->init() ) {
         akFatal() << "Unable to initialize database.";
     }
+    finishStartupPhase( startupPhases, phaseTimer, "schema" );
 
     NotificationManager::self();
     Tracer::self();
@@ -177,16 +196,26 @@ bool AkonadiServer::init()
         PreprocessorManager::instance()->setEnabled( false );
     }
 
+    finishStartupPhase( startupPhases, phaseTimer, "managers" );
+
+    // All maintenance shares a single low priority thread
+    mBackgroundTaskExecutor = new BackgroundTaskExecutor;
+
     if ( settings.value( QLatin1String( "Cache/EnableCleaner" ), true ).toBool() ) {
-        mCacheCleaner = new CacheCleaner( this );
-        mCacheCleaner->start( QThread::IdlePriority );
+        mCacheCleaner = new CacheCleaner;
+        mBackgroundTaskExecutor->addTask( mCacheCleaner, "initScheduler" );
     }
 
-    mIntervalChecker = new IntervalCheck( this );
-    mIntervalChecker->start( QThread::IdlePriority );
+    mIntervalChecker = new IntervalCheck;
+    mBackgroundTaskExecutor->addTask( mIntervalChecker, "initScheduler" );
+
+    mBackgroundTaskExecutor->addTask( new StorageJanitor, "resumeCheck" );
+
+    if ( settings.value( QLatin1String( "Maintenance/EnableVacuum" ), true ).toBool() ) {
+        mBackgroundTaskExecutor->addTask( new VacuumScheduler, "init" );
+    }
 
-    mStorageJanitor = new StorageJanitorThread;
-    mStorageJanitor->start( QThread::IdlePriority );
+    mBackgroundTaskExecutor->start( QThread::IdlePriority );
 
     mItemRetrievalThread = new ItemRetrievalThread( this );
     mItemRetrievalThread->start( QThread::HighPriority );
@@ -216,6 +245,10 @@ bool AkonadiServer::init()
     connect( watcher, SIGNAL(serviceOwnerChanged(QString,QString,QString)),
              this, SLOT(serviceOwnerChanged(QString,QString,QString)) );
 
+    finishStartupPhase( startupPhases, phaseTimer, "threads" );
+
+    // The threads started above initialize in parallel with the cleanups below
+
     // Unhide all the items that are actually hidden.
     // The hidden flag was probably left out after an (abrupt)
     // server quit. We don't attempt to resume preprocessing
@@ -225,6 +258,7 @@ bool AkonadiServer::init()
 
     // Cleanup referenced collections from the last run
     CollectionReferenceManager::cleanup();
+    finishStartupPhase( startupPhases, phaseTimer, "cleanup" );
 
     // We are ready, now register org.freedesktop.Akonadi service to DBus and
     // the fun can begin
@@ -232,6 +266,8 @@ bool AkonadiServer::init()
         akFatal() << "Unable to connect to dbus service: " << QDBusConnection::sessionBus().lastError().message();
     }
 
+    akDebug() << "Server started in" << startupTimer.elapsed() << "ms," << qPrintable( startupPhases.join( QLatin1String( ", " ) ) );
+
     return true;
 }
 
@@ -250,6 +286,21 @@ template <typename T> static void quitThread( T &thread )
     thread = 0;
 }
 
+static void quitConnectionThread( QPointer<ConnectionThread> &thread )
+{
+    if ( !thread ) {
+        return;
+    }
+    thread->quit();
+    // Connections with in-band notifications detach from the notification
+    // manager on their way out, which blocks until this thread handles it
+    while ( !thread->wait( 10 ) ) {
+        QCoreApplication::sendPostedEvents( NotificationManager::self(), QEvent::MetaCall );
+    }
+    delete thread;
+    thread = 0;
+}
+
 bool AkonadiServer::quit()
 {
     if ( mAlreadyShutdown ) {
@@ -258,9 +309,13 @@ bool AkonadiServer::quit()
     mAlreadyShutdown = true;
 
     akDebug() << "terminating service threads";
-    quitThread( mCacheCleaner );
-    quitThread( mIntervalChecker );
-    quitThread( mStorageJanitor );
+    // The maintenance tasks are deleted by their executor
+    mCacheCleaner = 0;
+    mIntervalChecker = 0;
+    if ( mBackgroundTaskExecutor ) {
+        mBackgroundTaskExecutor->stop();
+    }
+    quitThread( mBackgroundTaskExecutor );
     quitThread( mItemRetrievalThread );
     mAgentSearchManagerThread->stop();
     quitThread( mAgentSearchManagerThread );
@@ -271,7 +326,7 @@ bool AkonadiServer::quit()
 
     akDebug() << "terminating connection threads";
     for ( int i = 0; i < mConnections.count(); ++i ) {
-        quitThread( mConnections[i] );
+        quitConnectionThread( mConnections[i] );
     }
     mConnections.clear();
 
@@ -35,7 +35,7 @@ class CacheCleaner;
 class SearchManagerThread;
 class ItemRetrievalThread;
 class SearchTaskManagerThread;
-class StorageJanitorThread;
+class BackgroundTaskExecutor;
 class IntervalCheck;
 
 class AkonadiServer : public QLocalServer
@@ -83,7 +83,7 @@ class AkonadiServer : public QLocalServer
 
     CacheCleaner *mCacheCleaner;
     IntervalCheck *mIntervalChecker;
-    StorageJanitorThread *mStorageJanitor;
+    BackgroundTaskExecutor *mBackgroundTaskExecutor;
     ItemRetrievalThread *mItemRetrievalThread;
     SearchTaskManagerThread *mAgentSearchManagerThread;
     QProcess *mDatabaseProcess;
@@ -0,0 +1,170 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "backgroundtaskexecutor.h"
+#include "storage/datastore.h"
+#include "akdebug.h"
+
+#include <akstandarddirs.h>
+
+#include <QAbstractEventDispatcher>
+#include <QDateTime>
+#include <QSettings>
+
+#ifdef Q_OS_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace Akonadi::Server;
+
+#ifdef Q_OS_LINUX
+// From linux/ioprio.h, which is not installed everywhere
+static const int IoprioClassIdle = 3;
+static const int IoprioClassShift = 13;
+static const int IoprioWhoProcess = 1;
+#endif
+
+/// Initial wait while client commands are in progress, in ms, doubled on every retry
+static const int InitialBackOff = 10;
+
+/// Longest single wait while client commands are in progress, in ms
+static const int BackOffStep = 500;
+
+BackgroundTaskExecutor *BackgroundTaskExecutor::sInstance = 0;
+QAtomicInt BackgroundTaskExecutor::sForegroundCommands;
+QAtomicInt BackgroundTaskExecutor::sLastForegroundCommand( QDateTime::currentDateTime().toTime_t() );
+
+BackgroundTaskExecutor::BackgroundTaskExecutor( QObject *parent )
+  : QThread( parent )
+  , mStopping( 0 )
+{
+  Q_ASSERT( !sInstance );
+  sInstance = this;
+
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mTaskBudget = qMax( 1, settings.value( QLatin1String( "Maintenance/TaskBudget" ), 100 ).toInt() );
+  mDutyCycle = qBound( 1, settings.value( QLatin1String( "Maintenance/DutyCycle" ), 25 ).toInt(), 100 );
+  mMaximumBackOff = qMax( 0, settings.value( QLatin1String( "Maintenance/MaximumBackOff" ), 5000 ).toInt() );
+}
+
+BackgroundTaskExecutor::~BackgroundTaskExecutor()
+{
+  sInstance = 0;
+}
+
+void BackgroundTaskExecutor::addTask( QObject *task, const char *initSlot )
+{
+  Q_ASSERT( !task->parent() );
+  task->moveToThread( this );
+  mTasks << task;
+  if ( initSlot ) {
+    QMetaObject::invokeMethod( task, initSlot, Qt::QueuedConnection );
+  }
+}
+
+void BackgroundTaskExecutor::stop()
+{
+  mStopping = 1;
+  quit();
+}
+
+int BackgroundTaskExecutor::foregroundCommands()
+{
+  return sForegroundCommands;
+}
+
+int BackgroundTaskExecutor::idleTime()
+{
+  if ( sForegroundCommands > 0 ) {
+    return 0;
+  }
+  return qMax<int>( 0, QDateTime::currentDateTime().toTime_t() - uint( int( sLastForegroundCommand ) ) );
+}
+
+void BackgroundTaskExecutor::run()
+{
+#ifdef Q_OS_LINUX
+  // This only covers I/O of the server process itself, i.e. payload files
+  // and SQLite, not that of a separate database server
+  const int ioprio = IoprioClassIdle << IoprioClassShift;
+  if ( syscall( SYS_ioprio_set, IoprioWhoProcess, syscall( SYS_gettid ), ioprio ) < 0 ) {
+    akDebug() << "Failed to set idle I/O priority for background tasks";
+  }
+#endif
+
+  // Shared by all tasks
+  DataStore::self();
+
+  // A new slice begins whenever the thread wakes up to handle an event
+  connect( QAbstractEventDispatcher::instance(), SIGNAL(awake()),
+           this, SLOT(startSlice()), Qt::DirectConnection );
+  mSlice.start();
+
+  exec();
+
+  qDeleteAll( mTasks );
+  mTasks.clear();
+
+  DataStore::self()->close();
+}
+
+void BackgroundTaskExecutor::startSlice()
+{
+  mSlice.restart();
+}
+
+void BackgroundTaskExecutor::throttle()
+{
+  BackgroundTaskExecutor *executor = sInstance;
+  if ( !executor || QThread::currentThread() != executor ) {
+    return;
+  }
+
+  // Pause in proportion to the work done, so that tasks take at most their
+  // share of the time
+  const qint64 work = executor->mSlice.elapsed();
+  if ( work >= executor->mTaskBudget && !executor->mStopping ) {
+    const qint64 pause = work * ( 100 - executor->mDutyCycle ) / executor->mDutyCycle;
+    msleep( qMin<qint64>( pause, executor->mMaximumBackOff ) );
+  }
+
+  // Wait for clients to finish, but make sure maintenance is not starved
+  int waited = 0;
+  int backOff = InitialBackOff;
+  while ( sForegroundCommands > 0 && waited < executor->mMaximumBackOff && !executor->mStopping ) {
+    const int step = qMin( backOff, executor->mMaximumBackOff - waited );
+    msleep( step );
+    waited += step;
+    backOff = qMin( backOff * 2, BackOffStep );
+  }
+
+  executor->mSlice.restart();
+}
+
+ForegroundCommand::ForegroundCommand()
+{
+  BackgroundTaskExecutor::sForegroundCommands.ref();
+}
+
+ForegroundCommand::~ForegroundCommand()
+{
+  BackgroundTaskExecutor::sLastForegroundCommand.fetchAndStoreRelaxed( QDateTime::currentDateTime().toTime_t() );
+  BackgroundTaskExecutor::sForegroundCommands.deref();
+}
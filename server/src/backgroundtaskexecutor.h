@@ -0,0 +1,123 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_BACKGROUNDTASKEXECUTOR_H
+#define AKONADI_BACKGROUNDTASKEXECUTOR_H
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QElapsedTimer>
+#include <QList>
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * Runs the maintenance tasks of the server in the background.
+ *
+ * All maintenance tasks (cache cleaning, interval checking, the storage
+ * janitor) share a single thread with idle CPU and I/O priority, and with
+ * it a single database connection.
+ *
+ * Tasks call throttle() between two units of work. It backs off while
+ * clients have commands in progress, and makes a task pause once it used
+ * up its time budget, so that maintenance never competes with clients
+ * for the database.
+ */
+class BackgroundTaskExecutor : public QThread
+{
+  Q_OBJECT
+
+  public:
+    explicit BackgroundTaskExecutor( QObject *parent = 0 );
+    ~BackgroundTaskExecutor();
+
+    /**
+     * Moves @p task to the executor thread, its slots and timers are invoked
+     * there from then on. If given, the slot named @p initSlot is invoked
+     * once the executor runs. Tasks are deleted when the executor stops.
+     *
+     * Tasks must not have a parent.
+     */
+    void addTask( QObject *task, const char *initSlot = 0 );
+
+    /**
+     * Stops the executor, throttled tasks no longer wait from then on.
+     */
+    void stop();
+
+    /**
+     * Called by tasks between two units of work.
+     *
+     * Blocks while client commands are in progress, but for at most
+     * Maintenance/MaximumBackOff ms. Once the current task ran for longer
+     * than Maintenance/TaskBudget ms, it pauses for so long that
+     * maintenance takes at most Maintenance/DutyCycle percent of the time.
+     *
+     * Does nothing outside of the executor thread.
+     */
+    static void throttle();
+
+    /**
+     * Returns the number of client commands currently in progress.
+     */
+    static int foregroundCommands();
+
+    /**
+     * Returns the number of seconds since the last client command finished,
+     * or 0 while client commands are in progress.
+     */
+    static int idleTime();
+
+  protected:
+    void run();
+
+  private Q_SLOTS:
+    void startSlice();
+
+  private:
+    friend class ForegroundCommand;
+
+    QList<QObject *> mTasks;
+    QElapsedTimer mSlice;
+    QAtomicInt mStopping;
+    int mTaskBudget;
+    int mDutyCycle;
+    int mMaximumBackOff;
+
+    static BackgroundTaskExecutor *sInstance;
+    static QAtomicInt sForegroundCommands;
+    static QAtomicInt sLastForegroundCommand;
+};
+
+/**
+ * Marks a client command as being in progress for the lifetime of the
+ * object, maintenance tasks back off meanwhile.
+ */
+class ForegroundCommand
+{
+  public:
+    ForegroundCommand();
+    ~ForegroundCommand();
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -20,15 +20,42 @@
 
 #include "cachecleaner.h"
 #include "akdebug.h"
+#include "backgroundtaskexecutor.h"
 #include "storage/parthelper.h"
 #include "storage/datastore.h"
-#include "storage/selectquerybuilder.h"
+#include "storage/querybuilder.h"
 #include "storage/entity.h"
+#include "storage/transaction.h"
 #include "akonadi.h"
 #include "libs/protocol_p.h"
 
+#include <akstandarddirs.h>
+
+#include <QSettings>
+#include <QSet>
+#include <QTimer>
+#include <QtSql/QSqlQuery>
+
 using namespace Akonadi::Server;
 
+/// Interval of checking the size of the cache, in ms
+static const int EvictionInterval = 5 * 60 * 1000;
+
+/// Maximum number of parts truncated in a single transaction
+static const int EvictionBatchSize = 500;
+
+/// Items accessed within this many seconds are never evicted
+static const int MinimumAge = 5 * 60;
+
+/// Eviction stops once the cache is below this share of its budget (in %)
+static const int LowWatermark = 90;
+
+QMutex CacheCleaner::sStatisticsLock;
+qint64 CacheCleaner::sHits = 0;
+qint64 CacheCleaner::sMisses = 0;
+qint64 CacheCleaner::sEvictedBytes = 0;
+qint64 CacheCleaner::sEvictedParts = 0;
+
 QMutex CacheCleanerInhibitor::sLock;
 int CacheCleanerInhibitor::sInhibitCount = 0;
 
@@ -85,14 +112,85 @@ void CacheCleanerInhibitor::uninhibit()
 
 CacheCleaner::CacheCleaner( QObject *parent )
   : CollectionScheduler( parent )
+  , mMaximumCacheSize( 0 )
+  , mInhibited( 0 )
 {
   setMinimumInterval( 5 );
+
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mEvictionTimer = new QTimer( this );
+  mEvictionTimer->setInterval( EvictionInterval );
+  connect( mEvictionTimer, SIGNAL(timeout()),
+           this, SLOT(evictLeastRecentlyUsed()) );
+  setMaximumCacheSize( settings.value( QLatin1String( "Cache/MaximumSize" ), 0 ).toLongLong() * 1024 * 1024 );
 }
 
 CacheCleaner::~CacheCleaner()
 {
 }
 
+void CacheCleaner::setMaximumCacheSize( qint64 size )
+{
+  mMaximumCacheSize = qMax<qint64>( 0, size );
+  if ( mMaximumCacheSize > 0 ) {
+    mEvictionTimer->start();
+  } else {
+    mEvictionTimer->stop();
+  }
+}
+
+qint64 CacheCleaner::maximumCacheSize() const
+{
+  return mMaximumCacheSize;
+}
+
+void CacheCleaner::inhibit( bool inhibit )
+{
+  mInhibited = inhibit ? 1 : 0;
+  CollectionScheduler::inhibit( inhibit );
+}
+
+qint64 CacheCleaner::cacheSize()
+{
+  QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
+  qb.addJoin( QueryBuilder::InnerJoin, PartType::tableName(), Part::partTypeIdFullColumnName(), PartType::idFullColumnName() );
+  qb.addAggregation( Part::datasizeFullColumnName(), QLatin1String( "sum" ) );
+  qb.addValueCondition( Part::dataFullColumnName(), Query::IsNot, QVariant() );
+  qb.addValueCondition( PartType::nsFullColumnName(), Query::Equals, QLatin1String( "PLD" ) );
+  if ( !qb.exec() || !qb.query().next() ) {
+    return -1;
+  }
+  return qb.query().value( 0 ).toLongLong();
+}
+
+void CacheCleaner::recordCacheAccess( int hits, int misses )
+{
+  QMutexLocker locker( &sStatisticsLock );
+  sHits += hits;
+  sMisses += misses;
+}
+
+double CacheCleaner::hitRatio()
+{
+  QMutexLocker locker( &sStatisticsLock );
+  if ( sHits + sMisses == 0 ) {
+    return -1;
+  }
+  return double( sHits ) / ( sHits + sMisses );
+}
+
+qint64 CacheCleaner::evictedBytes()
+{
+  QMutexLocker locker( &sStatisticsLock );
+  return sEvictedBytes;
+}
+
+qint64 CacheCleaner::evictedParts()
+{
+  QMutexLocker locker( &sStatisticsLock );
+  return sEvictedParts;
+}
+
 int CacheCleaner::collectionScheduleInterval( const Collection &collection )
 {
   return collection.cachePolicyCacheTimeout();
@@ -114,9 +212,92 @@ bool CacheCleaner::shouldScheduleCollection( const Collection &collection )
 }
 
 
+CacheCleaner::CachedPart CacheCleaner::cachedPart( const QSqlQuery &query )
+{
+  CachedPart part;
+  part.id = query.value( 0 ).toLongLong();
+  part.size = query.value( 1 ).toLongLong();
+  part.external = query.value( 2 ).toBool();
+  return part;
+}
+
+QStringList CacheCleaner::externalFiles( const QVariantList &ids )
+{
+  // Only the data of external parts is a file name, everything else
+  // would pull the cached payload itself out of the database
+  QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
+  qb.addColumn( Part::dataColumn() );
+  qb.addValueCondition( Part::idColumn(), Query::In, ids );
+  qb.addValueCondition( Part::externalColumn(), Query::Equals, true );
+
+  QStringList fileNames;
+  if ( !qb.exec() ) {
+    return fileNames;
+  }
+  QSqlQuery &query = qb.query();
+  while ( query.next() ) {
+    fileNames << PartHelper::resolveAbsolutePath( query.value( 0 ).toByteArray() );
+  }
+  query.finish();
+  return fileNames;
+}
+
+qint64 CacheCleaner::evict( const QVector<CachedPart> &parts )
+{
+  qint64 freed = 0;
+  for ( int i = 0; i < parts.size(); i += EvictionBatchSize ) {
+    const QVector<CachedPart> batch = parts.mid( i, EvictionBatchSize );
+    QVariantList ids;
+    QVariantList externalIds;
+    qint64 size = 0;
+    Q_FOREACH ( const CachedPart &part, batch ) {
+      ids << part.id;
+      if ( part.external ) {
+        externalIds << part.id;
+      }
+      size += part.size;
+    }
+
+    Transaction transaction( DataStore::self() );
+    const QStringList fileNames = externalIds.isEmpty() ? QStringList() : externalFiles( externalIds );
+    QueryBuilder qb( Part::tableName(), QueryBuilder::Update );
+    qb.setColumnValue( Part::dataColumn(), QByteArray() );
+    qb.setColumnValue( Part::datasizeColumn(), 0 );
+    qb.setColumnValue( Part::externalColumn(), false );
+    qb.addValueCondition( Part::idColumn(), Query::In, ids );
+    if ( !qb.exec() || !transaction.commit() ) {
+      akError() << "Failed to truncate" << ids.count() << "item parts";
+      break;
+    }
+
+    // Only remove the files once nothing refers to them anymore, a failed
+    // transaction must not leave parts without their payload behind
+    Q_FOREACH ( const QString &fileName, fileNames ) {
+      try {
+        PartHelper::removeFile( fileName );
+      } catch ( const PartHelperException &e ) {
+        akError() << e.type() << e.what();
+      }
+    }
+
+    freed += size;
+    {
+      QMutexLocker locker( &sStatisticsLock );
+      sEvictedBytes += size;
+      sEvictedParts += batch.size();
+    }
+
+    BackgroundTaskExecutor::throttle();
+  }
+  return freed;
+}
+
 void CacheCleaner::collectionExpired( const Collection &collection )
 {
-  SelectQueryBuilder<Part> qb;
+  QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
+  qb.addColumn( Part::idFullColumnName() );
+  qb.addColumn( Part::datasizeFullColumnName() );
+  qb.addColumn( Part::externalFullColumnName() );
   qb.addJoin( QueryBuilder::InnerJoin, PimItem::tableName(), Part::pimItemIdColumn(), PimItem::idFullColumnName() );
   qb.addJoin( QueryBuilder::InnerJoin, PartType::tableName(), Part::partTypeIdFullColumnName(), PartType::idFullColumnName() );
   qb.addValueCondition( PimItem::collectionIdFullColumnName(), Query::Equals, collection.id() );
@@ -125,27 +306,122 @@ void CacheCleaner::collectionExpired( const Collection &collection )
   qb.addValueCondition( PartType::nsFullColumnName(), Query::Equals, QLatin1String( "PLD" ) );
   qb.addValueCondition( PimItem::dirtyFullColumnName(), Query::Equals, false );
 
-  QStringList localParts;
   Q_FOREACH ( QString partName, collection.cachePolicyLocalParts().split( QLatin1String( " " ) ) ) {
     if ( partName.startsWith( QLatin1String( AKONADI_PARAM_PLD ) ) ) {
       partName = partName.mid( 4 );
     }
     qb.addValueCondition( PartType::nameFullColumnName(), Query::NotEquals, partName );
   }
-  if ( qb.exec() ) {
-    const Part::List parts = qb.result();
-    if ( !parts.isEmpty() ) {
-      akDebug() << "found" << parts.count() << "item parts to expire in collection" << collection.name();
-      // clear data field
-      Q_FOREACH ( Part part, parts ) {
-        try {
-          if ( !PartHelper::truncate( part ) ) {
-            akDebug() << "failed to update item part" << part.id();
+  if ( !qb.exec() ) {
+    return;
+  }
+
+  QVector<CachedPart> parts;
+  QSqlQuery &query = qb.query();
+  while ( query.next() ) {
+    parts << cachedPart( query );
+  }
+  query.finish();
+
+  if ( !parts.isEmpty() ) {
+    akDebug() << "found" << parts.count() << "item parts to expire in collection" << collection.name();
+    evict( parts );
+  }
+}
+
+void CacheCleaner::evictLeastRecentlyUsed()
+{
+  if ( mMaximumCacheSize <= 0 || mInhibited ) {
+    return;
+  }
+
+  const qint64 size = cacheSize();
+  if ( size <= mMaximumCacheSize ) {
+    return;
+  }
+
+  // Only parts the cache policy of their collection allows to expire may be
+  // evicted, the cache policies are usually shared by many collections
+  QHash<qint64, QSet<QString> > localParts;
+  QSet<qint64> ignoredCollections;
+
+  const qint64 target = mMaximumCacheSize / 100 * LowWatermark;
+  qint64 freed = 0;
+  int offset = 0;
+  Q_FOREVER {
+    QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
+    qb.addColumn( Part::idFullColumnName() );
+    qb.addColumn( Part::datasizeFullColumnName() );
+    qb.addColumn( Part::externalFullColumnName() );
+    qb.addColumn( PimItem::collectionIdFullColumnName() );
+    qb.addColumn( PartType::nameFullColumnName() );
+    qb.addJoin( QueryBuilder::InnerJoin, PimItem::tableName(), Part::pimItemIdColumn(), PimItem::idFullColumnName() );
+    qb.addJoin( QueryBuilder::InnerJoin, PartType::tableName(), Part::partTypeIdFullColumnName(), PartType::idFullColumnName() );
+    qb.addValueCondition( PimItem::atimeFullColumnName(), Query::Less, QDateTime::currentDateTime().addSecs( -MinimumAge ) );
+    qb.addValueCondition( Part::dataFullColumnName(), Query::IsNot, QVariant() );
+    qb.addValueCondition( PartType::nsFullColumnName(), Query::Equals, QLatin1String( "PLD" ) );
+    qb.addValueCondition( PimItem::dirtyFullColumnName(), Query::Equals, false );
+    qb.addSortColumn( PimItem::atimeFullColumnName(), Query::Ascending );
+    qb.addSortColumn( Part::idFullColumnName(), Query::Ascending );
+    qb.setLimit( EvictionBatchSize );
+    // Evicted parts drop out of the result, skipped ones have to be jumped over
+    qb.setOffset( offset );
+    if ( !qb.exec() ) {
+      break;
+    }
+
+    QVector<CachedPart> batch;
+    qint64 batchSize = 0;
+    int rows = 0;
+    QSqlQuery &query = qb.query();
+    while ( query.next() && size - freed - batchSize > target ) {
+      ++rows;
+      const qint64 collectionId = query.value( 3 ).toLongLong();
+      if ( !localParts.contains( collectionId ) && !ignoredCollections.contains( collectionId ) ) {
+        Collection collection = Collection::retrieveById( collectionId );
+        DataStore::self()->activeCachePolicy( collection );
+        if ( shouldScheduleCollection( collection ) ) {
+          QSet<QString> names;
+          Q_FOREACH ( QString partName, collection.cachePolicyLocalParts().split( QLatin1String( " " ) ) ) {
+            if ( partName.startsWith( QLatin1String( AKONADI_PARAM_PLD ) ) ) {
+              partName = partName.mid( 4 );
+            }
+            names.insert( partName );
           }
-        } catch ( const PartHelperException &e ) {
-            akError() << e.type() << e.what();
+          localParts.insert( collectionId, names );
+        } else {
+          ignoredCollections.insert( collectionId );
         }
       }
+
+      if ( ignoredCollections.contains( collectionId )
+           || localParts.value( collectionId ).contains( query.value( 4 ).toString() ) ) {
+        ++offset;
+        continue;
+      }
+
+      const CachedPart part = cachedPart( query );
+      batch << part;
+      batchSize += part.size;
+    }
+    query.finish();
+
+    if ( batch.isEmpty() ) {
+      if ( rows < EvictionBatchSize ) {
+        break;
+      }
+      continue;
+    }
+
+    const qint64 evicted = evict( batch );
+    freed += evicted;
+    if ( evicted < batchSize || size - freed <= target || mInhibited ) {
+      break;
     }
   }
+
+  const double ratio = hitRatio();
+  akDebug() << "Cache size" << size << "exceeded budget of" << mMaximumCacheSize << "bytes, evicted" << freed << "bytes."
+            << "Hit ratio:" << ( ratio < 0 ? QString::fromLatin1( "n/a" ) : QString::number( ratio * 100, 'f', 1 ) + QLatin1Char( '%' ) )
+            << "- evicted since startup:" << evictedBytes() << "bytes in" << evictedParts() << "parts";
 }
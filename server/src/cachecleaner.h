@@ -22,7 +22,12 @@
 
 #include "collectionscheduler.h"
 
+#include <QAtomicInt>
 #include <QMutex>
+#include <QVector>
+
+class QSqlQuery;
+class CacheCleanerTest;
 
 namespace Akonadi {
 namespace Server {
@@ -55,7 +60,13 @@ class CacheCleanerInhibitor
 };
 
 /**
-  Cache cleaner thread.
+  Cache cleaner, run by the BackgroundTaskExecutor.
+
+  Besides expiring payload parts of each collection after the cache timeout
+  of its cache policy, the cleaner keeps the total size of all cached payload
+  within a global budget (Cache/MaximumSize, in MiB). Once the budget is
+  exceeded, the least recently accessed parts of all collections are evicted
+  until the cache is back below 90% of the budget.
 */
 class CacheCleaner : public CollectionScheduler
 {
@@ -63,22 +74,97 @@ class CacheCleaner : public CollectionScheduler
 
   public:
     /**
-      Creates a new cache cleaner thread.
+      Creates a new cache cleaner.
       @param parent The parent object.
     */
     CacheCleaner( QObject *parent = 0 );
     ~CacheCleaner();
 
+    /**
+     * Sets the maximum size of all cached payload in bytes, 0 disables
+     * the limit.
+     */
+    void setMaximumCacheSize( qint64 size );
+    qint64 maximumCacheSize() const;
+
+    /**
+     * Returns the total size of all cached payload parts in bytes.
+     */
+    static qint64 cacheSize();
+
+    /**
+     * Records that @p hits requested payload parts were found in the cache
+     * and @p misses had to be retrieved from the resource.
+     */
+    static void recordCacheAccess( int hits, int misses );
+
+    /**
+     * Returns the share of requested payload parts found in the cache,
+     * or -1 if no parts were requested yet.
+     */
+    static double hitRatio();
+
+    /**
+     * Returns the number of bytes evicted from the cache since startup.
+     */
+    static qint64 evictedBytes();
+
+    /**
+     * Returns the number of parts evicted from the cache since startup.
+     */
+    static qint64 evictedParts();
+
+  public Q_SLOTS:
+    /**
+     * Evicts least recently accessed payload parts until the cache fits
+     * into the budget again.
+     */
+    void evictLeastRecentlyUsed();
+
   protected:
     void collectionExpired( const Collection &collection );
     int collectionScheduleInterval( const Collection &collection );
     bool hasChanged( const Collection &collection, const Collection &changed );
     bool shouldScheduleCollection( const Collection &collection );
+    void inhibit( bool inhibit );
 
   private:
+    struct CachedPart
+    {
+      qint64 id;
+      qint64 size;
+      bool external;
+    };
+
+    /**
+     * Truncates @p parts in batched transactions and removes the external
+     * payload files of each batch once it is committed.
+     * @returns the number of bytes freed
+     */
+    qint64 evict( const QVector<CachedPart> &parts );
+
+    static CachedPart cachedPart( const QSqlQuery &query );
+
+    /**
+     * Returns the absolute paths of the payload files of the external
+     * parts among @p ids.
+     */
+    static QStringList externalFiles( const QVariantList &ids );
+
+    QTimer *mEvictionTimer;
+    qint64 mMaximumCacheSize;
+    QAtomicInt mInhibited;
+
+    static QMutex sStatisticsLock;
+    static qint64 sHits;
+    static qint64 sMisses;
+    static qint64 sEvictedBytes;
+    static qint64 sEvictedParts;
+
     static CacheCleaner *sInstance;
 
     friend class CacheCleanerInhibitor;
+    friend class ::CacheCleanerTest;
 
 };
 
@@ -27,6 +27,7 @@ ClientCapabilities::ClientCapabilities()
   , m_serverSideSearch( false )
   , m_akAppendStreaming( false )
   , m_directStreaming( false )
+  , m_inBandNotifications( false )
 {
 }
 
@@ -88,3 +89,12 @@ void ClientCapabilities::setDirectStreaming(bool directStreaming)
   m_directStreaming = directStreaming;
 }
 
+bool ClientCapabilities::inBandNotifications() const
+{
+  return m_inBandNotifications;
+}
+
+void ClientCapabilities::setInBandNotifications( bool inBandNotifications )
+{
+  m_inBandNotifications = inBandNotifications;
+}
@@ -54,12 +54,17 @@ public:
   bool directStreaming() const;
   void setDirectStreaming( bool directStreaming );
 
+  /** Notifications can be sent over the protocol connection, see the NOTIFY command. */
+  bool inBandNotifications() const;
+  void setInBandNotifications( bool inBandNotifications );
+
 private:
   int m_notificationMessageVersion;
   int m_noPayloadPath : 1;
   int m_serverSideSearch : 1;
   int m_akAppendStreaming : 1;
   int m_directStreaming : 1;
+  int m_inBandNotifications : 1;
 };
 
 } // namespace Server
@@ -19,12 +19,26 @@
 
 
 #include "collectionscheduler.h"
+#include "backgroundtaskexecutor.h"
 #include "storage/datastore.h"
 #include "storage/selectquerybuilder.h"
 #include "akdebug.h"
 
+#include <akstandarddirs.h>
+
 #include <QDateTime>
 #include <QCoreApplication>
+#include <QSettings>
+#include <QThread>
+
+#include <climits>
+
+// Collections due within this many ms expire together with the one that is
+// due now, to reduce wakeups
+static const qint64 CoalescingWindow = 5 * 1000;
+
+// Delay between batches when more collections are due than expire at once
+static const int BatchDelay = 1000;
 
 namespace Akonadi {
 namespace Server {
@@ -104,13 +118,155 @@ class PauseableTimer : public QTimer
 
 using namespace Akonadi::Server;
 
+bool CollectionSchedule::Entry::operator<( const Entry &other ) const
+{
+  return due < other.due || ( due == other.due && collection.id() < other.collection.id() );
+}
+
+void CollectionSchedule::schedule( const Collection &collection, qint64 due )
+{
+  Entry entry;
+  entry.due = due;
+  entry.collection = collection;
+
+  const QHash<qint64, int>::const_iterator it = mPositions.constFind( collection.id() );
+  if ( it == mPositions.constEnd() ) {
+    mHeap.append( entry );
+    mPositions.insert( collection.id(), mHeap.size() - 1 );
+    moveUp( mHeap.size() - 1 );
+    return;
+  }
+
+  const int position = it.value();
+  const bool earlier = entry < mHeap.at( position );
+  mHeap[position] = entry;
+  if ( earlier ) {
+    moveUp( position );
+  } else {
+    moveDown( position );
+  }
+}
+
+bool CollectionSchedule::remove( qint64 collectionId )
+{
+  const QHash<qint64, int>::const_iterator it = mPositions.constFind( collectionId );
+  if ( it == mPositions.constEnd() ) {
+    return false;
+  }
+  removeAt( it.value() );
+  return true;
+}
+
+bool CollectionSchedule::contains( qint64 collectionId ) const
+{
+  return mPositions.contains( collectionId );
+}
+
+Collection CollectionSchedule::collection( qint64 collectionId ) const
+{
+  const QHash<qint64, int>::const_iterator it = mPositions.constFind( collectionId );
+  if ( it == mPositions.constEnd() ) {
+    return Collection();
+  }
+  return mHeap.at( it.value() ).collection;
+}
+
+bool CollectionSchedule::isEmpty() const
+{
+  return mHeap.isEmpty();
+}
+
+int CollectionSchedule::size() const
+{
+  return mHeap.size();
+}
+
+qint64 CollectionSchedule::nextDue() const
+{
+  return mHeap.isEmpty() ? -1 : mHeap.first().due;
+}
+
+QVector<Collection> CollectionSchedule::takeDue( qint64 time, int maximum )
+{
+  QVector<Collection> collections;
+  while ( !mHeap.isEmpty() && mHeap.first().due <= time && collections.size() < maximum ) {
+    collections << mHeap.first().collection;
+    removeAt( 0 );
+  }
+  return collections;
+}
+
+void CollectionSchedule::removeAt( int position )
+{
+  mPositions.remove( mHeap.at( position ).collection.id() );
+  const Entry last = mHeap.last();
+  mHeap.pop_back();
+  if ( position == mHeap.size() ) {
+    return;
+  }
+
+  const bool earlier = last < mHeap.at( position );
+  place( position, last );
+  if ( earlier ) {
+    moveUp( position );
+  } else {
+    moveDown( position );
+  }
+}
+
+void CollectionSchedule::moveUp( int position )
+{
+  const Entry entry = mHeap.at( position );
+  while ( position > 0 ) {
+    const int parent = ( position - 1 ) / 2;
+    if ( !( entry < mHeap.at( parent ) ) ) {
+      break;
+    }
+    place( position, mHeap.at( parent ) );
+    position = parent;
+  }
+  place( position, entry );
+}
+
+void CollectionSchedule::moveDown( int position )
+{
+  const Entry entry = mHeap.at( position );
+  const int count = mHeap.size();
+  Q_FOREVER {
+    int child = 2 * position + 1;
+    if ( child >= count ) {
+      break;
+    }
+    if ( child + 1 < count && mHeap.at( child + 1 ) < mHeap.at( child ) ) {
+      ++child;
+    }
+    if ( !( mHeap.at( child ) < entry ) ) {
+      break;
+    }
+    place( position, mHeap.at( child ) );
+    position = child;
+  }
+  place( position, entry );
+}
+
+void CollectionSchedule::place( int position, const Entry &entry )
+{
+  mHeap[position] = entry;
+  mPositions[entry.collection.id()] = position;
+}
+
+
 CollectionScheduler::CollectionScheduler( QObject *parent )
-  : QThread( parent )
+  : QObject( parent )
   , mMinInterval( 5 )
 {
   // make sure we are created from the main thread, ie. before all other threads start to potentially use us
   Q_ASSERT( QThread::currentThread() == QCoreApplication::instance()->thread() );
 
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mJitter = qBound( 0, settings.value( QLatin1String( "Scheduler/Jitter" ), 10 ).toInt(), 100 );
+  mMaximumBatchSize = qMax( 1, settings.value( QLatin1String( "Scheduler/MaximumBatchSize" ), 20 ).toInt() );
+
   mScheduler = new PauseableTimer( this );
   mScheduler->setSingleShot( true );
   connect( mScheduler, SIGNAL(timeout()),
@@ -121,16 +277,6 @@ CollectionScheduler::~CollectionScheduler()
 {
 }
 
-void CollectionScheduler::run()
-{
-  DataStore::self();
-
-  QTimer::singleShot( 0, this, SLOT(initScheduler()) );
-  exec();
-
-  DataStore::self()->close();
-}
-
 void CollectionScheduler::inhibit( bool inhibit )
 {
   if ( inhibit && mScheduler->isActive() && !mScheduler->isPaused() ) {
@@ -150,6 +296,26 @@ void CollectionScheduler::setMinimumInterval( int intervalMinutes )
   mMinInterval = intervalMinutes;
 }
 
+int CollectionScheduler::jitter() const
+{
+  return mJitter;
+}
+
+void CollectionScheduler::setJitter( int percent )
+{
+  mJitter = qBound( 0, percent, 100 );
+}
+
+int CollectionScheduler::maximumBatchSize() const
+{
+  return mMaximumBatchSize;
+}
+
+void CollectionScheduler::setMaximumBatchSize( int size )
+{
+  mMaximumBatchSize = qMax( 1, size );
+}
+
 void CollectionScheduler::collectionAdded( qint64 collectionId )
 {
   Collection collection = Collection::retrieveById( collectionId );
@@ -164,52 +330,53 @@ void CollectionScheduler::collectionAdded( qint64 collectionId )
 void CollectionScheduler::collectionChanged( qint64 collectionId )
 {
   QMutexLocker locker( &mScheduleLock );
-  Q_FOREACH ( const Collection &collection, mSchedule ) {
-    if ( collection.id() == collectionId ) {
-      Collection changed = Collection::retrieveById( collectionId );
-      DataStore::self()->activeCachePolicy( changed );
-      if ( hasChanged( collection, changed ) ) {
-        if ( shouldScheduleCollection( changed ) ) {
-          locker.unlock();
-          // Scheduling the changed collection will automatically remove the old one
-          scheduleCollection( changed );
-        } else {
-          locker.unlock();
-          // If the collection should no longer be scheduled then remove it
-          collectionRemoved( collectionId );
-        }
-      }
+  if ( !mSchedule.contains( collectionId ) ) {
+    locker.unlock();
+    // We don't know the collection yet, but maybe now it can be scheduled
+    collectionAdded( collectionId );
+    return;
+  }
 
-      return;
+  const Collection collection = mSchedule.collection( collectionId );
+  locker.unlock();
+
+  Collection changed = Collection::retrieveById( collectionId );
+  DataStore::self()->activeCachePolicy( changed );
+  if ( hasChanged( collection, changed ) ) {
+    if ( shouldScheduleCollection( changed ) ) {
+      // Scheduling the changed collection will automatically remove the old one
+      scheduleCollection( changed );
+    } else {
+      // If the collection should no longer be scheduled then remove it
+      collectionRemoved( collectionId );
     }
   }
-
-  // We don't know the collection yet, but maybe now it can be scheduled
-  collectionAdded( collectionId );
 }
 
 void CollectionScheduler::collectionRemoved( qint64 collectionId )
 {
   QMutexLocker locker( &mScheduleLock );
-  Q_FOREACH ( const Collection &collection, mSchedule ) {
-    if ( collection.id() == collectionId ) {
-      const uint key = mSchedule.key( collection );
-      const bool reschedule = ( key == mSchedule.constBegin().key() );
-      mSchedule.remove( key );
-      locker.unlock();
-
-      // If we just remove currently scheduled collection, schedule the next one
-      if ( reschedule ) {
-        startScheduler();
-      }
+  const qint64 next = mSchedule.nextDue();
+  if ( !mSchedule.remove( collectionId ) ) {
+    return;
+  }
+  const bool reschedule = ( mSchedule.nextDue() != next );
+  locker.unlock();
 
-      return;
-    }
+  // If we just remove currently scheduled collection, schedule the next one
+  if ( reschedule ) {
+    startScheduler();
   }
 }
 
 void CollectionScheduler::startScheduler()
 {
+  // The timer can only be started from its own thread
+  if ( QThread::currentThread() != mScheduler->thread() ) {
+    QMetaObject::invokeMethod( this, "startScheduler", Qt::QueuedConnection );
+    return;
+  }
+
   // Don't restart timer if we are paused.
   if ( mScheduler->isPaused() ) {
     return;
@@ -223,53 +390,48 @@ void CollectionScheduler::startScheduler()
   }
 
   // Get next collection to expire and start the timer
-  const uint next = mSchedule.constBegin().key();
-  // cast next - now() to int, so that we get negative result when next is in the past
-  mScheduler->start( qMax( 0, ( int ) ( next - QDateTime::currentDateTime().toTime_t() ) * 1000 ) );
+  const qint64 timeout = mSchedule.nextDue() - QDateTime::currentMSecsSinceEpoch();
+  mScheduler->start( qBound<qint64>( 0, timeout, INT_MAX ) );
 }
 
-void CollectionScheduler::scheduleCollection( Collection collection, bool shouldStartScheduler )
+qint64 CollectionScheduler::scheduleInterval( const Collection &collection )
 {
-  QMutexLocker locker( &mScheduleLock );
-  if ( mSchedule.values().contains( collection ) ) {
-    const uint key = mSchedule.key( collection );
-    mSchedule.remove( key, collection );
-  }
+  return qMax( mMinInterval, collectionScheduleInterval( collection ) ) * 60 * 1000ll;
+}
 
+void CollectionScheduler::scheduleCollection( Collection collection, bool shouldStartScheduler )
+{
   DataStore::self()->activeCachePolicy( collection );
 
+  // Collections with the same interval would otherwise stay in lockstep
+  const qint64 interval = scheduleInterval( collection );
+  const qint64 delay = qint64( double( interval ) * mJitter / 100 * qrand() / RAND_MAX );
+  schedule( collection, QDateTime::currentMSecsSinceEpoch() + interval + delay, shouldStartScheduler );
+}
+
+void CollectionScheduler::schedule( const Collection &collection, qint64 due, bool shouldStartScheduler )
+{
+  QMutexLocker locker( &mScheduleLock );
+  const qint64 next = mSchedule.nextDue();
+  mSchedule.remove( collection.id() );
+
   if ( !shouldScheduleCollection( collection ) ) {
     return;
   }
 
-  const int expireMinutes = qMax( mMinInterval, collectionScheduleInterval( collection ) );
-  uint nextCheck = QDateTime::currentDateTime().toTime_t() + ( expireMinutes * 60 );
-
-  // Check whether there's another check scheduled within a minute after this one.
-  // If yes, then delay this check so that it's scheduled together with the others
-  // This is a minor optimization to reduce wakeups and SQL queries
-  QMap<uint, Collection>::iterator it = mSchedule.lowerBound( nextCheck );
-  if ( it != mSchedule.end() && it.key() - nextCheck < 60 ) {
-    nextCheck = it.key();
-
-  // Also check whether there's another checked scheduled within a minute before
-  // this one.
-  } else if ( it != mSchedule.begin() ) {
-    --it;
-    if ( nextCheck - it.key() < 60 ) {
-      nextCheck = it.key();
-    }
-  }
+  mSchedule.schedule( collection, due );
+  const bool isNext = ( next < 0 || due < next );
+  locker.unlock();
 
-  mSchedule.insert( nextCheck, collection );
-  if ( shouldStartScheduler && !mScheduler->isActive() ) {
-    mScheduleLock.unlock();
+  if ( shouldStartScheduler && ( isNext || !mScheduler->isActive() ) ) {
     startScheduler();
   }
 }
 
 void CollectionScheduler::initScheduler()
 {
+  qsrand( QDateTime::currentMSecsSinceEpoch() );
+
   // Only retrieve enabled collections and referenced collections, we don't care
   // about anything else
   SelectQueryBuilder<Collection> qb;
@@ -286,9 +448,14 @@ void CollectionScheduler::initScheduler()
       qWarning() << "Not a fatal error, no collections will be scheduled for sync or cache expiration!";
   }
 
+  // Spread the first expiration of all collections over their whole interval,
+  // instead of letting them all expire at the same time after startup
+  const qint64 now = QDateTime::currentMSecsSinceEpoch();
   const Collection::List collections = qb.result();
   Q_FOREACH ( /*sic!*/ Collection collection, collections ) {
-    scheduleCollection( collection );
+    DataStore::self()->activeCachePolicy( collection );
+    const qint64 interval = scheduleInterval( collection );
+    schedule( collection, now + qint64( double( interval ) * qrand() / RAND_MAX ), false );
   }
 
   startScheduler();
@@ -300,14 +467,21 @@ void CollectionScheduler::schedulerTimeout()
   mScheduler->stop();
 
   mScheduleLock.lock();
-  const uint timestamp = mSchedule.constBegin().key();
-  const QList<Collection> collections = mSchedule.values( timestamp );
-  mSchedule.remove( timestamp );
+  const QVector<Collection> collections = mSchedule.takeDue( QDateTime::currentMSecsSinceEpoch() + CoalescingWindow,
+                                                             mMaximumBatchSize );
+  const bool moreDue = !mSchedule.isEmpty() && mSchedule.nextDue() <= QDateTime::currentMSecsSinceEpoch();
   mScheduleLock.unlock();
 
   Q_FOREACH ( const Collection &collection, collections ) {
     collectionExpired( collection );
     scheduleCollection( collection, false );
+    BackgroundTaskExecutor::throttle();
+  }
+
+  // Leave some time to the rest of the server before the next batch
+  if ( moreDue && !mScheduler->isPaused() ) {
+    mScheduler->start( BatchDelay );
+    return;
   }
 
   startScheduler();
@@ -21,10 +21,11 @@
 #ifndef AKONADI_SERVER_COLLECTIONSCHEDULER_H
 #define AKONADI_SERVER_COLLECTIONSCHEDULER_H
 
-#include <QThread>
+#include <QObject>
 #include <QTimer>
-#include <QMultiMap>
+#include <QHash>
 #include <QMutex>
+#include <QVector>
 
 #include "entities.h"
 
@@ -34,7 +35,66 @@ namespace Server {
 class Collection;
 class PauseableTimer;
 
-class CollectionScheduler: public QThread
+/**
+ * Collections ordered by the time they are due next.
+ *
+ * This is a binary min-heap with an index of the heap positions of all
+ * collections, so that looking up, rescheduling and removing a collection
+ * is O(log n) instead of a scan of the whole schedule.
+ */
+class CollectionSchedule
+{
+  public:
+    /**
+     * Schedules @p collection for @p due (in ms since the epoch), replacing
+     * a previous schedule of the collection.
+     */
+    void schedule( const Collection &collection, qint64 due );
+    bool remove( qint64 collectionId );
+
+    bool contains( qint64 collectionId ) const;
+    Collection collection( qint64 collectionId ) const;
+
+    bool isEmpty() const;
+    int size() const;
+
+    /**
+     * Returns the time the first collection is due, or -1 if there are
+     * no collections scheduled.
+     */
+    qint64 nextDue() const;
+
+    /**
+     * Removes and returns up to @p maximum collections due at or before
+     * @p time, earliest first.
+     */
+    QVector<Collection> takeDue( qint64 time, int maximum );
+
+  private:
+    struct Entry
+    {
+      qint64 due;
+      Collection collection;
+
+      bool operator<( const Entry &other ) const;
+    };
+
+    void removeAt( int position );
+    void moveUp( int position );
+    void moveDown( int position );
+    void place( int position, const Entry &entry );
+
+    QVector<Entry> mHeap;
+    QHash<qint64, int> mPositions;
+};
+
+/**
+ * Base class of maintenance tasks that act on collections periodically.
+ *
+ * The scheduler is meant to be run by the BackgroundTaskExecutor, with
+ * initScheduler() as the slot that starts it.
+ */
+class CollectionScheduler: public QObject
 {
     Q_OBJECT
 
@@ -56,9 +116,28 @@ class CollectionScheduler: public QThread
     void setMinimumInterval( int intervalMinutes );
     int minimumInterval() const;
 
-  protected:
-    virtual void run();
+    /**
+     * Sets how much later than its interval a collection may be scheduled
+     * at random, so that collections with the same interval do not all
+     * expire at once.
+     *
+     * Default value is 10, configurable by Scheduler/Jitter.
+     *
+     * @p percent Maximum delay in percent of the interval
+     */
+    void setJitter( int percent );
+    int jitter() const;
 
+    /**
+     * Sets the maximum number of collections that expire at once. Further
+     * due collections follow a second later.
+     *
+     * Default value is 20, configurable by Scheduler/MaximumBatchSize.
+     */
+    void setMaximumBatchSize( int size );
+    int maximumBatchSize() const;
+
+  protected:
     virtual bool shouldScheduleCollection( const Collection &collection ) = 0;
     virtual bool hasChanged( const Collection &collection, const Collection &changed ) = 0;
     /**
@@ -67,7 +146,7 @@ class CollectionScheduler: public QThread
     virtual int collectionScheduleInterval( const Collection &collection ) = 0;
     virtual void collectionExpired( const Collection &collection ) = 0;
 
-    void inhibit( bool inhibit = true );
+    virtual void inhibit( bool inhibit = true );
 
   protected Q_SLOTS:
     void initScheduler();
@@ -76,10 +155,22 @@ class CollectionScheduler: public QThread
     void scheduleCollection( /*sic!*/ Collection collection, bool shouldStartScheduler = true );
 
   protected:
+    /**
+     * Schedules @p collection to expire at @p due, in ms since the epoch.
+     */
+    void schedule( const Collection &collection, qint64 due, bool shouldStartScheduler );
+
+    /**
+     * Returns the time in ms between expirations of @p collection.
+     */
+    qint64 scheduleInterval( const Collection &collection );
+
     QMutex mScheduleLock;
-    QMultiMap<uint /*timestamp*/, Collection> mSchedule;
+    CollectionSchedule mSchedule;
     PauseableTimer *mScheduler;
     int mMinInterval;
+    int mJitter;
+    int mMaximumBatchSize;
 };
 
 } // namespace Server
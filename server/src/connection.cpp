@@ -19,26 +19,35 @@
  ***************************************************************************/
 #include "connection.h"
 
+#include <QtCore/QDataStream>
 #include <QtCore/QDebug>
 #include <QtCore/QEventLoop>
 #include <QtCore/QLatin1String>
 #include <QSettings>
 
 #include "storage/datastore.h"
+#include "backgroundtaskexecutor.h"
 #include "handler.h"
 #include "response.h"
 #include "tracer.h"
 #include "clientcapabilityaggregator.h"
 #include "collectionreferencemanager.h"
+#include "notificationmanager.h"
 
 #include "imapstreamparser.h"
 #include "shared/akdebug.h"
 #include "shared/akcrash.h"
 
 #include <akstandarddirs.h>
+#include <libs/protocol_p.h>
 
 #include <assert.h>
 
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <sys/socket.h>
+#endif
+
 #define AKONADI_PROTOCOL_VERSION 44
 
 using namespace Akonadi::Server;
@@ -52,6 +61,8 @@ Connection::Connection( QObject *parent )
     , m_backend( 0 )
     , m_streamParser( 0 )
     , m_verifyCacheOnRetrieval( false )
+    , m_notificationsWritten( false )
+    , m_notificationsAttached( false )
     , m_totalTime( 0 )
     , m_reportTime( false )
 {
@@ -67,6 +78,8 @@ Connection::Connection( quintptr socketDescriptor, QObject *parent )
     , m_backend( 0 )
     , m_streamParser( 0 )
     , m_verifyCacheOnRetrieval( false )
+    , m_notificationsWritten( false )
+    , m_notificationsAttached( false )
     , m_totalTime( 0 )
     , m_reportTime( false )
 {
@@ -101,6 +114,8 @@ Connection::Connection( quintptr socketDescriptor, QObject *parent )
              this, SLOT(slotNewData()) );
     connect( socket, SIGNAL(disconnected()),
              this, SIGNAL(disconnected()) );
+    connect( socket, SIGNAL(bytesWritten(qint64)),
+             this, SLOT(slotBytesWritten()) );
 
     m_streamParser = new ImapStreamParser( m_socket );
     m_streamParser->setTracerIdentifier( m_identifier );
@@ -135,6 +150,12 @@ CollectionReferenceManager *Connection::collectionReferenceManager()
 
 Connection::~Connection()
 {
+    // Sources only hold a plain pointer to us, and must not deliver to a
+    // connection that is being destroyed
+    if ( m_notificationsAttached ) {
+        NotificationManager::self()->detachConnection( this );
+    }
+
     if (m_reportTime) {
         reportTime();
     }
@@ -158,6 +179,8 @@ void Connection::slotNewData()
 
   QString currentCommand;
   while ( m_socket->bytesAvailable() > 0 || !m_streamParser->readRemainingData().isEmpty() ) {
+    // Maintenance backs off while commands are being processed
+    const ForegroundCommand foregroundCommand;
     try {
       const QByteArray tag = m_streamParser->readString();
       // deal with stray newlines
@@ -214,6 +237,7 @@ void Connection::slotNewData()
     }
     delete m_currentHandler;
     m_currentHandler = 0;
+    flushNotifications();
 
     if ( m_streamParser->readRemainingData().startsWith( '\n' ) || m_streamParser->readRemainingData().startsWith( "\r\n" ) ) {
       try {
@@ -232,6 +256,52 @@ void Connection::writeOut( const QByteArray &data )
     Tracer::self()->connectionOutput( m_identifier, block );
 }
 
+void Connection::sendNotifications( const NotificationMessageV3::List &notifications )
+{
+    m_pendingNotifications += notifications;
+    // Don't interleave notifications with the responses of a command
+    if ( !m_currentHandler ) {
+        flushNotifications();
+    }
+}
+
+void Connection::flushNotifications()
+{
+    if ( m_pendingNotifications.isEmpty() ) {
+        return;
+    }
+    if ( !m_socket ) {
+        // Nobody to write to anymore, but the source must not wait for us forever
+        m_pendingNotifications.clear();
+        Q_EMIT notificationsFlushed();
+        return;
+    }
+
+    QByteArray data;
+    QDataStream stream( &data, QIODevice::WriteOnly );
+    stream.setVersion( QDataStream::Qt_4_6 );
+    stream << m_pendingNotifications;
+    m_pendingNotifications.clear();
+
+    Response response;
+    response.setUntagged();
+    response.setString( AKONADI_CMD_NOTIFY " {" + QByteArray::number( data.size() ) + "}\r\n" + data );
+    slotResponseAvailable( response );
+
+    // The source sends the next batch once this one has left our buffer,
+    // so that a slow client holds back the notifications in the source
+    m_notificationsWritten = true;
+    slotBytesWritten();
+}
+
+void Connection::slotBytesWritten()
+{
+    if ( m_notificationsWritten && m_socket->bytesToWrite() == 0 ) {
+        m_notificationsWritten = false;
+        Q_EMIT notificationsFlushed();
+    }
+}
+
 CommandContext *Connection::context() const
 {
     return const_cast<CommandContext*>( &m_context );
@@ -367,6 +437,34 @@ bool Connection::verifyCacheOnRetrieval() const
   return m_verifyCacheOnRetrieval;
 }
 
+bool Connection::isClientConnected() const
+{
+    QLocalSocket *socket = qobject_cast<QLocalSocket *>( m_socket );
+    if ( !socket ) {
+        return true;
+    }
+    if ( socket->state() != QLocalSocket::ConnectedState ) {
+        return false;
+    }
+
+#ifdef Q_OS_UNIX
+    // The socket state only changes when QLocalSocket reads from the socket,
+    // which happens in the event loop or would start processing the next
+    // command. Just peek whether the client has hung up instead.
+    char c;
+    const ssize_t ret = ::recv( socket->socketDescriptor(), &c, 1, MSG_PEEK | MSG_DONTWAIT );
+    if ( ret == 0 || ( ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) ) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+void Connection::setNotificationsAttached( bool attached )
+{
+    m_notificationsAttached = attached;
+}
+
 void Connection::startTime()
 {
     m_time.start();
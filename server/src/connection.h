@@ -29,6 +29,8 @@
 #include "clientcapabilities.h"
 #include "commandcontext.h"
 
+#include <libs/notificationmessagev3_p.h>
+
 namespace Akonadi {
 namespace Server {
 
@@ -75,9 +77,36 @@ public:
     /** Returns @c true if permanent cache verification is enabled. */
     bool verifyCacheOnRetrieval() const;
 
+    /**
+     * Returns @c false once the client has closed the connection. Unlike
+     * QLocalSocket::state(), this is up to date while a command is being
+     * processed.
+     */
+    bool isClientConnected() const;
+
+    /**
+     * Remembers whether notification sources deliver over this connection,
+     * which then detaches them when it is destroyed.
+     * @see NotificationManager::attachConnection()
+     */
+    void setNotificationsAttached( bool attached );
+
+public Q_SLOTS:
+    /**
+     * Sends @p notifications to the client as an untagged NOTIFY response,
+     * once the currently processed command has finished.
+     */
+    void sendNotifications( const Akonadi::NotificationMessageV3::List &notifications );
+
 Q_SIGNALS:
     void disconnected();
 
+    /**
+     * Emitted when notifications were completely written out to the client,
+     * or dropped because the client is gone already.
+     */
+    void notificationsFlushed();
+
 protected Q_SLOTS:
     /**
      * New data arrived from the client. Creates a handler for it and passes the data to the handler.
@@ -87,10 +116,17 @@ protected Q_SLOTS:
 
     virtual void slotResponseAvailable( const Akonadi::Server::Response &response );
 
+    /**
+     * Emits notificationsFlushed() once written notifications have been
+     * passed on to the client completely.
+     */
+    void slotBytesWritten();
+
 protected:
     Connection(QObject *parent = 0); // used for testing
 
     void writeOut( const QByteArray &data );
+    void flushNotifications();
     virtual Handler *findHandlerForCommand( const QByteArray &command );
 
 protected:
@@ -105,11 +141,15 @@ protected:
     ImapStreamParser *m_streamParser;
     ClientCapabilities m_clientCapabilities;
     bool m_verifyCacheOnRetrieval;
+    //! Notifications were written, notificationsFlushed() is due once they are sent
+    bool m_notificationsWritten;
+    bool m_notificationsAttached;
     CommandContext m_context;
     QTime m_time;
     qint64 m_totalTime;
     QHash<QString, qint64> m_totalTimeByHandler;
     QHash<QString, qint64> m_executionsByHandler;
+    NotificationMessageV3::List m_pendingNotifications;
 
 private:
     /** For debugging */
@@ -35,6 +35,7 @@
 #include "handler/colmove.h"
 #include "handler/create.h"
 #include "handler/delete.h"
+#include "handler/export.h"
 #include "handler/expunge.h"
 #include "handler/fetch.h"
 #include "handler/link.h"
@@ -44,6 +45,7 @@
 #include "handler/merge.h"
 #include "handler/modify.h"
 #include "handler/move.h"
+#include "handler/notify.h"
 #include "handler/remove.h"
 #include "handler/resourceselect.h"
 #include "handler/search.h"
@@ -147,6 +149,9 @@ Handler *Handler::findHandlerForCommandAuthenticated( const QByteArray &_command
     if ( command == AKONADI_CMD_ITEMFETCH ) {
         return new Fetch( scope );
     }
+    if ( command == AKONADI_CMD_EXPORT ) {
+        return new Export();
+    }
     if ( command == AKONADI_CMD_EXPUNGE ) { //TODO: remove EXPUNGE support in Akonadi 2.0
         return new Expunge();
     }
@@ -201,6 +206,9 @@ Handler *Handler::findHandlerForCommandAuthenticated( const QByteArray &_command
     if ( command == AKONADI_CMD_ITEMMOVE ) {
       return new Move( scope );
     }
+    if ( command == AKONADI_CMD_NOTIFY ) {
+      return new Notify();
+    }
     if ( command == AKONADI_CMD_COLLECTIONMOVE ) {
       return new ColMove( scope );
     }
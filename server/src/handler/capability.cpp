@@ -59,6 +59,8 @@ bool Capability::parseStream()
       capabilities.setAkAppendStreaming( true );
     } else if ( capability == AKONADI_PARAM_CAPABILITY_DIRECTSTREAMING ) {
       capabilities.setDirectStreaming( true );
+    } else if ( capability == AKONADI_PARAM_CAPABILITY_INBANDNOTIFY ) {
+      capabilities.setInBandNotifications( true );
     } else {
       qDebug() << Q_FUNC_INFO << "Unknown client capability:" << capability;
     }
@@ -45,6 +45,7 @@ namespace Server {
   <h4>Client Capabilities</h4>
   - @c NOTIFY version - version of the notification message format
   - @c NOPAYLOADPATH - only filename of external payload file is expected
+  - @c INBANDNOTIFY - notifications can be received over this connection, see Notify
 
   <h4>Server Capabilities</h4>
   None defined yet.
@@ -0,0 +1,186 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "export.h"
+
+#include "connection.h"
+#include "fetchhelper.h"
+#include "imapstreamparser.h"
+#include "response.h"
+#include "cachecleaner.h"
+#include "storage/querybuilder.h"
+
+#include <libs/protocol_p.h>
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QMutex>
+#include <QtCore/QWaitCondition>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+static const int s_defaultChunkSize = 100;
+
+// QThread::msleep() is not public in Qt 4
+static void waitFor( qint64 msecs )
+{
+  QMutex mutex;
+  QWaitCondition condition;
+  mutex.lock();
+  condition.wait( &mutex, msecs );
+  mutex.unlock();
+}
+
+Export::Export()
+  : Handler()
+  , mChunkSize( s_defaultChunkSize )
+  , mBackground( false )
+{
+}
+
+QVector<PimItem::Id> Export::nextChunk( PimItem::Id after )
+{
+  QueryBuilder qb( PimItem::tableName() );
+  qb.addColumn( PimItem::idFullColumnName() );
+  if ( mCollection.isValid() ) {
+    qb.addValueCondition( PimItem::collectionIdFullColumnName(), Query::Equals, mCollection.id() );
+  } else {
+    qb.addJoin( QueryBuilder::InnerJoin, Collection::tableName(),
+                PimItem::collectionIdFullColumnName(), Collection::idFullColumnName() );
+    qb.addValueCondition( Collection::resourceIdFullColumnName(), Query::Equals, mResource.id() );
+  }
+  qb.addValueCondition( PimItem::idFullColumnName(), Query::Greater, after );
+  qb.addSortColumn( PimItem::idFullColumnName(), Query::Ascending );
+  qb.setLimit( mChunkSize );
+
+  if ( !qb.exec() ) {
+    throw HandlerException( "Unable to list items for export" );
+  }
+
+  QVector<PimItem::Id> ids;
+  ids.reserve( mChunkSize );
+  QSqlQuery &query = qb.query();
+  while ( query.next() ) {
+    ids << query.value( 0 ).toLongLong();
+  }
+  return ids;
+}
+
+bool Export::parseStream()
+{
+  const QByteArray source = m_streamParser->readString();
+  if ( source == AKONADI_PARAM_COLLECTION ) {
+    bool ok = false;
+    const qint64 collectionId = m_streamParser->readNumber( &ok );
+    if ( !ok ) {
+      throw HandlerException( "Invalid collection id" );
+    }
+    mCollection = Collection::retrieveById( collectionId );
+    if ( !mCollection.isValid() ) {
+      throw HandlerException( "No such collection" );
+    }
+    // Items of virtual collections are exported with their real parents
+    if ( mCollection.isVirtual() ) {
+      throw HandlerException( "Cannot export a virtual collection" );
+    }
+  } else if ( source == AKONADI_PARAM_RESOURCE ) {
+    mResource = Resource::retrieveByName( m_streamParser->readUtf8String() );
+    if ( !mResource.isValid() ) {
+      throw HandlerException( "No such resource" );
+    }
+    if ( mResource.isVirtual() ) {
+      throw HandlerException( "Cannot export a virtual resource" );
+    }
+  } else {
+    throw HandlerException( "No export source specified" );
+  }
+
+  PimItem::Id lastId = 0;
+  while ( !m_streamParser->atCommandEnd() && !m_streamParser->hasList() ) {
+    const QByteArray param = m_streamParser->peekString();
+    if ( param == AKONADI_PARAM_CHUNKSIZE ) {
+      m_streamParser->readString();
+      bool ok = false;
+      mChunkSize = m_streamParser->readNumber( &ok );
+      if ( !ok || mChunkSize <= 0 ) {
+        throw HandlerException( "Invalid CHUNKSIZE value" );
+      }
+    } else if ( param == AKONADI_PARAM_AFTER ) {
+      m_streamParser->readString();
+      bool ok = false;
+      lastId = m_streamParser->readNumber( &ok );
+      if ( !ok || lastId < 0 ) {
+        throw HandlerException( "Invalid AFTER value" );
+      }
+    } else if ( param == AKONADI_PARAM_PRIORITY ) {
+      m_streamParser->readString();
+      const QByteArray priority = m_streamParser->readString();
+      if ( priority == AKONADI_PARAM_BACKGROUND ) {
+        mBackground = true;
+      } else if ( priority != AKONADI_PARAM_NORMAL ) {
+        throw HandlerException( "Invalid PRIORITY value" );
+      }
+    } else {
+      break;
+    }
+  }
+
+  FetchScope fetchScope( m_streamParser );
+  // Let FetchHelper sort each chunk in UID order and report the resume point
+  fetchScope.setSortOrder( FetchScope::SortByUid, Qt::AscendingOrder );
+  fetchScope.setLimit( mChunkSize );
+  fetchScope.setOffset( -1 );
+  fetchScope.setContinuationToken( QByteArray() );
+
+  CacheCleanerInhibitor inhibitor;
+
+  QElapsedTimer chunkTimer;
+  Q_FOREVER {
+    chunkTimer.start();
+
+    const QVector<PimItem::Id> chunk = nextChunk( lastId );
+    if ( chunk.isEmpty() ) {
+      break;
+    }
+
+    ImapSet set;
+    set.add( chunk );
+    Scope scope( Scope::Uid );
+    scope.setUidSet( set );
+
+    FetchHelper fetchHelper( connection(), scope, fetchScope );
+    connect( &fetchHelper, SIGNAL(responseAvailable(Akonadi::Server::Response)),
+             this, SIGNAL(responseAvailable(Akonadi::Server::Response)) );
+    if ( !fetchHelper.fetchItems( AKONADI_CMD_ITEMFETCH ) ) {
+      return false;
+    }
+
+    if ( chunk.count() < mChunkSize ) {
+      break;
+    }
+    lastId = chunk.last();
+
+    if ( mBackground ) {
+      waitFor( chunkTimer.elapsed() );
+    }
+  }
+
+  successResponse( "EXPORT completed" );
+  return true;
+}
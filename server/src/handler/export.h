@@ -0,0 +1,77 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_EXPORT_H
+#define AKONADI_EXPORT_H
+
+#include <entities.h>
+#include <handler.h>
+
+namespace Akonadi {
+namespace Server {
+
+/**
+  @ingroup akonadi_server_handler
+
+  Handler for the EXPORT command.
+
+  Streams all items of a collection or resource in ascending UID order, meant
+  for indexers and backup tools. Unlike a FETCH of the whole collection, the
+  items are read and sent in chunks of bounded size, so neither the server nor
+  the database has to hold the complete result at any time.
+
+  Request syntax:
+  @verbatim
+  export-request = tag " EXPORT " source *(" " export-parameter) " " fetch-parameters " " part-list
+  source = "COLLECTION " collection-id / "RESOURCE " resource-name
+  export-parameter = "CHUNKSIZE " number / "AFTER " uid / "PRIORITY " ( "NORMAL" / "BACKGROUND" )
+  @endverbatim
+
+  @c fetch-parameters and @c part-list are the same as for FETCH.
+
+  Semantics:
+  - @c CHUNKSIZE: Number of items read per chunk, 100 by default.
+  - @c AFTER: Resume an interrupted export after the item with the given UID.
+  - @c PRIORITY: @c BACKGROUND pauses after each chunk for as long as the chunk
+    took to process, leaving at least half of the time to other clients.
+
+  Items are sent as untagged FETCH responses. After every complete chunk an
+  untagged <tt>OK [NEXT uid]</tt> response reports the resume point.
+ */
+class Export : public Handler
+{
+  Q_OBJECT
+  public:
+    Export();
+
+    bool parseStream();
+
+  private:
+    QVector<PimItem::Id> nextChunk( PimItem::Id after );
+
+    Collection mCollection;
+    Resource mResource;
+    int mChunkSize;
+    bool mBackground;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -36,9 +36,13 @@ namespace Server {
   @verbatim
   fetch-request = tag " " [scope-selector " "] "FETCH " scope " " fetch-parameters " " part-list
   scope-selector = [ "UID" / "RID" ]
-  fetch-parameters = [ "FULLPAYLOAD" / "CACHEONLY" / "CACHEONLY" / "EXTERNALPAYLOAD" / "ANCESTORS " depth ]
+  fetch-parameters = [ "FULLPAYLOAD" / "CACHEONLY" / "CACHEONLY" / "EXTERNALPAYLOAD" / "ANCESTORS " depth /
+                       "CHANGEDSINCE MODSEQ " modseq / "SORT " sort-key " " sort-order / "LIMIT " number /
+                       "OFFSET " number / "AFTER " token ]
   part-list = "(" *(part-id) ")"
   depth = "0" / "1" / "INF"
+  sort-key = "UID" / "DATETIME" / "SIZE"
+  sort-order = "ASC" / "DESC"
   @endverbatim
 
   Semantics:
@@ -46,6 +50,20 @@ namespace Server {
   - @c CACHEONLY: Restrict retrieval to parts already in the cache, even if more parts have been requested.
   - @c EXTERNALPAYLOAD: Indicate the capability to retrieve parts via the filesystem instead over the socket
   - @c ANCESTORS: Indicate the desired ancestor collection depth (0 is the default)
+  - @c CHANGEDSINCE @c MODSEQ: Only return items changed after the given modseq of the
+    selected collection, requires a non-virtual collection context. Items removed since then
+    are listed in the untagged response <tt>VANISHED uid-set</tt>, or <tt>OK [FULLSYNC]</tt> is
+    sent if the modseq is too old to know them. The untagged response
+    <tt>OK [HIGHESTMODSEQ modseq]</tt> is sent last. When paging with @c LIMIT, each page
+    reports the same removals; clients keep the @c HIGHESTMODSEQ of the first page and only
+    store it after the last page (the one without @c NEXT) was received.
+  - @c SORT: Order of the results, ties are broken by the UID. The default is by UID, descending.
+    Requires @c LIMIT.
+  - @c LIMIT: Maximum number of items to return. If the limit is reached, the untagged
+    response <tt>OK [NEXT token]</tt> is sent after the items.
+  - @c OFFSET: Number of items to skip, requires @c LIMIT
+  - @c AFTER: Continue after the last item of a previous page, @c token is the one from its
+    @c NEXT response. Unlike @c OFFSET this is not affected by items added or removed meanwhile.
  */
 class Fetch : public Handler
 {
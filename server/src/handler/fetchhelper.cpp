@@ -33,6 +33,7 @@
 #include "storage/itemqueryhelper.h"
 #include "storage/itemretrievalmanager.h"
 #include "storage/itemretrievalrequest.h"
+#include "storage/modseqhelper.h"
 #include "storage/parthelper.h"
 #include <storage/parttypehelper.h>
 #include "storage/transaction.h"
@@ -60,6 +61,7 @@ FetchHelper::FetchHelper( Connection *connection, const Scope &scope, const Fetc
   , mConnection( connection )
   , mScope( scope )
   , mFetchScope( fetchScope )
+  , mFullResync( false )
 {
   std::fill( mItemQueryColumnMap, mItemQueryColumnMap + ItemQueryColumnCount, -1 );
 }
@@ -117,6 +119,7 @@ QSqlQuery FetchHelper::buildPartQuery( const QVector<QByteArray> &partList, bool
     }
 
     ItemQueryHelper::scopeToQuery( mScope, mConnection->context(), partQuery );
+    addChangedSinceModSeqCondition( partQuery );
 
     if ( !partQuery.exec() ) {
       throw HandlerException( "Unable to list item parts" );
@@ -158,6 +161,9 @@ QSqlQuery FetchHelper::buildItemQuery()
   if ( mFetchScope.gidRequested() ) {
     ADD_COLUMN( PimItem::gidFullColumnName(), ItemQueryPimItemGidColumn )
   }
+  if ( mFetchScope.modSeqRequested() ) {
+    ADD_COLUMN( PimItem::modseqFullColumnName(), ItemQueryModSeqColumn )
+  }
   #undef ADD_COLUMN
 
   itemQuery.addSortColumn( PimItem::idFullColumnName(), Query::Descending );
@@ -169,6 +175,7 @@ QSqlQuery FetchHelper::buildItemQuery()
   if ( mFetchScope.changedSince().isValid() ) {
     itemQuery.addValueCondition( PimItem::datetimeFullColumnName(), Query::GreaterOrEqual, mFetchScope.changedSince().toUTC() );
   }
+  addChangedSinceModSeqCondition( itemQuery );
 
   if ( !itemQuery.exec() ) {
     throw HandlerException( "Unable to list items" );
@@ -194,6 +201,7 @@ QSqlQuery FetchHelper::buildFlagQuery()
   flagQuery.addColumn( PimItem::idFullColumnName() );
   flagQuery.addColumn( Flag::nameFullColumnName() );
   ItemQueryHelper::scopeToQuery( mScope, mConnection->context(), flagQuery );
+  addChangedSinceModSeqCondition( flagQuery );
   flagQuery.addSortColumn( PimItem::idFullColumnName(), Query::Descending );
 
   if ( !flagQuery.exec() ) {
@@ -221,6 +229,7 @@ QSqlQuery FetchHelper::buildTagQuery()
   tagQuery.addColumn( Tag::idFullColumnName() );
 
   ItemQueryHelper::scopeToQuery( mScope, mConnection->context(), tagQuery );
+  addChangedSinceModSeqCondition( tagQuery );
   tagQuery.addSortColumn( PimItem::idFullColumnName(), Query::Descending );
 
   if ( !tagQuery.exec() ) {
@@ -246,6 +255,7 @@ QSqlQuery FetchHelper::buildVRefQuery()
   vRefQuery.addColumn( CollectionPimItemRelation::leftFullColumnName() );
   vRefQuery.addColumn( CollectionPimItemRelation::rightFullColumnName() );
   ItemQueryHelper::scopeToQuery( mScope, mConnection->context(), vRefQuery );
+  addChangedSinceModSeqCondition( vRefQuery );
   vRefQuery.addSortColumn( PimItem::idFullColumnName(), Query::Descending );
 
   if (!vRefQuery.exec() ) {
@@ -257,6 +267,165 @@ QSqlQuery FetchHelper::buildVRefQuery()
   return vRefQuery.query();
 }
 
+void FetchHelper::addChangedSinceModSeqCondition( QueryBuilder &qb ) const
+{
+  if ( mFetchScope.changedSinceModSeq() >= 0 && !mFullResync ) {
+    qb.addValueCondition( PimItem::modseqFullColumnName(), Query::Greater, mFetchScope.changedSinceModSeq() );
+  }
+}
+
+void FetchHelper::emitRemovals( Collection::Id collectionId )
+{
+  if ( mFullResync ) {
+    // Everything that is not listed is gone
+    Response response;
+    response.setUntagged();
+    response.setString( "OK [" AKONADI_PARAM_FULLSYNC "]" );
+    Q_EMIT responseAvailable( response );
+    return;
+  }
+
+  const QVector<PimItem::Id> vanished = ModSeqHelper::vanishedItems( collectionId, mFetchScope.changedSinceModSeq() );
+  if ( vanished.isEmpty() ) {
+    return;
+  }
+
+  ImapSet set;
+  set.add( vanished );
+
+  Response response;
+  response.setUntagged();
+  response.setString( AKONADI_PARAM_VANISHED " " + set.toImapSequenceSet() );
+  Q_EMIT responseAvailable( response );
+}
+
+void FetchHelper::emitHighestModSeq( qint64 highestModSeq )
+{
+  Response response;
+  response.setUntagged();
+  response.setString( "OK [" AKONADI_PARAM_HIGHESTMODSEQ " " + QByteArray::number( highestModSeq ) + "]" );
+  Q_EMIT responseAvailable( response );
+}
+
+static QString sortColumnName( FetchScope::SortKey key )
+{
+  switch ( key ) {
+  case FetchScope::SortByDatetime:
+    return PimItem::datetimeFullColumnName();
+  case FetchScope::SortBySize:
+    return PimItem::sizeFullColumnName();
+  case FetchScope::SortByUid:
+    break;
+  }
+  return PimItem::idFullColumnName();
+}
+
+// Keep the datetime in the format we read it from the database, so that it
+// compares equal when we bind it again for the next page
+static const QLatin1String s_tokenDateTimeFormat( "yyyy-MM-ddThh:mm:ss.zzz" );
+
+static QByteArray sortValueToToken( FetchScope::SortKey key, const QVariant &value )
+{
+  if ( key == FetchScope::SortByDatetime ) {
+    return value.toDateTime().toString( s_tokenDateTimeFormat ).toLatin1();
+  }
+  return QByteArray::number( value.toLongLong() );
+}
+
+static QVariant sortValueFromToken( FetchScope::SortKey key, const QByteArray &token )
+{
+  if ( key == FetchScope::SortByDatetime ) {
+    const QDateTime dt = QDateTime::fromString( QString::fromLatin1( token ), s_tokenDateTimeFormat );
+    return dt.isValid() ? QVariant( dt ) : QVariant();
+  }
+  bool ok = false;
+  const qint64 value = token.toLongLong( &ok );
+  return ok ? QVariant( value ) : QVariant();
+}
+
+QVector<PimItem::Id> FetchHelper::fetchPage( QByteArray &continuationToken )
+{
+  const FetchScope::SortKey key = mFetchScope.sortKey();
+  const bool byUid = ( key == FetchScope::SortByUid );
+  const QString sortColumn = sortColumnName( key );
+  const Query::SortOrder order = ( mFetchScope.sortOrder() == Qt::AscendingOrder ) ? Query::Ascending : Query::Descending;
+  const Query::CompareOperator after = ( order == Query::Ascending ) ? Query::Greater : Query::Less;
+
+  QueryBuilder pageQuery( PimItem::tableName() );
+  pageQuery.setForwardOnly( true );
+  pageQuery.addColumn( PimItem::idFullColumnName() );
+  if ( !byUid ) {
+    pageQuery.addColumn( sortColumn );
+  }
+
+  if ( mScope.scope() != Scope::Invalid ) {
+    ItemQueryHelper::scopeToQuery( mScope, mConnection->context(), pageQuery );
+  }
+  if ( mFetchScope.changedSince().isValid() ) {
+    pageQuery.addValueCondition( PimItem::datetimeFullColumnName(), Query::GreaterOrEqual, mFetchScope.changedSince().toUTC() );
+  }
+  addChangedSinceModSeqCondition( pageQuery );
+
+  // Keyset pagination: continue after the (sort key, UID) pair of the last
+  // item of the previous page, which is served by the composite indexes
+  const QByteArray token = mFetchScope.continuationToken();
+  if ( !token.isEmpty() ) {
+    const int separator = token.lastIndexOf( ':' );
+    bool ok = false;
+    const qint64 lastId = token.mid( separator + 1 ).toLongLong( &ok );
+    if ( !ok || ( !byUid && separator <= 0 ) ) {
+      throw HandlerException( "Invalid AFTER token" );
+    }
+
+    if ( byUid ) {
+      pageQuery.addValueCondition( PimItem::idFullColumnName(), after, lastId );
+    } else {
+      const QVariant lastValue = sortValueFromToken( key, token.left( separator ) );
+      if ( !lastValue.isValid() ) {
+        throw HandlerException( "Invalid AFTER token" );
+      }
+      Query::Condition tieCondition( Query::And );
+      tieCondition.addValueCondition( sortColumn, Query::Equals, lastValue );
+      tieCondition.addValueCondition( PimItem::idFullColumnName(), after, lastId );
+      Query::Condition keysetCondition( Query::Or );
+      keysetCondition.addValueCondition( sortColumn, after, lastValue );
+      keysetCondition.addCondition( tieCondition );
+      pageQuery.addCondition( keysetCondition );
+    }
+  }
+
+  if ( !byUid ) {
+    pageQuery.addSortColumn( sortColumn, order );
+  }
+  pageQuery.addSortColumn( PimItem::idFullColumnName(), order );
+  pageQuery.setLimit( mFetchScope.limit() );
+  pageQuery.setOffset( mFetchScope.offset() );
+
+  if ( !pageQuery.exec() ) {
+    throw HandlerException( "Unable to list items" );
+  }
+
+  QVector<PimItem::Id> ids;
+  QVariant lastValue;
+  QSqlQuery &query = pageQuery.query();
+  while ( query.next() ) {
+    ids << query.value( 0 ).toLongLong();
+    if ( !byUid ) {
+      lastValue = query.value( 1 );
+    }
+  }
+
+  // A full page means there might be more
+  continuationToken.clear();
+  if ( ids.count() == mFetchScope.limit() ) {
+    if ( !byUid ) {
+      continuationToken = sortValueToToken( key, lastValue ) + ':';
+    }
+    continuationToken += QByteArray::number( ids.last() );
+  }
+
+  return ids;
+}
 
 bool FetchHelper::isScopeLocal( const Scope &scope )
 {
@@ -340,10 +509,61 @@ bool FetchHelper::fetchItems( const QByteArray &responseIdentifier )
   // cacheOnly and retrieve missing parts from the resource. However ItemRetriever
   // is painfully slow with many items and is generally designed to fetch a few
   // messages, not all of them. In the long term, we need a better way to do this.
-  if ( !mFetchScope.cacheOnly() || isScopeLocal( mScope ) ) {
+  const bool retrieveMissingParts = !mFetchScope.cacheOnly() || isScopeLocal( mScope );
+
+  // Removals are only remembered back to the modseq horizon, a client that
+  // has seen an older modseq gets the whole collection instead
+  const Collection::Id modseqCollectionId = mConnection->context()->collectionId();
+  if ( mFetchScope.changedSinceModSeq() >= 0 ) {
+    // Modseqs are counted per collection, they mean nothing across collections
+    // and virtual collections only reference items of other collections
+    if ( modseqCollectionId <= 0 || mConnection->context()->tagId() >= 0 ) {
+      throw HandlerException( "CHANGEDSINCE MODSEQ requires a collection context" );
+    }
+    if ( Collection::retrieveById( modseqCollectionId ).isVirtual() ) {
+      throw HandlerException( "CHANGEDSINCE MODSEQ is not supported for virtual collections" );
+    }
+    mFullResync = mFetchScope.changedSinceModSeq() < ModSeqHelper::modSeqHorizon( modseqCollectionId );
+  }
+
+  if ( retrieveMissingParts ) {
     // trigger a collection sync if configured to do so
     triggerOnDemandFetch();
+  }
 
+  // Read the highest modseq before the items, so that changes committed while
+  // we are fetching are reported (again) on the next incremental fetch.
+  qint64 highestModSeq = -1;
+  if ( mFetchScope.changedSinceModSeq() >= 0 ) {
+    highestModSeq = ModSeqHelper::highestModSeq( modseqCollectionId );
+  }
+
+  // Narrow the scope down to the requested page first, so that only the items
+  // on that page are retrieved from the resource and listed
+  QVector<PimItem::Id> page;
+  QByteArray continuationToken;
+  if ( mFetchScope.limit() > 0 ) {
+    page = fetchPage( continuationToken );
+    if ( page.isEmpty() ) {
+      // nothing changed on this page, but items may still have been removed
+      if ( highestModSeq >= 0 ) {
+        emitRemovals( modseqCollectionId );
+        emitHighestModSeq( highestModSeq );
+      }
+      return true;
+    }
+    ImapSet pageSet;
+    pageSet.add( page );
+    mScope = Scope( Scope::Uid );
+    mScope.setUidSet( pageSet );
+  }
+  // All queries below are sorted by UID (descending), responses for any other
+  // order are collected first and then sent in page order
+  const bool reorderResponses = !page.isEmpty() &&
+                                ( mFetchScope.sortKey() != FetchScope::SortByUid || mFetchScope.sortOrder() != Qt::DescendingOrder );
+  QHash<PimItem::Id, QByteArray> pageResponses;
+
+  if ( retrieveMissingParts ) {
     // Prepare for a call to ItemRetriever::exec();
     // From a resource perspective the only parts that can be fetched are payloads.
     ItemRetriever retriever( mConnection );
@@ -351,6 +571,7 @@ bool FetchHelper::fetchItems( const QByteArray &responseIdentifier )
     retriever.setRetrieveParts( mFetchScope.requestedPayloads() );
     retriever.setRetrieveFullPayload( mFetchScope.fullPayload() );
     retriever.setChangedSince( mFetchScope.changedSince() );
+    retriever.setChangedSinceModSeq( mFullResync ? -1 : mFetchScope.changedSinceModSeq() );
     if ( !retriever.exec() && !mFetchScope.ignoreErrors() ) { // There we go, retrieve the missing parts from the resource.
       if ( mConnection->context()->resource().isValid() ) {
         throw HandlerException( QString::fromLatin1( "Unable to fetch item from backend (collection %1, resource %2) : %3" )
@@ -368,8 +589,8 @@ bool FetchHelper::fetchItems( const QByteArray &responseIdentifier )
   QSqlQuery itemQuery = buildItemQuery();
 
   // error if query did not find any item and scope is not listing items but
-  // a request for a specific item
-  if ( !itemQuery.isValid() ) {
+  // a request for a specific item (an incremental fetch may well find nothing)
+  if ( !itemQuery.isValid() && mFetchScope.changedSinceModSeq() < 0 ) {
     if ( mFetchScope.ignoreErrors() ) {
       return true;
     }
@@ -407,6 +628,11 @@ bool FetchHelper::fetchItems( const QByteArray &responseIdentifier )
     vRefQuery = buildVRefQuery();
   }
 
+  // report removals first, an item might have been moved out and back in again
+  if ( highestModSeq >= 0 ) {
+    emitRemovals( modseqCollectionId );
+  }
+
   // build responses
   Response response;
   response.setUntagged();
@@ -529,6 +755,11 @@ bool FetchHelper::fetchItems( const QByteArray &responseIdentifier )
       }
     }
 
+    if ( mFetchScope.modSeqRequested() ) {
+      const qint64 modseq = extractQueryResult( itemQuery, ItemQueryModSeqColumn ).toLongLong();
+      attributes.append( AKONADI_PARAM_MODSEQ " " + QByteArray::number( modseq ) );
+    }
+
     if ( mFetchScope.ancestorDepth() > 0 ) {
       attributes.append( HandlerHelper::ancestorsToByteArray( mFetchScope.ancestorDepth(), ancestorsForItem( parentCollectionId ) ) );
     }
@@ -609,11 +840,36 @@ bool FetchHelper::fetchItems( const QByteArray &responseIdentifier )
     // IMAP protocol violation: should actually be the sequence number
     QByteArray attr = QByteArray::number( pimItemId ) + ' ' + responseIdentifier + " (";
     attr += ImapParser::join( attributes, " " ) + ')';
+    if ( reorderResponses ) {
+      pageResponses.insert( pimItemId, attr );
+    } else {
+      response.setUntagged();
+      response.setString( attr );
+      Q_EMIT responseAvailable( response );
+    }
+
+    itemQuery.next();
+  }
+
+  if ( reorderResponses ) {
+    Q_FOREACH ( PimItem::Id id, page ) {
+      const QHash<PimItem::Id, QByteArray>::const_iterator it = pageResponses.constFind( id );
+      if ( it != pageResponses.constEnd() ) {
+        response.setUntagged();
+        response.setString( it.value() );
+        Q_EMIT responseAvailable( response );
+      }
+    }
+  }
+
+  if ( !continuationToken.isEmpty() ) {
     response.setUntagged();
-    response.setString( attr );
+    response.setString( "OK [" AKONADI_PARAM_NEXT " " + continuationToken + "]" );
     Q_EMIT responseAvailable( response );
+  }
 
-    itemQuery.next();
+  if ( highestModSeq >= 0 ) {
+    emitHighestModSeq( highestModSeq );
   }
 
   // update atime (only if the payload was actually requested, otherwise a simple resource sync prevents cache clearing)
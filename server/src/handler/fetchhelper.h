@@ -62,6 +62,7 @@ class FetchHelper : public QObject
       ItemQueryDatetimeColumn,
       ItemQueryCollectionIdColumn,
       ItemQueryPimItemGidColumn,
+      ItemQueryModSeqColumn,
       ItemQueryColumnCount
     };
 
@@ -72,6 +73,10 @@ class FetchHelper : public QObject
     QSqlQuery buildFlagQuery();
     QSqlQuery buildTagQuery();
     QSqlQuery buildVRefQuery();
+    void addChangedSinceModSeqCondition( QueryBuilder &qb ) const;
+    void emitRemovals( Collection::Id collectionId );
+    void emitHighestModSeq( qint64 highestModSeq );
+    QVector<PimItem::Id> fetchPage( QByteArray &continuationToken );
     QStack<Collection> ancestorsForItem( Collection::Id parentColId );
     static bool needsAccessTimeUpdate( const QVector<QByteArray> &parts );
     QVariant extractQueryResult( const QSqlQuery &query, ItemQueryColumns column ) const;
@@ -86,6 +91,8 @@ class FetchHelper : public QObject
     QHash<Collection::Id, QStack<Collection> > mAncestorCache;
     Scope mScope;
     FetchScope mFetchScope;
+    /** The CHANGEDSINCE modseq is beyond the horizon, all items are listed */
+    bool mFullResync;
     int mItemQueryColumnMap[ItemQueryColumnCount];
 
     friend class ::FetchHelperTest;
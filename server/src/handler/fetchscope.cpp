@@ -39,6 +39,12 @@ class FetchScope::Private : public QSharedData
     QVector<QByteArray> mRequestedParts;
     QStringList mRequestedPayloads;
     QDateTime mChangedSince;
+    qint64 mChangedSinceModSeq;
+    QByteArray mContinuationToken;
+    int mLimit;
+    int mOffset;
+    FetchScope::SortKey mSortKey;
+    Qt::SortOrder mSortOrder;
 
     int mAncestorDepth;
     uint mCacheOnly : 1;
@@ -56,12 +62,19 @@ class FetchScope::Private : public QSharedData
     uint mTagsRequested : 1;
     uint mRelationsRequested : 1;
     uint mVirtRefRequested: 1;
+    uint mModSeqRequested : 1;
+    uint mHasSortOrder : 1;
     QVector<QByteArray> mTagFetchScope;
 };
 
 FetchScope::Private::Private()
   : QSharedData()
   , mStreamParser( 0 )
+  , mChangedSinceModSeq( -1 )
+  , mLimit( -1 )
+  , mOffset( -1 )
+  , mSortKey( FetchScope::SortByUid )
+  , mSortOrder( Qt::DescendingOrder )
   , mAncestorDepth( 0 )
   , mCacheOnly( false )
   , mCheckCachedPayloadPartsOnly( false )
@@ -78,6 +91,8 @@ FetchScope::Private::Private()
   , mTagsRequested( false )
     , mRelationsRequested(false)
   , mVirtRefRequested( false )
+  , mModSeqRequested( false )
+  , mHasSortOrder( false )
 {
 }
 
@@ -87,6 +102,12 @@ FetchScope::Private::Private( const Private &other )
   , mRequestedParts( other.mRequestedParts )
   , mRequestedPayloads( other.mRequestedPayloads )
   , mChangedSince( other.mChangedSince )
+  , mChangedSinceModSeq( other.mChangedSinceModSeq )
+  , mContinuationToken( other.mContinuationToken )
+  , mLimit( other.mLimit )
+  , mOffset( other.mOffset )
+  , mSortKey( other.mSortKey )
+  , mSortOrder( other.mSortOrder )
   , mAncestorDepth( other.mAncestorDepth )
   , mCacheOnly( other.mCacheOnly )
   , mCheckCachedPayloadPartsOnly( other.mCheckCachedPayloadPartsOnly )
@@ -103,6 +124,8 @@ FetchScope::Private::Private( const Private &other )
   , mTagsRequested( other.mTagsRequested )
     , mRelationsRequested(other.mRelationsRequested)
   , mVirtRefRequested( other.mVirtRefRequested )
+  , mModSeqRequested( other.mModSeqRequested )
+  , mHasSortOrder( other.mHasSortOrder )
   , mTagFetchScope( other.mTagFetchScope )
 {
 }
@@ -139,15 +162,72 @@ void FetchScope::Private::parseCommandStream()
         mIgnoreErrors = true;
       } else if ( buffer == AKONADI_PARAM_CHANGEDSINCE ) {
         bool ok = false;
-        mChangedSince = QDateTime::fromTime_t( mStreamParser->readNumber( &ok ) );
-        if ( !ok ) {
-          throw HandlerException( "Invalid CHANGEDSINCE timestamp" );
+        if ( mStreamParser->peekString() == AKONADI_PARAM_MODSEQ ) {
+          mStreamParser->readString();
+          mChangedSinceModSeq = mStreamParser->readNumber( &ok );
+          if ( !ok || mChangedSinceModSeq < 0 ) {
+            throw HandlerException( "Invalid CHANGEDSINCE MODSEQ value" );
+          }
+          mModSeqRequested = true;
+        } else {
+          mChangedSince = QDateTime::fromTime_t( mStreamParser->readNumber( &ok ) );
+          if ( !ok ) {
+            throw HandlerException( "Invalid CHANGEDSINCE timestamp" );
+          }
+        }
+      } else if ( buffer == AKONADI_PARAM_SORT ) {
+        const QByteArray key = mStreamParser->readString();
+        if ( key == AKONADI_PARAM_UID ) {
+          mSortKey = FetchScope::SortByUid;
+        } else if ( key == AKONADI_PARAM_MTIME ) {
+          mSortKey = FetchScope::SortByDatetime;
+        } else if ( key == AKONADI_PARAM_SIZE ) {
+          mSortKey = FetchScope::SortBySize;
+        } else {
+          throw HandlerException( "Invalid SORT key" );
+        }
+        const QByteArray order = mStreamParser->readString();
+        if ( order == AKONADI_PARAM_ASCENDING ) {
+          mSortOrder = Qt::AscendingOrder;
+        } else if ( order == AKONADI_PARAM_DESCENDING ) {
+          mSortOrder = Qt::DescendingOrder;
+        } else {
+          throw HandlerException( "Invalid SORT order" );
+        }
+        mHasSortOrder = true;
+      } else if ( buffer == AKONADI_PARAM_LIMIT ) {
+        bool ok = false;
+        mLimit = mStreamParser->readNumber( &ok );
+        if ( !ok || mLimit <= 0 ) {
+          throw HandlerException( "Invalid LIMIT value" );
+        }
+      } else if ( buffer == AKONADI_PARAM_OFFSET ) {
+        bool ok = false;
+        mOffset = mStreamParser->readNumber( &ok );
+        if ( !ok || mOffset < 0 ) {
+          throw HandlerException( "Invalid OFFSET value" );
+        }
+      } else if ( buffer == AKONADI_PARAM_AFTER ) {
+        mContinuationToken = mStreamParser->readString();
+        if ( mContinuationToken.isEmpty() ) {
+          throw HandlerException( "Invalid AFTER token" );
         }
       } else {
         throw HandlerException( "Invalid command argument" );
       }
     }
   }
+
+  // Sorted results are reordered in memory, so they have to be bounded
+  if ( mHasSortOrder && mLimit <= 0 ) {
+    throw HandlerException( "SORT requires LIMIT" );
+  }
+  if ( ( mOffset >= 0 || !mContinuationToken.isEmpty() ) && mLimit <= 0 ) {
+    throw HandlerException( "OFFSET and AFTER require LIMIT" );
+  }
+  if ( mOffset >= 0 && !mContinuationToken.isEmpty() ) {
+    throw HandlerException( "OFFSET and AFTER are mutually exclusive" );
+  }
 }
 
 void FetchScope::Private::parsePartList()
@@ -184,6 +264,8 @@ void FetchScope::Private::parsePartList()
       // we always return collection IDs anyway
     } else if ( b == AKONADI_PARAM_VIRTREF ) {
       mVirtRefRequested = true;
+    } else if ( b == AKONADI_PARAM_MODSEQ ) {
+      mModSeqRequested = true;
     } else {
       mRequestedParts.push_back( b );
       if ( b.startsWith( AKONADI_PARAM_PLD ) ) {
@@ -264,6 +346,16 @@ QDateTime FetchScope::changedSince() const
   return d->mChangedSince;
 }
 
+void FetchScope::setChangedSinceModSeq( qint64 modseq )
+{
+  d->mChangedSinceModSeq = modseq;
+}
+
+qint64 FetchScope::changedSinceModSeq() const
+{
+  return d->mChangedSinceModSeq;
+}
+
 void FetchScope::setAncestorDepth( int depth )
 {
   d->mAncestorDepth = depth;
@@ -428,3 +520,60 @@ bool FetchScope::virtualReferencesRequested() const
 {
   return d->mVirtRefRequested;
 }
+
+void FetchScope::setModSeqRequested( bool modseqRequested )
+{
+  d->mModSeqRequested = modseqRequested;
+}
+
+bool FetchScope::modSeqRequested() const
+{
+  return d->mModSeqRequested;
+}
+
+void FetchScope::setSortOrder( SortKey key, Qt::SortOrder order )
+{
+  d->mSortKey = key;
+  d->mSortOrder = order;
+  d->mHasSortOrder = true;
+}
+
+FetchScope::SortKey FetchScope::sortKey() const
+{
+  return d->mSortKey;
+}
+
+Qt::SortOrder FetchScope::sortOrder() const
+{
+  return d->mSortOrder;
+}
+
+void FetchScope::setLimit( int limit )
+{
+  d->mLimit = limit;
+}
+
+int FetchScope::limit() const
+{
+  return d->mLimit;
+}
+
+void FetchScope::setOffset( int offset )
+{
+  d->mOffset = offset;
+}
+
+int FetchScope::offset() const
+{
+  return d->mOffset;
+}
+
+void FetchScope::setContinuationToken( const QByteArray &token )
+{
+  d->mContinuationToken = token;
+}
+
+QByteArray FetchScope::continuationToken() const
+{
+  return d->mContinuationToken;
+}
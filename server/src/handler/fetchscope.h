@@ -33,6 +33,15 @@ class ImapStreamParser;
 class FetchScope
 {
   public:
+    /**
+     * Item properties a FETCH result can be sorted by.
+     */
+    enum SortKey {
+      SortByUid,
+      SortByDatetime,
+      SortBySize
+    };
+
     FetchScope();
     FetchScope( ImapStreamParser *streamParser );
     FetchScope( const FetchScope &other );
@@ -50,6 +59,12 @@ class FetchScope
     QStringList requestedPayloads() const;
     void setChangedSince( const QDateTime &dt );
     QDateTime changedSince() const;
+    /**
+     * Only items with a change sequence number greater than @p modseq are
+     * fetched, -1 (the default) disables the filter.
+     */
+    void setChangedSinceModSeq( qint64 modseq );
+    qint64 changedSinceModSeq() const;
     void setAncestorDepth( int depth );
     int ancestorDepth() const;
     void setCacheOnly( bool cacheOnly );
@@ -83,6 +98,31 @@ class FetchScope
     bool relationsRequested() const;
     void setVirtualReferencesRequested( bool vRefRequested );
     bool virtualReferencesRequested() const;
+    void setModSeqRequested( bool modseqRequested );
+    bool modSeqRequested() const;
+    /**
+     * Sets the order of the FETCH results, items are sorted by @p key first
+     * and by their UID second. The default is by UID, descending.
+     */
+    void setSortOrder( SortKey key, Qt::SortOrder order );
+    SortKey sortKey() const;
+    Qt::SortOrder sortOrder() const;
+    /**
+     * Limits the number of fetched items, -1 (the default) fetches everything.
+     */
+    void setLimit( int limit );
+    int limit() const;
+    /**
+     * Number of items to skip before the first fetched one, requires a limit.
+     */
+    void setOffset( int offset );
+    int offset() const;
+    /**
+     * Continues a previous limited FETCH after the last item it returned.
+     * @p token is the opaque value of the NEXT response of that FETCH.
+     */
+    void setContinuationToken( const QByteArray &token );
+    QByteArray continuationToken() const;
 
   private:
     class Private;
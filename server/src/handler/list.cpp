@@ -24,6 +24,7 @@
 #include "storage/datastore.h"
 #include "storage/entity.h"
 #include "storage/selectquerybuilder.h"
+#include "storage/modseqhelper.h"
 
 #include "connection.h"
 #include "response.h"
@@ -31,6 +32,7 @@
 #include "imapstreamparser.h"
 #include "collectionreferencemanager.h"
 
+#include <libs/imapset_p.h>
 #include <libs/protocol_p.h>
 #include <storage/collectionqueryhelper.h>
 
@@ -51,6 +53,7 @@ List::List(Scope::SelectionScope scope, bool onlySubscribed)
     : Handler()
     , mScope(scope)
     , mAncestorDepth(0)
+    , mChangedSince(-1)
     , mOnlySubscribed(onlySubscribed)
     , mIncludeStatistics(false)
     , mEnabledCollections(false)
@@ -276,6 +279,10 @@ void List::retrieveCollections(const Collection &topParent, int depth)
             }
         }
 
+        if (mChangedSince > 0) {
+            qb.addValueCondition(Collection::treeRevisionFullColumnName(), Query::Greater, mChangedSince);
+        }
+
         //Base listings should succeed always
         if (depth != 0) {
             if (mCollectionsToSynchronize) {
@@ -502,6 +509,30 @@ void List::retrieveCollections(const Collection &topParent, int depth)
     }
 }
 
+void List::listRemovedCollections(const Collection &topParent)
+{
+    //The tombstones do not know about the tree structure anymore, limit them at least to the resource
+    Resource::Id resourceId = -1;
+    if (mResource.isValid()) {
+        resourceId = mResource.id();
+    } else if (topParent.isValid()) {
+        resourceId = topParent.resourceId();
+    }
+
+    const QVector<Collection::Id> removed = ModSeqHelper::removedCollections(mChangedSince, resourceId);
+    if (removed.isEmpty()) {
+        return;
+    }
+
+    ImapSet set;
+    set.add(removed);
+
+    Response response;
+    response.setUntagged();
+    response.setString(AKONADI_PARAM_VANISHED " " + set.toImapSequenceSet());
+    Q_EMIT responseAvailable(response);
+}
+
 bool List::parseStream()
 {
     qint64 baseCollection = -1;
@@ -571,6 +602,13 @@ bool List::parseStream()
                     mIncludeStatistics = true;
                 }
             }
+            if (option == AKONADI_PARAM_CHANGEDSINCE) {
+                bool ok = false;
+                mChangedSince = m_streamParser->readNumber(&ok);
+                if (!ok || mChangedSince < 0) {
+                    throw HandlerException("Invalid CHANGEDSINCE tree revision");
+                }
+            }
             if (option == AKONADI_PARAM_ANCESTORS) {
                 const QByteArray argument = m_streamParser->readString();
                 if (m_streamParser->hasList()) {
@@ -590,8 +628,26 @@ bool List::parseStream()
         }
     }
 
+    //Read the revision before listing, so changes happening meanwhile are reported again next time
+    qint64 treeRevision = -1;
+    if (mChangedSince >= 0) {
+        treeRevision = ModSeqHelper::treeRevision();
+        if (treeRevision < 0) {
+            throw HandlerException("Unable to retrieve collection tree revision");
+        }
+    }
+
+    //Removals are only remembered back to the horizon, list everything for older revisions
+    if (mChangedSince > 0 && mChangedSince < ModSeqHelper::treeRevisionHorizon()) {
+        mChangedSince = 0;
+        Response response;
+        response.setUntagged();
+        response.setString("OK [" AKONADI_PARAM_FULLSYNC "]");
+        Q_EMIT responseAvailable(response);
+    }
+
+    Collection col;
     if (baseCollection != 0) { // not root
-        Collection col;
         if (mScope.scope() == Scope::None || mScope.scope() == Scope::Uid) {
             col = Collection::retrieveById(baseCollection);
         } else if (mScope.scope() == Scope::Rid) {
@@ -641,6 +697,16 @@ bool List::parseStream()
         }
     }
 
+    if (mChangedSince > 0) {
+        listRemovedCollections(col);
+    }
+    if (treeRevision >= 0) {
+        Response response;
+        response.setUntagged();
+        response.setString("OK [" AKONADI_PARAM_TREEREVISION " " + QByteArray::number(treeRevision) + "]");
+        Q_EMIT responseAvailable(response);
+    }
+
     Response response;
     response.setSuccess();
     response.setTag(tag());
@@ -47,7 +47,7 @@ namespace Server {
   filter-list = *(filter-key " " filter-value)
   filter-key = "RESOURCE" | "MIMETYPE" | "ENABLED" | "SYNC" | "DISPLAY" | "INDEX"
   option-list = *(option-key " " option-value)
-  option-key = "STATISTICS"
+  option-key = "STATISTICS" | "ANCESTORS" | "CHANGEDSINCE"
   @endverbatim
 
   @c LIST will include all known collections, @c LSUB only those that are
@@ -69,6 +69,15 @@ namespace Server {
     should be included additionally to the @c parent-id included anyway.
     Possible values are @c 0 (the default), @c 1 for the direct parent node and @c INF for all,
     terminating with the root collection.
+  - @c CHANGEDSINCE (numeric) restricts the listing to collections that were added or
+    changed after the given collection tree revision. Collections removed since then are
+    reported by an untagged @c VANISHED response containing their UIDs. Unchanged ancestors
+    are still included where needed to connect changed collections to the listed tree.
+    The current tree revision is reported by an untagged <tt>OK [TREEREVISION rev]</tt>
+    response, which clients store for the next listing; 0 lists everything. Removed
+    collections are only remembered for a limited number of revisions, for older ones
+    everything is listed after an untagged <tt>OK [FULLSYNC]</tt> response and
+    collections that are not listed are gone.
 
   Response:
   @verbatim
@@ -101,12 +110,14 @@ class List : public Handler
                                    const Collection &col);
     CollectionAttribute::List getAttributes(const Collection &colId, const QVector<QByteArray> &filter = QVector<QByteArray>());
     void retrieveAttributes(const QVariantList &collectionIds);
+    void listRemovedCollections(const Collection &topParent);
 
   private:
     Resource mResource;
     QVector<MimeType::Id> mMimeTypes;
     Scope mScope;
     int mAncestorDepth;
+    qint64 mChangedSince;
     bool mOnlySubscribed;
     bool mIncludeStatistics;
     bool mEnabledCollections;
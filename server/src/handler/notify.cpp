@@ -0,0 +1,58 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "notify.h"
+
+#include "connection.h"
+#include "imapstreamparser.h"
+#include "notificationmanager.h"
+
+#include <libs/protocol_p.h>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+bool Notify::parseStream()
+{
+  if ( !connection()->capabilities().inBandNotifications() ) {
+    throw HandlerException( "In-band notifications have not been enabled" );
+  }
+
+  const QByteArray subCommand = m_streamParser->readString();
+  if ( subCommand == AKONADI_CMD_SUBSCRIBE ) {
+    const QString identifier = m_streamParser->readUtf8String();
+    if ( identifier.isEmpty() ) {
+      throw HandlerException( "No notification source identifier given" );
+    }
+    switch ( NotificationManager::self()->attachConnection( identifier, connection() ) ) {
+    case NotificationManager::Attached:
+      break;
+    case NotificationManager::UnknownSource:
+      throw HandlerException( "Unknown notification source" );
+    case NotificationManager::InvalidationHintsRequired:
+      throw HandlerException( "Notification source does not support invalidation hints" );
+    }
+  } else if ( subCommand == AKONADI_CMD_UNSUBSCRIBE ) {
+    NotificationManager::self()->detachConnection( connection() );
+  } else {
+    throw HandlerException( "Invalid NOTIFY command" );
+  }
+
+  return successResponse( "NOTIFY completed" );
+}
@@ -0,0 +1,67 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_NOTIFY_H
+#define AKONADI_NOTIFY_H
+
+#include <handler.h>
+
+namespace Akonadi {
+namespace Server {
+
+/**
+  @ingroup akonadi_server_handler
+
+  Handler for the NOTIFY command.
+
+  Redirects the notifications of a notification source to this connection,
+  so that they don't have to travel through the D-Bus session bus. The
+  source is created and its filters are set up over D-Bus as before, only
+  the delivery changes. Requires the @c INBANDNOTIFY client capability.
+
+  Request syntax:
+  @verbatim
+  notify-request = tag " NOTIFY " ( "SUBSCRIBE " identifier / "UNSUBSCRIBE" )
+  @endverbatim
+
+  @c SUBSCRIBE attaches the notification source with the given identifier
+  to this connection, @c UNSUBSCRIBE sends the notifications of all sources
+  attached to this connection over D-Bus again. Closing the connection
+  detaches its sources as well. Only sources that support invalidation
+  hints (NotificationSource::setInvalidationHintsSupported()) can be
+  attached, since otherwise notifications for a slow client could pile up
+  in the server without bounds.
+
+  Notifications are sent as untagged responses between commands:
+  @verbatim
+  * NOTIFY {size}
+  <size bytes of a QDataStream serialized NotificationMessageV3::List>
+  @endverbatim
+ */
+class Notify : public Handler
+{
+  Q_OBJECT
+  public:
+    bool parseStream();
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -124,6 +124,7 @@ bool Search::parseStream()
     request.setMimeTypes( mimeTypes );
     request.setQuery( queryString );
     request.setRemoteSearch( remote );
+    request.setConnection( connection() );
     connect( &request, SIGNAL(resultsAvailable(QSet<qint64>)),
             this, SLOT(slotResultsAvailable(QSet<qint64>)) );
     request.exec();
@@ -20,7 +20,7 @@
 
 #include "intervalcheck.h"
 #include "storage/datastore.h"
-#include "storage/itemretrievalmanager.h"
+#include "storage/syncscheduler.h"
 #include "storage/entity.h"
 
 using namespace Akonadi::Server;
@@ -39,9 +39,8 @@ IntervalCheck::~ IntervalCheck()
 
 void IntervalCheck::requestCollectionSync( const Collection &collection )
 {
-  QMetaObject::invokeMethod( this, "collectionExpired",
-                             Qt::QueuedConnection,
-                             Q_ARG( Collection, collection ) );
+  // Not through our own thread, which runs throttled maintenance tasks
+  syncCollection( collection, SyncQueue::OnDemand );
 }
 
 int IntervalCheck::collectionScheduleInterval( const Collection &collection )
@@ -63,20 +62,23 @@ bool IntervalCheck::shouldScheduleCollection( const Collection &collection )
 }
 
 void IntervalCheck::collectionExpired( const Collection &collection )
+{
+  syncCollection( collection, SyncQueue::Interval );
+}
+
+void IntervalCheck::syncCollection( const Collection &collection, SyncQueue::Priority priority )
 {
   const QDateTime now( QDateTime::currentDateTime() );
+  const QString resourceName = collection.resource().name();
 
+  QMutexLocker locker( &mLock );
   if ( collection.parentId() == 0 ) {
-    const QString resourceName = collection.resource().name();
-
     const int interval = qMax( MINIMUM_COLTREESYNC_INTERVAL, collection.cachePolicyCheckInterval() );
 
     const QDateTime lastExpectedCheck = now.addSecs( interval * -60 );
     if ( !mLastCollectionTreeSyncs.contains( resourceName ) || mLastCollectionTreeSyncs.value( resourceName ) < lastExpectedCheck ) {
       mLastCollectionTreeSyncs.insert( resourceName, now );
-      QMetaObject::invokeMethod( ItemRetrievalManager::instance(), "triggerCollectionTreeSync",
-                                 Qt::QueuedConnection,
-                                 Q_ARG( QString, resourceName ) );
+      SyncScheduler::instance()->scheduleCollectionTreeSync( resourceName, priority );
     }
   }
 
@@ -88,8 +90,5 @@ void IntervalCheck::collectionExpired( const Collection &collection )
     return;
   }
   mLastChecks.insert( collection.id(), now );
-  QMetaObject::invokeMethod( ItemRetrievalManager::instance(), "triggerCollectionSync",
-                             Qt::QueuedConnection,
-                             Q_ARG( QString, collection.resource().name() ),
-                             Q_ARG( qint64, collection.id() ) );
+  SyncScheduler::instance()->scheduleCollectionSync( resourceName, collection.id(), priority );
 }
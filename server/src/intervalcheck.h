@@ -21,15 +21,17 @@
 #define INTERVALCHECK_H
 
 #include "collectionscheduler.h"
+#include "storage/syncscheduler.h"
 
 #include <QDateTime>
 #include <QHash>
+#include <QMutex>
 
 namespace Akonadi {
 namespace Server {
 
 /**
-  Interval checking thread.
+  Interval checking, run by the BackgroundTaskExecutor.
 */
 class IntervalCheck : public CollectionScheduler
 {
@@ -41,8 +43,9 @@ class IntervalCheck : public CollectionScheduler
 
     /**
      * Requests the given collection to be synced.
-     * Executed from any thread, forwards to triggerCollectionXSync() in the
-     * retrieval thread.
+     * Executed from any thread, forwards to the SyncScheduler with
+     * on-demand priority right away, without waiting for the background
+     * task thread.
      * A minimum time interval between two sync requests is ensured.
      */
     void requestCollectionSync( const Collection &collection );
@@ -56,6 +59,10 @@ class IntervalCheck : public CollectionScheduler
     void collectionExpired( const Collection &collection );
 
   private:
+    void syncCollection( const Collection &collection, SyncQueue::Priority priority );
+
+    /// Protects the last checks, on-demand requests come from connection threads
+    QMutex mLock;
     QHash<int, QDateTime> mLastChecks;
     QHash<QString, QDateTime> mLastCollectionTreeSyncs;
 
@@ -0,0 +1,250 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "notificationcompressor.h"
+
+#include <libs/notificationmessagev2_p_p.h>
+
+#include <QtCore/QDataStream>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+static bool isMergeable( const NotificationMessageV3 &msg )
+{
+  switch ( msg.operation() ) {
+  case NotificationMessageV2::Modify:
+  case NotificationMessageV2::ModifyFlags:
+  case NotificationMessageV2::ModifyTags:
+    return true;
+  default:
+    return false;
+  }
+}
+
+template<typename T>
+static QList<T> sorted( const QSet<T> &set )
+{
+  QList<T> list = set.toList();
+  qSort( list );
+  return list;
+}
+
+NotificationCompressor::NotificationCompressor()
+  : mMaximumEntities( 0 )
+{
+}
+
+void NotificationCompressor::setMaximumEntities( int maximum )
+{
+  mMaximumEntities = maximum;
+}
+
+int NotificationCompressor::maximumEntities() const
+{
+  return mMaximumEntities;
+}
+
+QByteArray NotificationCompressor::changeKey( const NotificationMessageV3 &msg )
+{
+  QByteArray key;
+  QDataStream stream( &key, QIODevice::WriteOnly );
+  writeBaseKey( stream, msg, msg.operation() );
+  stream << sorted( msg.itemParts() )
+         << sorted( msg.addedFlags() ) << sorted( msg.removedFlags() )
+         << sorted( msg.addedTags() ) << sorted( msg.removedTags() );
+  return key;
+}
+
+QByteArray NotificationCompressor::entitiesKey( const NotificationMessageV3 &msg, NotificationMessageV2::Operation operation )
+{
+  QByteArray key;
+  QDataStream stream( &key, QIODevice::WriteOnly );
+  writeBaseKey( stream, msg, operation );
+  stream << msg.uids();
+  return key;
+}
+
+void NotificationCompressor::writeBaseKey( QDataStream &stream, const NotificationMessageV3 &msg, NotificationMessageV2::Operation operation )
+{
+  stream << static_cast<int>( msg.type() ) << static_cast<int>( operation )
+         << msg.sessionId() << msg.resource() << msg.destinationResource()
+         << msg.parentCollection() << msg.parentDestCollection()
+         << msg.d->metadata;
+}
+
+bool NotificationCompressor::canMergeInto( int pos, const NotificationMessageV3 &msg ) const
+{
+  Q_FOREACH ( const NotificationMessageV2::Entity &entity, msg.d->items ) {
+    if ( mLastPositions.value( qMakePair( static_cast<int>( msg.type() ), entity.id ), -1 ) > pos ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void NotificationCompressor::mergeEntities( int pos, const NotificationMessageV3 &msg )
+{
+  // Entities with the same ID are replaced, the new one has the most recent
+  // remote revision
+  NotificationMessageV2::Private *target = mNotifications[pos].d.data();
+  Q_FOREACH ( const NotificationMessageV2::Entity &entity, msg.d->items ) {
+    target->insertEntity( entity );
+  }
+}
+
+void NotificationCompressor::updateLastPositions( int pos, const NotificationMessageV3 &msg )
+{
+  Q_FOREACH ( const NotificationMessageV2::Entity &entity, msg.d->items ) {
+    mLastPositions.insert( qMakePair( static_cast<int>( msg.type() ), entity.id ), pos );
+  }
+}
+
+void NotificationCompressor::updateChangeKey( int pos )
+{
+  Entry &entry = mEntries[pos];
+  if ( entry.changeKey.isEmpty() ) {
+    return;
+  }
+  if ( mByChange.value( entry.changeKey, -1 ) == pos ) {
+    mByChange.remove( entry.changeKey );
+  }
+  entry.changeKey = changeKey( mNotifications.at( pos ) );
+  if ( !mByChange.contains( entry.changeKey ) ) {
+    mByChange.insert( entry.changeKey, pos );
+  }
+}
+
+bool NotificationCompressor::append( const NotificationMessageV3 &msg )
+{
+  const int pos = mNotifications.count();
+
+  if ( !isMergeable( msg ) ) {
+    updateLastPositions( pos, msg );
+
+    Entry entry;
+    if ( msg.type() == NotificationMessageV2::Collections && msg.operation() == NotificationMessageV2::Add ) {
+      entry.entitiesKey = entitiesKey( msg, NotificationMessageV2::Add );
+      mByEntities.insert( entry.entitiesKey, pos );
+    }
+    mNotifications.append( msg );
+    mEntries.append( entry );
+    return true;
+  }
+
+  Entry entry;
+  QHash<QByteArray, int>::ConstIterator it;
+
+  // Same change on other items: merge the items
+  if ( msg.type() == NotificationMessageV2::Items ) {
+    entry.changeKey = changeKey( msg );
+    it = mByChange.constFind( entry.changeKey );
+    if ( it != mByChange.constEnd() && canMergeInto( *it, msg )
+         && ( mMaximumEntities <= 0 || mNotifications.at( *it ).d->items.count() + msg.d->items.count() <= mMaximumEntities ) ) {
+      const int target = *it;
+      mergeEntities( target, msg );
+      updateLastPositions( target, msg );
+      // Its entities have changed, so it cannot be found by them anymore
+      Entry &targetEntry = mEntries[target];
+      if ( mByEntities.value( targetEntry.entitiesKey, -1 ) == target ) {
+        mByEntities.remove( targetEntry.entitiesKey );
+      }
+      targetEntry.entitiesKey.clear();
+      return false;
+    }
+  }
+
+  // Another change on the same entities: merge the changes
+  entry.entitiesKey = entitiesKey( msg, msg.operation() );
+  it = mByEntities.constFind( entry.entitiesKey );
+  if ( it != mByEntities.constEnd() && canMergeInto( *it, msg ) ) {
+    const int target = *it;
+    NotificationMessageV3 &targetMsg = mNotifications[target];
+    switch ( msg.operation() ) {
+    case NotificationMessageV2::Modify:
+      targetMsg.setItemParts( targetMsg.itemParts() + msg.itemParts() );
+      break;
+    case NotificationMessageV2::ModifyFlags:
+      targetMsg.setAddedFlags( ( targetMsg.addedFlags() - msg.removedFlags() ) + msg.addedFlags() );
+      targetMsg.setRemovedFlags( ( targetMsg.removedFlags() - msg.addedFlags() ) + msg.removedFlags() );
+      break;
+    case NotificationMessageV2::ModifyTags:
+      targetMsg.setAddedTags( ( targetMsg.addedTags() - msg.removedTags() ) + msg.addedTags() );
+      targetMsg.setRemovedTags( ( targetMsg.removedTags() - msg.addedTags() ) + msg.removedTags() );
+      break;
+    default:
+      break;
+    }
+    mergeEntities( target, msg );
+    updateChangeKey( target );
+    updateLastPositions( target, msg );
+    return false;
+  }
+
+  // Modifications of collections created in the same batch are not
+  // interesting, clients will retrieve the whole collection anyway
+  if ( msg.type() == NotificationMessageV2::Collections && msg.operation() == NotificationMessageV2::Modify ) {
+    it = mByEntities.constFind( entitiesKey( msg, NotificationMessageV2::Add ) );
+    if ( it != mByEntities.constEnd() && canMergeInto( *it, msg ) ) {
+      return false;
+    }
+  }
+
+  // Later merges go into this notification from now on, earlier ones might
+  // precede other notifications about the merged entities
+  if ( !entry.changeKey.isEmpty() ) {
+    mByChange.insert( entry.changeKey, pos );
+  }
+  mByEntities.insert( entry.entitiesKey, pos );
+  updateLastPositions( pos, msg );
+  mNotifications.append( msg );
+  mEntries.append( entry );
+  return true;
+}
+
+const NotificationMessageV3::List &NotificationCompressor::notifications() const
+{
+  return mNotifications;
+}
+
+bool NotificationCompressor::isEmpty() const
+{
+  return mNotifications.isEmpty();
+}
+
+int NotificationCompressor::count() const
+{
+  return mNotifications.count();
+}
+
+NotificationMessageV3::List NotificationCompressor::takeNotifications()
+{
+  const NotificationMessageV3::List notifications = mNotifications;
+  clear();
+  return notifications;
+}
+
+void NotificationCompressor::clear()
+{
+  mNotifications.clear();
+  mEntries.clear();
+  mByChange.clear();
+  mByEntities.clear();
+  mLastPositions.clear();
+}
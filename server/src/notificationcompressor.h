@@ -0,0 +1,122 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_NOTIFICATIONCOMPRESSOR_H
+#define AKONADI_NOTIFICATIONCOMPRESSOR_H
+
+#include "../libs/notificationmessagev3_p.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QPair>
+
+class QDataStream;
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * Collects pending notifications and merges redundant ones as they arrive.
+ *
+ * Unlike NotificationMessageV3::appendAndCompress(), which only looks at the
+ * last few notifications, this keeps hash indexes of all pending mergeable
+ * notifications (Modify, ModifyFlags and ModifyTags), so that each new
+ * notification is merged in constant time no matter how large the batch is:
+ *
+ * - notifications that only differ in their entities (e.g. the same flag
+ *   change on thousands of items) are merged into one with all the entities
+ * - notifications about the same entities are merged into one with the
+ *   combined changed parts, flags or tags
+ * - modifications of collections added in the same batch are dropped
+ *
+ * A notification is only ever merged into an earlier one if none of its
+ * entities was part of any other notification in between, so that clients
+ * still see the changes of each entity in the order they happened.
+ *
+ * Entities are only merged for items, clients expect collection and tag
+ * notifications to be about a single entity, and only up to
+ * maximumEntities(), so that chunked notifications stay chunked.
+ */
+class NotificationCompressor
+{
+  public:
+    NotificationCompressor();
+
+    /**
+     * Sets the maximum number of entities a notification can get by merging,
+     * 0 means no limit (the default).
+     */
+    void setMaximumEntities( int maximum );
+    int maximumEntities() const;
+
+    /**
+     * Appends @p msg to the pending notifications, or merges it into one
+     * of them.
+     * @returns @c false if @p msg was merged or dropped
+     */
+    bool append( const NotificationMessageV3 &msg );
+
+    /**
+     * Returns the pending notifications.
+     */
+    const NotificationMessageV3::List &notifications() const;
+
+    bool isEmpty() const;
+    int count() const;
+
+    /**
+     * Returns the pending notifications and resets the compressor.
+     */
+    NotificationMessageV3::List takeNotifications();
+
+    void clear();
+
+  private:
+    typedef QPair<int, NotificationMessageV2::Id> EntityKey;
+
+    struct Entry
+    {
+      QByteArray changeKey;
+      QByteArray entitiesKey;
+    };
+
+    static QByteArray changeKey( const NotificationMessageV3 &msg );
+    static QByteArray entitiesKey( const NotificationMessageV3 &msg, NotificationMessageV2::Operation operation );
+    static void writeBaseKey( QDataStream &stream, const NotificationMessageV3 &msg, NotificationMessageV2::Operation operation );
+
+    bool canMergeInto( int pos, const NotificationMessageV3 &msg ) const;
+    void mergeEntities( int pos, const NotificationMessageV3 &msg );
+    void updateLastPositions( int pos, const NotificationMessageV3 &msg );
+    void updateChangeKey( int pos );
+
+    NotificationMessageV3::List mNotifications;
+    QVector<Entry> mEntries;
+    int mMaximumEntities;
+
+    //! Mergeable notifications by everything but their entities
+    QHash<QByteArray, int> mByChange;
+    //! Mergeable notifications by everything but their changed parts, flags or tags
+    QHash<QByteArray, int> mByEntities;
+    //! Position of the last notification each entity (type and ID) is part of
+    QHash<EntityKey, int> mLastPositions;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -0,0 +1,379 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "notificationjournal.h"
+
+#include <akdebug.h>
+#include <libs/notificationmessagev2_p_p.h>
+
+#include <QtCore/QDataStream>
+#include <QtCore/QDateTime>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+static const quint32 JournalMagic = 0x414B4E4A; // "AKNJ"
+static const quint32 JournalVersion = 2;
+
+static bool readHeader( QDataStream &stream, qint64 &previousSequence )
+{
+  quint32 magic = 0;
+  quint32 version = 0;
+  stream >> magic >> version >> previousSequence;
+  return stream.status() == QDataStream::Ok && magic == JournalMagic && version == JournalVersion;
+}
+
+NotificationJournal::SegmentInfo::SegmentInfo()
+  : previousSequence( 0 )
+  , lastSequence( 0 )
+  , oldestTimestamp( 0 )
+  , newestTimestamp( 0 )
+  , validSize( 0 )
+{
+}
+
+bool NotificationJournal::SegmentInfo::isEmpty() const
+{
+  return lastSequence == previousSequence;
+}
+
+NotificationJournal::Cursor::Cursor()
+  : sequence( 0 )
+  , segment( -1 )
+  , offset( 0 )
+{
+}
+
+NotificationJournal::NotificationJournal()
+  : mMaximumSize( 16 * 1024 * 1024 )
+  , mMaximumAge( 7 * 24 * 3600 * Q_INT64_C( 1000 ) )
+{
+}
+
+NotificationJournal::~NotificationJournal()
+{
+  close();
+}
+
+QString NotificationJournal::oldFileName() const
+{
+  return mFileName + QLatin1String( ".old" );
+}
+
+bool NotificationJournal::open( const QString &fileName )
+{
+  close();
+  mFileName = fileName;
+  mCurrent = SegmentInfo();
+  mOld = SegmentInfo();
+
+  if ( QFile::exists( oldFileName() ) && !scan( oldFileName(), mOld ) ) {
+    akError() << "Discarding corrupted notification journal" << oldFileName();
+    QFile::remove( oldFileName() );
+    mOld = SegmentInfo();
+  }
+  if ( QFile::exists( mFileName ) && !scan( mFileName, mCurrent ) ) {
+    akError() << "Discarding corrupted notification journal" << mFileName;
+    QFile::remove( mFileName );
+    mCurrent = SegmentInfo();
+  }
+  // The current file continues where the old one ended, anything else means
+  // that one of them got lost and the old one cannot be used anymore
+  if ( mCurrent.validSize > 0 && mOld.validSize > 0 && mOld.lastSequence != mCurrent.previousSequence ) {
+    QFile::remove( oldFileName() );
+    mOld = SegmentInfo();
+  }
+
+  if ( !openCurrent( mOld.lastSequence ) ) {
+    return false;
+  }
+  dropExpired();
+  return true;
+}
+
+void NotificationJournal::close()
+{
+  if ( mFile.isOpen() ) {
+    mFile.close();
+  }
+}
+
+bool NotificationJournal::isOpen() const
+{
+  return mFile.isOpen();
+}
+
+void NotificationJournal::setMaximumSize( qint64 size )
+{
+  mMaximumSize = size;
+}
+
+void NotificationJournal::setMaximumAge( int seconds )
+{
+  mMaximumAge = seconds * Q_INT64_C( 1000 );
+}
+
+bool NotificationJournal::openCurrent( qint64 previousSequence )
+{
+  mFile.setFileName( mFileName );
+  if ( !mFile.open( QIODevice::ReadWrite ) ) {
+    akError() << "Failed to open notification journal" << mFileName << ":" << mFile.errorString();
+    return false;
+  }
+
+  if ( mCurrent.validSize == 0 ) {
+    mCurrent = SegmentInfo();
+    mCurrent.previousSequence = previousSequence;
+    mCurrent.lastSequence = previousSequence;
+
+    mFile.resize( 0 );
+    QDataStream stream( &mFile );
+    stream.setVersion( QDataStream::Qt_4_6 );
+    stream << JournalMagic << JournalVersion << previousSequence;
+    mFile.flush();
+    mCurrent.validSize = mFile.pos();
+  } else {
+    // Drop the remains of a record that was not written completely
+    mFile.resize( mCurrent.validSize );
+    mFile.seek( mCurrent.validSize );
+  }
+
+  return true;
+}
+
+bool NotificationJournal::scan( const QString &fileName, SegmentInfo &info )
+{
+  QFile file( fileName );
+  if ( !file.open( QIODevice::ReadOnly ) ) {
+    return false;
+  }
+
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_6 );
+  if ( !readHeader( stream, info.previousSequence ) ) {
+    return false;
+  }
+  info.lastSequence = info.previousSequence;
+  info.validSize = file.pos();
+
+  while ( !stream.atEnd() ) {
+    qint64 sequence;
+    qint64 timestamp;
+    NotificationMessageV3 msg;
+    if ( !readRecord( stream, sequence, timestamp, msg ) ) {
+      break;
+    }
+
+    if ( info.isEmpty() ) {
+      info.oldestTimestamp = timestamp;
+    }
+    info.lastSequence = sequence;
+    info.newestTimestamp = timestamp;
+    info.validSize = file.pos();
+  }
+
+  return true;
+}
+
+void NotificationJournal::writeRecord( QDataStream &stream, qint64 sequence, qint64 timestamp, const NotificationMessageV3 &msg )
+{
+  // The client-facing format of the notification leaves out the metadata
+  stream << sequence << timestamp << msg << msg.d->metadata;
+}
+
+bool NotificationJournal::readRecord( QDataStream &stream, qint64 &sequence, qint64 &timestamp, NotificationMessageV3 &msg )
+{
+  QVector<QByteArray> metadata;
+  stream >> sequence >> timestamp >> msg >> metadata;
+  if ( stream.status() != QDataStream::Ok ) {
+    return false;
+  }
+  if ( !metadata.isEmpty() ) {
+    msg.d->metadata = metadata;
+  }
+  return true;
+}
+
+bool NotificationJournal::readSegment( const QString &fileName, const SegmentInfo &info, Cursor &cursor, int &count,
+                                       NotificationMessageV3::List &notifications )
+{
+  QFile file( fileName );
+  if ( !file.open( QIODevice::ReadOnly ) ) {
+    return false;
+  }
+
+  QDataStream stream( &file );
+  stream.setVersion( QDataStream::Qt_4_6 );
+  if ( cursor.segment == info.previousSequence && cursor.offset > 0 ) {
+    // Continue where the previous read stopped, rotation only renames the file
+    if ( !file.seek( cursor.offset ) ) {
+      return false;
+    }
+  } else {
+    qint64 previousSequence;
+    if ( !readHeader( stream, previousSequence ) || previousSequence != info.previousSequence ) {
+      return false;
+    }
+    cursor.segment = info.previousSequence;
+  }
+
+  while ( count > 0 && file.pos() < info.validSize ) {
+    qint64 sequence;
+    qint64 timestamp;
+    NotificationMessageV3 msg;
+    if ( !readRecord( stream, sequence, timestamp, msg ) ) {
+      return false;
+    }
+    cursor.offset = file.pos();
+    if ( sequence > cursor.sequence ) {
+      notifications << msg;
+      cursor.sequence = sequence;
+      --count;
+    }
+  }
+
+  return true;
+}
+
+void NotificationJournal::rotate()
+{
+  mFile.close();
+  QFile::remove( oldFileName() );
+  if ( !QFile::rename( mFileName, oldFileName() ) ) {
+    akError() << "Failed to rotate notification journal" << mFileName;
+    QFile::remove( mFileName );
+    mOld = SegmentInfo();
+  } else {
+    mOld = mCurrent;
+  }
+
+  const qint64 lastSequence = mCurrent.lastSequence;
+  mCurrent = SegmentInfo();
+  openCurrent( lastSequence );
+}
+
+void NotificationJournal::dropExpired()
+{
+  const qint64 threshold = QDateTime::currentMSecsSinceEpoch() - mMaximumAge;
+  if ( !mCurrent.isEmpty() && mCurrent.oldestTimestamp < threshold ) {
+    rotate();
+  }
+  if ( !mOld.isEmpty() && mOld.newestTimestamp < threshold ) {
+    QFile::remove( oldFileName() );
+    mOld = SegmentInfo();
+  }
+}
+
+qint64 NotificationJournal::append( const NotificationMessageV3::List &notifications )
+{
+  if ( !mFile.isOpen() || notifications.isEmpty() ) {
+    return lastSequence();
+  }
+
+  if ( mCurrent.validSize >= mMaximumSize / 2 ) {
+    rotate();
+  }
+  dropExpired();
+
+  // Write the whole batch at once, so that there's at most one partial
+  // record after a crash
+  QByteArray data;
+  QDataStream stream( &data, QIODevice::WriteOnly );
+  stream.setVersion( QDataStream::Qt_4_6 );
+  const qint64 timestamp = QDateTime::currentMSecsSinceEpoch();
+  qint64 sequence = mCurrent.lastSequence;
+  Q_FOREACH ( const NotificationMessageV3 &msg, notifications ) {
+    writeRecord( stream, ++sequence, timestamp, msg );
+  }
+
+  if ( mFile.write( data ) != data.size() || !mFile.flush() ) {
+    akError() << "Failed to write notification journal" << mFileName << ":" << mFile.errorString();
+    // Start over after the lost notifications, consumers asking for them
+    // will have to synchronize fully
+    mFile.close();
+    QFile::remove( oldFileName() );
+    QFile::remove( mFileName );
+    mOld = SegmentInfo();
+    mCurrent = SegmentInfo();
+    openCurrent( sequence );
+    return sequence;
+  }
+
+  if ( mCurrent.isEmpty() ) {
+    mCurrent.oldestTimestamp = timestamp;
+  }
+  mCurrent.lastSequence = sequence;
+  mCurrent.newestTimestamp = timestamp;
+  mCurrent.validSize += data.size();
+  return sequence;
+}
+
+qint64 NotificationJournal::lastSequence() const
+{
+  return mCurrent.lastSequence;
+}
+
+qint64 NotificationJournal::firstSequence() const
+{
+  if ( !mOld.isEmpty() ) {
+    return mOld.previousSequence + 1;
+  }
+  return mCurrent.previousSequence + 1;
+}
+
+bool NotificationJournal::seek( qint64 sequence, Cursor &cursor ) const
+{
+  if ( !mFile.isOpen() || sequence > lastSequence() || sequence < firstSequence() - 1 ) {
+    return false;
+  }
+
+  cursor = Cursor();
+  cursor.sequence = sequence;
+  return true;
+}
+
+bool NotificationJournal::read( Cursor &cursor, int count, NotificationMessageV3::List &notifications ) const
+{
+  if ( !mFile.isOpen() || cursor.sequence < firstSequence() - 1 ) {
+    return false;
+  }
+
+  while ( count > 0 && cursor.sequence < lastSequence() ) {
+    const bool old = !mOld.isEmpty() && cursor.sequence < mOld.lastSequence;
+    const qint64 sequence = cursor.sequence;
+    if ( !readSegment( old ? oldFileName() : mFileName, old ? mOld : mCurrent, cursor, count, notifications ) ) {
+      return false;
+    }
+    if ( cursor.sequence == sequence ) {
+      // The segment ended before the sequence numbers it claims to contain
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool NotificationJournal::replay( qint64 sequence, NotificationMessageV3::List &notifications ) const
+{
+  Cursor cursor;
+  if ( !seek( sequence, cursor ) ) {
+    return false;
+  }
+  return read( cursor, static_cast<int>( lastSequence() - sequence ), notifications );
+}
@@ -0,0 +1,168 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_NOTIFICATIONJOURNAL_H
+#define AKONADI_NOTIFICATIONJOURNAL_H
+
+#include "../libs/notificationmessagev3_p.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QString>
+
+class QDataStream;
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * Append-only on-disk log of all emitted notifications.
+ *
+ * Every notification gets a sequence number, increasing by one with each
+ * notification and continuing across server restarts. A consumer that
+ * remembers the sequence number of the last notification it has seen can
+ * get all later notifications replayed after a restart, instead of having
+ * to synchronize whole collections again. The journal keeps the
+ * server-internal metadata of the notifications as well, so that replayed
+ * notifications are filtered exactly like the live ones.
+ *
+ * The journal is kept in two files: new notifications are appended to the
+ * current one, which is rotated to @c fileName.old once it has reached half
+ * of the maximum size or contains notifications older than the maximum age.
+ * The previous old file is dropped then, so the journal never grows beyond
+ * the maximum size and only notifications from about the last maximum age
+ * can be replayed.
+ */
+class NotificationJournal
+{
+  public:
+    NotificationJournal();
+    ~NotificationJournal();
+
+    /**
+     * Opens the journal stored in @p fileName, creating it if needed.
+     * A partially written record at the end of the file is discarded.
+     */
+    bool open( const QString &fileName );
+    void close();
+    bool isOpen() const;
+
+    /**
+     * Sets the maximum size of the journal in bytes, default is 16 MiB.
+     */
+    void setMaximumSize( qint64 size );
+
+    /**
+     * Sets the maximum age of replayable notifications in seconds,
+     * default is one week.
+     */
+    void setMaximumAge( int seconds );
+
+    /**
+     * Appends @p notifications to the journal.
+     * @returns sequence number of the last appended notification
+     */
+    qint64 append( const NotificationMessageV3::List &notifications );
+
+    /**
+     * Returns sequence number of the most recent notification,
+     * 0 if there was none yet.
+     */
+    qint64 lastSequence() const;
+
+    /**
+     * Returns sequence number of the oldest notification still in the
+     * journal.
+     */
+    qint64 firstSequence() const;
+
+    /**
+     * Position of a reader in the journal, see seek() and read().
+     */
+    struct Cursor
+    {
+      Cursor();
+
+      //! Sequence number of the last notification read
+      qint64 sequence;
+      //! Segment (by its previous sequence number) and offset in its file
+      //! where reading continues
+      qint64 segment;
+      qint64 offset;
+    };
+
+    /**
+     * Positions @p cursor after the notification @p sequence.
+     * @returns @c false if the notifications after @p sequence are not all
+     *          in the journal anymore, or @p sequence is unknown, in which
+     *          case the consumer has to synchronize fully
+     */
+    bool seek( qint64 sequence, Cursor &cursor ) const;
+
+    /**
+     * Reads up to @p count notifications at @p cursor into @p notifications
+     * and advances the cursor. Reading stops at the end of the journal, so
+     * the cursor reached it when its sequence is lastSequence().
+     * @returns @c false if the notifications at @p cursor were dropped
+     *          from the journal in the meantime
+     */
+    bool read( Cursor &cursor, int count, NotificationMessageV3::List &notifications ) const;
+
+    /**
+     * Reads all notifications after @p sequence into @p notifications.
+     * @see seek()
+     */
+    bool replay( qint64 sequence, NotificationMessageV3::List &notifications ) const;
+
+  private:
+    struct SegmentInfo
+    {
+      SegmentInfo();
+
+      bool isEmpty() const;
+
+      //! Sequence number of the last notification before this file
+      qint64 previousSequence;
+      qint64 lastSequence;
+      qint64 oldestTimestamp;
+      qint64 newestTimestamp;
+      qint64 validSize;
+    };
+
+    static void writeRecord( QDataStream &stream, qint64 sequence, qint64 timestamp, const NotificationMessageV3 &msg );
+    static bool readRecord( QDataStream &stream, qint64 &sequence, qint64 &timestamp, NotificationMessageV3 &msg );
+    static bool scan( const QString &fileName, SegmentInfo &info );
+    static bool readSegment( const QString &fileName, const SegmentInfo &info, Cursor &cursor, int &count,
+                             NotificationMessageV3::List &notifications );
+    bool openCurrent( qint64 previousSequence );
+    void rotate();
+    void dropExpired();
+    QString oldFileName() const;
+
+    QString mFileName;
+    QFile mFile;
+    qint64 mMaximumSize;
+    qint64 mMaximumAge;
+    SegmentInfo mCurrent;
+    SegmentInfo mOld;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -25,21 +25,42 @@
 #include "tracer.h"
 #include "storage/datastore.h"
 #include "clientcapabilityaggregator.h"
+#include "connection.h"
+#include "storage/notificationcollector.h"
 
 #include <akstandarddirs.h>
 #include <libs/xdgbasedirs_p.h>
 
 #include <QtCore/QDebug>
+#include <QtCore/QThread>
+#include <QtCore/qmath.h>
 #include <QDBusConnection>
 #include <QSettings>
 
 using namespace Akonadi;
 using namespace Akonadi::Server;
 
+namespace {
+
+struct NotificationPayload
+{
+  NotificationMessageV3::List v3;
+  NotificationMessageV2::List v2;
+};
+
+}
+
 NotificationManager *NotificationManager::mSelf = 0;
 
 NotificationManager::NotificationManager()
   : QObject( 0 )
+  , mPendingEntities( 0 )
+  , mRate( 0.0 )
+  , mFlushCount( 0 )
+  , mLastBatchSize( 0 )
+  , mAverageBatchSize( 0.0 )
+  , mLastLatency( 0 )
+  , mMaximumLatency( 0 )
 {
   NotificationMessage::registerDBusTypes();
   NotificationMessageV2::registerDBusTypes();
@@ -55,8 +76,22 @@ NotificationManager::NotificationManager()
   QSettings settings( serverConfigFile, QSettings::IniFormat );
 
   mTimer.setInterval( settings.value( QLatin1String( "NotificationManager/Interval" ), 50 ).toInt() );
+  mMaximumBatchSize = settings.value( QLatin1String( "NotificationManager/MaximumBatchSize" ), 5000 ).toInt();
+  mBurstRate = settings.value( QLatin1String( "NotificationManager/BurstRate" ), 50 ).toDouble();
+  mQueueLimit = settings.value( QLatin1String( "NotificationManager/QueueLimit" ), 10000 ).toInt();
+  // Don't merge chunks of huge notifications back together
+  mNotifications.setMaximumEntities( NotificationCollector::maximumEntities() );
+
+  const qint64 journalSize = settings.value( QLatin1String( "NotificationManager/JournalSize" ), 16 * 1024 * 1024 ).toLongLong();
+  if ( journalSize > 0 ) {
+    mJournal.setMaximumSize( journalSize );
+    mJournal.setMaximumAge( settings.value( QLatin1String( "NotificationManager/JournalMaxAge" ), 7 * 24 * 3600 ).toInt() );
+    mJournal.open( AkStandardDirs::saveDir( "data" ) + QLatin1String( "/notification_journal" ) );
+  }
   mTimer.setSingleShot( true );
   connect( &mTimer, SIGNAL(timeout()), SLOT(emitPendingNotifications()) );
+  mLastArrival.invalidate();
+  mPendingSince.invalidate();
 }
 
 NotificationManager::~NotificationManager()
@@ -80,27 +115,128 @@ void NotificationManager::connectNotificationCollector( NotificationCollector *c
 
 void NotificationManager::slotNotify( const Akonadi::NotificationMessageV3::List &msgs )
 {
+  // Exponentially decaying rate with a time constant of one second
+  const double elapsed = mLastArrival.isValid() ? mLastArrival.restart() : 0.0;
+  if ( !mLastArrival.isValid() ) {
+    mLastArrival.start();
+  }
+  mRate = mRate * qExp( -elapsed / 1000.0 ) + msgs.count();
+
+  if ( mNotifications.isEmpty() ) {
+    mPendingSince.start();
+  }
+
   //akDebug() << Q_FUNC_INFO << "Appending" << msgs.count() << "notifications to current list of " << mNotifications.count() << "notifications";
-  Q_FOREACH ( const NotificationMessageV3 &msg, msgs )
-    NotificationMessageV3::appendAndCompress( mNotifications, msg );
-  //akDebug() << Q_FUNC_INFO << "We have" << mNotifications.count() << "notifications queued in total after appendAndCompress()";
+  Q_FOREACH ( const NotificationMessageV3 &msg, msgs ) {
+    mNotifications.append( msg );
+    mPendingEntities += qMax( 1, msg.entities().count() );
+  }
+  //akDebug() << Q_FUNC_INFO << "We have" << mNotifications.count() << "notifications queued in total after compression";
 
-  if ( !mTimer.isActive() ) {
+  scheduleFlush();
+}
+
+void NotificationManager::scheduleFlush()
+{
+  if ( mPendingEntities >= NotificationCollector::maximumEntities() ) {
+    // Huge transactions arrive in batches, pass each one on right away
+    // instead of collecting the whole transaction again
+    emitPendingNotifications();
+    return;
+  }
+
+  if ( mRate <= mBurstRate || mNotifications.count() >= mMaximumBatchSize ) {
+    // Isolated change or full batch: emit as soon as we get back to the
+    // event loop, so that changes arriving at the same time still share a batch
+    QTimer::singleShot( 0, this, SLOT(emitPendingNotifications()) );
+    mTimer.stop();
+  } else if ( !mTimer.isActive() ) {
+    // Keep the timer running from the first pending notification, so no
+    // notification waits longer than the interval
     mTimer.start();
   }
 }
 
+NotificationManager::AttachResult NotificationManager::attachConnection( const QString &identifier, Connection *connection )
+{
+  // Sources are only ever touched from the main thread
+  const Qt::ConnectionType type = QThread::currentThread() == thread() ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+  int result = UnknownSource;
+  QMetaObject::invokeMethod( this, "attachConnectionInternal", type,
+                             Q_RETURN_ARG( int, result ),
+                             Q_ARG( QString, identifier ),
+                             Q_ARG( QObject *, connection ) );
+  if ( result == Attached ) {
+    connection->setNotificationsAttached( true );
+  }
+  return static_cast<AttachResult>( result );
+}
+
+void NotificationManager::detachConnection( Connection *connection )
+{
+  const Qt::ConnectionType type = QThread::currentThread() == thread() ? Qt::DirectConnection : Qt::BlockingQueuedConnection;
+  QMetaObject::invokeMethod( this, "detachConnectionInternal", type,
+                             Q_ARG( QObject *, connection ) );
+  connection->setNotificationsAttached( false );
+}
+
+int NotificationManager::attachConnectionInternal( const QString &identifier, QObject *connection )
+{
+  NotificationSource *source = mNotificationSources.value( identifier );
+  if ( !source ) {
+    return UnknownSource;
+  }
+  if ( !source->invalidationHintsSupported() ) {
+    return InvalidationHintsRequired;
+  }
+
+  source->setConnection( qobject_cast<Connection *>( connection ) );
+  return Attached;
+}
+
+void NotificationManager::detachConnectionInternal( QObject *connection )
+{
+  Q_FOREACH ( NotificationSource *source, mNotificationSources ) {
+    if ( source->connection() == connection ) {
+      source->setConnection( 0 );
+    }
+  }
+}
+
 void NotificationManager::emitPendingNotifications()
 {
   if ( mNotifications.isEmpty() ) {
     return;
   }
 
+  mTimer.stop();
+  const NotificationMessageV3::List notifications = mNotifications.takeNotifications();
+  mPendingEntities = 0;
+
+  ++mFlushCount;
+  mLastBatchSize = notifications.count();
+  mAverageBatchSize = mAverageBatchSize * 0.9 + mLastBatchSize * 0.1;
+  mLastLatency = mPendingSince.isValid() ? mPendingSince.elapsed() : 0;
+  mMaximumLatency = qMax( mMaximumLatency, mLastLatency );
+
+  // A single D-Bus message with all changes of a huge transaction has to be
+  // marshalled and parsed in one go, deliver them in batches instead
+  Q_FOREACH ( const NotificationMessageV3::List &batch, NotificationCollector::batches( notifications ) ) {
+    emitNotificationBatch( batch );
+  }
+}
+
+void NotificationManager::emitNotificationBatch( const NotificationMessageV3::List &notifications )
+{
+  const qint64 sequence = mJournal.append( notifications );
+
+  // Only convert to the legacy format if there are clients that need it
+  const bool needsLegacy = ClientCapabilityAggregator::minimumNotificationMessageVersion() < 2;
   NotificationMessage::List legacyNotifications;
-  Q_FOREACH ( const NotificationMessageV3 &notification, mNotifications ) {
+  Q_FOREACH ( const NotificationMessageV3 &notification, notifications ) {
     Tracer::self()->signal( "NotificationManager::notify", notification.toString() );
 
-    if ( ClientCapabilityAggregator::minimumNotificationMessageVersion() < 2 ) {
+    if ( needsLegacy ) {
       const NotificationMessage::List tmp = notification.toNotificationV1().toList();
       Q_FOREACH ( const NotificationMessage &legacyNotification, tmp ) {
         bool appended = false;
@@ -114,41 +250,71 @@ void NotificationManager::emitPendingNotifications()
 
   if ( !legacyNotifications.isEmpty() ) {
     Q_FOREACH ( NotificationSource *src, mNotificationSources ) {
-      src->emitNotification( legacyNotifications );
+      // In-band delivery is only supported for V3 clients, and replaying
+      // sources get these notifications from the journal
+      if ( !src->connection() && !src->isReplaying() ) {
+        src->emitNotification( legacyNotifications );
+      }
     }
   }
 
+  const int maximumVersion = ClientCapabilityAggregator::maximumNotificationMessageVersion();
+  if ( maximumVersion > 1 ) {
+    // Route each notification only to the sources whose filters refer to it
+    QHash<NotificationSource *, QVector<int> > acceptedNotifications;
+    for ( int i = 0; i < notifications.count(); ++i ) {
+      const NotificationMessageV3 &notification = notifications.at( i );
+      const QSet<NotificationSource *> candidates = mSubscriptionIndex.candidates( notification );
+      Q_FOREACH ( NotificationSource *source, candidates ) {
+        if ( source->isServerSideMonitorEnabled() && source->acceptsNotification( notification ) ) {
+          acceptedNotifications[source] << i;
+        }
+      }
+    }
 
-  NotificationMessageV2::List v2List;
-  if ( ClientCapabilityAggregator::maximumNotificationMessageVersion() == 2 ) {
-    v2List = NotificationMessageV3::toV2List( mNotifications );
-  }
-
-  if ( ClientCapabilityAggregator::maximumNotificationMessageVersion() > 1 ) {
+    // Sources receiving the same notifications share a single payload, so
+    // that each distinct list is assembled and converted only once
+    QHash<QByteArray, NotificationPayload> payloads;
     Q_FOREACH ( NotificationSource *source, mNotificationSources ) {
-      if ( !source->isServerSideMonitorEnabled() ) {
-        if ( ClientCapabilityAggregator::maximumNotificationMessageVersion() == 2 ) {
-          source->emitNotification( v2List );
-        } else {
-          source->emitNotification( mNotifications );
-        }
+      if ( source->isReplaying() ) {
         continue;
       }
 
-      NotificationMessageV3::List acceptedNotifications;
-      Q_FOREACH ( const NotificationMessageV3 &notification, mNotifications ) {
-        if ( source->acceptsNotification( notification ) ) {
-          acceptedNotifications << notification;
+      QByteArray key;
+      if ( source->isServerSideMonitorEnabled() ) {
+        const QVector<int> accepted = acceptedNotifications.value( source );
+        if ( accepted.isEmpty() ) {
+          continue;
+        }
+        if ( accepted.count() < notifications.count() ) {
+          key = QByteArray( reinterpret_cast<const char *>( accepted.constData() ), accepted.count() * sizeof( int ) );
         }
       }
 
-      if ( !acceptedNotifications.isEmpty() ) {
-        if ( ClientCapabilityAggregator::maximumNotificationMessageVersion() == 2 ) {
-          source->emitNotification( NotificationMessageV3::toV2List( acceptedNotifications ) );
+      QHash<QByteArray, NotificationPayload>::Iterator it = payloads.find( key );
+      if ( it == payloads.end() ) {
+        NotificationPayload payload;
+        if ( key.isEmpty() ) {
+          payload.v3 = notifications;
         } else {
-          source->emitNotification( acceptedNotifications );
+          const QVector<int> accepted = acceptedNotifications.value( source );
+          payload.v3.reserve( accepted.count() );
+          Q_FOREACH ( int i, accepted ) {
+            payload.v3 << notifications.at( i );
+          }
+        }
+        if ( maximumVersion == 2 ) {
+          payload.v2 = NotificationMessageV3::toV2List( payload.v3 );
         }
+        it = payloads.insert( key, payload );
+      }
+
+      if ( maximumVersion == 2 && !source->connection() && !source->hasNotificationConsumer() ) {
+        source->emitNotification( it->v2 );
+      } else {
+        source->emitNotification( it->v3 );
       }
+      source->setJournalSequence( sequence );
     }
   }
 
@@ -157,20 +323,22 @@ void NotificationManager::emitPendingNotifications()
   if ( !legacyNotifications.isEmpty() ) {
     Q_EMIT notify( legacyNotifications );
   }
-
-  mNotifications.clear();
 }
 
 QDBusObjectPath NotificationManager::subscribeV2( const QString &identifier, bool serverSideMonitor )
 {
   akDebug() << Q_FUNC_INFO << this << identifier << serverSideMonitor;
-  return subscribeV3( identifier, serverSideMonitor, false );
+  return subscribeSource( identifier, serverSideMonitor, false, 2 );
 }
 
 QDBusObjectPath NotificationManager::subscribeV3( const QString &identifier, bool serverSideMonitor, bool exclusive )
 {
   akDebug() << Q_FUNC_INFO << this << identifier << serverSideMonitor << exclusive;
+  return subscribeSource( identifier, serverSideMonitor, exclusive, 3 );
+}
 
+QDBusObjectPath NotificationManager::subscribeSource( const QString &identifier, bool serverSideMonitor, bool exclusive, int version )
+{
   NotificationSource *source = mNotificationSources.value( identifier );
   if ( source ) {
     akDebug() << "Known subscriber" << identifier << "subscribes again";
@@ -182,6 +350,7 @@ QDBusObjectPath NotificationManager::subscribeV3( const QString &identifier, boo
   registerSource( source );
   source->setServerSideMonitorEnabled( serverSideMonitor );
   source->setExclusive( exclusive );
+  source->setNotificationMessageVersion( version );
 
   // The path is /subscriber/escaped_identifier. We want to extract
   // the escaped_identifier and emit it in subscribed() instead of the original
@@ -197,12 +366,13 @@ QDBusObjectPath NotificationManager::subscribeV3( const QString &identifier, boo
 void NotificationManager::registerSource( NotificationSource *source )
 {
   mNotificationSources.insert( source->identifier(), source );
+  mSubscriptionIndex.addSource( source );
 }
 
 QDBusObjectPath NotificationManager::subscribe( const QString &identifier )
 {
   akDebug() << Q_FUNC_INFO << this << identifier;
-  return subscribeV2( identifier, false );
+  return subscribeSource( identifier, false, false, 1 );
 }
 
 void NotificationManager::unsubscribe( const QString &identifier )
@@ -221,6 +391,7 @@ void NotificationManager::unsubscribe( const QString &identifier )
 void NotificationManager::unregisterSource( NotificationSource *source )
 {
   mNotificationSources.remove( source->identifier() );
+  mSubscriptionIndex.removeSource( source );
 }
 
 QStringList NotificationManager::subscribers() const
@@ -232,3 +403,54 @@ QStringList NotificationManager::subscribers() const
 
   return identifiers;
 }
+
+bool NotificationManager::journaledNotifications( NotificationSource *source, NotificationJournal::Cursor &cursor, int count,
+                                                  NotificationMessageV3::List &notifications )
+{
+  NotificationMessageV3::List journaled;
+  if ( !mJournal.read( cursor, count, journaled ) ) {
+    return false;
+  }
+
+  Q_FOREACH ( const NotificationMessageV3 &notification, journaled ) {
+    if ( !source->isServerSideMonitorEnabled() || source->acceptsNotification( notification ) ) {
+      notifications << notification;
+    }
+  }
+  return true;
+}
+
+QString NotificationManager::flushStatistics() const
+{
+  const double elapsed = mLastArrival.isValid() ? mLastArrival.elapsed() : 0.0;
+  const double rate = mRate * qExp( -elapsed / 1000.0 );
+  return QString::fromLatin1( "rate %1/s (burst above %2/s), %3 pending, %4 flushes, "
+                              "batch size %5 (average %6, limit %7), latency %8 ms (maximum %9 ms, budget %10 ms)" )
+           .arg( rate, 0, 'f', 1 )
+           .arg( mBurstRate )
+           .arg( mNotifications.count() )
+           .arg( mFlushCount )
+           .arg( mLastBatchSize )
+           .arg( mAverageBatchSize, 0, 'f', 1 )
+           .arg( mMaximumBatchSize )
+           .arg( mLastLatency )
+           .arg( mMaximumLatency )
+           .arg( mTimer.interval() );
+}
+
+QStringList NotificationManager::queueStatistics() const
+{
+  QStringList statistics;
+  Q_FOREACH ( NotificationSource *source, mNotificationSources ) {
+    statistics << QString::fromLatin1( "%1: queued %2 (max %3, limit %4), delivered %5, coalesced %6%7" )
+                    .arg( source->identifier() )
+                    .arg( source->queueDepth() )
+                    .arg( source->maximumQueueDepth() )
+                    .arg( source->queueLimit() )
+                    .arg( source->deliveredCount() )
+                    .arg( source->coalescedCount() )
+                    .arg( source->connection() ? QLatin1String( ", in-band" ) : QString() );
+  }
+
+  return statistics;
+}
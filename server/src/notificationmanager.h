@@ -22,8 +22,12 @@
 
 #include "../libs/notificationmessage_p.h"
 #include "../libs/notificationmessagev3_p.h"
+#include "notificationcompressor.h"
+#include "notificationjournal.h"
+#include "notificationsubscriptionindex.h"
 #include "storage/entity.h"
 
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QHash>
 #include <QtCore/QObject>
 #include <QtCore/QTimer>
@@ -34,6 +38,7 @@ class NotificationManagerTest;
 namespace Akonadi {
 namespace Server {
 
+class Connection;
 class NotificationCollector;
 class NotificationSource;
 
@@ -52,6 +57,32 @@ class NotificationManager : public QObject, protected QDBusContext
 
     void connectNotificationCollector( NotificationCollector *collector );
 
+    enum AttachResult {
+      Attached,
+      UnknownSource,
+      InvalidationHintsRequired
+    };
+
+    /**
+     * Sends the notifications of source @p identifier over @p connection
+     * instead of D-Bus. Can be called from any thread.
+     *
+     * The source only sends the next batch once the connection has written
+     * out the previous one. Meanwhile notifications queue up in the source
+     * and can only be bounded by coalescing them into invalidation hints,
+     * so sources whose client does not support these are not attached.
+     */
+    AttachResult attachConnection( const QString &identifier, Connection *connection );
+
+    /**
+     * Sends the notifications of all sources attached to @p connection
+     * over D-Bus again. Can be called from any thread.
+     *
+     * Sources keep a plain pointer to their connection, so a connection
+     * that was attached has to call this before it is destroyed.
+     */
+    void detachConnection( Connection *connection );
+
   public Q_SLOTS:
     Q_SCRIPTABLE void emitPendingNotifications();
 
@@ -97,6 +128,17 @@ class NotificationManager : public QObject, protected QDBusContext
      */
     Q_SCRIPTABLE QStringList subscribers() const;
 
+    /**
+     * Returns queue depth and delivery statistics of each subscribed source
+     */
+    Q_SCRIPTABLE QStringList queueStatistics() const;
+
+    /**
+     * Returns the current rate of incoming notifications, the size of
+     * emitted batches and how long notifications waited to be emitted
+     */
+    Q_SCRIPTABLE QString flushStatistics() const;
+
   Q_SIGNALS:
     Q_SCRIPTABLE void notify( const Akonadi::NotificationMessage::List &msgs );
 
@@ -105,20 +147,57 @@ class NotificationManager : public QObject, protected QDBusContext
 
   private Q_SLOTS:
     void slotNotify( const Akonadi::NotificationMessageV3::List &msgs );
+    int attachConnectionInternal( const QString &identifier, QObject *connection );
+    void detachConnectionInternal( QObject *connection );
 
   private:
     NotificationManager();
 
   private:
+    void scheduleFlush();
+    void emitNotificationBatch( const NotificationMessageV3::List &notifications );
     void registerSource( NotificationSource *source );
     void unregisterSource( NotificationSource *source );
+    QDBusObjectPath subscribeSource( const QString &identifier, bool serverSideMonitor, bool exclusive, int version );
+    /**
+     * Reads up to @p count notifications at @p cursor from the journal and
+     * returns those accepted by @p source in @p notifications.
+     */
+    bool journaledNotifications( NotificationSource *source, NotificationJournal::Cursor &cursor, int count,
+                                 NotificationMessageV3::List &notifications );
 
     static NotificationManager *mSelf;
-    NotificationMessageV3::List mNotifications;
+    NotificationCompressor mNotifications;
+
+    /*
+     * Isolated changes are emitted right away. When notifications arrive
+     * faster than mBurstRate, they are batched until the oldest one has
+     * waited for the timer interval, or until there are mMaximumBatchSize
+     * of them. A full batch of entities (see NotificationCollector::batches())
+     * is emitted as soon as it arrives.
+     */
     QTimer mTimer;
+    int mMaximumBatchSize;
+    //! Entities of the pending notifications, before compression
+    int mPendingEntities;
+    double mBurstRate;
+    //! Notifications per second, exponentially decaying
+    double mRate;
+    QElapsedTimer mLastArrival;
+    QElapsedTimer mPendingSince;
+    qint64 mFlushCount;
+    int mLastBatchSize;
+    double mAverageBatchSize;
+    qint64 mLastLatency;
+    qint64 mMaximumLatency;
+    //! Default queue limit of new sources
+    int mQueueLimit;
+    NotificationJournal mJournal;
 
     //! One message source for each subscribed process
     QHash<QString, NotificationSource *> mNotificationSources;
+    //! Filters of all sources, updated by the sources themselves
+    NotificationSubscriptionIndex mSubscriptionIndex;
 
     friend class NotificationSource;
     friend class ::NotificationManagerTest;
@@ -23,11 +23,17 @@
 #include "notificationsourceadaptor.h"
 #include "notificationmanager.h"
 #include "collectionreferencemanager.h"
+#include "connection.h"
+#include "notificationconsumerinterface.h"
 #include <libs/notificationmessagev2_p_p.h>
+#include <libs/protocol_p.h>
 
 using namespace Akonadi;
 using namespace Akonadi::Server;
 
+/// Number of journaled notifications read and emitted at once during replay
+static const int ReplayBatchSize = 1000;
+
 template<typename T>
 QVector<T> setToVector( const QSet<T> &set )
 {
@@ -36,15 +42,91 @@ QVector<T> setToVector( const QSet<T> &set )
   return v;
 }
 
+template<typename Message>
+static bool isInvalidationHint( const Message &msg )
+{
+  return msg.type() == NotificationMessageV2::Collections
+      && msg.operation() == NotificationMessageV2::Modify
+      && msg.itemParts().contains( AKONADI_PARAM_INVALIDATE );
+}
+
+static void addInvalidationHint( QMap<Entity::Id, QByteArray> &hints, Entity::Id collectionId, const QByteArray &resource )
+{
+  if ( !hints.contains( collectionId ) ) {
+    hints.insert( collectionId, resource );
+  }
+}
+
+/**
+ * Replaces all item notifications by a single "invalidate" hint for each
+ * affected collection, telling the client to re-fetch its content. Other
+ * notifications describe changes of the collection tree, tags or relations
+ * which clients cannot recover from such a hint, so they are kept.
+ *
+ * The hints are appended at the end, so that they are delivered after any
+ * structural change of the collections they refer to.
+ */
+template<typename List>
+static List coalesceNotifications( const List &notifications, qint64 &coalesced )
+{
+  typedef typename List::value_type Message;
+
+  List result;
+  QMap<Entity::Id, QByteArray> hints;
+  Q_FOREACH ( const Message &msg, notifications ) {
+    if ( isInvalidationHint( msg ) ) {
+      Q_FOREACH ( Entity::Id id, msg.uids() ) {
+        addInvalidationHint( hints, id, msg.resource() );
+      }
+      continue;
+    }
+    if ( msg.type() != NotificationMessageV2::Items || msg.parentCollection() < 0 ) {
+      result << msg;
+      continue;
+    }
+
+    addInvalidationHint( hints, msg.parentCollection(), msg.resource() );
+    if ( msg.operation() == NotificationMessageV2::Move && msg.parentDestCollection() >= 0 ) {
+      addInvalidationHint( hints, msg.parentDestCollection(), msg.destinationResource() );
+    }
+    ++coalesced;
+  }
+
+  QMap<Entity::Id, QByteArray>::ConstIterator it = hints.constBegin();
+  for ( ; it != hints.constEnd(); ++it ) {
+    Message hint;
+    hint.setType( NotificationMessageV2::Collections );
+    hint.setOperation( NotificationMessageV2::Modify );
+    hint.addEntity( it.key() );
+    hint.setResource( it.value() );
+    hint.setItemParts( QSet<QByteArray>() << AKONADI_PARAM_INVALIDATE );
+    result << hint;
+  }
+
+  return result;
+}
+
 NotificationSource::NotificationSource( const QString &identifier, const QString &clientServiceName, NotificationManager *parent )
   : QObject( parent )
   , mManager( parent )
   , mIdentifier( identifier )
   , mDBusIdentifier( identifier )
   , mClientWatcher( 0 )
+  , mConnection( 0 )
   , mServerSideMonitorEnabled( false )
   , mAllMonitored( false )
   , mExclusive( false )
+  , mQueueLimit( parent->mQueueLimit )
+  , mMaximumQueueDepth( 0 )
+  , mDeliveredCount( 0 )
+  , mCoalescedCount( 0 )
+  , mDeliveryPending( false )
+  , mConsumer( 0 )
+  , mReplyPending( false )
+  , mJournalTracking( false )
+  , mReplaying( false )
+  , mNotificationMessageVersion( 3 )
+  , mInvalidationHintsSupported( false )
 {
   new NotificationSourceAdaptor( this );
 
@@ -81,12 +163,262 @@ void NotificationSource::emitNotification( const NotificationMessage::List &noti
 
 void NotificationSource::emitNotification( const NotificationMessageV2::List &notifications )
 {
-  Q_EMIT notifyV2( notifications );
+  mMaximumQueueDepth = qMax( mMaximumQueueDepth, notifications.count() );
+  if ( mInvalidationHintsSupported && notifications.count() > mQueueLimit ) {
+    const NotificationMessageV2::List coalesced = coalesceNotifications( notifications, mCoalescedCount );
+    mDeliveredCount += coalesced.count();
+    Q_EMIT notifyV2( coalesced );
+  } else {
+    mDeliveredCount += notifications.count();
+    Q_EMIT notifyV2( notifications );
+  }
 }
 
 void NotificationSource::emitNotification( const NotificationMessageV3::List &notifications )
 {
-  Q_EMIT notifyV3( notifications );
+  mQueue += notifications;
+  mMaximumQueueDepth = qMax( mMaximumQueueDepth, mQueue.count() );
+  if ( mInvalidationHintsSupported && mQueue.count() > mQueueLimit ) {
+    mQueue = coalesceNotifications( mQueue, mCoalescedCount );
+  }
+
+  if ( !isDeliveryPending() ) {
+    deliverQueue();
+  }
+}
+
+bool NotificationSource::isDeliveryPending() const
+{
+  // Signals give us no feedback, they never wait for anything
+  return mDeliveryPending || mReplyPending;
+}
+
+void NotificationSource::deliverQueue()
+{
+  if ( mQueue.isEmpty() ) {
+    return;
+  }
+
+  const NotificationMessageV3::List notifications = mQueue;
+  mQueue.clear();
+  mDeliveredCount += notifications.count();
+
+  if ( mConnection ) {
+    mDeliveryPending = true;
+    Q_EMIT connectionNotify( notifications );
+  } else if ( mConsumer ) {
+    mReplyPending = true;
+    mConsumerPending = notifications;
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher( mConsumer->processNotificationsV3( notifications ), this );
+    connect( watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), SLOT(consumerReplied(QDBusPendingCallWatcher*)) );
+  } else {
+    Q_EMIT notifyV3( notifications );
+  }
+}
+
+void NotificationSource::connectionFlushed()
+{
+  mDeliveryPending = false;
+  if ( !isDeliveryPending() ) {
+    deliverQueue();
+  }
+}
+
+void NotificationSource::consumerReplied( QDBusPendingCallWatcher *watcher )
+{
+  watcher->deleteLater();
+  mReplyPending = false;
+  const NotificationMessageV3::List notifications = mConsumerPending;
+  mConsumerPending.clear();
+
+  if ( watcher->isError() ) {
+    akError() << "Notification consumer of" << mIdentifier << "failed:" << watcher->error().message();
+    delete mConsumer;
+    mConsumer = 0;
+    Q_EMIT notifyV3( notifications );
+  }
+
+  if ( !isDeliveryPending() ) {
+    deliverQueue();
+  }
+}
+
+void NotificationSource::setNotificationConsumer( const QString &service, const QDBusObjectPath &path )
+{
+  delete mConsumer;
+  mConsumer = 0;
+  if ( !service.isEmpty() ) {
+    mConsumer = new OrgFreedesktopAkonadiNotificationConsumerInterface( service, path.path(), QDBusConnection::sessionBus(), this );
+  }
+}
+
+bool NotificationSource::hasNotificationConsumer() const
+{
+  return mConsumer != 0;
+}
+
+void NotificationSource::setConnection( Connection *connection )
+{
+  if ( mConnection ) {
+    disconnect( this, SIGNAL(connectionNotify(Akonadi::NotificationMessageV3::List)), mConnection, 0 );
+    disconnect( mConnection, SIGNAL(notificationsFlushed()), this, 0 );
+  }
+
+  mConnection = connection;
+  mDeliveryPending = false;
+  if ( mConnection ) {
+    // The connection lives in its own thread
+    connect( this, SIGNAL(connectionNotify(Akonadi::NotificationMessageV3::List)),
+             mConnection, SLOT(sendNotifications(Akonadi::NotificationMessageV3::List)),
+             Qt::QueuedConnection );
+    connect( mConnection, SIGNAL(notificationsFlushed()),
+             this, SLOT(connectionFlushed()),
+             Qt::QueuedConnection );
+  } else if ( !isDeliveryPending() ) {
+    // Whatever was waiting for the connection goes over D-Bus now
+    deliverQueue();
+  }
+}
+
+Connection *NotificationSource::connection() const
+{
+  return mConnection;
+}
+
+void NotificationSource::setInvalidationHintsSupported( bool supported )
+{
+  mInvalidationHintsSupported = supported;
+  if ( !mInvalidationHintsSupported && mConnection ) {
+    // The queue could not be bounded anymore, see NotificationManager::attachConnection()
+    setConnection( 0 );
+  }
+}
+
+bool NotificationSource::invalidationHintsSupported() const
+{
+  return mInvalidationHintsSupported;
+}
+
+void NotificationSource::setQueueLimit( int limit )
+{
+  mQueueLimit = limit;
+}
+
+int NotificationSource::queueLimit() const
+{
+  return mQueueLimit;
+}
+
+int NotificationSource::queueDepth() const
+{
+  return mQueue.count();
+}
+
+int NotificationSource::maximumQueueDepth() const
+{
+  return mMaximumQueueDepth;
+}
+
+qint64 NotificationSource::deliveredCount() const
+{
+  return mDeliveredCount;
+}
+
+qint64 NotificationSource::coalescedCount() const
+{
+  return mCoalescedCount;
+}
+
+void NotificationSource::setJournalSequence( qint64 sequence )
+{
+  if ( mJournalTracking ) {
+    Q_EMIT journalSequenceChanged( sequence );
+  }
+}
+
+qint64 NotificationSource::journalSequence() const
+{
+  return mManager->mJournal.lastSequence();
+}
+
+void NotificationSource::setNotificationMessageVersion( int version )
+{
+  mNotificationMessageVersion = version;
+}
+
+int NotificationSource::notificationMessageVersion() const
+{
+  return mNotificationMessageVersion;
+}
+
+bool NotificationSource::isReplaying() const
+{
+  return mReplaying;
+}
+
+bool NotificationSource::replayNotifications( qint64 sequence )
+{
+  if ( !mManager->mJournal.seek( sequence, mReplayCursor ) ) {
+    return false;
+  }
+
+  mJournalTracking = true;
+  if ( !mReplaying ) {
+    mReplaying = true;
+    QMetaObject::invokeMethod( this, "replayNextBatch", Qt::QueuedConnection );
+  }
+  return true;
+}
+
+void NotificationSource::replayNextBatch()
+{
+  if ( !mReplaying ) {
+    return;
+  }
+
+  NotificationMessageV3::List notifications;
+  if ( !mManager->journaledNotifications( this, mReplayCursor, ReplayBatchSize, notifications ) ) {
+    akError() << "Replaying the notification journal for" << mIdentifier << "failed at" << mReplayCursor.sequence;
+    mReplaying = false;
+    Q_EMIT replayFailed();
+    return;
+  }
+
+  if ( !notifications.isEmpty() ) {
+    emitReplayedNotifications( notifications );
+  }
+  // New notifications are only appended to the journal from the event loop,
+  // so once the cursor has caught up, nothing falls between replay and
+  // regular delivery
+  if ( mReplayCursor.sequence >= journalSequence() ) {
+    mReplaying = false;
+  } else {
+    QMetaObject::invokeMethod( this, "replayNextBatch", Qt::QueuedConnection );
+  }
+  Q_EMIT journalSequenceChanged( mReplayCursor.sequence );
+}
+
+void NotificationSource::emitReplayedNotifications( const NotificationMessageV3::List &notifications )
+{
+  // In-band delivery is only supported for V3 clients
+  if ( mConnection || mNotificationMessageVersion >= 3 ) {
+    emitNotification( notifications );
+  } else if ( mNotificationMessageVersion == 2 ) {
+    emitNotification( NotificationMessageV3::toV2List( notifications ) );
+  } else {
+    NotificationMessage::List legacyNotifications;
+    Q_FOREACH ( const NotificationMessageV3 &notification, notifications ) {
+      const NotificationMessage::List tmp = notification.toNotificationV1().toList();
+      Q_FOREACH ( const NotificationMessage &legacyNotification, tmp ) {
+        bool appended = false;
+        NotificationMessage::appendAndCompress( legacyNotifications, legacyNotification, &appended );
+        if ( !appended ) {
+          legacyNotifications << legacyNotification;
+        }
+      }
+    }
+    emitNotification( legacyNotifications );
+  }
 }
 
 QString NotificationSource::identifier() const
@@ -117,6 +449,7 @@ bool NotificationSource::isExclusive() const
 void NotificationSource::setExclusive( bool enabled )
 {
   mExclusive = enabled;
+  mManager->mSubscriptionIndex.updateSource( this );
 }
 
 void NotificationSource::addClientServiceName( const QString &clientServiceName )
@@ -147,9 +480,11 @@ void NotificationSource::setMonitoredCollection( Entity::Id id, bool monitored )
 
   if ( monitored && !mMonitoredCollections.contains( id ) ) {
     mMonitoredCollections.insert( id );
+    mManager->mSubscriptionIndex.setMonitoredCollection( this, id, monitored );
     Q_EMIT monitoredCollectionsChanged();
   } else if ( !monitored ) {
     mMonitoredCollections.remove( id );
+    mManager->mSubscriptionIndex.setMonitoredCollection( this, id, monitored );
     Q_EMIT monitoredCollectionsChanged();
   }
 }
@@ -167,9 +502,11 @@ void NotificationSource::setMonitoredItem( Entity::Id id, bool monitored )
 
   if ( monitored && !mMonitoredItems.contains( id ) ) {
     mMonitoredItems.insert( id );
+    mManager->mSubscriptionIndex.setMonitoredItem( this, id, monitored );
     Q_EMIT monitoredItemsChanged();
   } else if ( !monitored ) {
     mMonitoredItems.remove( id );
+    mManager->mSubscriptionIndex.setMonitoredItem( this, id, monitored );
     Q_EMIT monitoredItemsChanged();
   }
 }
@@ -187,9 +524,11 @@ void NotificationSource::setMonitoredTag( Entity::Id id, bool monitored )
 
   if ( monitored && !mMonitoredTags.contains( id ) ) {
     mMonitoredTags.insert( id );
+    mManager->mSubscriptionIndex.setMonitoredTag( this, id, monitored );
     Q_EMIT monitoredTagsChanged();
   } else if ( !monitored ) {
     mMonitoredTags.remove( id );
+    mManager->mSubscriptionIndex.setMonitoredTag( this, id, monitored );
     Q_EMIT monitoredTagsChanged();
   }
 }
@@ -207,9 +546,11 @@ void NotificationSource::setMonitoredResource( const QByteArray &resource, bool
 
   if ( monitored && !mMonitoredResources.contains( resource ) ) {
     mMonitoredResources.insert( resource );
+    mManager->mSubscriptionIndex.setMonitoredResource( this, resource, monitored );
     Q_EMIT monitoredResourcesChanged();
   } else if ( !monitored ) {
     mMonitoredResources.remove( resource );
+    mManager->mSubscriptionIndex.setMonitoredResource( this, resource, monitored );
     Q_EMIT monitoredResourcesChanged();
   }
 }
@@ -227,9 +568,11 @@ void NotificationSource::setMonitoredMimeType( const QString &mimeType, bool mon
 
   if ( monitored && !mMonitoredMimeTypes.contains( mimeType ) ) {
     mMonitoredMimeTypes.insert( mimeType );
+    mManager->mSubscriptionIndex.setMonitoredMimeType( this, mimeType, monitored );
     Q_EMIT monitoredMimeTypesChanged();
   } else if ( !monitored ) {
     mMonitoredMimeTypes.remove( mimeType );
+    mManager->mSubscriptionIndex.setMonitoredMimeType( this, mimeType, monitored );
     Q_EMIT monitoredMimeTypesChanged();
   }
 }
@@ -247,9 +590,11 @@ void NotificationSource::setAllMonitored( bool allMonitored )
 
   if ( allMonitored && !mAllMonitored ) {
     mAllMonitored = true;
+    mManager->mSubscriptionIndex.updateSource( this );
     Q_EMIT isAllMonitoredChanged();
   } else if ( !allMonitored ) {
     mAllMonitored = false;
+    mManager->mSubscriptionIndex.updateSource( this );
     Q_EMIT isAllMonitoredChanged();
   }
 }
@@ -267,9 +612,11 @@ void NotificationSource::setIgnoredSession( const QByteArray &sessionId, bool ig
 
   if ( ignored && !mIgnoredSessions.contains( sessionId ) ) {
     mIgnoredSessions.insert( sessionId );
+    mManager->mSubscriptionIndex.setIgnoredSession( this, sessionId, ignored );
     Q_EMIT ignoredSessionsChanged();
   } else if ( !ignored ) {
     mIgnoredSessions.remove( sessionId );
+    mManager->mSubscriptionIndex.setIgnoredSession( this, sessionId, ignored );
     Q_EMIT ignoredSessionsChanged();
   }
 }
@@ -314,9 +661,11 @@ void NotificationSource::setMonitoredType( NotificationMessageV2::Type type, boo
 
   if ( monitored && !mMonitoredTypes.contains( type ) ) {
     mMonitoredTypes.insert( type );
+    mManager->mSubscriptionIndex.updateSource( this );
     Q_EMIT monitoredTypesChanged();
   } else if ( !monitored ) {
     mMonitoredTypes.remove( type );
+    mManager->mSubscriptionIndex.updateSource( this );
     Q_EMIT monitoredTypesChanged();
   }
 }
@@ -333,7 +682,7 @@ bool NotificationSource::acceptsNotification( const NotificationMessageV3 &notif
     return false;
   }
 
-  if (notification.entities().count() == 0 && notification.type() != NotificationMessageV2::Relations) {
+  if (notification.d->items.isEmpty() && notification.type() != NotificationMessageV2::Relations) {
     return false;
   }
 
@@ -351,7 +700,7 @@ bool NotificationSource::acceptsNotification( const NotificationMessageV3 &notif
 
         // Now let's see if the collection is referenced - then we still might need
         // to accept it
-        Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.entities() ) {
+        Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
           if ( CollectionReferenceManager::instance()->isReferenced( entity.id ) ) {
             return ( mExclusive || isCollectionMonitored( entity.id ) );
           }
@@ -392,7 +741,7 @@ bool NotificationSource::acceptsNotification( const NotificationMessageV3 &notif
         return true;
       }
 
-      Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.entities() ) {
+      Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
         if ( isMimeTypeMonitored( entity.mimeType ) ) {
           return true;
         }
@@ -402,7 +751,7 @@ bool NotificationSource::acceptsNotification( const NotificationMessageV3 &notif
     }
 
     // we explicitly monitor that item or the collections it's in
-    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.entities() ) {
+    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
       if ( mMonitoredItems.contains( entity.id ) ) {
         return true;
       }
@@ -430,7 +779,7 @@ bool NotificationSource::acceptsNotification( const NotificationMessageV3 &notif
     }
 
     // we explicitly monitor that colleciton, or all of them
-    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.entities() ) {
+    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
       if ( isCollectionMonitored( entity.id ) ) {
         return true;
       }
@@ -448,7 +797,7 @@ bool NotificationSource::acceptsNotification( const NotificationMessageV3 &notif
       return true;
     }
 
-    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.entities() ) {
+    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
       if ( mMonitoredTags.contains( entity.id ) ) {
         return true;
       }
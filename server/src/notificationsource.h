@@ -22,6 +22,7 @@
 #include "../libs/notificationmessage_p.h"
 #include "../libs/notificationmessagev2_p.h"
 #include "../libs/notificationmessagev3_p.h"
+#include "notificationjournal.h"
 
 #include <QtCore/QObject>
 #include <QtCore/QVector>
@@ -29,9 +30,12 @@
 
 #include "entities.h"
 
+class OrgFreedesktopAkonadiNotificationConsumerInterface;
+
 namespace Akonadi {
 namespace Server {
 
+class Connection;
 class NotificationManager;
 
 class NotificationSource : public QObject
@@ -58,6 +62,14 @@ class NotificationSource : public QObject
     /**
      * Emit the given notifications
      *
+     * Notifications for an attached connection are queued until the
+     * connection has written out the previous batch, and those for a
+     * notification consumer until it has replied to the previous call.
+     * If more than
+     * queueLimit() notifications are waiting and the client understands
+     * invalidation hints, the item notifications are coalesced into an
+     * invalidation hint for each affected collection.
+     *
      * @param notifications List of notifications to emit.
      */
     void emitNotification( const NotificationMessageV3::List &notifications );
@@ -65,6 +77,9 @@ class NotificationSource : public QObject
     /**
      * Emit the given notifications
      *
+     * Coalesced like V3 notifications if there are more than queueLimit()
+     * and the client understands invalidation hints.
+     *
      * @param notifications List of notifications to emit.
      */
     void emitNotification( const NotificationMessageV2::List &notifications );
@@ -97,6 +112,62 @@ class NotificationSource : public QObject
 
     bool acceptsNotification( const NotificationMessageV3 &notification );
 
+    /**
+     * Sends notifications over the Akonadi protocol @p connection instead
+     * of D-Bus, or over D-Bus again if @p connection is @c 0.
+     *
+     * The connection lives in another thread and is not guarded: it has to
+     * be detached through NotificationManager::detachConnection() before it
+     * is destroyed.
+     */
+    void setConnection( Connection *connection );
+    Connection *connection() const;
+
+    /**
+     * Sets the maximum number of notifications waiting for delivery to
+     * this source before they are coalesced.
+     *
+     * @see setInvalidationHintsSupported()
+     */
+    void setQueueLimit( int limit );
+    int queueLimit() const;
+
+    /**
+     * Returns number of notifications waiting for delivery. Notifications
+     * emitted as D-Bus signals are never waiting, unless the client has
+     * set a notification consumer.
+     */
+    int queueDepth() const;
+    /** Returns the highest queueDepth() seen so far. */
+    int maximumQueueDepth() const;
+    /** Returns number of notifications delivered so far. */
+    qint64 deliveredCount() const;
+    /** Returns number of notifications replaced by invalidation hints so far. */
+    qint64 coalescedCount() const;
+
+    /**
+     * Emits journalSequenceChanged() if the client asked for replay of
+     * journaled notifications before.
+     */
+    void setJournalSequence( qint64 sequence );
+
+    /**
+     * Sets the notification format the client asked for when subscribing,
+     * replayed notifications are emitted in it.
+     */
+    void setNotificationMessageVersion( int version );
+    int notificationMessageVersion() const;
+
+    /**
+     * Returns whether journaled notifications are being replayed. The
+     * source does not receive new notifications until the replay has
+     * caught up with the journal.
+     */
+    bool isReplaying() const;
+
+    /** Returns whether notifications are delivered to a notification consumer. */
+    bool hasNotificationConsumer() const;
+
   public Q_SLOTS:
     /**
       * Unsubscribe from the message source.
@@ -124,12 +195,57 @@ class NotificationSource : public QObject
     Q_SCRIPTABLE void setExclusive( bool exclusive );
     Q_SCRIPTABLE bool isExclusive() const;
 
+    /**
+     * Tells whether the client handles Collections Modify notifications
+     * with the INVALIDATE part by re-fetching the collection content.
+     * Only then item notifications exceeding queueLimit() are coalesced
+     * into such hints, otherwise everything is delivered. Off by default.
+     */
+    Q_SCRIPTABLE void setInvalidationHintsSupported( bool supported );
+    Q_SCRIPTABLE bool invalidationHintsSupported() const;
+
+    /**
+     * Delivers V3 notifications by calling processNotificationsV3() of the
+     * org.freedesktop.Akonadi.NotificationConsumer interface at @p path of
+     * @p service instead of emitting notifyV3(). Unlike signals, calls are
+     * answered, so the next batch is only sent once the client has replied
+     * to the previous one and notifications queue up here in the meantime.
+     * An empty @p service switches back to signals, so does a failed call.
+     */
+    Q_SCRIPTABLE void setNotificationConsumer( const QString &service, const QDBusObjectPath &path );
+
+    /**
+     * Returns sequence number of the most recent notification in the
+     * notification journal.
+     */
+    Q_SCRIPTABLE qint64 journalSequence() const;
+
+    /**
+     * Emits all notifications after @p sequence again that pass the filters
+     * of this source, and from then on emits journalSequenceChanged() after
+     * each batch of notifications, so that the client can remember where to
+     * continue after a restart. Notifications are replayed in the format
+     * the client subscribed with.
+     *
+     * The journal is read in batches from the event loop after this call
+     * has returned. New notifications are held back until the replay has
+     * caught up, replayFailed() is emitted if the journal was rotated past
+     * the notifications that were still to be replayed.
+     *
+     * @returns @c false if the journal does not reach back to @p sequence,
+     *          the client has to synchronize fully then
+     */
+    Q_SCRIPTABLE bool replayNotifications( qint64 sequence );
+
   Q_SIGNALS:
 
     Q_SCRIPTABLE void notify( const Akonadi::NotificationMessage::List &msgs );
     Q_SCRIPTABLE void notifyV2( const Akonadi::NotificationMessageV2::List &msgs );
     Q_SCRIPTABLE void notifyV3( const Akonadi::NotificationMessageV3::List &msgs );
 
+    /** In-band notifications, delivered to the attached connection. */
+    void connectionNotify( const Akonadi::NotificationMessageV3::List &msgs );
+
     Q_SCRIPTABLE void monitoredCollectionsChanged();
     Q_SCRIPTABLE void monitoredItemsChanged();
     Q_SCRIPTABLE void monitoredTagsChanged();
@@ -139,19 +255,56 @@ class NotificationSource : public QObject
     Q_SCRIPTABLE void ignoredSessionsChanged();
     Q_SCRIPTABLE void monitoredTypesChanged();
 
+    /**
+     * All notifications up to @p sequence have been emitted to this source.
+     */
+    Q_SCRIPTABLE void journalSequenceChanged( qint64 sequence );
+
+    /**
+     * Replaying journaled notifications failed midway, the client has to
+     * synchronize fully.
+     */
+    Q_SCRIPTABLE void replayFailed();
+
   private Q_SLOTS:
     void serviceUnregistered( const QString &serviceName );
+    void connectionFlushed();
+    void consumerReplied( QDBusPendingCallWatcher *watcher );
+    void replayNextBatch();
 
   private:
     bool isCollectionMonitored( Entity::Id id ) const;
     bool isMimeTypeMonitored( const QString &mimeType ) const;
     bool isMoveDestinationResourceMonitored( const NotificationMessageV3 &msg ) const;
+    bool isDeliveryPending() const;
+    void deliverQueue();
+    void emitReplayedNotifications( const NotificationMessageV3::List &notifications );
 
   private:
     NotificationManager *mManager;
     QString mIdentifier;
     QString mDBusIdentifier;
     QDBusServiceWatcher *mClientWatcher;
+    //! Only touched in the manager thread, the connection detaches itself
+    //! from there before it is destroyed
+    Connection *mConnection;
+
+    NotificationMessageV3::List mQueue;
+    int mQueueLimit;
+    int mMaximumQueueDepth;
+    qint64 mDeliveredCount;
+    qint64 mCoalescedCount;
+    //! A batch was handed over to mConnection and was not written out yet
+    bool mDeliveryPending;
+    OrgFreedesktopAkonadiNotificationConsumerInterface *mConsumer;
+    //! Batch sent to mConsumer that was not answered yet
+    NotificationMessageV3::List mConsumerPending;
+    bool mReplyPending;
+    bool mJournalTracking;
+    bool mReplaying;
+    NotificationJournal::Cursor mReplayCursor;
+    int mNotificationMessageVersion;
+    bool mInvalidationHintsSupported;
 
     bool mServerSideMonitorEnabled;
     bool mAllMonitored;
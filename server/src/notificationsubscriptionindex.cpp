@@ -0,0 +1,270 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "notificationsubscriptionindex.h"
+#include "notificationsource.h"
+
+#include <libs/notificationmessagev2_p_p.h>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+template<typename Key>
+static void updateIndex( QHash<Key, QSet<NotificationSource *> > &index, const Key &key,
+                         NotificationSource *source, bool add )
+{
+  if ( add ) {
+    index[key].insert( source );
+    return;
+  }
+
+  typename QHash<Key, QSet<NotificationSource *> >::Iterator it = index.find( key );
+  if ( it == index.end() ) {
+    return;
+  }
+  it->remove( source );
+  if ( it->isEmpty() ) {
+    index.erase( it );
+  }
+}
+
+template<typename Key>
+static void removeFromIndex( QHash<Key, QSet<NotificationSource *> > &index, NotificationSource *source )
+{
+  typename QHash<Key, QSet<NotificationSource *> >::Iterator it = index.begin();
+  while ( it != index.end() ) {
+    it->remove( source );
+    if ( it->isEmpty() ) {
+      it = index.erase( it );
+    } else {
+      ++it;
+    }
+  }
+}
+
+template<typename Key>
+static void collect( QSet<NotificationSource *> &result, const QHash<Key, QSet<NotificationSource *> > &index, const Key &key )
+{
+  typename QHash<Key, QSet<NotificationSource *> >::ConstIterator it = index.constFind( key );
+  if ( it != index.constEnd() ) {
+    result += *it;
+  }
+}
+
+void NotificationSubscriptionIndex::addSource( NotificationSource *source )
+{
+  mSources.insert( source );
+
+  Q_FOREACH ( Entity::Id id, source->monitoredCollections() ) {
+    updateIndex( mCollections, id, source, true );
+  }
+  Q_FOREACH ( Entity::Id id, source->monitoredItems() ) {
+    updateIndex( mItems, id, source, true );
+  }
+  Q_FOREACH ( Entity::Id id, source->monitoredTags() ) {
+    updateIndex( mTags, id, source, true );
+  }
+  Q_FOREACH ( const QByteArray &resource, source->monitoredResources() ) {
+    updateIndex( mResources, resource, source, true );
+  }
+  Q_FOREACH ( const QString &mimeType, source->monitoredMimeTypes() ) {
+    updateIndex( mMimeTypes, mimeType, source, true );
+  }
+  Q_FOREACH ( const QByteArray &sessionId, source->ignoredSessions() ) {
+    updateIndex( mIgnoredSessions, sessionId, source, true );
+  }
+
+  updateSource( source );
+}
+
+void NotificationSubscriptionIndex::removeSource( NotificationSource *source )
+{
+  if ( !mSources.remove( source ) ) {
+    return;
+  }
+
+  mAllMonitored.remove( source );
+  mExclusive.remove( source );
+  mAnyTag.remove( source );
+  mAnyRelation.remove( source );
+
+  removeFromIndex( mCollections, source );
+  removeFromIndex( mItems, source );
+  removeFromIndex( mTags, source );
+  removeFromIndex( mResources, source );
+  removeFromIndex( mMimeTypes, source );
+  removeFromIndex( mIgnoredSessions, source );
+}
+
+bool NotificationSubscriptionIndex::contains( NotificationSource *source ) const
+{
+  return mSources.contains( source );
+}
+
+void NotificationSubscriptionIndex::setMonitoredCollection( NotificationSource *source, Entity::Id id, bool monitored )
+{
+  if ( mSources.contains( source ) ) {
+    updateIndex( mCollections, id, source, monitored );
+  }
+}
+
+void NotificationSubscriptionIndex::setMonitoredItem( NotificationSource *source, Entity::Id id, bool monitored )
+{
+  if ( mSources.contains( source ) ) {
+    updateIndex( mItems, id, source, monitored );
+  }
+}
+
+void NotificationSubscriptionIndex::setMonitoredTag( NotificationSource *source, Entity::Id id, bool monitored )
+{
+  if ( mSources.contains( source ) ) {
+    updateIndex( mTags, id, source, monitored );
+    updateSource( source );
+  }
+}
+
+void NotificationSubscriptionIndex::setMonitoredResource( NotificationSource *source, const QByteArray &resource, bool monitored )
+{
+  if ( mSources.contains( source ) ) {
+    updateIndex( mResources, resource, source, monitored );
+  }
+}
+
+void NotificationSubscriptionIndex::setMonitoredMimeType( NotificationSource *source, const QString &mimeType, bool monitored )
+{
+  if ( mSources.contains( source ) ) {
+    updateIndex( mMimeTypes, mimeType, source, monitored );
+  }
+}
+
+void NotificationSubscriptionIndex::setIgnoredSession( NotificationSource *source, const QByteArray &sessionId, bool ignored )
+{
+  if ( mSources.contains( source ) ) {
+    updateIndex( mIgnoredSessions, sessionId, source, ignored );
+  }
+}
+
+void NotificationSubscriptionIndex::updateSource( NotificationSource *source )
+{
+  if ( !mSources.contains( source ) ) {
+    return;
+  }
+
+  mAllMonitored.remove( source );
+  mExclusive.remove( source );
+  mAnyTag.remove( source );
+  mAnyRelation.remove( source );
+
+  // allMonitored and exclusive sources bypass the type filter in
+  // NotificationSource::acceptsNotification(), tags and relations don't
+  if ( source->isAllMonitored() ) {
+    mAllMonitored.insert( source );
+  }
+  if ( source->isExclusive() ) {
+    mExclusive.insert( source );
+  }
+
+  const QVector<NotificationMessageV2::Type> types = source->monitoredTypes();
+  if ( source->monitoredTags().isEmpty() && ( types.isEmpty() || types.contains( NotificationMessageV2::Tags ) ) ) {
+    mAnyTag.insert( source );
+  }
+  if ( types.isEmpty() || types.contains( NotificationMessageV2::Relations ) ) {
+    mAnyRelation.insert( source );
+  }
+}
+
+void NotificationSubscriptionIndex::collectCollection( SourceSet &result, Entity::Id id ) const
+{
+  if ( id < 0 ) {
+    return;
+  }
+
+  collect( result, mCollections, id );
+  // Monitoring collection 0 means monitoring all of them
+  collect( result, mCollections, static_cast<Entity::Id>( 0 ) );
+}
+
+QSet<NotificationSource *> NotificationSubscriptionIndex::candidates( const NotificationMessageV3 &notification ) const
+{
+  SourceSet result;
+
+  if ( notification.type() == NotificationMessageV2::InvalidType ) {
+    return result;
+  }
+  if ( notification.d->items.isEmpty() && notification.type() != NotificationMessageV2::Relations ) {
+    return result;
+  }
+
+  result = mAllMonitored;
+  // Exclusive sources also get notifications about disabled and referenced
+  // collections, let acceptsNotification() decide about those
+  result += mExclusive;
+
+  const bool isMove = notification.operation() == NotificationMessageV2::Move;
+
+  switch ( notification.type() ) {
+  case NotificationMessageV2::Items:
+    collect( result, mResources, notification.resource() );
+    if ( isMove ) {
+      collect( result, mResources, notification.destinationResource() );
+    }
+    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
+      collect( result, mItems, entity.id );
+      collect( result, mMimeTypes, entity.mimeType );
+    }
+    collectCollection( result, notification.parentCollection() );
+    collectCollection( result, notification.parentDestCollection() );
+    break;
+
+  case NotificationMessageV2::Collections:
+    collect( result, mResources, notification.resource() );
+    if ( isMove ) {
+      collect( result, mResources, notification.destinationResource() );
+    }
+    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
+      collectCollection( result, entity.id );
+    }
+    collectCollection( result, notification.parentCollection() );
+    collectCollection( result, notification.parentDestCollection() );
+    break;
+
+  case NotificationMessageV2::Tags:
+    result += mAnyTag;
+    Q_FOREACH ( const NotificationMessageV2::Entity &entity, notification.d->items ) {
+      collect( result, mTags, entity.id );
+    }
+    break;
+
+  case NotificationMessageV2::Relations:
+    result += mAnyRelation;
+    break;
+
+  default:
+    break;
+  }
+
+  if ( !result.isEmpty() ) {
+    QHash<QByteArray, SourceSet>::ConstIterator it = mIgnoredSessions.constFind( notification.sessionId() );
+    if ( it != mIgnoredSessions.constEnd() ) {
+      result -= *it;
+    }
+  }
+
+  return result;
+}
@@ -0,0 +1,104 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_NOTIFICATIONSUBSCRIPTIONINDEX_H
+#define AKONADI_NOTIFICATIONSUBSCRIPTIONINDEX_H
+
+#include "../libs/notificationmessagev3_p.h"
+#include "storage/entity.h"
+
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+
+namespace Akonadi {
+namespace Server {
+
+class NotificationSource;
+
+/**
+ * Inverted index of the filters of all server-side monitoring notification sources.
+ *
+ * Instead of asking every source whether it is interested in a notification,
+ * NotificationManager looks up the sources monitoring the collections, items,
+ * tags, resources and mimetypes the notification refers to. The result is
+ * a superset of the interested sources, the exact decision is still made by
+ * NotificationSource::acceptsNotification(), which is then called for just
+ * a handful of sources instead of all of them.
+ *
+ * The index is kept up to date by the NotificationSource setters, changes
+ * to sources that have not been added to the index are ignored.
+ */
+class NotificationSubscriptionIndex
+{
+  public:
+    /**
+     * Adds @p source and all its current filters to the index.
+     */
+    void addSource( NotificationSource *source );
+
+    /**
+     * Removes @p source from the index.
+     */
+    void removeSource( NotificationSource *source );
+
+    bool contains( NotificationSource *source ) const;
+
+    void setMonitoredCollection( NotificationSource *source, Entity::Id id, bool monitored );
+    void setMonitoredItem( NotificationSource *source, Entity::Id id, bool monitored );
+    void setMonitoredTag( NotificationSource *source, Entity::Id id, bool monitored );
+    void setMonitoredResource( NotificationSource *source, const QByteArray &resource, bool monitored );
+    void setMonitoredMimeType( NotificationSource *source, const QString &mimeType, bool monitored );
+    void setIgnoredSession( NotificationSource *source, const QByteArray &sessionId, bool ignored );
+
+    /**
+     * Updates the sources that match whole classes of notifications: those
+     * monitoring everything, exclusive ones and those matching any tag or
+     * relation. Must be called whenever the allMonitored or exclusive flags,
+     * the monitored types or the monitored tags of @p source change.
+     */
+    void updateSource( NotificationSource *source );
+
+    /**
+     * Returns the sources that might be interested in @p notification.
+     */
+    QSet<NotificationSource *> candidates( const NotificationMessageV3 &notification ) const;
+
+  private:
+    typedef QSet<NotificationSource *> SourceSet;
+
+    void collectCollection( SourceSet &result, Entity::Id id ) const;
+
+    SourceSet mSources;
+    SourceSet mAllMonitored;
+    SourceSet mExclusive;
+    SourceSet mAnyTag;
+    SourceSet mAnyRelation;
+
+    QHash<Entity::Id, SourceSet> mCollections;
+    QHash<Entity::Id, SourceSet> mItems;
+    QHash<Entity::Id, SourceSet> mTags;
+    QHash<QByteArray, SourceSet> mResources;
+    QHash<QString, SourceSet> mMimeTypes;
+    QHash<QByteArray, SourceSet> mIgnoredSessions;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
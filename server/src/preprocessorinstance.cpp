@@ -28,6 +28,7 @@
 #include "preprocessormanager.h"
 
 #include "entities.h"
+#include "storage/selectquerybuilder.h"
 
 #include "agentcontrolinterface.h"
 #include "agentmanagerinterface.h"
@@ -37,12 +38,21 @@
 #include <akdbus.h>
 
 #include <QtCore/QTimer>
+#include <QtCore/QMutexLocker>
+#include <QtDBus/QDBusPendingCallWatcher>
+#include <QtDBus/QDBusPendingReply>
+
+#include <algorithm>
 
 using namespace Akonadi::Server;
 
 PreprocessorInstance::PreprocessorInstance( const QString &id )
   : QObject()
-  , mBusy( false )
+  , mProcessingCount( 0 )
+  , mSupportsBatches( false )
+  , mBatchSize( 0 )
+  , mAverageLatency( -1 )
+  , mProcessedItems( 0 )
   , mId( id )
   , mInterface( 0 )
 {
@@ -55,7 +65,7 @@ PreprocessorInstance::~PreprocessorInstance()
 
 bool PreprocessorInstance::init()
 {
-  Q_ASSERT( !mBusy ); // must be called very early
+  Q_ASSERT( !isBusy() ); // must be called very early
   Q_ASSERT( !mInterface );
 
   mInterface = new OrgFreedesktopAkonadiPreprocessorInterface(
@@ -76,75 +86,128 @@ bool PreprocessorInstance::init()
   }
 
   QObject::connect( mInterface, SIGNAL(itemProcessed(qlonglong)), this, SLOT(itemProcessed(qlonglong)) );
+  QObject::connect( mInterface, SIGNAL(itemsProcessed(QList<qlonglong>)), this, SLOT(itemsProcessed(QList<qlonglong>)) );
+
+  // Preprocessors built against an older Akonadi only know beginProcessItem()
+  // and calling anything else on them would go unnoticed (NoReply), so ask first.
+  // We're called with the manager's mutex held, so don't block on the reply:
+  // items are handed out one at a time until it arrives.
+  QDBusMessage introspection = QDBusMessage::createMethodCall(
+      mInterface->service(),
+      mInterface->path(),
+      QLatin1String( "org.freedesktop.DBus.Introspectable" ),
+      QLatin1String( "Introspect" ) );
+  QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher( mInterface->connection().asyncCall( introspection ), this );
+  QObject::connect( watcher, SIGNAL(finished(QDBusPendingCallWatcher*)), this, SLOT(introspectionFinished(QDBusPendingCallWatcher*)) );
 
   return true;
 }
 
-void PreprocessorInstance::enqueueItem( qint64 itemId )
+void PreprocessorInstance::enqueueItems( const QList< qint64 > &itemIds )
 {
-  akDebug() << "PreprocessorInstance::enqueueItem("  << itemId <<  ")";
+  akDebug() << "PreprocessorInstance::enqueueItems("  << itemIds.count() <<  "items )";
 
-  mItemQueue.push_back( itemId );
+  Q_FOREACH ( qint64 itemId, itemIds ) {
+    mItemQueue.push_back( itemId );
+  }
 
-  // If the preprocessor is already busy processing another item then do nothing.
-  if ( mBusy ) {
-    // The "head" item is the one being processed and we have just added another one.
-    Q_ASSERT( mItemQueue.size() > 1 );
+  // If the preprocessor is already busy processing other items then do nothing,
+  // the new ones will be part of the next batch.
+  if ( isBusy() || mItemQueue.empty() ) {
     return;
   }
 
-  // Not busy: handle the item.
-  processHeadItem();
+  // Not busy: handle the items.
+  processHeadItems();
 }
 
-void PreprocessorInstance::processHeadItem()
+void PreprocessorInstance::processHeadItems()
 {
-  // We shouldn't be called if there are no items in the queue
-  Q_ASSERT( !mItemQueue.empty() );
+  // We shouldn't be called while another batch is being processed
+  Q_ASSERT( !isBusy() );
   // We shouldn't be here with no interface
   Q_ASSERT( mInterface );
 
-  qint64 itemId = mItemQueue.front();
+  const int batchSize = mSupportsBatches ? PreprocessorManager::instance()->batchSize() : 1;
+
+  QList< qlonglong > ids;
+  QList< qlonglong > collectionIds;
+  QStringList mimeTypes;
 
-  // Fetch the actual item data (as it may have changed since it was enqueued)
-  // The fetch will hit the cache if the item wasn't changed.
+  while ( ids.isEmpty() && !mItemQueue.empty() ) {
+    const int count = qMin< int >( batchSize, mItemQueue.size() );
 
-  PimItem actualItem = PimItem::retrieveById( itemId );
+    // Fetch the actual item data (as it may have changed since it was enqueued)
+    QVariantList candidates;
+    for ( int i = 0; i < count; ++i ) {
+      candidates << mItemQueue[i];
+    }
 
-  while ( !actualItem.isValid() ) {
-    // hum... item is gone ?
-    // FIXME: Signal to the manager that the item is no longer valid!
-    PreprocessorManager::instance()->preProcessorFinishedHandlingItem( this, itemId );
+    QHash< qint64, PimItem > items;
+    SelectQueryBuilder< PimItem > qb;
+    qb.addValueCondition( PimItem::idColumn(), Query::In, candidates );
+    if ( qb.exec() ) {
+      Q_FOREACH ( const PimItem &item, qb.result() ) {
+        items.insert( item.id(), item );
+      }
+    }
 
-    mItemQueue.pop_front();
-    if ( mItemQueue.empty() ) {
-      // nothing more to process for this instance: jump out
-      mBusy = false;
-      return;
+    QList< qint64 > vanishedIds;
+    for ( int i = 0; i < count; ++i ) {
+      const qint64 itemId = mItemQueue.front();
+      mItemQueue.pop_front();
+
+      const PimItem item = items.value( itemId );
+      if ( !item.isValid() ) {
+        // hum... item is gone ?
+        vanishedIds << itemId;
+        continue;
+      }
+
+      ids << itemId;
+      collectionIds << item.collectionId();
+      mimeTypes << item.mimeType().name();
     }
 
-    // try the next one in the queue
-    itemId = mItemQueue.front();
-    actualItem = PimItem::retrieveById( itemId );
+    // The batch stays at the head of the queue until it's reported back
+    for ( int i = ids.count() - 1; i >= 0; --i ) {
+      mItemQueue.push_front( ids.at( i ) );
+    }
+
+    if ( !vanishedIds.isEmpty() ) {
+      // FIXME: Signal to the manager that the items are no longer valid!
+      PreprocessorManager::instance()->preProcessorFinishedHandlingItems( this, vanishedIds );
+    }
+  }
+
+  if ( ids.isEmpty() ) {
+    // nothing more to process for this instance
+    return;
   }
 
-  // Ok.. got a valid item to process: collection and mimetype is known.
+  // Ok.. got valid items to process: collection and mimetype is known.
 
-  akDebug() << "PreprocessorInstance::processHeadItem(): about to begin processing item " << itemId;
+  akDebug() << "PreprocessorInstance::processHeadItems(): about to begin processing" << ids.count() << "items";
 
-  mBusy = true;
+  mProcessingCount = ids.count();
+  mBatchSize = ids.count();
 
   mItemProcessingStartDateTime = QDateTime::currentDateTime();
+  mBatchTimer.start();
 
-  // The beginProcessItem() D-Bus call is asynchronous (marked with NoReply attribute)
-  mInterface->beginProcessItem( itemId, actualItem.collectionId(), actualItem.mimeType().name() );
+  // The beginProcessItem(s)() D-Bus calls are asynchronous (marked with NoReply attribute)
+  if ( mSupportsBatches ) {
+    mInterface->beginProcessItems( ids, collectionIds, mimeTypes );
+  } else {
+    mInterface->beginProcessItem( ids.first(), collectionIds.first(), mimeTypes.first() );
+  }
 
-  akDebug() << "PreprocessorInstance::processHeadItem(): processing started for item " << itemId;
+  akDebug() << "PreprocessorInstance::processHeadItems(): processing started for" << ids.count() << "items";
 }
 
 int PreprocessorInstance::currentProcessingTime()
 {
-  if ( !mBusy ) {
+  if ( !isBusy() ) {
     return -1; // nothing being processed
   }
 
@@ -153,7 +216,7 @@ int PreprocessorInstance::currentProcessingTime()
 
 bool PreprocessorInstance::abortProcessing()
 {
-  Q_ASSERT_X( mBusy, "PreprocessorInstance::abortProcessing()", "You shouldn't call this method when isBusy() returns false" );
+  Q_ASSERT_X( isBusy(), "PreprocessorInstance::abortProcessing()", "You shouldn't call this method when isBusy() returns false" );
 
   OrgFreedesktopAkonadiAgentControlInterface iface(
       AkDBus::agentServiceName( mId, AkDBus::Agent ),
@@ -180,7 +243,7 @@ bool PreprocessorInstance::abortProcessing()
 
 bool PreprocessorInstance::invokeRestart()
 {
-  Q_ASSERT_X( mBusy, "PreprocessorInstance::invokeRestart()", "You shouldn't call this method when isBusy() returns false" );
+  Q_ASSERT_X( isBusy(), "PreprocessorInstance::invokeRestart()", "You shouldn't call this method when isBusy() returns false" );
 
   OrgFreedesktopAkonadiAgentManagerInterface iface(
       AkDBus::serviceName( AkDBus::Control ),
@@ -202,24 +265,36 @@ bool PreprocessorInstance::invokeRestart()
   return true;
 }
 
+void PreprocessorInstance::introspectionFinished( QDBusPendingCallWatcher *watcher )
+{
+  watcher->deleteLater();
+
+  QMutexLocker locker( PreprocessorManager::instance()->mMutex );
+
+  const QDBusPendingReply<QString> reply = *watcher;
+  // A batch that is already running was started in single-item mode, the
+  // next one will be sized according to the answer
+  mSupportsBatches = !reply.isError() && reply.value().contains( QLatin1String( "beginProcessItems" ) );
+
+  akDebug() << "Preprocessor instance" << mId << ( mSupportsBatches ? "supports" : "does not support" ) << "batches";
+}
+
 void PreprocessorInstance::itemProcessed( qlonglong id )
 {
   akDebug() << "PreprocessorInstance::itemProcessed("  << id <<  ")";
 
-  // We shouldn't be called if there are no items in the queue
-  if ( mItemQueue.empty() ) {
+  QMutexLocker locker( PreprocessorManager::instance()->mMutex );
+
+  // We shouldn't be called if there are no items being processed
+  if ( !isBusy() ) {
     Tracer::self()->warning(
         QLatin1String( "PreprocessorInstance" ),
         QString::fromLatin1( "Pre-processor instance '%1' emitted itemProcessed(%2) but we actually have no item in the queue" )
           .arg( mId )
           .arg( id ) );
-    mBusy = false;
     return; // preprocessor is buggy (FIXME: What now ?)
   }
 
-  // We should be busy now: this is more likely our fault, not the preprocessor's one.
-  Q_ASSERT( mBusy );
-
   qlonglong itemId = mItemQueue.front();
 
   if ( itemId != id ) {
@@ -233,16 +308,66 @@ void PreprocessorInstance::itemProcessed( qlonglong id )
     // FIXME: And what now ?
   }
 
-  mItemQueue.pop_front();
+  finishItems( QList< qlonglong >() << itemId );
+}
+
+void PreprocessorInstance::itemsProcessed( const QList< qlonglong > &ids )
+{
+  akDebug() << "PreprocessorInstance::itemsProcessed("  << ids.count() <<  "items )";
+
+  QMutexLocker locker( PreprocessorManager::instance()->mMutex );
+
+  finishItems( ids );
+}
+
+void PreprocessorInstance::finishItems( const QList< qlonglong > &ids )
+{
+  QList< qint64 > finishedIds;
+
+  Q_FOREACH ( qlonglong id, ids ) {
+    const std::deque< qint64 >::iterator end = mItemQueue.begin() + mProcessingCount;
+    const std::deque< qint64 >::iterator it = std::find( mItemQueue.begin(), end, id );
+    if ( it == end ) {
+      Tracer::self()->warning(
+          QLatin1String( "PreprocessorInstance" ),
+          QString::fromLatin1( "Pre-processor instance '%1' reported item %2 as processed but it's not being processed" )
+            .arg( mId )
+            .arg( id ) );
+      continue; // preprocessor is buggy
+    }
+
+    mItemQueue.erase( it );
+    --mProcessingCount;
+    finishedIds << id;
+  }
+
+  if ( finishedIds.isEmpty() ) {
+    return;
+  }
+
+  mProcessedItems += finishedIds.count();
+
+  // The preprocessor is making progress, so the stuck detection in
+  // PreprocessorManager::heartbeat() starts over for the rest of the batch
+  mItemProcessingStartDateTime = QDateTime::currentDateTime();
+
+  PreprocessorManager::instance()->preProcessorFinishedHandlingItems( this, finishedIds );
+
+  if ( isBusy() ) {
+    // Wait for the rest of the batch
+    return;
+  }
+
+  const qint64 latency = mBatchTimer.elapsed();
+  mAverageLatency = mAverageLatency < 0 ? latency : ( mAverageLatency * 7 + latency ) / 8;
 
-  PreprocessorManager::instance()->preProcessorFinishedHandlingItem( this, itemId );
+  akDebug() << "Pre-processor instance" << mId << "processed" << mBatchSize << "items in" << latency << "ms";
 
   if ( mItemQueue.empty() ) {
     // Nothing more to do
-    mBusy = false;
     return;
   }
 
-  // Stay busy and process next item in the queue
-  processHeadItem();
+  // Stay busy and process the next batch in the queue
+  processHeadItems();
 }
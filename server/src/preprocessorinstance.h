@@ -27,10 +27,12 @@
 
 #include <QtCore/QObject>
 #include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
 
 #include <deque>
 
 class OrgFreedesktopAkonadiPreprocessorInterface;
+class QDBusPendingCallWatcher;
 
 namespace Akonadi {
 namespace Server {
@@ -71,26 +73,55 @@ private:
 
   /**
    * The internal queue if item identifiers.
-   * The head item in the queue is the one currently being processed.
-   * The other ones are waiting.
+   * The first mProcessingCount items in the queue are the ones currently
+   * being processed. The other ones are waiting.
    */
   std::deque< qint64 > mItemQueue;
 
   /**
-   * Is this processor busy ?
-   * This, in fact, *should* be equivalent to "mItemQueue.count() > 0"
-   * as the head item in the queue is the one being processed now.
+   * The number of items at the head of mItemQueue that have been
+   * submitted to the preprocessor and not reported back yet.
+   * The preprocessor is busy while this is greater than zero.
    */
-  bool mBusy;
+  int mProcessingCount;
+
+  /**
+   * Does the preprocessor implement beginProcessItems() ?
+   * Older preprocessors only get one item at a time, and so does
+   * every preprocessor until its introspection data has arrived.
+   */
+  bool mSupportsBatches;
 
   /**
    * The date-time at that we have started processing the current
-   * item in the queue. This is used to compute the processing time
+   * batch of items or at that the preprocessor last reported some of
+   * them back. This is used to compute the processing time
    * and eventually spot a "dead" preprocessor (which takes longer
    * than N minutes to process an item).
    */
   QDateTime mItemProcessingStartDateTime;
 
+  /**
+   * Measures the time the current batch of items has been in processing.
+   */
+  QElapsedTimer mBatchTimer;
+
+  /**
+   * The size of the current batch, used for the statistics.
+   */
+  int mBatchSize;
+
+  /**
+   * Running average of the time in milliseconds the preprocessor
+   * needs for a batch, -1 if nothing has been processed yet.
+   */
+  qint64 mAverageLatency;
+
+  /**
+   * The number of items this preprocessor has finished.
+   */
+  qint64 mProcessedItems;
+
   /**
    * The id of this preprocessor instance. This is actually
    * the AgentInstance identifier.
@@ -113,18 +144,46 @@ protected:
   bool init();
 
   /**
-   * Returns true if this preprocessor instance is currently processing an item.
-   * That is: if we have called "processItem()" on it and it hasn't emitted
-   * itemProcessed() yet.
+   * Returns true if this preprocessor instance is currently processing items.
+   * That is: if we have called "beginProcessItem()" or "beginProcessItems()"
+   * on it and it hasn't reported all of the items back yet.
    */
   bool isBusy() const
   {
-    return mBusy;
+    return mProcessingCount > 0;
+  }
+
+  /**
+   * Returns the number of items waiting for or being processed by
+   * this preprocessor.
+   */
+  int queueDepth() const
+  {
+    return mItemQueue.size();
   }
 
   /**
-   * Returns the time in seconds elapsed since the current item was submitted
-   * to the slave preprocessor instance. If no item is currently being
+   * Returns the running average of the time in milliseconds this
+   * preprocessor needs for a batch of items or -1 if it hasn't finished
+   * any item yet.
+   */
+  qint64 averageLatency() const
+  {
+    return mAverageLatency;
+  }
+
+  /**
+   * Returns the number of items this preprocessor has finished.
+   */
+  qint64 processedItems() const
+  {
+    return mProcessedItems;
+  }
+
+  /**
+   * Returns the time in seconds elapsed since the current batch was submitted
+   * to the slave preprocessor instance or since it last reported an item of
+   * the batch as processed, whichever is later. If no item is currently being
    * processed then this function returns -1;
    */
   int currentProcessingTime();
@@ -141,7 +200,7 @@ protected:
   /**
    * Returns a pointer to the internal preprocessor instance
    * item queue. Don't mess with it unless you *really* know
-   * what you're doing. Use enqueueItem() to add an item
+   * what you're doing. Use enqueueItems() to add items
    * to the queue. This method is provided to the PreprocessorManager
    * to take over the item queue of a dying preprocessor.
    *
@@ -153,10 +212,10 @@ protected:
   }
 
   /**
-   * This is called by PreprocessorManager to enqueue a PimItem
+   * This is called by PreprocessorManager to enqueue PimItems
    * for processing by this preprocessor instance.
    */
-  void enqueueItem( qint64 itemId );
+  void enqueueItems( const QList< qint64 > &itemIds );
 
   /**
    * Attempts to abort the processing of the current item.
@@ -178,19 +237,39 @@ protected:
 private:
 
   /**
-   * This function starts processing of the first item in mItemQueue.
-   * It's only used internally.
+   * This function starts processing of the next batch of items at the
+   * head of mItemQueue. It's only used internally.
    */
-  void processHeadItem();
+  void processHeadItems();
+
+  /**
+   * Removes the specified items from the batch being processed, passes
+   * them on to the next preprocessor and starts the next batch if the
+   * current one is complete.
+   */
+  void finishItems( const QList< qlonglong > &ids );
 
 private Q_SLOTS:
 
+  /**
+   * Evaluates the introspection data requested in init() to find
+   * out whether the preprocessor supports batches.
+   */
+  void introspectionFinished( QDBusPendingCallWatcher *watcher );
+
   /**
    * This is invoked to signal that the processing of the current (head)
    * item has terminated and the next item should be processed.
    */
   void itemProcessed( qlonglong id );
 
+  /**
+   * This is invoked by preprocessors that support batches to signal
+   * that the processing of some of the current items has terminated.
+   * The next batch is started once all the items have been reported.
+   */
+  void itemsProcessed( const QList< qlonglong > &ids );
+
 }; // class PreprocessorInstance
 
 } // namespace Server
@@ -27,12 +27,16 @@
 
 #include "entities.h" // Akonadi::Server::PimItem
 #include "storage/datastore.h"
+#include "storage/transaction.h"
 #include "tracer.h"
 #include "collectionreferencemanager.h"
 
 #include "preprocessormanageradaptor.h"
 
+#include <akstandarddirs.h>
+
 #include <QtCore/QDebug>
+#include <QtCore/QSettings>
 
 namespace Akonadi {
 namespace Server {
@@ -50,6 +54,9 @@ const int gMaximumItemProcessingTimeInSecs = 180;
 // we assume it's dead and just drop it's interface.
 const int gDeadlineItemProcessingTimeInSecs = 240;
 
+// Preprocessors supporting batches get up to this many items at once
+const int gDefaultBatchSize = 50;
+
 } // namespace Server
 } // namespace Akonadi
 
@@ -61,9 +68,17 @@ PreprocessorManager *PreprocessorManager::mSelf = NULL;
 PreprocessorManager::PreprocessorManager()
   : QObject()
   , mEnabled( true )
-  , mMutex( new QMutex() )
+  , mMutex( new QMutex( QMutex::Recursive ) )
+  , mAverageLatency( -1 )
+  , mProcessedItems( 0 )
 {
   mSelf = this; // just to have it set early
+
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mBatchSize = qMax( 1, settings.value( QLatin1String( "Preprocessing/BatchSize" ), gDefaultBatchSize ).toInt() );
+
+  mClock.start();
+
   // Hook in our D-Bus interface "shell".
   new PreprocessorManagerAdaptor( this );
 
@@ -183,6 +198,11 @@ void PreprocessorManager::lockedUnregisterInstance( const QString &id )
   std::deque< qint64 > *itemList = instance->itemQueue();
   Q_ASSERT( itemList );
 
+  QList< qint64 > itemIds;
+  Q_FOREACH ( qint64 itemId, *itemList ) {
+    itemIds << itemId;
+  }
+
   int idx = mPreprocessorChain.indexOf( instance );
   Q_ASSERT( idx >= 0 ); // must be there!
 
@@ -192,18 +212,19 @@ void PreprocessorManager::lockedUnregisterInstance( const QString &id )
     Q_ASSERT( nextPreprocessor );
     Q_ASSERT( nextPreprocessor != instance );
 
-    Q_FOREACH ( qint64 itemId, *itemList ) {
-      nextPreprocessor->enqueueItem( itemId );
-    }
+    // Take the instance out of the chain first, the next one might report
+    // items back right away.
+    mPreprocessorChain.removeOne( instance );
+    delete instance;
+
+    nextPreprocessor->enqueueItems( itemIds );
   } else {
     // This was the last preprocessor: end handling the items
-    Q_FOREACH ( qint64 itemId, *itemList ) {
-      lockedEndHandleItem( itemId );
-    }
-  }
+    mPreprocessorChain.removeOne( instance );
+    delete instance;
 
-  mPreprocessorChain.removeOne( instance );
-  delete instance;
+    lockedEndHandleItems( itemIds );
+  }
 }
 
 void PreprocessorManager::beginHandleItem( const PimItem &item, const DataStore *dataStore )
@@ -223,7 +244,7 @@ void PreprocessorManager::beginHandleItem( const PimItem &item, const DataStore
 
     qWarning() << "PreprocessorManager::beginHandleItem(" << item.id() << ") called with a disabled preprocessor";
 
-    lockedEndHandleItem( item.id() );
+    lockedEndHandleItems( QList< qint64 >() << item.id() );
     return;
   }
 
@@ -234,7 +255,7 @@ void PreprocessorManager::beginHandleItem( const PimItem &item, const DataStore
 
   if ( mPreprocessorChain.isEmpty() || CollectionReferenceManager::instance()->isReferenced( item.collectionId() ) ) {
     // No preprocessors at all or referenced collection: immediately end handling the item.
-    lockedEndHandleItem( item.id() );
+    lockedEndHandleItems( QList< qint64 >() << item.id() );
     return;
   }
 
@@ -263,22 +284,26 @@ void PreprocessorManager::beginHandleItem( const PimItem &item, const DataStore
   }
 
   // The calling thread data store is NOT in a transaction: we can proceed directly.
-  lockedActivateFirstPreprocessor( item.id() );
+  lockedActivateFirstPreprocessor( QList< qint64 >() << item.id() );
 }
 
-void PreprocessorManager::lockedActivateFirstPreprocessor( qint64 itemId )
+void PreprocessorManager::lockedActivateFirstPreprocessor( const QList< qint64 > &itemIds )
 {
+  const qint64 now = mClock.elapsed();
+  Q_FOREACH ( qint64 itemId, itemIds ) {
+    mItemStartTimes.insert( itemId, now );
+  }
+
   // Activate the first preprocessor.
   PreprocessorInstance *preProcessor = mPreprocessorChain.first();
   Q_ASSERT( preProcessor );
 
-  preProcessor->enqueueItem( itemId );
-  // The preprocessor will call our "preProcessorFinishedHandlingItem() method"
-  // when done with the item.
+  preProcessor->enqueueItems( itemIds );
+  // The preprocessor will call our "preProcessorFinishedHandlingItems() method"
+  // when done with the items.
   //
-  // The call should be asynchronous, that is it should never happen that
-  // preProcessorFinishedHandlingItem() is called from "inside" enqueueItem()...
-  // FIXME: Am I *really* sure of this ? If I'm wrong for some obscure reason then we have a deadlock.
+  // This may happen from "inside" enqueueItems() for items that vanished
+  // in the meantime, hence the recursive mutex.
 }
 
 void PreprocessorManager::lockedKillWaitQueue( const DataStore *dataStore, bool disconnectSlots )
@@ -336,15 +361,17 @@ void PreprocessorManager::dataStoreTransactionCommitted()
     return;
   }
 
+  QList< qint64 > itemIds;
+  Q_FOREACH ( qint64 id, *waitQueue ) {
+    itemIds << id;
+  }
+
   if ( !mEnabled || mPreprocessorChain.isEmpty() ) {
     // Preprocessing has been disabled in the meantime or all the preprocessors died
-    Q_FOREACH ( qint64 id, *waitQueue ) {
-      lockedEndHandleItem( id );
-    }
+    lockedEndHandleItems( itemIds );
   } else {
-    Q_FOREACH ( qint64 id, *waitQueue ) {
-      lockedActivateFirstPreprocessor( id );
-    }
+    // The whole transaction enters the chain at once
+    lockedActivateFirstPreprocessor( itemIds );
   }
 
   lockedKillWaitQueue( dataStore, true ); // disconnect slots this time
@@ -365,7 +392,7 @@ void PreprocessorManager::dataStoreTransactionRolledBack()
   lockedKillWaitQueue( dataStore, true ); // disconnect slots this time
 }
 
-void PreprocessorManager::preProcessorFinishedHandlingItem( PreprocessorInstance *preProcessor, qint64 itemId )
+void PreprocessorManager::preProcessorFinishedHandlingItems( PreprocessorInstance *preProcessor, const QList< qint64 > &itemIds )
 {
   QMutexLocker locker( mMutex );
 
@@ -378,47 +405,98 @@ void PreprocessorManager::preProcessorFinishedHandlingItem( PreprocessorInstance
     Q_ASSERT( nextPreprocessor );
     Q_ASSERT( nextPreprocessor != preProcessor );
 
-    nextPreprocessor->enqueueItem( itemId );
+    nextPreprocessor->enqueueItems( itemIds );
   } else {
-    // This was the last preprocessor: end handling the item.
-    lockedEndHandleItem( itemId );
+    // This was the last preprocessor: end handling the items.
+    lockedEndHandleItems( itemIds );
   }
 }
 
-void PreprocessorManager::lockedEndHandleItem( qint64 itemId )
+void PreprocessorManager::lockedEndHandleItems( const QList< qint64 > &itemIds )
 {
   // The exit point of the pre-processing chain.
 
-  // Refetch the PimItem, the Collection and the MimeType now: preprocessing might have changed them.
-  PimItem item = PimItem::retrieveById( itemId );
-  if ( !item.isValid() ) {
-    // HUM... the preprocessor killed the item ?
-    // ... or retrieveById() failed ?
-    // Well.. if the preprocessor killed the item then this might be actually OK (spam?).
-    akDebug() << "Invalid PIM item id '" << itemId << "' passed to preprocessing chain termination function";
-    return;
-  }
+  // Unhiding each item on its own would cost a commit per item.
+  Transaction transaction( DataStore::self() );
+
+  const qint64 now = mClock.elapsed();
+
+  Q_FOREACH ( qint64 itemId, itemIds ) {
+    const QHash< qint64, qint64 >::iterator it = mItemStartTimes.find( itemId );
+    if ( it != mItemStartTimes.end() ) {
+      const qint64 latency = now - it.value();
+      mAverageLatency = mAverageLatency < 0 ? latency : ( mAverageLatency * 7 + latency ) / 8;
+      ++mProcessedItems;
+      mItemStartTimes.erase( it );
+    }
+
+    // Refetch the PimItem, the Collection and the MimeType now: preprocessing might have changed them.
+    PimItem item = PimItem::retrieveById( itemId );
+    if ( !item.isValid() ) {
+      // HUM... the preprocessor killed the item ?
+      // ... or retrieveById() failed ?
+      // Well.. if the preprocessor killed the item then this might be actually OK (spam?).
+      akDebug() << "Invalid PIM item id '" << itemId << "' passed to preprocessing chain termination function";
+      continue;
+    }
 
 #if 0
-  if ( !item.hidden() ) {
-    // HUM... the item was already unhidden for some reason: we have nothing more to do here.
-    akDebug() << "The PIM item with id '" << itemId << "' reached the preprocessing chain termination function in unhidden state";
-    return;
-  }
+    if ( !item.hidden() ) {
+      // HUM... the item was already unhidden for some reason: we have nothing more to do here.
+      akDebug() << "The PIM item with id '" << itemId << "' reached the preprocessing chain termination function in unhidden state";
+      continue;
+    }
 #endif
 
-  if ( !DataStore::self()->unhidePimItem( item ) ) {
+    if ( !DataStore::self()->unhidePimItem( item ) ) {
+      Tracer::self()->warning(
+          QLatin1String( "PreprocessorManager" ),
+          QString::fromLatin1( "Failed to unhide the PIM item '%1': data is not lost but a server restart is required in order to unhide it" )
+            .arg( itemId ) );
+    }
+  }
+
+  if ( !transaction.commit() ) {
     Tracer::self()->warning(
         QLatin1String( "PreprocessorManager" ),
-        QString::fromLatin1( "Failed to unhide the PIM item '%1': data is not lost but a server restart is required in order to unhide it" )
-          .arg( itemId ) );
+        QString::fromLatin1( "Failed to unhide %1 PIM items: data is not lost but a server restart is required in order to unhide them" )
+          .arg( itemIds.count() ) );
   }
 }
 
+QVariantMap PreprocessorManager::statistics()
+{
+  QMutexLocker locker( mMutex );
+
+  int waitingItems = 0;
+  Q_FOREACH ( const std::deque< qint64 > *waitQueue, mTransactionWaitQueueHash ) {
+    waitingItems += waitQueue->size();
+  }
+
+  QVariantMap result;
+  result.insert( QLatin1String( "QueueDepth" ), mItemStartTimes.count() );
+  result.insert( QLatin1String( "WaitingItems" ), waitingItems );
+  result.insert( QLatin1String( "ProcessedItems" ), mProcessedItems );
+  result.insert( QLatin1String( "AverageLatency" ), mAverageLatency );
+
+  Q_FOREACH ( const PreprocessorInstance *instance, mPreprocessorChain ) {
+    const QString prefix = instance->id() + QLatin1Char( '/' );
+    result.insert( prefix + QLatin1String( "QueueDepth" ), instance->queueDepth() );
+    result.insert( prefix + QLatin1String( "ProcessedItems" ), instance->processedItems() );
+    result.insert( prefix + QLatin1String( "AverageLatency" ), instance->averageLatency() );
+  }
+
+  return result;
+}
+
 void PreprocessorManager::heartbeat()
 {
   QMutexLocker locker( mMutex );
 
+  if ( !mItemStartTimes.isEmpty() ) {
+    akDebug() << "PreprocessorManager:" << mItemStartTimes.count() << "items in the chain, average latency" << mAverageLatency << "ms";
+  }
+
   // Loop through the processor instances and check their current processing time.
 
   QList< PreprocessorInstance *> firedPreprocessors;
@@ -28,6 +28,8 @@
 #include <QtCore/QObject>
 #include <QtCore/QList>
 #include <QtCore/QHash>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QVariantMap>
 
 #include <deque>
 
@@ -48,6 +50,12 @@ class DataStore;
  *
  * This class takes care of synchronizing the preprocessor agents.
  *
+ * Every preprocessor has its own queue, so the chain works as a pipeline:
+ * while one preprocessor works on a batch of items the previous one can
+ * already work on the next batch. Preprocessors that implement
+ * beginProcessItems() get up to batchSize() items per D-Bus call, older
+ * ones get them one by one.
+ *
  * The preprocessors see the incoming PimItem objects before the user
  * can see them (as long as the UI applications honor the hidden attribute).
  * The items are marked as hidden (by the Append and AkAppend
@@ -115,12 +123,41 @@ protected:
    */
   bool mEnabled;
 
+  /**
+   * The maximum number of items passed to a preprocessor in a single call.
+   */
+  int mBatchSize;
+
   /**
    * The mutex used to protect the internals of this class  (mainly
-   * the mPreprocessorChain member).
+   * the mPreprocessorChain member). The PreprocessorInstance objects
+   * are protected by it too. It's recursive as an instance may call
+   * back into the manager while processing its queue.
    */
   QMutex *mMutex;
 
+  /**
+   * The time at that each item currently in the chain entered it,
+   * in milliseconds of mClock. Used for the latency statistics.
+   */
+  QHash< qint64, qint64 > mItemStartTimes;
+
+  /**
+   * The reference clock for mItemStartTimes.
+   */
+  QElapsedTimer mClock;
+
+  /**
+   * Running average of the time in milliseconds an item spends
+   * in the chain, -1 if no item went through the chain yet.
+   */
+  qint64 mAverageLatency;
+
+  /**
+   * The number of items that went through the whole chain.
+   */
+  qint64 mProcessedItems;
+
   /**
    * The heartbeat timer. Used mainly to expire preprocessor jobs.
    */
@@ -200,6 +237,15 @@ public:
     mEnabled = enabled;
   }
 
+  /**
+   * Returns the maximum number of items passed to a preprocessor in
+   * a single call. Configurable via Preprocessing/BatchSize.
+   */
+  int batchSize() const
+  {
+    return mBatchSize;
+  }
+
   /**
    * Trigger the preprocessor chain for the specified item.
    * The item should have been added to the Akonadi database via
@@ -232,15 +278,25 @@ public:
    */
   void unregisterInstance( const QString &id );
 
+  /**
+   * This is called via D-Bus to query the state of the preprocessor chain:
+   * the number of items in the chain, the number of items waiting for their
+   * transaction to be committed, the average time an item spends in the chain
+   * and the same values for every preprocessor.
+   *
+   * This function is thread-safe.
+   */
+  QVariantMap statistics();
+
 protected:
 
   /**
    * This is called by PreprocessorInstance to signal that a certain preprocessor has finished
-   * handling an item.
+   * handling some items.
    *
    * This function is thread-safe.
    */
-  void preProcessorFinishedHandlingItem( PreprocessorInstance *preProcessor, qint64 itemId );
+  void preProcessorFinishedHandlingItems( PreprocessorInstance *preProcessor, const QList< qint64 > &itemIds );
 
 private:
 
@@ -252,19 +308,20 @@ private:
   PreprocessorInstance *lockedFindInstance( const QString &id );
 
   /**
-   * Pushes the specified item to the first preprocessor.
+   * Pushes the specified items to the first preprocessor.
    * The caller *MUST* make sure that there is at least one preprocessor in the chain.
    */
-  void lockedActivateFirstPreprocessor( qint64 itemId );
+  void lockedActivateFirstPreprocessor( const QList< qint64 > &itemIds );
 
   /**
    * This is called internally to terminate the pre-processing
-   * chain for the specified Item. All the preprocessors have
-   * been triggered for it.
+   * chain for the specified Items. All the preprocessors have
+   * been triggered for them. The items are unhidden in
+   * a single transaction.
    *
    * This must be called with mMutex locked.
    */
-  void lockedEndHandleItem( qint64 itemId );
+  void lockedEndHandleItems( const QList< qint64 > &itemIds );
 
   /**
    * This is the unprotected core of the unregisterInstance() function above.
@@ -0,0 +1,1379 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "localsearchplugin.h"
+
+#include "akdebug.h"
+#include "entities.h"
+#include "libs/protocol_p.h"
+#include "storage/parthelper.h"
+#include "storage/querybuilder.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QTextCodec>
+#include <QtCore/QThread>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+
+#include <algorithm>
+#include <iterator>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+// Bumped whenever the schema or the way words are extracted changes
+static const qint64 IndexVersion = 2;
+
+// Only the beginning of large payloads (attachments, mostly) is indexed
+static const int MaximumPartSize = 1024 * 1024;
+static const int MaximumWordLength = 64;
+// Items read from the database at once, bounds both the number of bound
+// query parameters and the payload held in memory
+static const int ReadBatchSize = 100;
+
+// Search query conditions, see Akonadi::SearchTerm::Condition
+enum Condition {
+  Equal = 0,
+  GreaterOrEqual,
+  Greater,
+  Less,
+  LessOrEqual,
+  Contains
+};
+
+static const char *textFields[] = {
+  "subject", "from", "to", "cc", "bcc", "replyto", "organization", "listid",
+  "resentfrom", "xloop", "xmailinglist", "xspamflag", "headers", "body",
+  "name", "email", "nickname", "uid", "summary", "location", "organizer"
+};
+
+namespace {
+
+/**
+ * Just enough of a JSON parser to read serialized search queries.
+ */
+class JsonReader
+{
+  public:
+    explicit JsonReader( const QString &json )
+      : mJson( json )
+      , mPos( 0 )
+    {
+    }
+
+    bool read( QVariant &value )
+    {
+      return readValue( value ) && ( skipSpace(), mPos == mJson.size() );
+    }
+
+  private:
+    void skipSpace()
+    {
+      while ( mPos < mJson.size() && mJson.at( mPos ).isSpace() ) {
+        ++mPos;
+      }
+    }
+
+    bool accept( QChar c )
+    {
+      skipSpace();
+      if ( mPos < mJson.size() && mJson.at( mPos ) == c ) {
+        ++mPos;
+        return true;
+      }
+      return false;
+    }
+
+    bool readValue( QVariant &value )
+    {
+      skipSpace();
+      if ( mPos >= mJson.size() ) {
+        return false;
+      }
+
+      const QChar c = mJson.at( mPos );
+      if ( c == QLatin1Char( '{' ) ) {
+        return readObject( value );
+      } else if ( c == QLatin1Char( '[' ) ) {
+        return readArray( value );
+      } else if ( c == QLatin1Char( '"' ) ) {
+        QString str;
+        if ( !readString( str ) ) {
+          return false;
+        }
+        value = str;
+        return true;
+      } else if ( mJson.midRef( mPos, 4 ) == QLatin1String( "true" ) ) {
+        mPos += 4;
+        value = true;
+        return true;
+      } else if ( mJson.midRef( mPos, 5 ) == QLatin1String( "false" ) ) {
+        mPos += 5;
+        value = false;
+        return true;
+      } else if ( mJson.midRef( mPos, 4 ) == QLatin1String( "null" ) ) {
+        mPos += 4;
+        value = QVariant();
+        return true;
+      }
+      return readNumber( value );
+    }
+
+    bool readObject( QVariant &value )
+    {
+      QVariantMap map;
+      ++mPos;
+      if ( !accept( QLatin1Char( '}' ) ) ) {
+        do {
+          QString key;
+          QVariant member;
+          skipSpace();
+          if ( !readString( key ) || !accept( QLatin1Char( ':' ) ) || !readValue( member ) ) {
+            return false;
+          }
+          map.insert( key, member );
+        } while ( accept( QLatin1Char( ',' ) ) );
+        if ( !accept( QLatin1Char( '}' ) ) ) {
+          return false;
+        }
+      }
+      value = map;
+      return true;
+    }
+
+    bool readArray( QVariant &value )
+    {
+      QVariantList list;
+      ++mPos;
+      if ( !accept( QLatin1Char( ']' ) ) ) {
+        do {
+          QVariant element;
+          if ( !readValue( element ) ) {
+            return false;
+          }
+          list << element;
+        } while ( accept( QLatin1Char( ',' ) ) );
+        if ( !accept( QLatin1Char( ']' ) ) ) {
+          return false;
+        }
+      }
+      value = list;
+      return true;
+    }
+
+    bool readString( QString &str )
+    {
+      if ( mPos >= mJson.size() || mJson.at( mPos ) != QLatin1Char( '"' ) ) {
+        return false;
+      }
+      ++mPos;
+      while ( mPos < mJson.size() ) {
+        const QChar c = mJson.at( mPos++ );
+        if ( c == QLatin1Char( '"' ) ) {
+          return true;
+        } else if ( c != QLatin1Char( '\\' ) ) {
+          str += c;
+          continue;
+        }
+
+        if ( mPos >= mJson.size() ) {
+          return false;
+        }
+        const char escaped = mJson.at( mPos++ ).toLatin1();
+        switch ( escaped ) {
+        case 'b': str += QLatin1Char( '\b' ); break;
+        case 'f': str += QLatin1Char( '\f' ); break;
+        case 'n': str += QLatin1Char( '\n' ); break;
+        case 'r': str += QLatin1Char( '\r' ); break;
+        case 't': str += QLatin1Char( '\t' ); break;
+        case 'u': {
+          bool ok = false;
+          const ushort code = mJson.mid( mPos, 4 ).toUShort( &ok, 16 );
+          if ( !ok ) {
+            return false;
+          }
+          str += QChar( code );
+          mPos += 4;
+          break;
+        }
+        default:
+          str += QLatin1Char( escaped );
+        }
+      }
+      return false;
+    }
+
+    bool readNumber( QVariant &value )
+    {
+      const int start = mPos;
+      while ( mPos < mJson.size() ) {
+        const QChar c = mJson.at( mPos );
+        if ( !c.isDigit() && c != QLatin1Char( '-' ) && c != QLatin1Char( '+' )
+             && c != QLatin1Char( '.' ) && c != QLatin1Char( 'e' ) && c != QLatin1Char( 'E' ) ) {
+          break;
+        }
+        ++mPos;
+      }
+
+      const QString number = mJson.mid( start, mPos - start );
+      bool ok = false;
+      const qlonglong integer = number.toLongLong( &ok );
+      if ( ok ) {
+        value = integer;
+        return true;
+      }
+      const double real = number.toDouble( &ok );
+      value = real;
+      return ok;
+    }
+
+    const QString mJson;
+    int mPos;
+};
+
+/**
+ * What the index stores about an item besides its words.
+ */
+struct ItemRecord
+{
+  qint64 collectionId;
+  qint64 size;
+  QString mimeType;
+};
+
+}
+
+/**
+ * Splits @p text into lower-case words, which are added to @p words
+ * prefixed by @p field.
+ */
+static void addWords( const QByteArray &field, const QString &text, QSet<QByteArray> &words )
+{
+  const QString lower = text.toLower();
+  int start = -1;
+  for ( int i = 0; i <= lower.size(); ++i ) {
+    if ( i < lower.size() && lower.at( i ).isLetterOrNumber() ) {
+      if ( start < 0 ) {
+        start = i;
+      }
+      continue;
+    }
+    if ( start >= 0 ) {
+      words.insert( field + ':' + lower.mid( start, qMin( i - start, MaximumWordLength ) ).toUtf8() );
+      start = -1;
+    }
+  }
+}
+
+static QVector<QByteArray> splitWords( const QString &text )
+{
+  QSet<QByteArray> words;
+  addWords( QByteArray(), text, words );
+
+  QVector<QByteArray> result;
+  result.reserve( words.size() );
+  Q_FOREACH ( const QByteArray &word, words ) {
+    result << word.mid( 1 );
+  }
+  return result;
+}
+
+/**
+ * Decodes RFC 2047 encoded words in a header value.
+ */
+static QString decodeHeader( const QByteArray &value )
+{
+  QString result;
+  int pos = 0;
+  while ( pos < value.size() ) {
+    const int start = value.indexOf( "=?", pos );
+    const int charsetEnd = start < 0 ? -1 : value.indexOf( '?', start + 2 );
+    const int encodingEnd = charsetEnd < 0 ? -1 : value.indexOf( '?', charsetEnd + 1 );
+    const int end = encodingEnd < 0 ? -1 : value.indexOf( "?=", encodingEnd + 1 );
+    if ( end < 0 ) {
+      result += QString::fromUtf8( value.mid( pos ) );
+      break;
+    }
+
+    result += QString::fromUtf8( value.mid( pos, start - pos ) );
+    const QByteArray charset = value.mid( start + 2, charsetEnd - start - 2 );
+    const QByteArray encoding = value.mid( charsetEnd + 1, encodingEnd - charsetEnd - 1 ).toUpper();
+    QByteArray text = value.mid( encodingEnd + 1, end - encodingEnd - 1 );
+    if ( encoding == "B" ) {
+      text = QByteArray::fromBase64( text );
+    } else {
+      text.replace( '_', ' ' );
+      text = QByteArray::fromPercentEncoding( text, '=' );
+    }
+    QTextCodec *codec = QTextCodec::codecForName( charset );
+    result += codec ? codec->toUnicode( text ) : QString::fromLatin1( text );
+    pos = end + 2;
+  }
+  return result;
+}
+
+static QHash<QByteArray, QByteArray> headerFields()
+{
+  QHash<QByteArray, QByteArray> fieldForHeader;
+  fieldForHeader.insert( "subject", "subject" );
+  fieldForHeader.insert( "from", "from" );
+  fieldForHeader.insert( "to", "to" );
+  fieldForHeader.insert( "cc", "cc" );
+  fieldForHeader.insert( "bcc", "bcc" );
+  fieldForHeader.insert( "reply-to", "replyto" );
+  fieldForHeader.insert( "organization", "organization" );
+  fieldForHeader.insert( "list-id", "listid" );
+  fieldForHeader.insert( "resent-from", "resentfrom" );
+  fieldForHeader.insert( "x-loop", "xloop" );
+  fieldForHeader.insert( "x-mailing-list", "xmailinglist" );
+  fieldForHeader.insert( "x-spam-flag", "xspamflag" );
+  return fieldForHeader;
+}
+
+static void addHeaderWords( const QByteArray &name, const QByteArray &value, QSet<QByteArray> &words )
+{
+  // Items are indexed from all connection threads
+  static const QHash<QByteArray, QByteArray> fieldForHeader = headerFields();
+
+  const QString decoded = decodeHeader( value.trimmed() );
+  addWords( "headers", decoded, words );
+  const QByteArray field = fieldForHeader.value( name );
+  if ( !field.isEmpty() ) {
+    addWords( field, decoded, words );
+  }
+}
+
+static void addMessageWords( const QByteArray &data, bool withBody, QSet<QByteArray> &words )
+{
+  QByteArray name;
+  QByteArray value;
+  int pos = 0;
+  while ( pos <= data.size() ) {
+    int end = data.indexOf( '\n', pos );
+    if ( end < 0 ) {
+      end = data.size();
+    }
+    QByteArray line = data.mid( pos, end - pos );
+    if ( line.endsWith( '\r' ) ) {
+      line.chop( 1 );
+    }
+    pos = end + 1;
+
+    if ( !line.isEmpty() && ( line.at( 0 ) == ' ' || line.at( 0 ) == '\t' ) ) {
+      value += line;
+      continue;
+    }
+
+    if ( !name.isEmpty() ) {
+      addHeaderWords( name, value, words );
+      name.clear();
+    }
+
+    if ( line.isEmpty() ) {
+      break;
+    }
+    const int colon = line.indexOf( ':' );
+    if ( colon > 0 ) {
+      name = line.left( colon ).trimmed().toLower();
+      value = line.mid( colon + 1 );
+    }
+  }
+
+  if ( !name.isEmpty() ) {
+    addHeaderWords( name, value, words );
+  }
+
+  if ( withBody && pos < data.size() ) {
+    addWords( "body", QString::fromUtf8( data.mid( pos ) ), words );
+  }
+}
+
+/**
+ * Adds words of vCard and iCalendar properties.
+ */
+static QHash<QByteArray, QByteArray> propertyFields()
+{
+  QHash<QByteArray, QByteArray> fieldForProperty;
+  fieldForProperty.insert( "fn", "name" );
+  fieldForProperty.insert( "n", "name" );
+  fieldForProperty.insert( "email", "email" );
+  fieldForProperty.insert( "nickname", "nickname" );
+  fieldForProperty.insert( "uid", "uid" );
+  fieldForProperty.insert( "summary", "summary" );
+  fieldForProperty.insert( "location", "location" );
+  fieldForProperty.insert( "organizer", "organizer" );
+  fieldForProperty.insert( "attendee", "organizer" );
+  fieldForProperty.insert( "description", "body" );
+  fieldForProperty.insert( "note", "body" );
+  return fieldForProperty;
+}
+
+static void addDirectoryWords( const QByteArray &data, QSet<QByteArray> &words )
+{
+  static const QHash<QByteArray, QByteArray> fieldForProperty = propertyFields();
+
+  // Unfold continuation lines first
+  QByteArray unfolded = data;
+  unfolded.replace( "\r\n", "\n" );
+  unfolded.replace( "\n ", "" );
+  unfolded.replace( "\n\t", "" );
+
+  Q_FOREACH ( const QByteArray &line, unfolded.split( '\n' ) ) {
+    const int colon = line.indexOf( ':' );
+    if ( colon <= 0 ) {
+      continue;
+    }
+    int nameEnd = line.indexOf( ';' );
+    if ( nameEnd < 0 || nameEnd > colon ) {
+      nameEnd = colon;
+    }
+    QByteArray name = line.left( nameEnd ).toLower();
+    name = name.mid( name.lastIndexOf( '.' ) + 1 ); // drop vCard groups
+    const QByteArray field = fieldForProperty.value( name );
+    if ( field.isEmpty() ) {
+      continue;
+    }
+    // Parameters of people contain their names (CN=...)
+    const QByteArray value = ( field == "organizer" ) ? line.mid( nameEnd + 1 ) : line.mid( colon + 1 );
+    addWords( field, QString::fromUtf8( value ).replace( QLatin1String( "\\n" ), QLatin1String( " " ) ), words );
+  }
+}
+
+static void addPartWords( const QByteArray &partName, const QString &mimeType, const QByteArray &data, QSet<QByteArray> &words )
+{
+  if ( data.startsWith( "BEGIN:VCARD" ) || data.startsWith( "BEGIN:VCALENDAR" ) ) {
+    addDirectoryWords( data, words );
+  } else if ( partName == "RFC822" || partName == "HEAD" || mimeType == QLatin1String( "message/rfc822" ) ) {
+    addMessageWords( data, partName != "HEAD", words );
+  } else {
+    addWords( "body", QString::fromUtf8( data ), words );
+  }
+}
+
+static QVector<qint64> unite( const QVector<qint64> &a, const QVector<qint64> &b )
+{
+  if ( a.isEmpty() ) {
+    return b;
+  } else if ( b.isEmpty() ) {
+    return a;
+  }
+  QVector<qint64> result;
+  result.reserve( a.size() + b.size() );
+  std::set_union( a.constBegin(), a.constEnd(), b.constBegin(), b.constEnd(), std::back_inserter( result ) );
+  return result;
+}
+
+static QVector<qint64> intersect( const QVector<qint64> &a, const QVector<qint64> &b )
+{
+  QVector<qint64> result;
+  result.reserve( qMin( a.size(), b.size() ) );
+  std::set_intersection( a.constBegin(), a.constEnd(), b.constBegin(), b.constEnd(), std::back_inserter( result ) );
+  return result;
+}
+
+static QVector<qint64> subtract( const QVector<qint64> &a, const QVector<qint64> &b )
+{
+  QVector<qint64> result;
+  result.reserve( a.size() );
+  std::set_difference( a.constBegin(), a.constEnd(), b.constBegin(), b.constEnd(), std::back_inserter( result ) );
+  return result;
+}
+
+static QString placeholders( int count )
+{
+  QStringList list;
+  for ( int i = 0; i < count; ++i ) {
+    list << QLatin1String( "?" );
+  }
+  return list.join( QLatin1String( ", " ) );
+}
+
+static bool execQuery( QSqlQuery &query )
+{
+  if ( !query.exec() ) {
+    akError() << "Search index query" << query.lastQuery() << "failed:" << query.lastError().text();
+    return false;
+  }
+  return true;
+}
+
+static QVector<qint64> readIds( QSqlQuery &query )
+{
+  QVector<qint64> ids;
+  while ( query.next() ) {
+    ids << query.value( 0 ).toLongLong();
+  }
+  return ids;
+}
+
+static bool finishTransaction( QSqlDatabase &db, bool ok )
+{
+  if ( ok && db.commit() ) {
+    return true;
+  }
+  akError() << "Failed to update search index:" << db.lastError().text();
+  db.rollback();
+  return false;
+}
+
+static bool setInfo( const QSqlDatabase &db, const QString &name, qint64 value )
+{
+  QSqlQuery query( db );
+  query.prepare( QLatin1String( "INSERT OR REPLACE INTO Info (name, value) VALUES (?, ?)" ) );
+  query.addBindValue( name );
+  query.addBindValue( value );
+  return execQuery( query );
+}
+
+struct LocalSearchPlugin::Scope
+{
+  QList<qint64> collections;
+  QStringList mimeTypes;
+
+  bool isEmpty() const
+  {
+    return collections.isEmpty() && mimeTypes.isEmpty();
+  }
+
+  /**
+   * Returns the condition on the Documents table, the MIME types have to
+   * be bound with bindValues().
+   */
+  QString condition() const
+  {
+    QStringList conditions;
+    if ( !collections.isEmpty() ) {
+      // Searches can cover more collections than SQLite allows parameters
+      QStringList ids;
+      Q_FOREACH ( qint64 collection, collections ) {
+        ids << QString::number( collection );
+      }
+      conditions << QLatin1String( "collection IN (" ) + ids.join( QLatin1String( ", " ) ) + QLatin1Char( ')' );
+    }
+    if ( !mimeTypes.isEmpty() ) {
+      conditions << QLatin1String( "mimetype IN (" ) + placeholders( mimeTypes.size() ) + QLatin1Char( ')' );
+    }
+    return conditions.join( QLatin1String( " AND " ) );
+  }
+
+  void bindValues( QSqlQuery &query ) const
+  {
+    Q_FOREACH ( const QString &mimeType, mimeTypes ) {
+      query.addBindValue( mimeType );
+    }
+  }
+};
+
+LocalSearchPlugin::LocalSearchPlugin()
+  : mRebuildPosition( -1 )
+{
+}
+
+LocalSearchPlugin::~LocalSearchPlugin()
+{
+  removeConnections();
+}
+
+QSqlDatabase LocalSearchPlugin::database() const
+{
+  if ( mFileName.isEmpty() ) {
+    return QSqlDatabase();
+  }
+
+  // Connections may only be used by the thread that opened them
+  const QString name = mConnectionPrefix + QString::number( reinterpret_cast<quintptr>( QThread::currentThread() ) );
+  QMutexLocker locker( &mConnectionLock );
+  if ( mConnections.contains( name ) ) {
+    return QSqlDatabase::database( name );
+  }
+
+  const QString driver = QSqlDatabase::isDriverAvailable( QLatin1String( "QSQLITE3" ) ) ? QLatin1String( "QSQLITE3" )
+                                                                                       : QLatin1String( "QSQLITE" );
+  QSqlDatabase db = QSqlDatabase::addDatabase( driver, name );
+  db.setDatabaseName( mFileName );
+  if ( !db.open() ) {
+    akError() << "Failed to open search index" << mFileName << ":" << db.lastError().text();
+  }
+  mConnections.insert( name );
+  return db;
+}
+
+void LocalSearchPlugin::removeConnections()
+{
+  QMutexLocker locker( &mConnectionLock );
+  Q_FOREACH ( const QString &name, mConnections ) {
+    QSqlDatabase::removeDatabase( name );
+  }
+  mConnections.clear();
+}
+
+bool LocalSearchPlugin::open( const QString &fileName )
+{
+  mFileName = fileName;
+  mConnectionPrefix = QString::fromLatin1( "LocalSearchPlugin-%1-" ).arg( reinterpret_cast<quintptr>( this ) );
+
+  bool clean = false;
+  if ( !initDatabase( clean ) ) {
+    akError() << "Search index" << mFileName << "is damaged, rebuilding it";
+    removeConnections();
+    QFile::remove( mFileName );
+    if ( !initDatabase( clean ) ) {
+      akError() << "Failed to create search index" << mFileName;
+      removeConnections();
+      mFileName.clear();
+    }
+  }
+
+  if ( clean ) {
+    return true;
+  }
+  scheduleRebuild();
+  return false;
+}
+
+bool LocalSearchPlugin::initDatabase( bool &clean )
+{
+  clean = false;
+  QSqlDatabase db = database();
+  if ( !db.isOpen() ) {
+    return false;
+  }
+
+  QWriteLocker locker( &mIndexLock );
+  QSqlQuery query( db );
+  // Fails as well when the file is not an SQLite database
+  if ( !query.exec( QLatin1String( "CREATE TABLE IF NOT EXISTS Info (name TEXT PRIMARY KEY, value INTEGER)" ) )
+       || !query.exec( QLatin1String( "SELECT name, value FROM Info" ) ) ) {
+    return false;
+  }
+  QHash<QString, qint64> info;
+  while ( query.next() ) {
+    info.insert( query.value( 0 ).toString(), query.value( 1 ).toLongLong() );
+  }
+  query.finish();
+
+  if ( info.value( QLatin1String( "version" ), -1 ) != IndexVersion ) {
+    if ( !info.isEmpty() ) {
+      akError() << "Search index" << mFileName << "has unknown format, rebuilding it";
+    }
+    if ( !query.exec( QLatin1String( "DROP TABLE IF EXISTS Documents" ) )
+         || !query.exec( QLatin1String( "DROP TABLE IF EXISTS Postings" ) )
+         || !query.exec( QLatin1String( "DELETE FROM Info" ) ) ) {
+      return false;
+    }
+    info.clear();
+  }
+
+  static const char *schema[] = {
+    "CREATE TABLE IF NOT EXISTS Documents (id INTEGER PRIMARY KEY, collection INTEGER, size INTEGER, mimetype TEXT)",
+    // Terms are "field:word" in UTF-8, part is the payload part they come from
+    "CREATE TABLE IF NOT EXISTS Postings (term BLOB, item INTEGER, part BLOB)",
+    "CREATE INDEX IF NOT EXISTS PostingsTermIndex ON Postings (term, item)",
+    "CREATE INDEX IF NOT EXISTS PostingsItemIndex ON Postings (item)"
+  };
+  for ( uint i = 0; i < sizeof( schema ) / sizeof( *schema ); ++i ) {
+    if ( !query.exec( QLatin1String( schema[i] ) ) ) {
+      return false;
+    }
+  }
+
+  // Until close(), changes might be missing from the index
+  if ( !setInfo( db, QLatin1String( "version" ), IndexVersion ) || !setInfo( db, QLatin1String( "clean" ), 0 ) ) {
+    return false;
+  }
+
+  clean = info.value( QLatin1String( "clean" ) ) == 1;
+  if ( clean ) {
+    QMutexLocker pendingLocker( &mPendingLock );
+    mRebuildPosition = info.value( QLatin1String( "rebuildPosition" ), -1 );
+  }
+  return true;
+}
+
+bool LocalSearchPlugin::close()
+{
+  if ( mFileName.isEmpty() ) {
+    return false;
+  }
+
+  indexPending( -1 );
+
+  qint64 rebuildPosition;
+  bool complete;
+  {
+    QMutexLocker pendingLocker( &mPendingLock );
+    rebuildPosition = mRebuildPosition;
+    // Items that could not be read would be missing for good
+    complete = mPending.isEmpty();
+  }
+
+  bool ok = false;
+  if ( complete ) {
+    QWriteLocker indexLocker( &mIndexLock );
+    QSqlDatabase db = database();
+    ok = finishTransaction( db, db.transaction()
+                                && setInfo( db, QLatin1String( "rebuildPosition" ), rebuildPosition )
+                                && setInfo( db, QLatin1String( "clean" ), 1 ) );
+  }
+
+  removeConnections();
+  mFileName.clear();
+  return ok;
+}
+
+bool LocalSearchPlugin::queueNotifications( const NotificationMessageV3::List &notifications )
+{
+  QMutexLocker locker( &mPendingLock );
+  const int pending = mPending.size();
+  Q_FOREACH ( const NotificationMessageV3 &msg, notifications ) {
+    if ( msg.type() != NotificationMessageV2::Items ) {
+      continue;
+    }
+
+    PendingOperation op;
+    QSet<QByteArray> staleParts;
+    switch ( msg.operation() ) {
+    case NotificationMessageV2::Add:
+      op = ReindexItem;
+      break;
+    case NotificationMessageV2::Modify:
+      // Only payload changes affect the words, anything else at most the
+      // size of the item
+      Q_FOREACH ( const QByteArray &part, msg.itemParts() ) {
+        if ( part.startsWith( AKONADI_PARAM_PLD ) ) {
+          staleParts.insert( part.mid( 4 ) );
+        }
+      }
+      op = staleParts.isEmpty() ? UpdateItem : ReindexItem;
+      break;
+    case NotificationMessageV2::Move:
+      op = UpdateItem;
+      break;
+    case NotificationMessageV2::Remove:
+      op = RemoveItem;
+      break;
+    default:
+      continue;
+    }
+
+    Q_FOREACH ( NotificationMessageV2::Id id, msg.uids() ) {
+      QHash<qint64, PendingOperation>::iterator it = mPending.find( id );
+      if ( it == mPending.end() ) {
+        mPending.insert( id, op );
+      } else if ( op > *it ) {
+        // A move must not downgrade a pending reindex, and nothing
+        // can follow a removal
+        *it = op;
+      }
+      if ( !staleParts.isEmpty() ) {
+        mStaleParts[id] += staleParts;
+      }
+    }
+  }
+  return mPending.size() != pending || mRebuildPosition >= 0;
+}
+
+void LocalSearchPlugin::scheduleRebuild()
+{
+  QMutexLocker locker( &mPendingLock );
+  mRebuildPosition = 0;
+}
+
+QVector<qint64> LocalSearchPlugin::nextRebuildBatch( int count, qint64 &from, qint64 &to )
+{
+  QMutexLocker locker( &mPendingLock );
+  QVector<qint64> ids;
+  from = to = -1;
+  if ( mRebuildPosition < 0 ) {
+    return ids;
+  }
+
+  QueryBuilder qb( PimItem::tableName() );
+  qb.addColumn( PimItem::idColumn() );
+  qb.addValueCondition( PimItem::idColumn(), Query::Greater, mRebuildPosition );
+  qb.addSortColumn( PimItem::idColumn() );
+  qb.setLimit( count );
+  if ( !qb.exec() ) {
+    return ids;
+  }
+
+  while ( qb.query().next() ) {
+    ids << qb.query().value( 0 ).toLongLong();
+  }
+
+  from = mRebuildPosition;
+  if ( ids.isEmpty() ) {
+    akDebug() << "Search index rebuild finished";
+    mRebuildPosition = -1;
+  } else {
+    mRebuildPosition = to = ids.last();
+  }
+  return ids;
+}
+
+void LocalSearchPlugin::requeue( const QVector<qint64> &ids, PendingOperation op, const PartSets &staleParts )
+{
+  QMutexLocker locker( &mPendingLock );
+  Q_FOREACH ( qint64 id, ids ) {
+    QHash<qint64, PendingOperation>::iterator it = mPending.find( id );
+    if ( it == mPending.end() ) {
+      mPending.insert( id, op );
+    } else if ( op > *it ) {
+      *it = op;
+    }
+    const PartSets::const_iterator stale = staleParts.constFind( id );
+    if ( stale != staleParts.constEnd() ) {
+      mStaleParts[id] += *stale;
+    }
+  }
+}
+
+bool LocalSearchPlugin::isComplete() const
+{
+  QMutexLocker locker( &mPendingLock );
+  return mRebuildPosition < 0;
+}
+
+bool LocalSearchPlugin::indexPending( int count )
+{
+  int done = 0;
+  while ( count < 0 || done < count ) {
+    const int batchSize = count < 0 ? ReadBatchSize : qMin( ReadBatchSize, count - done );
+    QVector<qint64> updated, reindexed, removed;
+    PartSets staleParts;
+    {
+      QMutexLocker locker( &mPendingLock );
+      QHash<qint64, PendingOperation>::iterator it = mPending.begin();
+      for ( int i = 0; it != mPending.end() && i < batchSize; ++i ) {
+        switch ( *it ) {
+        case UpdateItem: updated << it.key(); break;
+        case ReindexItem: reindexed << it.key(); break;
+        case RemoveItem: removed << it.key(); break;
+        }
+        const PartSets::iterator stale = mStaleParts.find( it.key() );
+        if ( stale != mStaleParts.end() ) {
+          if ( *it == ReindexItem ) {
+            staleParts.insert( it.key(), *stale );
+          }
+          mStaleParts.erase( stale );
+        }
+        it = mPending.erase( it );
+      }
+    }
+
+    // Continue a running rebuild with whatever this batch left over
+    if ( count > 0 ) {
+      const int remaining = batchSize - updated.size() - reindexed.size() - removed.size();
+      if ( remaining > 0 ) {
+        qint64 from, to;
+        const QVector<qint64> rebuilt = nextRebuildBatch( remaining, from, to );
+        // Drop items removed while changes were not being indexed
+        if ( from >= 0 ) {
+          removeStaleDocuments( from, to, rebuilt );
+        }
+        reindexed += rebuilt;
+      }
+    }
+
+    const int batchCount = updated.size() + reindexed.size() + removed.size();
+    if ( batchCount == 0 ) {
+      break;
+    }
+    done += batchCount;
+
+    // Keep what could not be written or read for the next attempt, and
+    // don't retry right away
+    bool failed = false;
+    if ( !removed.isEmpty() ) {
+      QWriteLocker locker( &mIndexLock );
+      QSqlDatabase db = database();
+      bool ok = db.transaction();
+      Q_FOREACH ( qint64 id, removed ) {
+        ok = ok && removeDocument( db, id );
+      }
+      if ( !finishTransaction( db, ok ) ) {
+        requeue( removed, RemoveItem );
+        failed = true;
+      }
+    }
+    if ( !updated.isEmpty() && !readItems( updated, false, PartSets() ) ) {
+      requeue( updated, UpdateItem );
+      failed = true;
+    }
+    if ( !reindexed.isEmpty() && !readItems( reindexed, true, staleParts ) ) {
+      requeue( reindexed, ReindexItem, staleParts );
+      failed = true;
+    }
+    if ( failed ) {
+      break;
+    }
+  }
+
+  QMutexLocker locker( &mPendingLock );
+  return !mPending.isEmpty() || mRebuildPosition >= 0;
+}
+
+void LocalSearchPlugin::removeStaleDocuments( qint64 from, qint64 to, const QVector<qint64> &ids )
+{
+  QWriteLocker locker( &mIndexLock );
+  QSqlDatabase db = database();
+  if ( !db.isOpen() ) {
+    return;
+  }
+
+  Postings stale;
+  {
+    QSqlQuery query( db );
+    if ( to < 0 ) {
+      query.prepare( QLatin1String( "SELECT id FROM Documents WHERE id > ? ORDER BY id" ) );
+      query.addBindValue( from );
+    } else {
+      query.prepare( QLatin1String( "SELECT id FROM Documents WHERE id > ? AND id <= ? ORDER BY id" ) );
+      query.addBindValue( from );
+      query.addBindValue( to );
+    }
+    if ( !execQuery( query ) ) {
+      return;
+    }
+    stale = subtract( readIds( query ), ids );
+  }
+
+  if ( stale.isEmpty() ) {
+    return;
+  }
+  bool ok = db.transaction();
+  Q_FOREACH ( qint64 id, stale ) {
+    ok = ok && removeDocument( db, id );
+  }
+  finishTransaction( db, ok );
+}
+
+bool LocalSearchPlugin::readItems( const QVector<qint64> &ids, bool withContent, const PartSets &staleParts )
+{
+  QVariantList idList;
+  idList.reserve( ids.size() );
+  Q_FOREACH ( qint64 id, ids ) {
+    idList << id;
+  }
+
+  QueryBuilder itemQb( PimItem::tableName() );
+  itemQb.addJoin( QueryBuilder::InnerJoin, MimeType::tableName(), PimItem::mimeTypeIdFullColumnName(), MimeType::idFullColumnName() );
+  itemQb.addColumn( PimItem::idFullColumnName() );
+  itemQb.addColumn( PimItem::collectionIdFullColumnName() );
+  itemQb.addColumn( PimItem::sizeFullColumnName() );
+  itemQb.addColumn( MimeType::nameFullColumnName() );
+  itemQb.addValueCondition( PimItem::idFullColumnName(), Query::In, idList );
+  if ( !itemQb.exec() ) {
+    akError() << "Failed to read items for the search index";
+    return false;
+  }
+
+  QHash<qint64, ItemRecord> items;
+  while ( itemQb.query().next() ) {
+    ItemRecord &item = items[itemQb.query().value( 0 ).toLongLong()];
+    item.collectionId = itemQb.query().value( 1 ).toLongLong();
+    item.size = itemQb.query().value( 2 ).toLongLong();
+    item.mimeType = itemQb.query().value( 3 ).toString();
+  }
+
+  if ( !withContent ) {
+    QVector<qint64> unknown;
+    {
+      QWriteLocker locker( &mIndexLock );
+      QSqlDatabase db = database();
+      bool ok = db.transaction();
+      QSqlQuery query( db );
+      query.prepare( QLatin1String( "UPDATE Documents SET collection = ?, size = ? WHERE id = ?" ) );
+      Q_FOREACH ( qint64 id, ids ) {
+        const QHash<qint64, ItemRecord>::const_iterator it = items.constFind( id );
+        if ( !ok ) {
+          break;
+        } else if ( it == items.constEnd() ) {
+          ok = removeDocument( db, id );
+          continue;
+        }
+        query.bindValue( 0, it->collectionId );
+        query.bindValue( 1, it->size );
+        query.bindValue( 2, id );
+        ok = execQuery( query );
+        if ( ok && query.numRowsAffected() == 0 ) {
+          unknown << id;
+        }
+      }
+      if ( !finishTransaction( db, ok ) ) {
+        return false;
+      }
+    }
+    return unknown.isEmpty() || readItems( unknown, true, PartSets() );
+  }
+
+  QueryBuilder partQb( Part::tableName() );
+  partQb.setForwardOnly( true );
+  partQb.addJoin( QueryBuilder::InnerJoin, PartType::tableName(), Part::partTypeIdFullColumnName(), PartType::idFullColumnName() );
+  partQb.addColumn( Part::pimItemIdFullColumnName() );
+  partQb.addColumn( PartType::nameFullColumnName() );
+  partQb.addColumn( Part::dataFullColumnName() );
+  partQb.addColumn( Part::externalFullColumnName() );
+  partQb.addValueCondition( Part::pimItemIdFullColumnName(), Query::In, idList );
+  partQb.addValueCondition( PartType::nsFullColumnName(), Query::Equals, QLatin1String( "PLD" ) );
+  if ( !partQb.exec() ) {
+    akError() << "Failed to read item parts for the search index";
+    return false;
+  }
+
+  QHash<qint64, QHash<QByteArray, QByteArray> > parts;
+  PartSets uncachedParts;
+  while ( partQb.query().next() ) {
+    const qint64 id = partQb.query().value( 0 ).toLongLong();
+    const QByteArray name = partQb.query().value( 1 ).toString().toLatin1();
+    if ( partQb.query().value( 2 ).isNull() ) {
+      // Evicted from the cache, the words indexed before are still valid
+      // unless the part changed since
+      if ( !staleParts.value( id ).contains( name ) ) {
+        uncachedParts[id].insert( name );
+      }
+      continue;
+    }
+    const QByteArray data = PartHelper::translateData( partQb.query().value( 2 ).toByteArray(),
+                                                       partQb.query().value( 3 ).toBool() );
+    parts[id].insert( name, data.left( MaximumPartSize ) );
+  }
+
+  QWriteLocker locker( &mIndexLock );
+  QSqlDatabase db = database();
+  bool ok = db.transaction();
+  Q_FOREACH ( qint64 id, ids ) {
+    if ( !ok ) {
+      break;
+    }
+    const QHash<qint64, ItemRecord>::const_iterator it = items.constFind( id );
+    if ( it == items.constEnd() ) {
+      ok = removeDocument( db, id );
+    } else {
+      ok = storeDocument( db, id, it->collectionId, it->mimeType, it->size, parts.value( id ), uncachedParts.value( id ) );
+    }
+  }
+  return finishTransaction( db, ok );
+}
+
+void LocalSearchPlugin::indexItem( qint64 id, qint64 collectionId, const QString &mimeType, qint64 size,
+                                   const QHash<QByteArray, QByteArray> &parts, const QSet<QByteArray> &keptParts )
+{
+  QWriteLocker locker( &mIndexLock );
+  QSqlDatabase db = database();
+  if ( db.isOpen() ) {
+    finishTransaction( db, db.transaction() && storeDocument( db, id, collectionId, mimeType, size, parts, keptParts ) );
+  }
+}
+
+void LocalSearchPlugin::removeItem( qint64 id )
+{
+  QWriteLocker locker( &mIndexLock );
+  QSqlDatabase db = database();
+  if ( db.isOpen() ) {
+    finishTransaction( db, db.transaction() && removeDocument( db, id ) );
+  }
+}
+
+bool LocalSearchPlugin::storeDocument( QSqlDatabase &db, qint64 id, qint64 collectionId, const QString &mimeType, qint64 size,
+                                       const QHash<QByteArray, QByteArray> &parts, const QSet<QByteArray> &keptParts )
+{
+  QSqlQuery query( db );
+  query.prepare( QLatin1String( "INSERT OR REPLACE INTO Documents (id, collection, size, mimetype) VALUES (?, ?, ?, ?)" ) );
+  query.addBindValue( id );
+  query.addBindValue( collectionId );
+  query.addBindValue( size );
+  query.addBindValue( mimeType );
+  if ( !execQuery( query ) ) {
+    return false;
+  }
+
+  QString sql = QLatin1String( "DELETE FROM Postings WHERE item = ?" );
+  if ( !keptParts.isEmpty() ) {
+    sql += QLatin1String( " AND part NOT IN (" ) + placeholders( keptParts.size() ) + QLatin1Char( ')' );
+  }
+  query.prepare( sql );
+  query.addBindValue( id );
+  Q_FOREACH ( const QByteArray &part, keptParts ) {
+    query.addBindValue( part );
+  }
+  if ( !execQuery( query ) ) {
+    return false;
+  }
+
+  query.prepare( QLatin1String( "INSERT INTO Postings (term, item, part) VALUES (?, ?, ?)" ) );
+  QHash<QByteArray, QByteArray>::const_iterator it = parts.constBegin();
+  for ( ; it != parts.constEnd(); ++it ) {
+    if ( keptParts.contains( it.key() ) ) {
+      continue;
+    }
+    QSet<QByteArray> words;
+    addPartWords( it.key(), mimeType, it.value(), words );
+    Q_FOREACH ( const QByteArray &word, words ) {
+      query.bindValue( 0, word );
+      query.bindValue( 1, id );
+      query.bindValue( 2, it.key() );
+      if ( !execQuery( query ) ) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool LocalSearchPlugin::removeDocument( QSqlDatabase &db, qint64 id )
+{
+  QSqlQuery query( db );
+  query.prepare( QLatin1String( "DELETE FROM Postings WHERE item = ?" ) );
+  query.addBindValue( id );
+  if ( !execQuery( query ) ) {
+    return false;
+  }
+  query.prepare( QLatin1String( "DELETE FROM Documents WHERE id = ?" ) );
+  query.addBindValue( id );
+  return execQuery( query );
+}
+
+int LocalSearchPlugin::itemCount() const
+{
+  QReadLocker locker( &mIndexLock );
+  QSqlQuery query( database() );
+  if ( !query.exec( QLatin1String( "SELECT COUNT(*) FROM Documents" ) ) || !query.next() ) {
+    return 0;
+  }
+  return query.value( 0 ).toInt();
+}
+
+int LocalSearchPlugin::termCount() const
+{
+  QReadLocker locker( &mIndexLock );
+  QSqlQuery query( database() );
+  if ( !query.exec( QLatin1String( "SELECT COUNT(DISTINCT term) FROM Postings" ) ) || !query.next() ) {
+    return 0;
+  }
+  return query.value( 0 ).toInt();
+}
+
+LocalSearchPlugin::Postings LocalSearchPlugin::lookup( const QSqlDatabase &db, const QByteArray &field, const QByteArray &word, bool prefix ) const
+{
+  const QByteArray term = field + ':' + word;
+  QSqlQuery query( db );
+  if ( prefix ) {
+    // UTF-8 never contains 0xff, so this covers all terms starting with
+    // the prefix
+    query.prepare( QLatin1String( "SELECT DISTINCT item FROM Postings WHERE term >= ? AND term < ? ORDER BY item" ) );
+    query.addBindValue( term );
+    query.addBindValue( QByteArray( term + '\xff' ) );
+  } else {
+    query.prepare( QLatin1String( "SELECT DISTINCT item FROM Postings WHERE term = ? ORDER BY item" ) );
+    query.addBindValue( term );
+  }
+  if ( !execQuery( query ) ) {
+    return Postings();
+  }
+  return readIds( query );
+}
+
+LocalSearchPlugin::Postings LocalSearchPlugin::allDocuments( const QSqlDatabase &db, const Scope &scope ) const
+{
+  QString sql = QLatin1String( "SELECT id FROM Documents" );
+  if ( !scope.isEmpty() ) {
+    sql += QLatin1String( " WHERE " ) + scope.condition();
+  }
+  sql += QLatin1String( " ORDER BY id" );
+
+  QSqlQuery query( db );
+  query.prepare( sql );
+  scope.bindValues( query );
+  if ( !execQuery( query ) ) {
+    return Postings();
+  }
+  return readIds( query );
+}
+
+LocalSearchPlugin::Postings LocalSearchPlugin::evaluateLeaf( const QSqlDatabase &db, const QString &key, const QString &value, int condition ) const
+{
+  Postings result;
+
+  if ( key == QLatin1String( "size" ) ) {
+    bool ok = false;
+    const qint64 size = value.toLongLong( &ok );
+    if ( !ok ) {
+      return result;
+    }
+    const char *op;
+    switch ( condition ) {
+    case GreaterOrEqual: op = ">="; break;
+    case Greater: op = ">"; break;
+    case Less: op = "<"; break;
+    case LessOrEqual: op = "<="; break;
+    default: op = "="; break;
+    }
+    QSqlQuery query( db );
+    query.prepare( QString::fromLatin1( "SELECT id FROM Documents WHERE size %1 ? ORDER BY id" ).arg( QLatin1String( op ) ) );
+    query.addBindValue( size );
+    if ( execQuery( query ) ) {
+      result = readIds( query );
+    }
+    return result;
+  }
+
+  QList<QByteArray> fields;
+  if ( key.isEmpty() || key == QLatin1String( "all" ) || key == QLatin1String( "message" ) ) {
+    for ( uint i = 0; i < sizeof( textFields ) / sizeof( *textFields ); ++i ) {
+      fields << QByteArray( textFields[i] );
+    }
+  } else {
+    for ( uint i = 0; i < sizeof( textFields ) / sizeof( *textFields ); ++i ) {
+      if ( key == QLatin1String( textFields[i] ) ) {
+        fields << QByteArray( textFields[i] );
+        break;
+      }
+    }
+  }
+
+  const QVector<QByteArray> words = splitWords( value );
+  if ( fields.isEmpty() || words.isEmpty() ) {
+    return result;
+  }
+
+  // All words have to match, but each of them in any of the fields
+  for ( int i = 0; i < words.size(); ++i ) {
+    Postings matches;
+    Q_FOREACH ( const QByteArray &field, fields ) {
+      matches = unite( matches, lookup( db, field, words.at( i ), condition == Contains ) );
+    }
+    result = ( i == 0 ) ? matches : intersect( result, matches );
+    if ( result.isEmpty() ) {
+      break;
+    }
+  }
+  return result;
+}
+
+LocalSearchPlugin::Postings LocalSearchPlugin::evaluate( const QSqlDatabase &db, const QVariantMap &term, const Scope &scope ) const
+{
+  Postings result;
+
+  const QVariantList subTerms = term.value( QLatin1String( "subTerms" ) ).toList();
+  if ( subTerms.isEmpty() ) {
+    if ( term.contains( QLatin1String( "key" ) ) ) {
+      result = evaluateLeaf( db, term.value( QLatin1String( "key" ) ).toString(),
+                             term.value( QLatin1String( "value" ) ).toString(),
+                             term.value( QLatin1String( "cond" ) ).toInt() );
+    }
+  } else {
+    const bool matchAll = term.value( QLatin1String( "rel" ) ).toInt() == 0;
+    for ( int i = 0; i < subTerms.size(); ++i ) {
+      const Postings matches = evaluate( db, subTerms.at( i ).toMap(), scope );
+      if ( i == 0 ) {
+        result = matches;
+      } else {
+        result = matchAll ? intersect( result, matches ) : unite( result, matches );
+      }
+      if ( matchAll && result.isEmpty() ) {
+        break;
+      }
+    }
+  }
+
+  if ( term.value( QLatin1String( "negated" ) ).toBool() ) {
+    result = subtract( allDocuments( db, scope ), result );
+  }
+  return result;
+}
+
+static bool parseQuery( const QString &query, QVariantMap &root )
+{
+  QVariant value;
+  if ( !JsonReader( query ).read( value ) || value.type() != QVariant::Map ) {
+    akDebug() << "Local search: unsupported query" << query;
+    return false;
+  }
+  root = value.toMap();
+  return true;
+}
+
+QSet<qint64> LocalSearchPlugin::search( const QString &query, const QList<qint64> &collections, const QStringList &mimeTypes )
+{
+  QSet<qint64> results;
+
+  QVariantMap root;
+  if ( !parseQuery( query, root ) ) {
+    return results;
+  }
+
+  // Bring the index up to date with recent changes
+  indexPending( -1 );
+
+  Scope scope;
+  scope.collections = collections;
+  scope.mimeTypes = mimeTypes;
+
+  QReadLocker locker( &mIndexLock );
+  const QSqlDatabase db = database();
+  if ( !db.isOpen() ) {
+    return results;
+  }
+  Postings matches = evaluate( db, root, scope );
+  if ( !scope.isEmpty() && !matches.isEmpty() ) {
+    matches = intersect( matches, allDocuments( db, scope ) );
+  }
+
+  int limit = root.value( QLatin1String( "limit" ), -1 ).toInt();
+  if ( limit <= 0 ) {
+    limit = matches.size();
+  }
+
+  // Return the newest items when the result is limited
+  results.reserve( qMin( limit, matches.size() ) );
+  for ( int i = matches.size() - 1; i >= 0 && results.size() < limit; --i ) {
+    results.insert( matches.at( i ) );
+  }
+  return results;
+}
+
+bool LocalSearchPlugin::match( const QString &query, const QList<qint64> &collections, const QStringList &mimeTypes,
+                               const QVector<qint64> &items, QSet<qint64> &matches )
+{
+  QVariantMap root;
+  if ( !parseQuery( query, root ) || root.value( QLatin1String( "limit" ), -1 ).toInt() > 0 ) {
+    return false;
+  }
+
+  indexPending( -1 );
+
+  Scope scope;
+  scope.collections = collections;
+  scope.mimeTypes = mimeTypes;
+
+  QReadLocker locker( &mIndexLock );
+  const QSqlDatabase db = database();
+  if ( !db.isOpen() ) {
+    return true;
+  }
+  Postings results = intersect( evaluate( db, root, scope ), items );
+  if ( !scope.isEmpty() && !results.isEmpty() ) {
+    results = intersect( results, allDocuments( db, scope ) );
+  }
+  Q_FOREACH ( qint64 id, results ) {
+    matches.insert( id );
+  }
+  return true;
+}
@@ -0,0 +1,189 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_LOCALSEARCHPLUGIN_H
+#define AKONADI_LOCALSEARCHPLUGIN_H
+
+#include "abstractsearchplugin.h"
+
+#include <libs/notificationmessagev3_p.h>
+
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+#include <QtCore/QVariant>
+#include <QtCore/QVector>
+#include <QtSql/QSqlDatabase>
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * Search plugin backed by an inverted index built into the server.
+ *
+ * The index maps every word of the payload parts of an item to the sorted
+ * list of items containing it, separately for each field of the search
+ * query format (subject, from, body, ...). Mails, contacts and incidences
+ * are split into these fields from their RFC 822, vCard and iCalendar
+ * payloads, anything else is indexed as body text.
+ *
+ * The index is kept in a separate SQLite database and updated in place, so
+ * that it neither has to fit into memory nor to be written out as a whole.
+ * Words are stored per payload part: when a part has been evicted from the
+ * cache, its words stay in the index until the part changes.
+ *
+ * Changes are queued from item notifications and indexed in batches by
+ * indexPending(), which reads the items from the database of the calling
+ * thread; search() indexes all queued changes first, so that results never
+ * lag behind. Changes still queued are lost when the server does not shut
+ * down cleanly, so all items are reindexed in the background after that,
+ * as well as when there is no usable index file.
+ *
+ * Queries are the JSON serialization of Akonadi::SearchQuery: a tree of
+ * terms with "rel" (0 = and, 1 = or) and "subTerms", leaves with "key",
+ * "value" and "cond" (0 = equal, 5 = contains), all of them with optional
+ * "negated", and an optional "limit" at the root. Equal matches whole
+ * words, contains matches word prefixes. The "size" key compares against
+ * the item size, unknown keys do not match anything.
+ *
+ * The plugin is not enabled by default, add "Local" to Search/Manager in
+ * the server configuration to use it.
+ *
+ * All methods are thread-safe.
+ */
+class LocalSearchPlugin : public AbstractSearchPlugin
+{
+  public:
+    LocalSearchPlugin();
+    ~LocalSearchPlugin();
+
+    /**
+     * Opens the index in @p fileName. When the file does not exist, is
+     * damaged or was not closed properly, a full rebuild is scheduled.
+     * @returns @c false when a rebuild is needed
+     */
+    bool open( const QString &fileName );
+
+    /**
+     * Indexes all queued changes and marks the index as complete, so that
+     * the next open() does not need to rebuild it.
+     */
+    bool close();
+
+    /**
+     * Queues items affected by @p notifications for reindexing.
+     * @returns @c true when there is something to index
+     */
+    bool queueNotifications( const NotificationMessageV3::List &notifications );
+
+    /**
+     * Schedules indexing of all items in the database.
+     */
+    void scheduleRebuild();
+
+    /**
+     * Indexes up to @p count queued items, or all of them if @p count is
+     * negative. A positive @p count not used up by queued items continues
+     * a running rebuild. Items are read in small batches, those that could
+     * not be read stay queued.
+     * @returns @c true when there is more work left
+     */
+    bool indexPending( int count );
+
+    /**
+     * Returns whether the index covers all items, i.e. no rebuild is
+     * running. Search results are incomplete until then.
+     */
+    bool isComplete() const;
+
+    /**
+     * Adds item @p id to the index, replacing any previous content.
+     * @param parts payload parts, by part name without namespace
+     * @param keptParts parts whose payload is not available, their words
+     *        stay in the index as they are
+     */
+    void indexItem( qint64 id, qint64 collectionId, const QString &mimeType, qint64 size,
+                    const QHash<QByteArray, QByteArray> &parts,
+                    const QSet<QByteArray> &keptParts = QSet<QByteArray>() );
+    void removeItem( qint64 id );
+
+    int itemCount() const;
+    int termCount() const;
+
+    virtual QSet<qint64> search( const QString &query, const QList<qint64> &collections, const QStringList &mimeTypes );
+
+    /**
+     * Evaluates @p query only for @p items, which is what keeping a
+     * persistent search up to date needs.
+     * @param items sorted item IDs
+     * @param matches the subset of @p items matching the query
+     * @returns @c false when the query is invalid or limits the number of
+     *          results, so that it can only be evaluated as a whole
+     */
+    bool match( const QString &query, const QList<qint64> &collections, const QStringList &mimeTypes,
+                const QVector<qint64> &items, QSet<qint64> &matches );
+
+  private:
+    enum PendingOperation {
+      UpdateItem,
+      ReindexItem,
+      RemoveItem
+    };
+
+    struct Scope;
+
+    typedef QVector<qint64> Postings;
+    typedef QHash<qint64, QSet<QByteArray> > PartSets;
+
+    QSqlDatabase database() const;
+    bool initDatabase( bool &clean );
+    void removeConnections();
+    bool storeDocument( QSqlDatabase &db, qint64 id, qint64 collectionId, const QString &mimeType, qint64 size,
+                        const QHash<QByteArray, QByteArray> &parts, const QSet<QByteArray> &keptParts );
+    bool removeDocument( QSqlDatabase &db, qint64 id );
+    void removeStaleDocuments( qint64 from, qint64 to, const QVector<qint64> &ids );
+    Postings evaluate( const QSqlDatabase &db, const QVariantMap &term, const Scope &scope ) const;
+    Postings evaluateLeaf( const QSqlDatabase &db, const QString &key, const QString &value, int condition ) const;
+    Postings lookup( const QSqlDatabase &db, const QByteArray &field, const QByteArray &word, bool prefix ) const;
+    Postings allDocuments( const QSqlDatabase &db, const Scope &scope ) const;
+    bool readItems( const QVector<qint64> &ids, bool withContent, const PartSets &staleParts );
+    void requeue( const QVector<qint64> &ids, PendingOperation op, const PartSets &staleParts = PartSets() );
+    QVector<qint64> nextRebuildBatch( int count, qint64 &from, qint64 &to );
+
+    QString mFileName;
+    QString mConnectionPrefix;
+    mutable QMutex mConnectionLock;
+    mutable QSet<QString> mConnections;
+
+    mutable QReadWriteLock mIndexLock;
+
+    mutable QMutex mPendingLock;
+    QHash<qint64, PendingOperation> mPending;
+    // Payload parts changed since they were indexed, their words must not
+    // be kept when the new payload is not in the cache
+    PartSets mStaleParts;
+    qint64 mRebuildPosition;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -24,6 +24,7 @@
 
 #include "akdebug.h"
 #include "agentsearchengine.h"
+#include "localsearchplugin.h"
 #include "nepomuksearchengine.h"
 #include "notificationmanager.h"
 #include "dbusconnectionpool.h"
@@ -36,6 +37,7 @@
 #include "searchhelper.h"
 #include "libs/xdgbasedirs_p.h"
 #include "libs/protocol_p.h"
+#include "akstandarddirs.h"
 
 
 #include <QDir>
@@ -73,8 +75,21 @@ void SearchManagerThread::run()
   delete manager;
 }
 
+// Number of items indexed at once in the background
+static const int IndexBatchSize = 200;
+
+// Seconds after which a persistent search is evaluated as a whole again
+// instead of only for changed items
+static const int FullUpdateInterval = 60 * 60;
+
+// Keeps IN lists and batch inserts within the limits of all database backends
+static const int MaximumBulkSize = 1000;
+
 SearchManager::SearchManager( QObject *parent )
   : QObject( parent )
+  , mLocalSearch( 0 )
+  , mSearchUpdateTimer( 0 )
+  , mIndexTimer( 0 )
 {
   qRegisterMetaType< QSet<qint64> >();
   qRegisterMetaType<Collection>();
@@ -96,6 +111,8 @@ void SearchManager::init(const QStringList& searchEngines)
 #endif
     } else if ( engineName == QLatin1String( "Agent" ) ) {
       mEngines.append( new AgentSearchEngine );
+    } else if ( engineName == QLatin1String( "Local" ) ) {
+      mLocalSearch = new LocalSearchPlugin;
     } else {
       akError() << "Unknown search engine type: " << engineName;
     }
@@ -117,10 +134,31 @@ void SearchManager::init(const QStringList& searchEngines)
   mSearchUpdateTimer->setSingleShot( true );
   connect( mSearchUpdateTimer, SIGNAL(timeout()),
            this, SLOT(searchUpdateTimeout()) );
+
+  if ( mLocalSearch ) {
+    // Index changes in batches, searches index everything still pending
+    // themselves
+    mIndexTimer = new QTimer( this );
+    mIndexTimer->setInterval( 1000 );
+    mIndexTimer->setSingleShot( true );
+    connect( mIndexTimer, SIGNAL(timeout()),
+             this, SLOT(indexTimeout()) );
+
+    if ( !mLocalSearch->open( AkStandardDirs::saveDir( "data" ) + QLatin1String( "/search_index" ) ) ) {
+      akDebug() << "Building local search index";
+    }
+    mPlugins << mLocalSearch;
+    // Continues an unfinished rebuild as well
+    mIndexTimer->start();
+  }
 }
 
 SearchManager::~SearchManager()
 {
+  if ( mLocalSearch ) {
+    mLocalSearch->close();
+    delete mLocalSearch;
+  }
   qDeleteAll( mEngines );
   DataStore::self()->close();
   sInstance = 0;
@@ -144,9 +182,54 @@ void SearchManager::unregisterInstance( const QString &id )
 
 QVector<AbstractSearchPlugin *> SearchManager::searchPlugins() const
 {
+  // A partial index would silently drop results
+  if ( mLocalSearch && !mLocalSearch->isComplete() ) {
+    QVector<AbstractSearchPlugin *> plugins = mPlugins;
+    plugins.remove( plugins.indexOf( mLocalSearch ) );
+    return plugins;
+  }
   return mPlugins;
 }
 
+void SearchManager::indexNotifications( const NotificationMessageV3::List &notifications )
+{
+  if ( !mLocalSearch ) {
+    return;
+  }
+
+  if ( mLocalSearch->queueNotifications( notifications ) && !mIndexTimer->isActive() ) {
+    QMetaObject::invokeMethod( mIndexTimer, "start", Qt::QueuedConnection );
+  }
+
+  // Remember changed items for the next incremental update of persistent searches
+  QMutexLocker locker( &mLock );
+  Q_FOREACH ( const NotificationMessageV3 &msg, notifications ) {
+    if ( msg.type() != NotificationMessageV2::Items
+         || msg.operation() == NotificationMessageV2::Link
+         || msg.operation() == NotificationMessageV2::Unlink ) {
+      continue;
+    }
+    Q_FOREACH ( NotificationMessageV2::Id id, msg.uids() ) {
+      mChangedItems.insert( id );
+    }
+  }
+}
+
+void SearchManager::indexTimeout()
+{
+  const bool rebuilding = !mLocalSearch->isComplete();
+  if ( mLocalSearch->indexPending( IndexBatchSize ) ) {
+    mIndexTimer->start( 0 );
+  } else {
+    mIndexTimer->setInterval( 1000 );
+  }
+
+  // Persistent searches were not fully updated while the index was incomplete
+  if ( rebuilding && mLocalSearch->isComplete() ) {
+    scheduleSearchUpdate();
+  }
+}
+
 void SearchManager::loadSearchPlugins()
 {
   QStringList loadedPlugins;
@@ -215,10 +298,23 @@ void SearchManager::scheduleSearchUpdate()
 
 void SearchManager::searchUpdateTimeout()
 {
+  QVector<qint64> changedItems;
+  {
+    QMutexLocker locker( &mLock );
+    changedItems.reserve( mChangedItems.size() );
+    Q_FOREACH ( qint64 id, mChangedItems ) {
+      changedItems << id;
+    }
+    mChangedItems.clear();
+  }
+  qSort( changedItems );
+
   // Get all search collections, that is subcollections of "Search", which always has ID 1
   const Collection::List collections = Collection::retrieveFiltered( Collection::parentIdFullColumnName(), 1 );
   Q_FOREACH ( const Collection &collection, collections ) {
-    updateSearchAsync( collection );
+    if ( !updateSearchIncremental( collection, changedItems ) ) {
+      updateSearchAsync( collection );
+    }
   }
 }
 
@@ -263,29 +359,26 @@ void SearchManager::updateSearch( const Collection &collection )
     cond->wakeAll(); \
   }
 
-void SearchManager::updateSearchImpl( const Collection &collection, QWaitCondition *cond )
+bool SearchManager::searchScope( const Collection &collection, QStringList &mimeTypes,
+                                 QVector<qint64> &collections, bool &remote ) const
 {
   if ( collection.queryString().size() >= 32768 ) {
     qWarning() << "The query is at least 32768 chars long, which is the maximum size supported by the akonadi db schema. The query is therefore most likely truncated and will not be executed.";
-    wakeUpCaller(cond);
-    return;
+    return false;
   }
   if ( collection.queryString().isEmpty() ) {
-    wakeUpCaller(cond);
-    return;
+    return false;
   }
 
   const QStringList queryAttributes = collection.queryAttributes().split( QLatin1Char (' ') );
-  const bool remoteSearch =  queryAttributes.contains( QLatin1String( AKONADI_PARAM_REMOTE ) );
+  remote = queryAttributes.contains( QLatin1String( AKONADI_PARAM_REMOTE ) );
   bool recursive = queryAttributes.contains( QLatin1String( AKONADI_PARAM_RECURSIVE ) );
 
-
-  QStringList queryMimeTypes;
   Q_FOREACH ( const MimeType &mt, collection.mimeTypes() ) {
-    queryMimeTypes << mt.name();
+    mimeTypes << mt.name();
   }
 
-  QVector<qint64> queryCollections, queryAncestors;
+  QVector<qint64> queryAncestors;
   if ( collection.queryCollections().isEmpty() ) {
       queryAncestors << 0;
       recursive = true;
@@ -296,18 +389,34 @@ void SearchManager::updateSearchImpl( const Collection &collection, QWaitConditi
   }
 
   if ( recursive ) {
-    queryCollections = SearchHelper::listCollectionsRecursive( queryAncestors, queryMimeTypes );
+    collections = SearchHelper::listCollectionsRecursive( queryAncestors, mimeTypes );
   } else {
-    queryCollections = queryAncestors;
+    collections = queryAncestors;
   }
 
   //This happens if we try to search a virtual collection in recursive mode (because virtual collections are excluded from listCollectionsRecursive)
-  if ( queryCollections.isEmpty() ) {
+  if ( collections.isEmpty() ) {
     akDebug() << "No collections to search, you're probably trying to search a virtual collection.";
+    return false;
+  }
+
+  return true;
+}
+
+void SearchManager::updateSearchImpl( const Collection &collection, QWaitCondition *cond )
+{
+  QStringList queryMimeTypes;
+  QVector<qint64> queryCollections;
+  bool remoteSearch = false;
+  if ( !searchScope( collection, queryMimeTypes, queryCollections, remoteSearch ) ) {
     wakeUpCaller(cond);
     return;
   }
 
+  // Without the complete index the results lack anything not indexed yet,
+  // so only add new results then
+  const bool indexComplete = !mLocalSearch || mLocalSearch->isComplete();
+
   // Query all plugins for search results
   SearchRequest request( "searchUpdate-" + QByteArray::number( QDateTime::currentDateTime().toTime_t() ) );
   request.setCollections( queryCollections );
@@ -322,6 +431,12 @@ void SearchManager::updateSearchImpl( const Collection &collection, QWaitConditi
 
   const QSet<qint64> results = request.results();
 
+  if ( !indexComplete ) {
+    akDebug() << "Search index incomplete, not removing results from" << collection.id();
+    wakeUpCaller(cond);
+    return;
+  }
+
   // Get all items in the collection
   QueryBuilder qb( CollectionPimItemRelation::tableName() );
   qb.addColumn( CollectionPimItemRelation::rightColumn() );
@@ -331,40 +446,160 @@ void SearchManager::updateSearchImpl( const Collection &collection, QWaitConditi
     return;
   }
 
-  DataStore::self()->beginTransaction();
-
   // Unlink all items that were not in search results from the collection
-  QVariantList toRemove;
+  QSet<qint64> toRemove;
   while ( qb.query().next() ) {
     const qint64 id = qb.query().value( 0 ).toLongLong();
     if ( !results.contains( id ) ) {
       toRemove << id;
-      Collection::removePimItem( collection.id(), id );
     }
   }
 
-  if ( !DataStore::self()->commitTransaction() ) {
+  if ( !updateLinks( collection, QSet<qint64>(), toRemove ) ) {
     wakeUpCaller(cond);
     return;
   }
 
-  if ( !toRemove.isEmpty() ) {
+  mLastFullUpdate.insert( collection.id(), QDateTime::currentDateTime() );
+
+  akDebug() << "Search update finished";
+  akDebug() << "All results:" << results.count();
+  akDebug() << "Removed results:" << toRemove.count();
+
+  wakeUpCaller(cond);
+}
+
+bool SearchManager::updateSearchIncremental( const Collection &collection, const QVector<qint64> &changedItems )
+{
+  // Other plugins can only evaluate whole queries
+  if ( !mLocalSearch || mPlugins.size() != 1 ) {
+    return false;
+  }
+
+  // A full update every now and then catches anything the index missed
+  const QDateTime lastFullUpdate = mLastFullUpdate.value( collection.id() );
+  if ( !lastFullUpdate.isValid() || lastFullUpdate.secsTo( QDateTime::currentDateTime() ) > FullUpdateInterval ) {
+    return false;
+  }
+
+  QStringList queryMimeTypes;
+  QVector<qint64> queryCollections;
+  bool remoteSearch = false;
+  if ( !searchScope( collection, queryMimeTypes, queryCollections, remoteSearch ) || remoteSearch ) {
+    return false;
+  }
+
+  if ( changedItems.isEmpty() ) {
+    return true;
+  }
+
+  QSet<qint64> matches;
+  if ( !mLocalSearch->match( collection.queryString(), queryCollections.toList(), queryMimeTypes, changedItems, matches ) ) {
+    return false;
+  }
+
+  QSet<qint64> linked;
+  for ( int i = 0; i < changedItems.size(); i += MaximumBulkSize ) {
+    QVariantList ids;
+    Q_FOREACH ( qint64 id, changedItems.mid( i, MaximumBulkSize ) ) {
+      ids << id;
+    }
+
+    QueryBuilder qb( CollectionPimItemRelation::tableName() );
+    qb.addColumn( CollectionPimItemRelation::rightColumn() );
+    qb.addValueCondition( CollectionPimItemRelation::leftColumn(), Query::Equals, collection.id() );
+    qb.addValueCondition( CollectionPimItemRelation::rightColumn(), Query::In, ids );
+    if ( !qb.exec() ) {
+      return false;
+    }
+    while ( qb.query().next() ) {
+      linked << qb.query().value( 0 ).toLongLong();
+    }
+  }
+
+  const QSet<qint64> toAdd = matches - linked;
+  const QSet<qint64> toRemove = linked - matches;
+  akDebug() << "Incremental search update of" << collection.id() << ":" << changedItems.count() << "changed items,"
+            << toAdd.count() << "added," << toRemove.count() << "removed";
+  return updateLinks( collection, toAdd, toRemove );
+}
+
+static QVector<PimItem> retrieveItems( const QSet<qint64> &ids )
+{
+  QVector<PimItem> items;
+  QVariantList idList;
+  Q_FOREACH ( qint64 id, ids ) {
+    idList << id;
+  }
+
+  for ( int i = 0; i < idList.size(); i += MaximumBulkSize ) {
     SelectQueryBuilder<PimItem> qb;
-    qb.addValueCondition( PimItem::idFullColumnName(), Query::In, toRemove );
+    qb.addValueCondition( PimItem::idFullColumnName(), Query::In, idList.mid( i, MaximumBulkSize ) );
     if ( !qb.exec() ) {
-      wakeUpCaller(cond);
-      return;
+      return QVector<PimItem>();
     }
+    items += qb.result();
+  }
+  return items;
+}
 
-    const QVector<PimItem> removedItems = qb.result();
-    DataStore::self()->notificationCollector()->itemsUnlinked( removedItems, collection );
+bool SearchManager::updateLinks( const Collection &collection, const QSet<qint64> &toAdd, const QSet<qint64> &toRemove )
+{
+  if ( toAdd.isEmpty() && toRemove.isEmpty() ) {
+    return true;
   }
 
-  akDebug() << "Search update finished";
-  akDebug() << "All results:" << results.count();
-  akDebug() << "Removed results:" << toRemove.count();
+  // Items removed in the meantime are not reported
+  const QVector<PimItem> addedItems = retrieveItems( toAdd );
+  const QVector<PimItem> removedItems = retrieveItems( toRemove );
 
-  wakeUpCaller(cond);
+  Transaction transaction( DataStore::self() );
+
+  QVariantList ids;
+  Q_FOREACH ( qint64 id, toRemove ) {
+    ids << id;
+  }
+  for ( int i = 0; i < ids.size(); i += MaximumBulkSize ) {
+    QueryBuilder qb( CollectionPimItemRelation::tableName(), QueryBuilder::Delete );
+    qb.addValueCondition( CollectionPimItemRelation::leftColumn(), Query::Equals, collection.id() );
+    qb.addValueCondition( CollectionPimItemRelation::rightColumn(), Query::In, ids.mid( i, MaximumBulkSize ) );
+    if ( !qb.exec() ) {
+      akError() << "Failed to unlink search results from collection" << collection.id();
+      return false;
+    }
+  }
+
+  // Items are linked only once they exist
+  ids.clear();
+  QVariantList collectionIds;
+  Q_FOREACH ( const PimItem &item, addedItems ) {
+    ids << item.id();
+    collectionIds << collection.id();
+  }
+  for ( int i = 0; i < ids.size(); i += MaximumBulkSize ) {
+    QueryBuilder qb( CollectionPimItemRelation::tableName(), QueryBuilder::Insert );
+    qb.setColumnValue( CollectionPimItemRelation::leftColumn(), collectionIds.mid( i, MaximumBulkSize ) );
+    qb.setColumnValue( CollectionPimItemRelation::rightColumn(), ids.mid( i, MaximumBulkSize ) );
+    qb.setIdentificationColumn( QString() );
+    if ( !qb.exec() ) {
+      akError() << "Failed to link search results to collection" << collection.id();
+      return false;
+    }
+  }
+
+  NotificationCollector *collector = DataStore::self()->notificationCollector();
+  if ( !removedItems.isEmpty() ) {
+    collector->itemsUnlinked( removedItems, collection );
+  }
+  if ( !addedItems.isEmpty() ) {
+    collector->itemsLinked( addedItems, collection );
+  }
+
+  if ( !transaction.commit() ) {
+    akDebug() << "Failed to commit transaction";
+    return false;
+  }
+  return true;
 }
 
 void SearchManager::searchUpdateResultsAvailable( const QSet<qint64> &results )
@@ -393,34 +628,7 @@ void SearchManager::searchUpdateResultsAvailable( const QSet<qint64> &results )
   qDebug() << "Got" << newMatches.count() << "results, out of which" << existingMatches.count() << "are already in the collection";
 
   newMatches = newMatches - existingMatches;
-
-  const bool existingTransaction = DataStore::self()->inTransaction();
-  if ( !existingTransaction ) {
-    DataStore::self()->beginTransaction();
-  }
-
-  QVariantList newMatchesVariant;
-  Q_FOREACH ( qint64 id, newMatches ) {
-    newMatchesVariant << id;
-    Collection::addPimItem( collection.id(), id );
-  }
-
-  qDebug() << "Added" << newMatches.count();
-
-  if ( !existingTransaction && !DataStore::self()->commitTransaction() ) {
-    akDebug() << "Failed to commit transaction";
-    return;
-  }
-
-  if ( !newMatchesVariant.isEmpty() ) {
-    SelectQueryBuilder<PimItem> qb;
-    qb.addValueCondition( PimItem::idFullColumnName(), Query::In, newMatchesVariant );
-    if ( !qb.exec() ) {
-      return ;
-    }
-    const QVector<PimItem> newItems = qb.result();
-    DataStore::self()->notificationCollector()->itemsLinked( newItems, collection );
-    // Force collector to dispatch the notification now
-    DataStore::self()->notificationCollector()->dispatchNotifications();
+  if ( updateLinks( collection, newMatches, QSet<qint64>() ) ) {
+    qDebug() << "Added" << newMatches.count();
   }
 }
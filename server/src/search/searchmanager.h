@@ -21,6 +21,8 @@
 #ifndef SEARCHMANAGER_H
 #define SEARCHMANAGER_H
 
+#include <QDateTime>
+#include <QHash>
 #include <QThread>
 #include <QVector>
 #include <QMutex>
@@ -40,6 +42,7 @@ namespace Server {
 class NotificationCollector;
 class AbstractSearchEngine;
 class Collection;
+class LocalSearchPlugin;
 
 
 class SearchManagerThread : public QThread
@@ -99,16 +102,25 @@ class SearchManager : public QObject
     virtual void updateSearch( const Collection &collection );
 
     /**
-     * Returns currently available search plugins.
+     * Returns currently available search plugins. The built-in index is
+     * left out while it is being rebuilt.
      */
     virtual QVector<AbstractSearchPlugin *> searchPlugins() const;
 
+    /**
+     * Passes committed changes to the built-in search index, if enabled,
+     * and remembers the changed items for the next update of persistent
+     * searches. This is called from all connection threads.
+     */
+    virtual void indexNotifications( const NotificationMessageV3::List &notifications );
+
   public Q_SLOTS:
     virtual void scheduleSearchUpdate();
 
   private Q_SLOTS:
     void searchUpdateTimeout();
     void searchUpdateResultsAvailable( const QSet<qint64> &results );
+    void indexTimeout();
 
     /**
      * Actual implementation of search updates.
@@ -126,15 +138,42 @@ class SearchManager : public QObject
   private:
     void loadSearchPlugins();
 
+    /**
+     * Determines the collections and mime types searched by the persistent
+     * search @p collection.
+     * @returns @c false if there is nothing to search
+     */
+    bool searchScope( const Collection &collection, QStringList &mimeTypes,
+                      QVector<qint64> &collections, bool &remote ) const;
+
+    /**
+     * Evaluates the query of @p collection for @p changedItems only, and
+     * links or unlinks them accordingly.
+     * @returns @c false when the search has to be updated as a whole
+     */
+    bool updateSearchIncremental( const Collection &collection, const QVector<qint64> &changedItems );
+
+    /**
+     * Links @p toAdd to and unlinks @p toRemove from the persistent search
+     * @p collection in bulk, and emits the notifications.
+     */
+    bool updateLinks( const Collection &collection, const QSet<qint64> &toAdd, const QSet<qint64> &toRemove );
+
     static SearchManager *sInstance;
 
     QVector<AbstractSearchEngine *> mEngines;
     QVector<AbstractSearchPlugin *> mPlugins;
+    LocalSearchPlugin *mLocalSearch;
 
     QTimer *mSearchUpdateTimer;
+    QTimer *mIndexTimer;
 
     QMutex mLock;
     QSet<qint64> mUpdatingCollections;
+    QSet<qint64> mChangedItems;
+
+    // Only used in the search manager thread
+    QHash<qint64, QDateTime> mLastFullUpdate;
 
 };
 
@@ -34,6 +34,7 @@ SearchRequest::SearchRequest( const QByteArray &connectionId )
   : mConnectionId( connectionId )
   , mRemoteSearch( true )
   , mStoreResults( false )
+  , mConnection( 0 )
 {
 }
 
@@ -87,6 +88,11 @@ bool SearchRequest::remoteSearch() const
   return mRemoteSearch;
 }
 
+void SearchRequest::setConnection( Connection *connection )
+{
+  mConnection = connection;
+}
+
 void SearchRequest::setStoreResults( bool storeResults )
 {
   mStoreResults = storeResults;
@@ -118,16 +124,6 @@ void SearchRequest::exec()
 {
   akDebug() << "Executing search" << mConnectionId;
 
-  //TODO should we move this to the AgentSearchManager as well? If we keep it here the agents can be searched in parallel
-  //since the plugin search is executed in this thread directly.
-  searchPlugins();
-
-  // If remote search is disabled, just finish here after searching the plugins
-  if ( !mRemoteSearch ) {
-    akDebug() << "Search done" << mConnectionId << "(without remote search)";
-    return;
-  }
-
   SearchTask task;
   task.id = mConnectionId;
   task.query = mQuery;
@@ -135,28 +131,49 @@ void SearchRequest::exec()
   task.collections = mCollections;
   task.complete = false;
 
-  SearchTaskManager::instance()->addTask( &task );
+  // Agents answer asynchronously, so send them the query first and search
+  // the plugins in this thread meanwhile
+  if ( mRemoteSearch ) {
+    SearchTaskManager::instance()->addTask( &task );
+  }
+
+  searchPlugins();
+
+  // If remote search is disabled, just finish here after searching the plugins
+  if ( !mRemoteSearch ) {
+    akDebug() << "Search done" << mConnectionId << "(without remote search)";
+    return;
+  }
 
-  task.sharedLock.lock();
   Q_FOREVER {
-    if ( task.complete ) {
+    task.sharedLock.lock();
+    if ( !task.complete && task.pendingResults.isEmpty() ) {
+      // Wake up regularly to notice disconnected clients
+      task.notifier.wait( &task.sharedLock, 1000 );
+    }
+    const QSet<qint64> results = task.pendingResults;
+    task.pendingResults.clear();
+    const bool complete = task.complete;
+    task.sharedLock.unlock();
+
+    // Results of each agent are passed on as soon as they arrive, without
+    // blocking the search task manager meanwhile
+    if ( !results.isEmpty() ) {
+      akDebug() << results.count() << "search results available in search" << task.id;
+      emitResults( results );
+    }
+
+    if ( complete ) {
       akDebug() << "All queries processed!";
       break;
-    } else {
-      task.notifier.wait( &task.sharedLock );
-
-      akDebug() << task.pendingResults.count() << "search results available in search" << task.id;
-      if ( !task.pendingResults.isEmpty() ) {
-        emitResults( task.pendingResults );
-      }
-      task.pendingResults.clear();
     }
-  }
 
-  if ( !task.pendingResults.isEmpty() ) {
-    emitResults( task.pendingResults );
+    if ( mConnection && !mConnection->isClientConnected() ) {
+      akDebug() << "Client of search" << mConnectionId << "has disconnected, cancelling";
+      SearchTaskManager::instance()->removeTask( &task );
+      break;
+    }
   }
-  task.sharedLock.unlock();
 
   akDebug() << "Search done" << mConnectionId;
 }
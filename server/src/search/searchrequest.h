@@ -47,6 +47,12 @@ class SearchRequest: public QObject
     void setRemoteSearch( bool remote );
     bool remoteSearch() const;
 
+    /**
+     * Sets the connection of the client that started the search. Searches
+     * in agents are cancelled once the client disconnects.
+     */
+    void setConnection( Connection *connection );
+
     /**
      * Whether results should be stored after they are emitted via resultsAvailable(),
      * so that they can be extracted via results() after the search is over. This
@@ -74,6 +80,7 @@ class SearchRequest: public QObject
     bool mRemoteSearch;
     bool mStoreResults;
     QSet<qint64> mResults;
+    Connection *mConnection;
 
 };
 
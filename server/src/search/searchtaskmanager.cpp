@@ -26,6 +26,9 @@
 #include "dbusconnectionpool.h"
 #include <entities.h>
 
+#include <akstandarddirs.h>
+
+#include <QSettings>
 #include <QSqlError>
 #include <QTimer>
 #include <QTime>
@@ -40,6 +43,9 @@ SearchTaskManager::SearchTaskManager()
 {
   sInstance = this;
 
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mQueryTimeout = qMax( 1, settings.value( QLatin1String( "Search/AgentTimeout" ), 60 ).toInt() ) * 1000;
+
   QTimer::singleShot(0, this, SLOT(searchLoop()) );
 }
 
@@ -119,6 +125,8 @@ void SearchTaskManager::addTask( SearchTask *task )
 
   QSqlQuery query = qb.query();
   if ( !query.next() ) {
+    // Nothing to wait for
+    task->complete = true;
     return;
   }
 
@@ -147,6 +155,38 @@ void SearchTaskManager::addTask( SearchTask *task )
   mWait.wakeAll();
 }
 
+void SearchTaskManager::removeTask( SearchTask *task )
+{
+  QMutexLocker locker( &mLock );
+  const int index = mTasklist.indexOf( task );
+  if ( index >= 0 ) {
+    mTasklist.remove( index );
+  }
+
+  TasksMap::Iterator it = mRunningTasks.begin();
+  while ( it != mRunningTasks.end() ) {
+    if ( it.value()->parentTask == task ) {
+      // A late result from the resource is ignored then
+      delete it.value();
+      it = mRunningTasks.erase( it );
+    } else {
+      ++it;
+    }
+  }
+
+  QVector<ResourceTask *>::Iterator resultIt = mPendingResults.begin();
+  while ( resultIt != mPendingResults.end() ) {
+    if ( ( *resultIt )->parentTask == task ) {
+      delete *resultIt;
+      resultIt = mPendingResults.erase( resultIt );
+    } else {
+      ++resultIt;
+    }
+  }
+
+  // Queued queries of other tasks may be waiting for one of the resources
+  mWait.wakeAll();
+}
 
 void SearchTaskManager::pushResults( const QByteArray &searchId, const QSet<qint64> &ids,
                                       Connection* connection )
@@ -156,18 +196,21 @@ void SearchTaskManager::pushResults( const QByteArray &searchId, const QSet<qint
   akDebug() << ids.count() << "results for search" << searchId << "pushed from" << connection->context()->resource().name();
 
   QMutexLocker locker( &mLock );
-  ResourceTask *task = mRunningTasks.take( connection->context()->resource().name() );
-  if ( !task ) {
+  TasksMap::Iterator it = mRunningTasks.find( connection->context()->resource().name() );
+  if ( it == mRunningTasks.end() ) {
     akDebug() << "No running task for" << connection->context()->resource().name() << " - maybe it has timed out?";
     return;
   }
 
+  ResourceTask *task = it.value();
   if ( task->parentTask->id != searchId ) {
+    // Keep waiting for the result of the current search
     akDebug() << "Received results for different search - maybe the original task has timed out?";
     akDebug() << "Search is" << searchId << ", but task is" << task->parentTask->id;
     return;
   }
 
+  mRunningTasks.erase( it );
   task->results = ids;
   mPendingResults.append( task );
 
@@ -207,9 +250,47 @@ SearchTaskManager::TasksMap::Iterator SearchTaskManager::cancelRunningTask( Task
   return it;
 }
 
+void SearchTaskManager::dispatchQueries( SearchTask *task )
+{
+  QVector<QPair<QString,qint64> >::iterator it = task->queries.begin();
+  for ( ; it != task->queries.end(); ) {
+    // Resources handle one query at a time
+    if ( mRunningTasks.contains( it->first ) ) {
+      ++it;
+      continue;
+    }
+
+    mInstancesLock.lock();
+    AgentSearchInstance *instance = mInstances.value( it->first );
+    if ( !instance ) {
+      mInstancesLock.unlock();
+      // Resource disappeared in the meanwhile
+      task->sharedLock.lock();
+      it = task->queries.erase( it );
+      task->sharedLock.unlock();
+      continue;
+    }
+
+    akDebug() << "\t Sending query for collection" << it->second << "to resource" << it->first;
+    ResourceTask *rTask = new ResourceTask;
+    rTask->resourceId = it->first;
+    rTask->collectionId = it->second;
+    rTask->parentTask = task;
+    rTask->deadline = QDateTime::currentMSecsSinceEpoch() + mQueryTimeout;
+    mRunningTasks.insert( it->first, rTask );
+
+    instance->search( task->id, task->query, it->second );
+    mInstancesLock.unlock();
+
+    task->sharedLock.lock();
+    it = task->queries.erase( it );
+    task->sharedLock.unlock();
+  }
+}
+
 void SearchTaskManager::searchLoop()
 {
-  qint64 timeout = ULONG_MAX;
+  unsigned long timeout = ULONG_MAX;
 
   QMutexLocker locker( &mLock );
 
@@ -251,12 +332,13 @@ void SearchTaskManager::searchLoop()
       delete finishedTask;
     }
 
-    // No check whether there are any tasks running longer than 1 minute and kill them
-    QMap<QString,ResourceTask*>::Iterator it = mRunningTasks.begin();
+    // Give up on resources that did not answer in time, the search
+    // continues with the results of the others
     const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMap<QString,ResourceTask*>::Iterator it = mRunningTasks.begin();
     for ( ; it != mRunningTasks.end(); ) {
       ResourceTask *task = it.value();
-      if ( now - task->timestamp > 60 * 1000 ) {
+      if ( task->deadline <= now ) {
         // Remove the task - and signal to parent task that it has "finished" without results
         akDebug() << "Resource task" << task->resourceId << "for search" << task->parentTask->id << "timed out!";
         it = cancelRunningTask( it );
@@ -265,59 +347,34 @@ void SearchTaskManager::searchLoop()
       }
     }
 
-    if ( !mTasklist.isEmpty() ) {
-      SearchTask *task = mTasklist.first();
-      akDebug() << "Search task" << task->id << "available!";
-      if ( task->queries.isEmpty() ) {
-        akDebug() << "nothing to do for task";
-        QMutexLocker locker( &task->sharedLock );
-        //After this the AgentSearchTask will be destroyed
-        task->complete = true;
-        task->notifier.wakeAll();
-        mTasklist.remove( 0 );
+    // Dispatch queries of all tasks, so that a busy resource does not
+    // hold up searches in other resources
+    for ( int i = 0; i < mTasklist.size(); ) {
+      SearchTask *task = mTasklist.at( i );
+      dispatchQueries( task );
+      if ( !task->queries.isEmpty() ) {
+        ++i;
         continue;
       }
 
-      QVector<QPair<QString,qint64> >::iterator it = task->queries.begin();
-      for ( ; it != task->queries.end(); ) {
-        if ( !mRunningTasks.contains( it->first ) ) {
-          akDebug() << "\t Sending query for collection" << it->second << "to resource" << it->first;
-          ResourceTask *rTask = new ResourceTask;
-          rTask->resourceId = it->first;
-          rTask->collectionId = it->second;
-          rTask->parentTask = task;
-          rTask->timestamp = QDateTime::currentMSecsSinceEpoch();
-          mRunningTasks.insert( it->first, rTask );
-
-          mInstancesLock.lock();
-          AgentSearchInstance *instance = mInstances.value( it->first );
-          if ( !instance ) {
-            mInstancesLock.unlock();
-            // Resource disappeared in the meanwhile
-            continue;
-          }
-
-          instance->search( task->id, task->query, it->second );
-          mInstancesLock.unlock();
-
-          task->sharedLock.lock();
-          it = task->queries.erase( it );
-          task->sharedLock.unlock();
-        } else {
-          ++it;
-        }
-      }
-      // Yay! We managed to dispatch all requests!
-      if ( task->queries.isEmpty() ) {
-        akDebug() << "All queries from task" << task->id << "dispatched!";
-        mTasklist.remove( 0 );
+      akDebug() << "All queries from task" << task->id << "dispatched!";
+      mTasklist.remove( i );
+
+      QMutexLocker locker( &task->sharedLock );
+      if ( allResourceTasksCompleted( task ) ) {
+        //After this the AgentSearchTask will be destroyed
+        task->complete = true;
+        task->notifier.wakeAll();
       }
+    }
 
-      timeout = 60 * 1000; // check whether all tasks have finished within a minute
-    } else {
-      if ( mRunningTasks.isEmpty() ) {
-        timeout = ULONG_MAX;
+    // Wake up again when the next query expires
+    qint64 nextDeadline = -1;
+    Q_FOREACH ( ResourceTask *task, mRunningTasks ) {
+      if ( nextDeadline < 0 || task->deadline < nextDeadline ) {
+        nextDeadline = task->deadline;
       }
     }
+    timeout = nextDeadline < 0 ? ULONG_MAX : qMax<qint64>( 0, nextDeadline - now ) + 1;
   }
 }
@@ -69,6 +69,12 @@ class SearchTaskManager : public QObject
 
     void addTask( SearchTask *task );
 
+    /**
+     * Withdraws @p task, dropping all its queued and running queries, so
+     * that the caller can destroy it before it has completed.
+     */
+    void removeTask( SearchTask *task );
+
     void pushResults( const QByteArray &searchId, const QSet<qint64> &ids,
                       Connection *connection );
 
@@ -84,7 +90,8 @@ class SearchTaskManager : public QObject
         SearchTask *parentTask;
         QSet<qint64> results;
 
-        qint64 timestamp;
+        //! Time in ms since the epoch when the query is given up
+        qint64 deadline;
     };
 
     typedef QMap<QString /* resource */, ResourceTask *>  TasksMap;
@@ -96,6 +103,7 @@ class SearchTaskManager : public QObject
 
     TasksMap::Iterator cancelRunningTask( TasksMap::Iterator &iter );
     bool allResourceTasksCompleted( SearchTask* ) const;
+    void dispatchQueries( SearchTask *task );
 
     QMap<QString, AgentSearchInstance* > mInstances;
     QMutex mInstancesLock;
@@ -103,6 +111,9 @@ class SearchTaskManager : public QObject
     QWaitCondition mWait;
     QMutex mLock;
 
+    //! How long resources may take to answer a query, in ms
+    qint64 mQueryTimeout;
+
     QVector<SearchTask*> mTasklist;
 
     QMap<QString /* resource */, ResourceTask *> mRunningTasks;
@@ -38,10 +38,16 @@
 #include "akonadischema.h"
 #include "parttypehelper.h"
 #include "querycache.h"
+#include "modseqhelper.h"
+
+#include <akstandarddirs.h>
+#include <config-akonadi.h>
 
 #include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
 #include <QtCore/QDir>
 #include <QtCore/QEventLoop>
+#include <QtCore/QFile>
 #include <QtCore/QSettings>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
@@ -152,12 +158,62 @@ void DataStore::close()
   m_dbOpened = false;
 }
 
+static QString schemaFingerprintFile()
+{
+  return AkStandardDirs::saveDir( "data" ) + QLatin1String( "/schema_fingerprint" );
+}
+
+static QString databaseIdentity( const QSqlDatabase &database )
+{
+  return QString::fromLatin1( "%1:%2@%3:%4" ).arg( database.driverName(), database.databaseName(),
+                                                   database.hostName() ).arg( database.port() );
+}
+
+static int currentSchemaVersion( const QSqlDatabase &database )
+{
+  // Not via SchemaVersion::retrieveAll(), the table does not exist in a new database
+  QSqlQuery query( database );
+  if ( !query.exec( QString::fromLatin1( "SELECT %1 FROM %2" ).arg( SchemaVersion::versionColumn(), SchemaVersion::tableName() ) )
+       || !query.next() ) {
+    return -1;
+  }
+  return query.value( 0 ).toInt();
+}
+
 bool DataStore::init()
 {
   Q_ASSERT( QThread::currentThread() == QCoreApplication::instance()->thread() );
 
   AkonadiSchema schema;
   DbInitializer::Ptr initializer = DbInitializer::createInstance( m_database, &schema );
+
+  // Introspecting every table, column and index takes a while on large
+  // databases. Skip it if nothing changed since the last successful run.
+  QCryptographicHash hash( QCryptographicHash::Sha1 );
+  hash.addData( initializer->schemaFingerprint() );
+  hash.addData( AKONADI_VERSION_STRING );
+  QFile updateFile( QLatin1String( ":dbupdate.xml" ) );
+  if ( updateFile.open( QIODevice::ReadOnly ) ) {
+    hash.addData( updateFile.readAll() );
+  }
+  const QByteArray fingerprint = hash.result().toHex();
+
+  QSettings fingerprintSettings( schemaFingerprintFile(), QSettings::IniFormat );
+  const int schemaVersion = currentSchemaVersion( m_database );
+  if ( schemaVersion >= 0
+       && fingerprintSettings.value( QLatin1String( "Schema/Fingerprint" ) ).toByteArray() == fingerprint
+       && fingerprintSettings.value( QLatin1String( "Schema/Database" ) ).toString() == databaseIdentity( m_database )
+       && fingerprintSettings.value( QLatin1String( "Schema/Version" ), -1 ).toInt() == schemaVersion ) {
+    akDebug() << "Database schema unchanged, skipping schema check";
+    s_hasForeignKeyConstraints = fingerprintSettings.value( QLatin1String( "Schema/ForeignKeys" ), false ).toBool();
+    enableEntityCaches();
+    return true;
+  }
+
+  // Don't trust an old fingerprint if anything below fails halfway
+  fingerprintSettings.remove( QLatin1String( "Schema" ) );
+  fingerprintSettings.sync();
+
   if ( !initializer->run() ) {
     akError() << initializer->errorMsg();
     return false;
@@ -178,13 +234,22 @@ bool DataStore::init()
     return false;
   }
 
+  fingerprintSettings.setValue( QLatin1String( "Schema/Fingerprint" ), fingerprint );
+  fingerprintSettings.setValue( QLatin1String( "Schema/Database" ), databaseIdentity( m_database ) );
+  fingerprintSettings.setValue( QLatin1String( "Schema/Version" ), currentSchemaVersion( m_database ) );
+  fingerprintSettings.setValue( QLatin1String( "Schema/ForeignKeys" ), s_hasForeignKeyConstraints );
+
+  enableEntityCaches();
+  return true;
+}
+
+void DataStore::enableEntityCaches()
+{
   // enable caching for some tables
   MimeType::enableCache( true );
   Flag::enableCache( true );
   Resource::enableCache( true );
   Collection::enableCache( true );
-
-  return true;
 }
 
 NotificationCollector *DataStore::notificationCollector()
@@ -726,6 +791,11 @@ bool DataStore::cleanupCollection_slow( Collection &collection )
     }
   }
 
+  // delete the removal log
+  if ( !PimItemTombstone::remove( PimItemTombstone::collectionIdColumn(), collection.id() ) ) {
+    return false;
+  }
+
   // delete the collection itself
   mNotificationCollector->collectionRemoved( collection );
   return collection.remove();
@@ -1317,6 +1387,13 @@ bool DataStore::commitTransaction()
   }
 
   if ( m_transactionLevel == 1 ) {
+    // assign change sequence numbers as late as possible, it locks the affected collections
+    if ( mNotificationCollector && !ModSeqHelper::recordChanges( mNotificationCollector->pendingNotifications() ) ) {
+      debugLastDbError( "DataStore::commitTransaction (modseq)" );
+      rollbackTransaction();
+      return false;
+    }
+
     QSqlDriver *driver = m_database.driver();
     if ( !driver->commitTransaction() ) {
       debugLastDbError( "DataStore::commitTransaction" );
@@ -280,6 +280,9 @@ protected:
                           const QSet<Entity::Id> &existing, const Collection &col,
                           bool silent );
 
+    /** Enables the entity caches, once the schema is known to be up to date. */
+    static void enableEntityCaches();
+
     /** Converts the given date/time to the database format, i.e.
         "YYYY-MM-DD HH:MM:SS".
         @param dateTime the date/time in UTC
@@ -197,6 +197,14 @@ void DbConfigSqlite::setup()
     return;
   }
 
+  // free pages are given back by the VacuumScheduler; this only takes effect
+  // for new databases, existing ones are converted by "akonadictl vacuum"
+  if ( !query.exec( QLatin1String( "PRAGMA auto_vacuum = INCREMENTAL" ) ) ) {
+    akDebug() << "Could not set sqlite auto vacuum mode to INCREMENTAL";
+    akDebug() << "Database: " << mDatabaseName;
+    akDebug() << "Query error: " << query.lastError().text();
+  }
+
   if ( sqliteVersionMajor < 3 && sqliteVersionMinor < 7 ) {
     // wal mode is only supported with >= sqlite 3.7.0
     db.close();
@@ -26,6 +26,8 @@
 #include "schema.h"
 #include "entity.h"
 
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDataStream>
 #include <QtCore/QDebug>
 #include <QtCore/QFile>
 #include <QtCore/QPair>
@@ -284,6 +286,42 @@ bool DbInitializer::updateIndexesAndConstraints()
   return true;
 }
 
+QByteArray DbInitializer::schemaFingerprint() const
+{
+  QByteArray description;
+  QDataStream stream( &description, QIODevice::WriteOnly );
+
+  stream << static_cast<int>( DbType::type( mDatabase ) );
+
+  Q_FOREACH ( const TableDescription &table, mSchema->tables() ) {
+    stream << table.name;
+    Q_FOREACH ( const ColumnDescription &column, table.columns ) {
+      stream << column.name << column.type << column.size << column.allowNull
+             << column.isAutoIncrement << column.isPrimaryKey << column.isUnique
+             << column.refTable << column.refColumn << column.defaultValue
+             << static_cast<int>( column.onUpdate ) << static_cast<int>( column.onDelete )
+             << column.noUpdate;
+    }
+    Q_FOREACH ( const IndexDescription &index, table.indexes ) {
+      stream << index.name << index.columns << index.isUnique;
+    }
+    Q_FOREACH ( const DataDescription &data, table.data ) {
+      // QHash iteration order is not stable
+      QStringList columns = data.data.keys();
+      columns.sort();
+      Q_FOREACH ( const QString &column, columns ) {
+        stream << column << data.data.value( column );
+      }
+    }
+  }
+
+  Q_FOREACH ( const RelationDescription &relation, mSchema->relations() ) {
+    stream << relation.firstTable << relation.firstColumn << relation.secondTable << relation.secondColumn;
+  }
+
+  return QCryptographicHash::hash( description, QCryptographicHash::Sha1 ).toHex();
+}
+
 void DbInitializer::execPendingQueries( const QStringList &queries )
 {
   Q_FOREACH( const QString &statement, queries ) {
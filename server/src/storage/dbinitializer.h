@@ -96,6 +96,14 @@ class DbInitializer
      */
     bool updateIndexesAndConstraints();
 
+    /**
+     * Returns a hash of the schema description for the backend of the database.
+     *
+     * As long as neither the schema nor the backend change, the result of
+     * a previous run() and updateIndexesAndConstraints() is still valid.
+     */
+    QByteArray schemaFingerprint() const;
+
     /**
      * Returns a backend-specific CREATE TABLE SQL query describing given table
      */
@@ -19,6 +19,7 @@
 
 #include "itemretrievalthread.h"
 #include "itemretrievalmanager.h"
+#include "syncscheduler.h"
 
 #include <QCoreApplication>
 
@@ -34,6 +35,8 @@ ItemRetrievalThread::ItemRetrievalThread( QObject *parent )
 void ItemRetrievalThread::run()
 {
   ItemRetrievalManager *mgr = new ItemRetrievalManager();
+  SyncScheduler *scheduler = new SyncScheduler();
   exec();
+  delete scheduler;
   delete mgr;
 }
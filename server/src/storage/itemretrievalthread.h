@@ -27,7 +27,7 @@
 namespace Akonadi {
 namespace Server {
 
-/** Container thread for the item retrieval manager. */
+/** Container thread for the item retrieval manager and the sync scheduler. */
 class ItemRetrievalThread : public QThread
 {
   Q_OBJECT
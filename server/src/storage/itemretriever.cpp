@@ -21,6 +21,7 @@
 #include "itemretriever.h"
 
 #include "akdebug.h"
+#include "cachecleaner.h"
 #include "connection.h"
 #include "storage/datastore.h"
 #include "storage/itemqueryhelper.h"
@@ -44,6 +45,7 @@ ItemRetriever::ItemRetriever( Connection *connection )
   , mConnection( connection )
   , mFullPayload( false )
   , mRecursive( false )
+  , mChangedSinceModSeq( -1 )
 {
 }
 
@@ -120,6 +122,11 @@ void ItemRetriever::setChangedSince( const QDateTime &changedSince )
   mChangedSince = changedSince;
 }
 
+void ItemRetriever::setChangedSinceModSeq( qint64 modseq )
+{
+  mChangedSinceModSeq = modseq;
+}
+
 QStringList ItemRetriever::retrieveParts() const
 {
   return mParts;
@@ -181,6 +188,10 @@ QSqlQuery ItemRetriever::buildQuery() const
                           mChangedSince.toUTC() );
   }
 
+  if ( mChangedSinceModSeq >= 0 ) {
+    qb.addValueCondition( PimItem::modseqFullColumnName(), Query::Greater, mChangedSinceModSeq );
+  }
+
   qb.addSortColumn( PimItem::idFullColumnName(), Query::Ascending );
 
   if ( !qb.exec() ) {
@@ -212,6 +223,7 @@ bool ItemRetriever::exec()
     }
   }
 
+  int hits = 0;
   while ( query.isValid() ) {
     const qint64 pimItemId = query.value( PimItemIdColumn ).toLongLong();
     if ( !lastRequest || lastRequest->id != pimItemId ) {
@@ -241,7 +253,9 @@ bool ItemRetriever::exec()
       }
     } else {
       // data available, don't request update
-      lastRequest->parts.removeAll( partName );
+      if ( lastRequest->parts.removeAll( partName ) > 0 || mFullPayload ) {
+        ++hits;
+      }
     }
     query.next();
   }
@@ -250,6 +264,12 @@ bool ItemRetriever::exec()
 
   query.finish();
 
+  int misses = 0;
+  Q_FOREACH ( ItemRetrievalRequest *request, requests ) {
+    misses += request->parts.count();
+  }
+  CacheCleaner::recordCacheAccess( hits, misses );
+
   Q_FOREACH ( ItemRetrievalRequest *request, requests ) {
     if ( request->parts.isEmpty() ) {
         delete request;
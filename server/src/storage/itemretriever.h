@@ -55,6 +55,7 @@ class ItemRetriever
     QStringList retrieveParts() const;
     void setRetrieveFullPayload( bool fullPayload );
     void setChangedSince( const QDateTime &changedSince );
+    void setChangedSinceModSeq( qint64 modseq );
     void setItemSet( const ImapSet &set, const Collection &collection = Collection() );
     void setItemSet( const ImapSet &set, bool isUid );
     void setItem( const Entity::Id &id );
@@ -86,6 +87,7 @@ class ItemRetriever
     bool mFullPayload;
     bool mRecursive;
     QDateTime mChangedSince;
+    qint64 mChangedSinceModSeq;
     mutable QByteArray mLastError;
 };
 
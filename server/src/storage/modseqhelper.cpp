@@ -0,0 +1,412 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "modseqhelper.h"
+
+#include "datastore.h"
+#include "querybuilder.h"
+#include "akdebug.h"
+
+#include <QtCore/QMap>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+/// Number of modseqs of a collection for which removed items are remembered
+static const qint64 ModSeqRetention = 10000;
+
+/// Number of collection tree revisions for which removed collections are remembered
+static const qint64 TreeRevisionRetention = 10000;
+
+static QVariantList entityIds( const NotificationMessageV3 &msg )
+{
+  QVariantList ids;
+  Q_FOREACH ( NotificationMessageV2::Id id, msg.uids() ) {
+    ids << id;
+  }
+  return ids;
+}
+
+static bool touchItems( const QVariantList &ids, Collection::Id collectionId, qint64 modseq )
+{
+  QueryBuilder qb( PimItem::tableName(), QueryBuilder::Update );
+  qb.setColumnValue( PimItem::modseqColumn(), modseq );
+  qb.addValueCondition( PimItem::idColumn(), Query::In, ids );
+  qb.addValueCondition( PimItem::collectionIdColumn(), Query::Equals, collectionId );
+  if ( !qb.exec() ) {
+    akError() << "Failed to update item modseqs in collection" << collectionId;
+    return false;
+  }
+  return true;
+}
+
+static bool addTombstones( const QVariantList &ids, Collection::Id collectionId, qint64 modseq )
+{
+  QVariantList collectionIds;
+  QVariantList modseqs;
+  for ( int i = 0; i < ids.count(); ++i ) {
+    collectionIds << collectionId;
+    modseqs << modseq;
+  }
+
+  QueryBuilder qb( PimItemTombstone::tableName(), QueryBuilder::Insert );
+  qb.setColumnValue( PimItemTombstone::pimItemIdColumn(), ids );
+  qb.setColumnValue( PimItemTombstone::collectionIdColumn(), collectionIds );
+  qb.setColumnValue( PimItemTombstone::modseqColumn(), modseqs );
+  qb.setIdentificationColumn( QString() );
+  if ( !qb.exec() ) {
+    akError() << "Failed to record removed items in collection" << collectionId;
+    return false;
+  }
+  return true;
+}
+
+static bool touchCollections( const QVariantList &ids, qint64 treeRevision )
+{
+  QueryBuilder qb( Collection::tableName(), QueryBuilder::Update );
+  qb.setColumnValue( Collection::treeRevisionColumn(), treeRevision );
+  qb.addValueCondition( Collection::idColumn(), Query::In, ids );
+  if ( !qb.exec() ) {
+    akError() << "Failed to update collection tree revisions";
+    return false;
+  }
+  return true;
+}
+
+static bool addCollectionTombstones( const QVariantList &ids, const QByteArray &resource, qint64 treeRevision )
+{
+  const Resource res = Resource::retrieveByName( QString::fromLatin1( resource ) );
+  if ( !res.isValid() ) {
+    // The whole resource is going away, clients will notice that anyway
+    return true;
+  }
+
+  QVariantList resourceIds;
+  QVariantList revisions;
+  for ( int i = 0; i < ids.count(); ++i ) {
+    resourceIds << res.id();
+    revisions << treeRevision;
+  }
+
+  QueryBuilder qb( CollectionTombstone::tableName(), QueryBuilder::Insert );
+  qb.setColumnValue( CollectionTombstone::collectionIdColumn(), ids );
+  qb.setColumnValue( CollectionTombstone::resourceIdColumn(), resourceIds );
+  qb.setColumnValue( CollectionTombstone::treeRevisionColumn(), revisions );
+  qb.setIdentificationColumn( QString() );
+  if ( !qb.exec() ) {
+    akError() << "Failed to record removed collections";
+    return false;
+  }
+  return true;
+}
+
+static bool isTreeChange( const NotificationMessageV3 &msg )
+{
+  switch ( msg.operation() ) {
+  case NotificationMessageV2::Add:
+  case NotificationMessageV2::Modify:
+  case NotificationMessageV2::Move:
+  case NotificationMessageV2::Remove:
+  case NotificationMessageV2::Subscribe:
+  case NotificationMessageV2::Unsubscribe:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool isVirtualCollection( Collection::Id collectionId )
+{
+  const Collection col = Collection::retrieveById( collectionId );
+  return !col.isValid() || col.isVirtual();
+}
+
+bool ModSeqHelper::recordChanges( const NotificationMessageV3::List &notifications )
+{
+  // Find all collections whose counters change first: the counter rows stay
+  // locked until the transaction is committed, and locking them in ascending
+  // id order (QMap keeps them sorted) prevents concurrent transactions from
+  // deadlocking on each other
+  QMap<Collection::Id, qint64> modseqs;
+  QVariantList changedCollections;
+  bool treeChanged = false;
+  Q_FOREACH ( const NotificationMessageV3 &msg, notifications ) {
+    if ( msg.type() == NotificationMessageV2::Collections ) {
+      if ( isTreeChange( msg ) ) {
+        treeChanged = true;
+        if ( msg.operation() != NotificationMessageV2::Remove ) {
+          changedCollections << entityIds( msg );
+        }
+      }
+      continue;
+    }
+    if ( msg.type() != NotificationMessageV2::Items ) {
+      continue;
+    }
+
+    // Virtual collections only reference items, their content is tracked
+    // in the collections the items actually belong to
+    if ( isVirtualCollection( msg.parentCollection() ) ) {
+      continue;
+    }
+
+    switch ( msg.operation() ) {
+    case NotificationMessageV2::Move:
+      modseqs.insert( msg.parentDestCollection(), -1 );
+      // fall through
+    case NotificationMessageV2::Add:
+    case NotificationMessageV2::Modify:
+    case NotificationMessageV2::ModifyFlags:
+    case NotificationMessageV2::ModifyTags:
+    case NotificationMessageV2::ModifyRelations:
+    case NotificationMessageV2::Remove:
+      modseqs.insert( msg.parentCollection(), -1 );
+      break;
+    default:
+      break;
+    }
+  }
+
+  // All changes of a transaction to a collection share a single modseq.
+  // Removal of the whole collection: the collection is gone already, and
+  // so are its tombstones (nextModSeq() fails then and we skip it)
+  for ( QMap<Collection::Id, qint64>::iterator it = modseqs.begin(); it != modseqs.end(); ++it ) {
+    it.value() = nextModSeq( it.key() );
+  }
+
+  // All collection changes of a transaction share a single tree revision,
+  // the revision row is locked after the collection rows
+  qint64 treeRevision = -1;
+  if ( treeChanged ) {
+    treeRevision = nextTreeRevision();
+    if ( treeRevision < 0 ) {
+      return false;
+    }
+    if ( !changedCollections.isEmpty() && !touchCollections( changedCollections, treeRevision ) ) {
+      return false;
+    }
+  }
+
+  Q_FOREACH ( const NotificationMessageV3 &msg, notifications ) {
+    if ( msg.type() == NotificationMessageV2::Collections ) {
+      if ( msg.operation() == NotificationMessageV2::Remove
+           && !addCollectionTombstones( entityIds( msg ), msg.resource(), treeRevision ) ) {
+        return false;
+      }
+      continue;
+    }
+    if ( msg.type() != NotificationMessageV2::Items || isVirtualCollection( msg.parentCollection() ) ) {
+      continue;
+    }
+
+    const qint64 modseq = modseqs.value( msg.parentCollection(), -1 );
+    switch ( msg.operation() ) {
+    case NotificationMessageV2::Add:
+    case NotificationMessageV2::Modify:
+    case NotificationMessageV2::ModifyFlags:
+    case NotificationMessageV2::ModifyTags:
+    case NotificationMessageV2::ModifyRelations:
+      if ( modseq >= 0 && !touchItems( entityIds( msg ), msg.parentCollection(), modseq ) ) {
+        return false;
+      }
+      break;
+    case NotificationMessageV2::Move: {
+      const QVariantList ids = entityIds( msg );
+      if ( modseq >= 0 && !addTombstones( ids, msg.parentCollection(), modseq ) ) {
+        return false;
+      }
+      const qint64 destModseq = modseqs.value( msg.parentDestCollection(), -1 );
+      if ( destModseq >= 0 && !touchItems( ids, msg.parentDestCollection(), destModseq ) ) {
+        return false;
+      }
+      break;
+    }
+    case NotificationMessageV2::Remove:
+      if ( modseq >= 0 && !addTombstones( entityIds( msg ), msg.parentCollection(), modseq ) ) {
+        return false;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  return true;
+}
+
+qint64 ModSeqHelper::nextModSeq( Collection::Id collectionId )
+{
+  if ( collectionId <= 0 ) {
+    return -1;
+  }
+
+  // QueryBuilder cannot express "column = column + 1" and a separate SELECT
+  // would allow two concurrent transactions to hand out the same value. The
+  // UPDATE also locks the collection row until the transaction is committed,
+  // so modseqs become visible in the order they were assigned.
+  QSqlQuery query( DataStore::self()->database() );
+  query.prepare( QString::fromLatin1( "UPDATE %1 SET %2 = %2 + 1 WHERE %3 = :id" )
+                    .arg( Collection::tableName(), Collection::modseqColumn(), Collection::idColumn() ) );
+  query.bindValue( QLatin1String( ":id" ), collectionId );
+  if ( !query.exec() ) {
+    akError() << "Failed to increase modseq of collection" << collectionId << ":" << query.lastError().text();
+    return -1;
+  }
+  if ( query.numRowsAffected() == 0 ) {
+    return -1;
+  }
+
+  return highestModSeq( collectionId );
+}
+
+qint64 ModSeqHelper::highestModSeq( Collection::Id collectionId )
+{
+  QueryBuilder qb( Collection::tableName(), QueryBuilder::Select );
+  qb.addColumn( Collection::modseqColumn() );
+  qb.addValueCondition( Collection::idColumn(), Query::Equals, collectionId );
+  if ( !qb.exec() ) {
+    return -1;
+  }
+
+  QSqlQuery &query = qb.query();
+  if ( !query.next() ) {
+    return -1;
+  }
+  return query.value( 0 ).toLongLong();
+}
+
+QVector<PimItem::Id> ModSeqHelper::vanishedItems( Collection::Id collectionId, qint64 modseq )
+{
+  QVector<PimItem::Id> ids;
+
+  QueryBuilder qb( PimItemTombstone::tableName(), QueryBuilder::Select );
+  qb.addColumn( PimItemTombstone::pimItemIdColumn() );
+  qb.addValueCondition( PimItemTombstone::collectionIdColumn(), Query::Equals, collectionId );
+  qb.addValueCondition( PimItemTombstone::modseqColumn(), Query::Greater, modseq );
+  qb.setDistinct( true );
+  if ( !qb.exec() ) {
+    return ids;
+  }
+
+  QSqlQuery &query = qb.query();
+  while ( query.next() ) {
+    ids << query.value( 0 ).toLongLong();
+  }
+  return ids;
+}
+
+qint64 ModSeqHelper::nextTreeRevision()
+{
+  // Same as in nextModSeq(), the UPDATE serializes concurrent writers
+  QSqlQuery query( DataStore::self()->database() );
+  if ( !query.exec( QString::fromLatin1( "UPDATE %1 SET %2 = %2 + 1" )
+                      .arg( CollectionTreeRevision::tableName(), CollectionTreeRevision::revisionColumn() ) ) ) {
+    akError() << "Failed to increase collection tree revision:" << query.lastError().text();
+    return -1;
+  }
+
+  return treeRevision();
+}
+
+qint64 ModSeqHelper::treeRevision()
+{
+  QueryBuilder qb( CollectionTreeRevision::tableName(), QueryBuilder::Select );
+  qb.addColumn( CollectionTreeRevision::revisionColumn() );
+  if ( !qb.exec() ) {
+    return -1;
+  }
+
+  QSqlQuery &query = qb.query();
+  if ( !query.next() ) {
+    return -1;
+  }
+  return query.value( 0 ).toLongLong();
+}
+
+QVector<Collection::Id> ModSeqHelper::removedCollections( qint64 treeRevision, Resource::Id resourceId )
+{
+  QVector<Collection::Id> ids;
+
+  QueryBuilder qb( CollectionTombstone::tableName(), QueryBuilder::Select );
+  qb.addColumn( CollectionTombstone::collectionIdColumn() );
+  qb.addValueCondition( CollectionTombstone::treeRevisionColumn(), Query::Greater, treeRevision );
+  if ( resourceId > 0 ) {
+    qb.addValueCondition( CollectionTombstone::resourceIdColumn(), Query::Equals, resourceId );
+  }
+  qb.setDistinct( true );
+  if ( !qb.exec() ) {
+    return ids;
+  }
+
+  QSqlQuery &query = qb.query();
+  while ( query.next() ) {
+    ids << query.value( 0 ).toLongLong();
+  }
+  return ids;
+}
+
+qint64 ModSeqHelper::modSeqHorizon( Collection::Id collectionId )
+{
+  const qint64 modseq = highestModSeq( collectionId );
+  if ( modseq < 0 ) {
+    return -1;
+  }
+  return qMax<qint64>( 0, modseq - ModSeqRetention );
+}
+
+qint64 ModSeqHelper::treeRevisionHorizon()
+{
+  const qint64 revision = treeRevision();
+  if ( revision < 0 ) {
+    return -1;
+  }
+  return qMax<qint64>( 0, revision - TreeRevisionRetention );
+}
+
+bool ModSeqHelper::pruneTombstones()
+{
+  // The horizon differs per collection, QueryBuilder cannot express that
+  QSqlQuery query( DataStore::self()->database() );
+  query.prepare( QString::fromLatin1( "DELETE FROM %1 WHERE %2 <= (SELECT %3 FROM %4 WHERE %5 = %6) - :retention" )
+                    .arg( PimItemTombstone::tableName(), PimItemTombstone::modseqColumn(),
+                          Collection::modseqFullColumnName(), Collection::tableName(),
+                          Collection::idFullColumnName(), PimItemTombstone::collectionIdFullColumnName() ) );
+  query.bindValue( QLatin1String( ":retention" ), ModSeqRetention );
+  if ( !query.exec() ) {
+    akError() << "Failed to prune item tombstones:" << query.lastError().text();
+    return false;
+  }
+  const int items = query.numRowsAffected();
+
+  const qint64 horizon = treeRevisionHorizon();
+  if ( horizon < 0 ) {
+    return false;
+  }
+  QueryBuilder qb( CollectionTombstone::tableName(), QueryBuilder::Delete );
+  qb.addValueCondition( CollectionTombstone::treeRevisionColumn(), Query::LessOrEqual, horizon );
+  if ( !qb.exec() ) {
+    akError() << "Failed to prune collection tombstones";
+    return false;
+  }
+
+  akDebug() << "Pruned" << items << "item and" << qb.query().numRowsAffected() << "collection tombstones";
+  return true;
+}
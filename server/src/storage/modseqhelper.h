@@ -0,0 +1,133 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_MODSEQHELPER_H
+#define AKONADI_MODSEQHELPER_H
+
+#include "entities.h"
+
+#include <libs/notificationmessagev3_p.h>
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * Methods for maintaining change sequence numbers (modseqs).
+ *
+ * Every collection has a counter that is increased whenever any of its items
+ * is added, changed, moved in or out, or removed. The items touched by such
+ * a change get the new value of the counter, items leaving the collection are
+ * recorded in the PimItemTombstone table. Clients can then ask for everything
+ * that changed since a modseq they have seen before (FETCH CHANGEDSINCE MODSEQ)
+ * instead of comparing the whole collection.
+ *
+ * Modseqs are only comparable within a single collection.
+ *
+ * Changes to the collections themselves are tracked by a single, global
+ * collection tree revision instead. Changed collections remember the revision
+ * of their last change, removed ones are recorded in the CollectionTombstone
+ * table (LIST CHANGEDSINCE).
+ *
+ * Tombstones are only kept for a limited number of changes, clients asking
+ * for changes since an older modseq or revision get a full listing instead.
+ */
+namespace ModSeqHelper
+{
+  /**
+   * Assigns new modseqs to all items affected by the given notifications,
+   * records tombstones for removed and moved items and bumps the collection
+   * tree revision if any collection was changed.
+   *
+   * All changes of a transaction to a collection share a single modseq.
+   *
+   * This is called by DataStore right before committing a transaction, so
+   * that the collection counter rows are locked only for a short period of
+   * time. They are locked in ascending id order, followed by the collection
+   * tree revision.
+   * @returns @c false on database errors
+   */
+  bool recordChanges( const NotificationMessageV3::List &notifications );
+
+  /**
+   * Increases the modseq counter of collection @p collectionId and returns
+   * its new value.
+   * @returns -1 if the collection does not exist or on database errors
+   */
+  qint64 nextModSeq( Collection::Id collectionId );
+
+  /**
+   * Returns the highest modseq of collection @p collectionId, bypassing
+   * the Collection entity cache.
+   * @returns -1 if the collection does not exist or on database errors
+   */
+  qint64 highestModSeq( Collection::Id collectionId );
+
+  /**
+   * Returns IDs of items that were removed from collection @p collectionId
+   * after @p modseq.
+   */
+  QVector<PimItem::Id> vanishedItems( Collection::Id collectionId, qint64 modseq );
+
+  /**
+   * Increases the collection tree revision and returns its new value.
+   * @returns -1 on database errors
+   */
+  qint64 nextTreeRevision();
+
+  /**
+   * Returns the current collection tree revision.
+   * @returns -1 on database errors
+   */
+  qint64 treeRevision();
+
+  /**
+   * Returns IDs of collections that were removed after @p treeRevision,
+   * optionally limited to those that belonged to resource @p resourceId.
+   */
+  QVector<Collection::Id> removedCollections( qint64 treeRevision, Resource::Id resourceId = -1 );
+
+  /**
+   * Returns the oldest modseq of collection @p collectionId that removed
+   * items can still be reported for, tombstones of older removals may have
+   * been pruned. Clients that have only seen an older modseq have to
+   * resynchronize the whole collection.
+   * @returns -1 if the collection does not exist or on database errors
+   */
+  qint64 modSeqHorizon( Collection::Id collectionId );
+
+  /**
+   * Returns the oldest collection tree revision that removed collections
+   * can still be reported for, see modSeqHorizon().
+   * @returns -1 on database errors
+   */
+  qint64 treeRevisionHorizon();
+
+  /**
+   * Removes the tombstones of items and collections that were removed
+   * before modSeqHorizon() or treeRevisionHorizon() respectively.
+   * @returns @c false on database errors
+   */
+  bool pruneTombstones();
+
+} // namespace ModSeqHelper
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
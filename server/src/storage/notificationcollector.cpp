@@ -20,6 +20,7 @@
 #include "notificationcollector.h"
 #include "storage/datastore.h"
 #include "storage/entity.h"
+#include "storage/modseqhelper.h"
 #include "handlerhelper.h"
 #include "cachecleaner.h"
 #include "intervalcheck.h"
@@ -28,7 +29,10 @@
 #include "libs/notificationmessagev2_p_p.h"
 #include <search.h>
 
+#include <akstandarddirs.h>
+
 #include <QtCore/QDebug>
+#include <QtCore/QSettings>
 
 using namespace Akonadi;
 using namespace Akonadi::Server;
@@ -241,6 +245,42 @@ void NotificationCollector::setSessionId( const QByteArray &sessionId )
   mSessionId = sessionId;
 }
 
+static int readMaximumEntities()
+{
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  return qMax( 1, settings.value( QLatin1String( "NotificationManager/MaximumEntities" ), 5000 ).toInt() );
+}
+
+int NotificationCollector::maximumEntities()
+{
+  // Collectors live in all connection threads
+  static const int maximum = readMaximumEntities();
+  return maximum;
+}
+
+QList<NotificationMessageV3::List> NotificationCollector::batches( const NotificationMessageV3::List &notifications )
+{
+  const int maximum = maximumEntities();
+  QList<NotificationMessageV3::List> result;
+  NotificationMessageV3::List batch;
+  int entities = 0;
+  Q_FOREACH ( const NotificationMessageV3 &msg, notifications ) {
+    // Tag and relation notifications carry no entities, they still cost something
+    const int count = qMax( 1, msg.entities().count() );
+    if ( !batch.isEmpty() && entities + count > maximum ) {
+      result << batch;
+      batch.clear();
+      entities = 0;
+    }
+    batch << msg;
+    entities += count;
+  }
+  if ( !batch.isEmpty() ) {
+    result << batch;
+  }
+  return result;
+}
+
 void NotificationCollector::itemNotification( NotificationMessageV2::Operation op,
                                               const PimItem &item,
                                               const Collection &collection,
@@ -266,6 +306,40 @@ void NotificationCollector::itemNotification( NotificationMessageV2::Operation o
                                              const Relation::List &addedRelations,
                                              const Relation::List &removedRelations)
 {
+  // Modseqs and tombstones are recorded for the parent collection of a
+  // notification, so items of several collections are reported separately.
+  if ( !collection.isValid() && items.count() > 1 ) {
+    QMap<Collection::Id, PimItem::List> itemsByCollection;
+    Q_FOREACH ( const PimItem &item, items ) {
+      itemsByCollection[item.collectionId()] << item;
+    }
+    if ( itemsByCollection.count() > 1 ) {
+      QMap<Collection::Id, PimItem::List>::const_iterator it = itemsByCollection.constBegin();
+      for ( ; it != itemsByCollection.constEnd(); ++it ) {
+        itemNotification( op, it.value(), collection, collectionDest, resource, parts, addedFlags, removedFlags,
+                          addedTags, removedTags, addedRelations, removedRelations );
+      }
+      return;
+    }
+  }
+
+  // Huge notifications have to be built, marshalled and parsed in one go
+  // by the server, D-Bus and every client, so split them into chunks. Each
+  // chunk is a complete notification on its own and they are emitted in order.
+  const int chunkSize = maximumEntities();
+  if ( items.count() > chunkSize ) {
+    for ( int i = 0; i < items.count(); i += chunkSize ) {
+      PimItem::List chunk;
+      chunk.reserve( qMin( chunkSize, items.count() - i ) );
+      for ( int j = i; j < i + chunkSize && j < items.count(); ++j ) {
+        chunk << items.at( j );
+      }
+      itemNotification( op, chunk, collection, collectionDest, resource, parts, addedFlags, removedFlags,
+                        addedTags, removedTags, addedRelations, removedRelations );
+    }
+    return;
+  }
+
   Collection notificationDestCollection;
   QMap<Entity::Id, QList<PimItem> > vCollections;
 
@@ -407,6 +481,8 @@ void NotificationCollector::dispatchNotification( const NotificationMessageV3 &m
   } else {
     NotificationMessageV3::List l;
     l << msg;
+    ModSeqHelper::recordChanges( l );
+    SearchManager::instance()->indexNotifications( l );
     Q_EMIT notify( l );
   }
 }
@@ -414,7 +490,17 @@ void NotificationCollector::dispatchNotification( const NotificationMessageV3 &m
 void NotificationCollector::dispatchNotifications()
 {
   if ( !mNotifications.isEmpty() ) {
-    Q_EMIT notify( mNotifications );
+    SearchManager::instance()->indexNotifications( mNotifications );
+    // Hand huge transactions over in batches, the manager delivers
+    // each of them as soon as it arrives
+    Q_FOREACH ( const NotificationMessageV3::List &batch, batches( mNotifications ) ) {
+      Q_EMIT notify( batch );
+    }
     clear();
   }
 }
+
+NotificationMessageV3::List NotificationCollector::pendingNotifications() const
+{
+  return mNotifications;
+}
@@ -66,6 +66,20 @@ class NotificationCollector : public QObject
     */
     void setSessionId( const QByteArray &sessionId );
 
+    /**
+      Returns the maximum number of items in a single notification, changes
+      of more items are split into several notifications. Configured with
+      NotificationManager/MaximumEntities, default is 5000.
+    */
+    static int maximumEntities();
+
+    /**
+      Splits @p notifications into consecutive batches of at most
+      maximumEntities() entities each, so that they can be delivered one
+      after the other. The order of the notifications is kept.
+    */
+    static QList<NotificationMessageV3::List> batches( const NotificationMessageV3::List &notifications );
+
     /**
       Notify about an added item.
       Provide as many parameters as you have at hand currently, everything
@@ -216,6 +230,11 @@ class NotificationCollector : public QObject
     */
     void dispatchNotifications();
 
+    /**
+      Returns the notifications collected in the current transaction so far.
+    */
+    NotificationMessageV3::List pendingNotifications() const;
+
   Q_SIGNALS:
     void notify( const Akonadi::NotificationMessageV3::List &msgs );
 
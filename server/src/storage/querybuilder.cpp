@@ -96,6 +96,7 @@ QueryBuilder::QueryBuilder( const QString &table, QueryBuilder::QueryType type )
    , mType( type )
    , mIdentificationColumn( QLatin1String( "id" ) )
    , mLimit( -1 )
+   , mOffset( -1 )
    , mDistinct( false )
 {
 }
@@ -315,6 +316,9 @@ QString QueryBuilder::buildQuery()
 
   if ( mLimit > 0 ) {
     statement += QLatin1Literal( " LIMIT " ) + QString::number( mLimit );
+    if ( mOffset > 0 ) {
+      statement += QLatin1Literal( " OFFSET " ) + QString::number( mOffset );
+    }
   }
 
   return statement;
@@ -539,6 +543,11 @@ void QueryBuilder::setLimit( int limit )
   mLimit = limit;
 }
 
+void QueryBuilder::setOffset( int offset )
+{
+  mOffset = offset;
+}
+
 void QueryBuilder::setIdentificationColumn( const QString &column )
 {
   mIdentificationColumn = column;
@@ -205,6 +205,13 @@ class QueryBuilder
      */
     void setLimit( int limit );
 
+    /**
+     * Skips the given amount of rows at the beginning of the result.
+     * @param offset the number of rows to skip.
+     * @note This has only an effect on SELECT queries with a limit set.
+     */
+    void setOffset( int offset );
+
     /**
      * Sets the column used for identification in an INSERT statement.
      * The default is "id", only change this on tables without such a column
@@ -266,6 +273,7 @@ class QueryBuilder
     QStringList mJoinedTables;
     QMap< QString, QPair< JoinType, Query::Condition > > mJoins;
     int mLimit;
+    int mOffset;
     bool mDistinct;
 #ifdef QUERYBUILDER_UNITTEST
     QString mStatement;
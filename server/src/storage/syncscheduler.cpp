@@ -0,0 +1,467 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "syncscheduler.h"
+#include "itemretrievalmanager.h"
+#include "dbusconnectionpool.h"
+
+#include <akdbus.h>
+#include <akdebug.h>
+#include <akstandarddirs.h>
+
+#include <QCoreApplication>
+#include <QDBusConnectionInterface>
+#include <QDBusMessage>
+#include <QDBusPendingCallWatcher>
+#include <QDBusPendingReply>
+#include <QSettings>
+#include <QTimer>
+
+using namespace Akonadi::Server;
+
+/// Agent states as defined by AgentBase::Status
+static const int AgentStatusIdle = 0;
+static const int AgentStatusBroken = 2;
+static const int AgentStatusNotConfigured = 3;
+
+/// How often running synchronizations are checked for the timeout, in milliseconds
+static const int TimeoutCheckInterval = 15 * 1000;
+
+static const char *AgentStatusInterface = "org.freedesktop.Akonadi.Agent.Status";
+
+SyncQueue::SyncQueue( int maximumSyncs, int maximumSyncsPerResource )
+  : mMaximumSyncs( maximumSyncs )
+  , mMaximumSyncsPerResource( maximumSyncsPerResource )
+  , mRunningCount( 0 )
+{
+}
+
+bool SyncQueue::enqueue( const Key &key, Priority priority, qint64 now )
+{
+  // The running synchronization will pick up the changes that made the
+  // request necessary
+  Q_FOREACH ( const Request &running, mRunning.value( key.first ) ) {
+    if ( running.key == key ) {
+      return false;
+    }
+  }
+
+  const QHash<Key, Priority>::const_iterator queued = mQueued.constFind( key );
+  if ( queued != mQueued.constEnd() ) {
+    if ( queued.value() <= priority ) {
+      return false;
+    }
+
+    // Someone is waiting for a collection that was only due for an interval
+    // check: move it up
+    QList<Request> &queue = mQueues[queued.value()];
+    for ( int i = 0; i < queue.count(); ++i ) {
+      if ( queue.at( i ).key == key ) {
+        Request request = queue.takeAt( i );
+        request.priority = priority;
+        mQueues[priority].append( request );
+        break;
+      }
+    }
+    mQueued.insert( key, priority );
+    return false;
+  }
+
+  Request request;
+  request.key = key;
+  request.priority = priority;
+  request.queued = now;
+  request.time = now;
+  mQueues[priority].append( request );
+  mQueued.insert( key, priority );
+  return true;
+}
+
+QList<SyncQueue::Request> SyncQueue::start( qint64 now )
+{
+  QList<Request> started;
+  for ( int priority = 0; priority < PriorityCount; ++priority ) {
+    QList<Request> &queue = mQueues[priority];
+    for ( QList<Request>::iterator it = queue.begin(); it != queue.end(); ) {
+      // Someone is waiting for on-demand requests, the total limit only
+      // keeps background synchronization in check
+      if ( priority != OnDemand && mRunningCount >= mMaximumSyncs ) {
+        return started;
+      }
+
+      QList<Request> &running = mRunning[it->key.first];
+      if ( running.count() >= mMaximumSyncsPerResource ) {
+        ++it;
+        continue;
+      }
+
+      Request request = *it;
+      it = queue.erase( it );
+      mQueued.remove( request.key );
+
+      request.time = now;
+      running.append( request );
+      ++mRunningCount;
+      started << request;
+    }
+  }
+  return started;
+}
+
+QList<SyncQueue::Request> SyncQueue::finish( const QString &resource )
+{
+  const QList<Request> running = mRunning.take( resource );
+  mRunningCount -= running.count();
+  return running;
+}
+
+void SyncQueue::touch( const QString &resource, qint64 now )
+{
+  QHash<QString, QList<Request> >::iterator it = mRunning.find( resource );
+  if ( it == mRunning.end() ) {
+    return;
+  }
+  for ( int i = 0; i < it->count(); ++i ) {
+    ( *it )[i].time = now;
+  }
+}
+
+QStringList SyncQueue::expired( qint64 now, qint64 timeout ) const
+{
+  QStringList resources;
+  for ( QHash<QString, QList<Request> >::const_iterator it = mRunning.constBegin(); it != mRunning.constEnd(); ++it ) {
+    Q_FOREACH ( const Request &request, it.value() ) {
+      if ( now - request.time > timeout ) {
+        resources << it.key();
+        break;
+      }
+    }
+  }
+  return resources;
+}
+
+QList<SyncQueue::Request> SyncQueue::queued() const
+{
+  QList<Request> requests;
+  for ( int priority = 0; priority < PriorityCount; ++priority ) {
+    requests += mQueues[priority];
+  }
+  return requests;
+}
+
+QList<SyncQueue::Request> SyncQueue::running() const
+{
+  QList<Request> requests;
+  for ( QHash<QString, QList<Request> >::const_iterator it = mRunning.constBegin(); it != mRunning.constEnd(); ++it ) {
+    requests += it.value();
+  }
+  return requests;
+}
+
+int SyncQueue::runningCount() const
+{
+  return mRunningCount;
+}
+
+SyncScheduler *SyncScheduler::sInstance = 0;
+
+SyncScheduler::SyncScheduler( QObject *parent )
+  : QObject( parent )
+  , mConnection( DBusConnectionPool::threadConnection() )
+{
+  // make sure we are created from the retrieval thread and only once
+  Q_ASSERT( QThread::currentThread() != QCoreApplication::instance()->thread() );
+  Q_ASSERT( sInstance == 0 );
+  sInstance = this;
+
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mQueue = SyncQueue( qMax( 1, settings.value( QLatin1String( "Sync/MaximumConcurrentSyncs" ), 4 ).toInt() ),
+                      qMax( 1, settings.value( QLatin1String( "Sync/MaximumConcurrentSyncsPerResource" ), 1 ).toInt() ) );
+  mTimeout = qMax( 1, settings.value( QLatin1String( "Sync/Timeout" ), 60 ).toInt() );
+  mClock.start();
+
+  // All agents report their status on the same interface, the sender is
+  // looked up in the slots
+  mConnection.connect( QString(), QLatin1String( "/" ), QLatin1String( AgentStatusInterface ),
+                       QLatin1String( "status" ), this, SLOT(resourceStatusChanged(int,QString)) );
+  mConnection.connect( QString(), QLatin1String( "/" ), QLatin1String( AgentStatusInterface ),
+                       QLatin1String( "percent" ), this, SLOT(resourceProgress(int)) );
+  mConnection.connect( QString(), QLatin1String( "/" ), QLatin1String( AgentStatusInterface ),
+                       QLatin1String( "onlineChanged" ), this, SLOT(resourceOnlineChanged(bool)) );
+  connect( mConnection.interface(), SIGNAL(serviceOwnerChanged(QString,QString,QString)),
+           this, SLOT(serviceOwnerChanged(QString,QString,QString)) );
+
+  mTimeoutTimer = new QTimer( this );
+  connect( mTimeoutTimer, SIGNAL(timeout()), this, SLOT(expireRunningSyncs()) );
+  mTimeoutTimer->start( TimeoutCheckInterval );
+
+  // Calls are delivered in our thread
+  QDBusConnection::sessionBus().registerObject( QLatin1String( "/SyncScheduler" ), this,
+                                                QDBusConnection::ExportScriptableSlots );
+}
+
+SyncScheduler::~SyncScheduler()
+{
+  QDBusConnection::sessionBus().unregisterObject( QLatin1String( "/SyncScheduler" ) );
+  sInstance = 0;
+}
+
+SyncScheduler *SyncScheduler::instance()
+{
+  Q_ASSERT( sInstance );
+  return sInstance;
+}
+
+// called from any thread
+void SyncScheduler::scheduleCollectionSync( const QString &resource, qint64 collectionId, SyncQueue::Priority priority )
+{
+  QMetaObject::invokeMethod( this, "enqueue", Qt::QueuedConnection,
+                             Q_ARG( QString, resource ),
+                             Q_ARG( qint64, collectionId ),
+                             Q_ARG( int, priority ) );
+}
+
+// called from any thread
+void SyncScheduler::scheduleCollectionTreeSync( const QString &resource, SyncQueue::Priority priority )
+{
+  scheduleCollectionSync( resource, 0, priority );
+}
+
+void SyncScheduler::enqueue( const QString &resource, qint64 collectionId, int priority )
+{
+  if ( resource.isEmpty() ) {
+    return;
+  }
+
+  mQueue.enqueue( SyncQueue::Key( resource, collectionId ), static_cast<SyncQueue::Priority>( priority ), mClock.elapsed() );
+  dispatch();
+}
+
+void SyncScheduler::dispatch()
+{
+  // Offline resources give their slots back right away, which can make
+  // room for more requests
+  Q_FOREVER {
+    const QList<SyncQueue::Request> started = mQueue.start( mClock.elapsed() );
+    if ( started.isEmpty() ) {
+      return;
+    }
+
+    QStringList offline;
+    Q_FOREACH ( const SyncQueue::Request &request, started ) {
+      const QString resource = request.key.first;
+      akDebug() << "Starting" << describe( request ) << "after" << request.time - request.queued << "ms in the queue";
+
+      // Remember who the resource is, its status signals only carry the unique name
+      if ( !mResourceOwners.contains( resource ) ) {
+        const QString owner = mConnection.interface()->serviceOwner( AkDBus::agentServiceName( resource, AkDBus::Agent ) );
+        if ( !owner.isEmpty() ) {
+          mResourceOwners.insert( resource, owner );
+        }
+      }
+
+      // Offline resources only queue the request, they won't become idle
+      // before they are online again
+      const QHash<QString, bool>::const_iterator online = mResourceOnline.constFind( resource );
+      if ( online == mResourceOnline.constEnd() ) {
+        QDBusMessage msg = QDBusMessage::createMethodCall( AkDBus::agentServiceName( resource, AkDBus::Agent ),
+                                                           QLatin1String( "/" ),
+                                                           QLatin1String( AgentStatusInterface ),
+                                                           QLatin1String( "isOnline" ) );
+        QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher( mConnection.asyncCall( msg ), this );
+        watcher->setProperty( "resource", resource );
+        connect( watcher, SIGNAL(finished(QDBusPendingCallWatcher*)),
+                 this, SLOT(onlineStateReceived(QDBusPendingCallWatcher*)) );
+      } else if ( !online.value() && !offline.contains( resource ) ) {
+        offline << resource;
+      }
+
+      if ( request.key.second == 0 ) {
+        QMetaObject::invokeMethod( ItemRetrievalManager::instance(), "triggerCollectionTreeSync",
+                                   Q_ARG( QString, resource ) );
+      } else {
+        QMetaObject::invokeMethod( ItemRetrievalManager::instance(), "triggerCollectionSync",
+                                   Q_ARG( QString, resource ),
+                                   Q_ARG( qint64, request.key.second ) );
+      }
+    }
+
+    if ( offline.isEmpty() ) {
+      return;
+    }
+    Q_FOREACH ( const QString &resource, offline ) {
+      releaseRunningSyncs( resource );
+    }
+  }
+}
+
+bool SyncScheduler::releaseRunningSyncs( const QString &resource )
+{
+  const QList<SyncQueue::Request> running = mQueue.finish( resource );
+  Q_FOREACH ( const SyncQueue::Request &request, running ) {
+    akDebug() << "Finished" << describe( request ) << "in" << mClock.elapsed() - request.time << "ms";
+  }
+  return !running.isEmpty();
+}
+
+void SyncScheduler::finishRunningSyncs( const QString &resource )
+{
+  if ( releaseRunningSyncs( resource ) ) {
+    dispatch();
+  }
+}
+
+QString SyncScheduler::resourceForService( const QString &uniqueName ) const
+{
+  for ( QHash<QString, QString>::const_iterator it = mResourceOwners.constBegin(); it != mResourceOwners.constEnd(); ++it ) {
+    if ( it.value() == uniqueName ) {
+      return it.key();
+    }
+  }
+  return QString();
+}
+
+QString SyncScheduler::senderResource() const
+{
+  if ( !calledFromDBus() ) {
+    return QString();
+  }
+  return resourceForService( message().service() );
+}
+
+void SyncScheduler::resourceStatusChanged( int status, const QString &message )
+{
+  Q_UNUSED( message );
+
+  const QString resource = senderResource();
+  if ( resource.isEmpty() ) {
+    return;
+  }
+
+  // Anything else than idle means the resource is either still working or
+  // unable to do so (broken, not configured), which won't change soon
+  if ( status != AgentStatusIdle && status != AgentStatusBroken && status != AgentStatusNotConfigured ) {
+    mQueue.touch( resource, mClock.elapsed() );
+    return;
+  }
+
+  finishRunningSyncs( resource );
+}
+
+void SyncScheduler::resourceProgress( int percent )
+{
+  Q_UNUSED( percent );
+
+  const QString resource = senderResource();
+  if ( !resource.isEmpty() ) {
+    mQueue.touch( resource, mClock.elapsed() );
+  }
+}
+
+void SyncScheduler::resourceOnlineChanged( bool online )
+{
+  const QString resource = senderResource();
+  if ( !resource.isEmpty() ) {
+    setResourceOnline( resource, online );
+  }
+}
+
+void SyncScheduler::onlineStateReceived( QDBusPendingCallWatcher *watcher )
+{
+  watcher->deleteLater();
+
+  const QString resource = watcher->property( "resource" ).toString();
+  const QDBusPendingReply<bool> reply = *watcher;
+  if ( reply.isError() ) {
+    // Not an agent we can ask, rely on its status and the timeout
+    return;
+  }
+  setResourceOnline( resource, reply.value() );
+}
+
+void SyncScheduler::setResourceOnline( const QString &resource, bool online )
+{
+  mResourceOnline.insert( resource, online );
+  if ( !online ) {
+    akDebug() << "Resource" << resource << "is offline, releasing its synchronization slots";
+    finishRunningSyncs( resource );
+  }
+}
+
+void SyncScheduler::serviceOwnerChanged( const QString &serviceName, const QString &oldOwner, const QString &newOwner )
+{
+  Q_UNUSED( newOwner );
+  if ( oldOwner.isEmpty() ) {
+    return;
+  }
+
+  AkDBus::AgentType type = AkDBus::Unknown;
+  const QString resource = AkDBus::parseAgentServiceName( serviceName, type );
+  if ( resource.isEmpty() || type != AkDBus::Agent ) {
+    return;
+  }
+
+  // The resource went away (or was restarted), it won't finish anything we asked for
+  mResourceOwners.remove( resource );
+  mResourceOnline.remove( resource );
+  finishRunningSyncs( resource );
+}
+
+void SyncScheduler::expireRunningSyncs()
+{
+  Q_FOREACH ( const QString &resource, mQueue.expired( mClock.elapsed(), mTimeout * 1000ll ) ) {
+    akDebug() << "Resource" << resource << "did not report back in time, releasing its synchronization slots";
+    finishRunningSyncs( resource );
+  }
+}
+
+QString SyncScheduler::describe( const SyncQueue::Request &request )
+{
+  if ( request.key.second == 0 ) {
+    return QString::fromLatin1( "collection tree sync of %1" ).arg( request.key.first );
+  }
+  return QString::fromLatin1( "sync of collection %1 of %2" ).arg( request.key.second ).arg( request.key.first );
+}
+
+QStringList SyncScheduler::queue() const
+{
+  static const char *priorityNames[SyncQueue::PriorityCount] = { "on-demand", "interval" };
+
+  const qint64 now = mClock.elapsed();
+  QStringList result;
+  Q_FOREACH ( const SyncQueue::Request &request, mQueue.queued() ) {
+    result << QString::fromLatin1( "%1 (%2, queued for %3 s)" )
+                .arg( describe( request ) )
+                .arg( QLatin1String( priorityNames[request.priority] ) )
+                .arg( ( now - request.queued ) / 1000 );
+  }
+  return result;
+}
+
+QStringList SyncScheduler::runningSyncs() const
+{
+  const qint64 now = mClock.elapsed();
+  QStringList result;
+  Q_FOREACH ( const SyncQueue::Request &request, mQueue.running() ) {
+    result << QString::fromLatin1( "%1 (last heard of %2 s ago)" )
+                .arg( describe( request ) )
+                .arg( ( now - request.time ) / 1000 );
+  }
+  return result;
+}
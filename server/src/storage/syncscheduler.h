@@ -0,0 +1,214 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_SYNCSCHEDULER_H
+#define AKONADI_SYNCSCHEDULER_H
+
+#include <QDBusConnection>
+#include <QDBusContext>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPair>
+#include <QStringList>
+
+class QDBusPendingCallWatcher;
+class QTimer;
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * The queue of the SyncScheduler, without any D-Bus communication.
+ *
+ * Times are in ms on any monotonic clock.
+ */
+class SyncQueue
+{
+  public:
+    enum Priority {
+      OnDemand,     ///< A client is waiting for the collection
+      Interval,     ///< Regular interval check
+      PriorityCount
+    };
+
+    /// Resource and collection, collection 0 stands for the collection tree
+    typedef QPair<QString, qint64> Key;
+
+    struct Request
+    {
+      Key key;
+      Priority priority;
+      /// When the request was queued
+      qint64 queued;
+      /// When the request was started or the resource was last heard of
+      qint64 time;
+    };
+
+    /**
+     * @param maximumSyncs number of synchronizations running at the same
+     *        time, on-demand ones are not limited by it
+     * @param maximumSyncsPerResource number of synchronizations running at
+     *        the same time for a single resource
+     */
+    explicit SyncQueue( int maximumSyncs = 4, int maximumSyncsPerResource = 1 );
+
+    /**
+     * Queues synchronization of @p key. Requests for collections that are
+     * already queued or running are merged with those, an on-demand request
+     * moves a queued interval request up.
+     * @returns @c false if the request was merged
+     */
+    bool enqueue( const Key &key, Priority priority, qint64 now );
+
+    /**
+     * Moves as many queued requests to the running ones as the limits
+     * allow, on-demand ones first, and returns them.
+     */
+    QList<Request> start( qint64 now );
+
+    /**
+     * Removes and returns the running requests of @p resource.
+     */
+    QList<Request> finish( const QString &resource );
+
+    /**
+     * Restarts the timeout of the running requests of @p resource.
+     */
+    void touch( const QString &resource, qint64 now );
+
+    /**
+     * Returns resources with running requests not heard of for more than
+     * @p timeout.
+     */
+    QStringList expired( qint64 now, qint64 timeout ) const;
+
+    /** Returns the queued requests in the order they will be started. */
+    QList<Request> queued() const;
+    QList<Request> running() const;
+    int runningCount() const;
+
+  private:
+    int mMaximumSyncs;
+    int mMaximumSyncsPerResource;
+    /// FIFO queues, one per priority
+    QList<Request> mQueues[PriorityCount];
+    /// Priority of every queued request, for merging duplicates
+    QHash<Key, Priority> mQueued;
+    /// Running synchronizations per resource
+    QHash<QString, QList<Request> > mRunning;
+    int mRunningCount;
+};
+
+/**
+ * Central queue for collection (tree) synchronization requests.
+ *
+ * Interval checks, on-demand syncs and collection references used to
+ * trigger the resources directly, so after a server start every resource
+ * synchronized every due collection at the same time. Requests are now
+ * queued in a SyncQueue instead:
+ *
+ * - a request for a collection that is already queued or being synchronized
+ *   is merged with the existing one,
+ * - only a limited number of synchronizations run at the same time, both in
+ *   total (Sync/MaximumConcurrentSyncs) and per resource
+ *   (Sync/MaximumConcurrentSyncsPerResource),
+ * - on-demand requests, i.e. collections a user is looking at, are started
+ *   before interval checks and regardless of the total limit.
+ *
+ * Resources queue synchronization requests internally and don't report when
+ * a specific collection is done, so all synchronizations of a resource are
+ * considered finished once it reports to be idle again, or when nothing was
+ * heard of it for Sync/Timeout seconds. Offline resources don't synchronize
+ * anything, they don't hold any slots.
+ *
+ * Lives in the ItemRetrievalThread, next to the ItemRetrievalManager that
+ * talks to the resources. The queue is available via D-Bus at /SyncScheduler.
+ */
+class SyncScheduler : public QObject, protected QDBusContext
+{
+  Q_OBJECT
+  Q_CLASSINFO( "D-Bus Interface", "org.freedesktop.Akonadi.SyncScheduler" )
+
+  public:
+    explicit SyncScheduler( QObject *parent = 0 );
+    ~SyncScheduler();
+
+    static SyncScheduler *instance();
+
+    /**
+     * Requests synchronization of collection @p collectionId of @p resource.
+     * Can be called from any thread.
+     */
+    void scheduleCollectionSync( const QString &resource, qint64 collectionId, SyncQueue::Priority priority );
+
+    /**
+     * Requests synchronization of the collection tree of @p resource.
+     * Can be called from any thread.
+     */
+    void scheduleCollectionTreeSync( const QString &resource, SyncQueue::Priority priority );
+
+  public Q_SLOTS:
+    /**
+     * Returns the queued requests in the order they will be started.
+     */
+    Q_SCRIPTABLE QStringList queue() const;
+
+    /**
+     * Returns the synchronizations that are currently running.
+     */
+    Q_SCRIPTABLE QStringList runningSyncs() const;
+
+  private Q_SLOTS:
+    void enqueue( const QString &resource, qint64 collectionId, int priority );
+    void dispatch();
+    void resourceStatusChanged( int status, const QString &message );
+    void resourceProgress( int percent );
+    void resourceOnlineChanged( bool online );
+    void onlineStateReceived( QDBusPendingCallWatcher *watcher );
+    void serviceOwnerChanged( const QString &serviceName, const QString &oldOwner, const QString &newOwner );
+    void expireRunningSyncs();
+
+  private:
+    void finishRunningSyncs( const QString &resource );
+    bool releaseRunningSyncs( const QString &resource );
+    void setResourceOnline( const QString &resource, bool online );
+    QString senderResource() const;
+    QString resourceForService( const QString &uniqueName ) const;
+    static QString describe( const SyncQueue::Request &request );
+
+    static SyncScheduler *sInstance;
+
+    QDBusConnection mConnection;
+    SyncQueue mQueue;
+    QElapsedTimer mClock;
+    /// Unique D-Bus names of the resources we are waiting for
+    QHash<QString, QString> mResourceOwners;
+    /// Last known online state of resources
+    QHash<QString, bool> mResourceOnline;
+
+    int mTimeout;
+    QTimer *mTimeoutTimer;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
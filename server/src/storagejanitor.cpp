@@ -18,6 +18,7 @@
 */
 
 #include "storagejanitor.h"
+#include "backgroundtaskexecutor.h"
 
 #include "storage/queryhelper.h"
 #include "storage/transaction.h"
@@ -38,7 +39,10 @@
 
 #include <agentmanagerinterface.h>
 
+#include <QSettings>
 #include <QStringBuilder>
+#include <QTimer>
+#include <QtConcurrentRun>
 #include <QtDBus/QDBusConnection>
 #include <QtSql/QSqlQuery>
 #include <QtSql/QSqlError>
@@ -51,24 +55,120 @@
 
 using namespace Akonadi::Server;
 
-StorageJanitorThread::StorageJanitorThread( QObject *parent )
-  : QThread( parent )
+/// Number of rows checked at once by chunked steps of the consistency check
+static const qint64 CheckChunkSize = 1000;
+
+/// Interval of progress reports, in ms
+static const int ProgressInterval = 1000;
+
+static QString checkpointFile()
+{
+  return AkStandardDirs::saveDir( "data" ) + QLatin1String( "/janitor_checkpoint" );
+}
+
+static QSet<QString> listExternalFiles( const QString &dataDir )
+{
+  QSet<QString> files;
+  QDirIterator it( dataDir, QDir::Files );
+  while ( it.hasNext() ) {
+    files.insert( it.next() );
+  }
+  return files;
+}
+
+static qint64 maximumId( const QString &table )
 {
+  QueryBuilder qb( table, QueryBuilder::Select );
+  qb.addAggregation( QLatin1String( "id" ), QLatin1String( "max" ) );
+  if ( !qb.exec() || !qb.query().next() ) {
+    return 0;
+  }
+  return qb.query().value( 0 ).toLongLong();
 }
 
-void StorageJanitorThread::run()
+/**
+ * Finds the next chunk of at most CheckChunkSize rows of @p table starting
+ * at id @p first, stores the highest id in it in @p last and returns the
+ * number of rows in the chunk, or -1 on error.
+ */
+static int nextChunk( const QString &table, qint64 first, qint64 &last )
 {
-  StorageJanitor *janitor = new StorageJanitor;
-  exec();
-  delete janitor;
+  QueryBuilder qb( table, QueryBuilder::Select );
+  qb.addColumn( QLatin1String( "id" ) );
+  qb.addValueCondition( QLatin1String( "id" ), Query::GreaterOrEqual, first );
+  qb.addSortColumn( QLatin1String( "id" ), Query::Ascending );
+  qb.setLimit( CheckChunkSize );
+  if ( !qb.exec() ) {
+    return -1;
+  }
+
+  int rows = 0;
+  QSqlQuery &query = qb.query();
+  while ( query.next() ) {
+    last = query.value( 0 ).toLongLong();
+    ++rows;
+  }
+  query.finish();
+  return rows;
 }
 
+const StorageJanitor::CheckStep StorageJanitor::sCheckSteps[] = {
+  { "Looking for resources in the DB not matching a configured resource...", 0,
+    &StorageJanitor::findOrphanedResources, 0, 0, 0, 0 },
+  { "Looking for collections not belonging to a valid resource...", 0,
+    &StorageJanitor::findOrphanedCollections, 0, 0, 0, 0 },
+  { "Checking collection tree consistency...", 0,
+    &StorageJanitor::checkCollectionTree, 0, 0, 0, 0 },
+  { "Looking for items not belonging to a valid collection...", &PimItem::tableName,
+    0, &StorageJanitor::findOrphanedItems, 0, 0, "Found %1 orphan items." },
+  { "Looking for item parts not belonging to a valid item...", &Part::tableName,
+    0, &StorageJanitor::findOrphanedParts, 0, 0, "Found %1 orphan parts." },
+  // Flags are checked in ranges of the item ids they refer to
+  { "Looking for item flags not belonging to a valid item...", &PimItem::tableName,
+    0, &StorageJanitor::findOrphanedPimItemFlags, 0, 0, "Found and deleted %1 orphan pim item flags." },
+  { "Looking for overlapping external parts...", 0,
+    &StorageJanitor::findOverlappingParts, 0, 0, 0, 0 },
+  { "Verifying external parts...", &Part::tableName,
+    0, &StorageJanitor::verifyExternalParts,
+    &StorageJanitor::beginVerifyExternalParts, &StorageJanitor::finishVerifyExternalParts,
+    "Cleaned up %1 parts with missing external files." },
+  { "Checking size treshold changes...", &Part::tableName,
+    0, &StorageJanitor::checkSizeTreshold, 0, 0, "Moved %1 parts between database and external files." },
+  { "Looking for collections without RID...", 0,
+    &StorageJanitor::findRidLessCollections, 0, 0, 0, 0 },
+  { "Looking for items without RID...", &PimItem::tableName,
+    0, &StorageJanitor::findRidLessItems, 0, 0, "Found %1 items without RID." },
+  { "Looking for dirty items...", &PimItem::tableName,
+    0, &StorageJanitor::findDirtyItems, 0, 0, "Found %1 dirty items." }
+
+  /* TODO some ideas for further checks:
+   * the collection tree is non-cyclic
+   * content type constraints of collections are not violated
+   * find unused flags
+   * find unused mimetypes
+   * check for dead entries in relation tables
+   * check if part size matches file size
+   */
+};
+
+const int StorageJanitor::sCheckStepCount = sizeof( sCheckSteps ) / sizeof( sCheckSteps[0] );
+
 StorageJanitor::StorageJanitor( QObject *parent )
   : QObject( parent )
   , m_connection( DBusConnectionPool::threadConnection() )
   , m_lostFoundCollectionId( -1 )
+  , m_checkStep( -1 )
+  , m_checkPosition( 0 )
+  , m_checkEnd( 0 )
+  , m_checkFindings( 0 )
+  , m_checkedRows( 0 )
 {
-  DataStore::self();
+  m_checkTimer = new QTimer( this );
+  m_checkTimer->setSingleShot( true );
+  connect( m_checkTimer, SIGNAL(timeout()),
+           this, SLOT(checkNextChunk()) );
+
+  // D-Bus calls are delivered to the thread the janitor is moved to
   m_connection.registerService( AkDBus::serviceName( AkDBus::StorageJanitor ) );
   m_connection.registerObject( QLatin1String( AKONADI_DBUS_STORAGEJANITOR_PATH ), this, QDBusConnection::ExportScriptableSlots | QDBusConnection::ExportScriptableSignals );
 }
@@ -77,56 +177,151 @@ StorageJanitor::~StorageJanitor()
 {
   m_connection.unregisterObject( QLatin1String( AKONADI_DBUS_STORAGEJANITOR_PATH ), QDBusConnection::UnregisterTree );
   m_connection.unregisterService( AkDBus::serviceName( AkDBus::StorageJanitor ) );
-  m_connection.disconnectFromBus( m_connection.name() );
 
-  DataStore::self()->close();
+  // The checkpoint is up to date, the check continues after the next start
+  if ( m_externalFileScan.isRunning() ) {
+    m_externalFileScan.waitForFinished();
+  }
 }
 
 void StorageJanitor::check() // implementation of `akonadictl fsck`
 {
-  m_lostFoundCollectionId = -1; // start with a fresh one each time
+  if ( m_checkStep >= 0 ) {
+    inform( "Consistency check already running." );
+    return;
+  }
 
-  inform( "Looking for resources in the DB not matching a configured resource..." );
-  findOrphanedResources();
+  startCheck( 0, 0 );
+}
 
-  inform( "Looking for collections not belonging to a valid resource..." );
-  findOrphanedCollections();
+void StorageJanitor::resumeCheck()
+{
+  if ( m_checkStep >= 0 || !QFile::exists( checkpointFile() ) ) {
+    return;
+  }
 
-  inform( "Checking collection tree consistency..." );
-  const Collection::List cols = Collection::retrieveAll();
-  std::for_each( cols.begin(), cols.end(), boost::bind( &StorageJanitor::checkPathToRoot, this, _1 ) );
+  const QSettings checkpoint( checkpointFile(), QSettings::IniFormat );
+  const int step = checkpoint.value( QLatin1String( "Check/Step" ), -1 ).toInt();
+  const qint64 position = checkpoint.value( QLatin1String( "Check/Position" ), 0 ).toLongLong();
+  if ( step < 0 || step >= sCheckStepCount ) {
+    removeCheckpoint();
+    return;
+  }
 
-  inform( "Looking for items not belonging to a valid collection..." );
-  findOrphanedItems();
+  inform( QString::fromLatin1( "Resuming interrupted consistency check at step %1 of %2..." ).arg( step + 1 ).arg( sCheckStepCount ) );
+  startCheck( step, position );
+}
 
-  inform( "Looking for item parts not belonging to a valid item..." );
-  findOrphanedParts();
+void StorageJanitor::startCheck( int step, qint64 position )
+{
+  m_lostFoundCollectionId = -1; // start with a fresh one each time
+  m_checkedRows = 0;
+  m_checkDuration.start();
+  m_lastProgress.start();
+
+  // Listing the payload files does not need the database, do it while the
+  // other steps run
+  m_externalFiles.clear();
+  m_usedExternalFiles.clear();
+  m_externalFileScan = QtConcurrent::run( listExternalFiles, AkStandardDirs::saveDir( "data", QLatin1String( "file_db_data" ) ) );
+
+  m_checkStep = step;
+  m_checkPosition = position;
+  beginCheckStep();
+  saveCheckpoint();
+  m_checkTimer->start( 0 );
+}
 
-  inform( "Looking for item flags not belonging to a valid item..." );
-  findOrphanedPimItemFlags();
+void StorageJanitor::beginCheckStep()
+{
+  const CheckStep &step = sCheckSteps[m_checkStep];
+  inform( step.description );
+  m_checkFindings = 0;
+  m_checkEnd = step.table ? maximumId( step.table() ) : 0;
+  if ( step.begin ) {
+    ( this->*step.begin )();
+  }
+}
 
-  inform( "Looking for overlapping external parts..." );
-  findOverlappingParts();
+void StorageJanitor::checkNextChunk()
+{
+  const CheckStep &step = sCheckSteps[m_checkStep];
+  if ( step.runChunk ) {
+    // Chunks span the ids of the next CheckChunkSize rows, so that gaps
+    // in the ids don't turn into lots of empty chunks
+    qint64 last = m_checkPosition - 1;
+    const int rows = nextChunk( step.table(), m_checkPosition, last );
+    if ( rows < 0 ) {
+      inform( QString::fromLatin1( "Failed to read %1, skipping the rest of the step." ).arg( step.table() ) );
+      last = m_checkEnd;
+    } else {
+      if ( rows < CheckChunkSize ) {
+        // The last chunk also covers the rest of the range the step
+        // started with, like flags of items deleted in the meantime
+        last = qMax( last, m_checkEnd );
+      }
+      ( this->*step.runChunk )( m_checkPosition, last );
+      m_checkedRows += rows;
+    }
+    m_checkPosition = last + 1;
+  } else {
+    ( this->*step.run )();
+    m_checkPosition = m_checkEnd + 1;
+  }
 
-  inform( "Verifying external parts..." );
-  verifyExternalParts();
+  if ( m_checkPosition > m_checkEnd ) {
+    if ( step.finish ) {
+      ( this->*step.finish )();
+    }
+    if ( step.summary ) {
+      inform( QString::fromLatin1( step.summary ).arg( m_checkFindings ) );
+    }
 
-  inform( "Checking size treshold changes..." );
-  checkSizeTreshold();
+    if ( ++m_checkStep == sCheckStepCount ) {
+      m_checkStep = -1;
+      m_externalFiles.clear();
+      m_usedExternalFiles.clear();
+      removeCheckpoint();
+      inform( QString::fromLatin1( "Consistency check done, checked %1 rows in %2 seconds." )
+                .arg( m_checkedRows ).arg( m_checkDuration.elapsed() / 1000 ) );
+      return;
+    }
 
-  inform( "Looking for dirty objects..." );
-  findDirtyObjects();
+    m_checkPosition = 0;
+    beginCheckStep();
+  }
 
-  /* TODO some ideas for further checks:
-   * the collection tree is non-cyclic
-   * content type constraints of collections are not violated
-   * find unused flags
-   * find unused mimetypes
-   * check for dead entries in relation tables
-   * check if part size matches file size
-   */
+  saveCheckpoint();
+  reportProgress();
+
+  // Return to the event loop between chunks, so that other tasks and
+  // D-Bus calls get their turn
+  BackgroundTaskExecutor::throttle();
+  m_checkTimer->start( 0 );
+}
 
-  inform( "Consistency check done." );
+void StorageJanitor::saveCheckpoint()
+{
+  QSettings checkpoint( checkpointFile(), QSettings::IniFormat );
+  checkpoint.setValue( QLatin1String( "Check/Step" ), m_checkStep );
+  checkpoint.setValue( QLatin1String( "Check/Position" ), m_checkPosition );
+}
+
+void StorageJanitor::removeCheckpoint()
+{
+  QFile::remove( checkpointFile() );
+}
+
+void StorageJanitor::reportProgress()
+{
+  if ( m_lastProgress.elapsed() < ProgressInterval ) {
+    return;
+  }
+  m_lastProgress.restart();
+
+  const int percent = m_checkEnd > 0 ? int( qMin<qint64>( m_checkPosition, m_checkEnd ) * 100 / m_checkEnd ) : 100;
+  const qint64 elapsed = qMax<qint64>( 1, m_checkDuration.elapsed() );
+  Q_EMIT progress( m_checkStep + 1, sCheckStepCount, percent, int( m_checkedRows * 1000 / elapsed ) );
 }
 
 qint64 StorageJanitor::lostAndFoundCollection()
@@ -235,6 +430,12 @@ void StorageJanitor::findOrphanedCollections()
   }
 }
 
+void StorageJanitor::checkCollectionTree()
+{
+  const Collection::List cols = Collection::retrieveAll();
+  std::for_each( cols.begin(), cols.end(), boost::bind( &StorageJanitor::checkPathToRoot, this, _1 ) );
+}
+
 void StorageJanitor::checkPathToRoot( const Collection &col )
 {
   if ( col.parentId() == 0 ) {
@@ -257,55 +458,68 @@ void StorageJanitor::checkPathToRoot( const Collection &col )
   checkPathToRoot( parent );
 }
 
-void StorageJanitor::findOrphanedItems()
+void StorageJanitor::findOrphanedItems( qint64 first, qint64 last )
 {
-  SelectQueryBuilder<PimItem> qb;
-  qb.addJoin( QueryBuilder::LeftJoin, Collection::tableName(), PimItem::collectionIdFullColumnName(), Collection::idFullColumnName() );
-  qb.addValueCondition( Collection::idFullColumnName(), Query::Is, QVariant() );
-  qb.exec();
-  const PimItem::List orphans = qb.result();
-  if ( orphans.size() > 0 ) {
-    inform( QLatin1Literal( "Found " ) + QString::number( orphans.size() ) + QLatin1Literal( " orphan items." ) );
+  QueryBuilder sqb( PimItem::tableName(), QueryBuilder::Select );
+  sqb.addColumn( PimItem::idFullColumnName() );
+  sqb.addJoin( QueryBuilder::LeftJoin, Collection::tableName(), PimItem::collectionIdFullColumnName(), Collection::idFullColumnName() );
+  sqb.addValueCondition( Collection::idFullColumnName(), Query::Is, QVariant() );
+  sqb.addValueCondition( PimItem::idFullColumnName(), Query::GreaterOrEqual, first );
+  sqb.addValueCondition( PimItem::idFullColumnName(), Query::LessOrEqual, last );
+  if ( !sqb.exec() ) {
+    akError() << "Error:" << sqb.query().lastError().text();
+    return;
+  }
+  QVector<ImapSet::Id> imapIds;
+  while ( sqb.query().next() ) {
+    imapIds.append( sqb.query().value( 0 ).toLongLong() );
+  }
+  sqb.query().finish();
+
+  if ( !imapIds.isEmpty() ) {
+    m_checkFindings += imapIds.size();
     // Attach to lost+found collection
     Transaction transaction( DataStore::self() );
     QueryBuilder qb( PimItem::tableName(), QueryBuilder::Update );
     qint64 col = lostAndFoundCollection();
     qb.setColumnValue( PimItem::collectionIdFullColumnName(), col );
-    QVector<ImapSet::Id> imapIds;
-    Q_FOREACH ( const PimItem &item, orphans ) {
-      imapIds.append( item.id() );
-    }
     ImapSet set;
     set.add( imapIds );
     QueryHelper::setToQuery( set, PimItem::idFullColumnName(), qb );
     if ( qb.exec() && transaction.commit() ) {
-      inform( QLatin1Literal( "Moved orphan items to collection " ) + QString::number( col ) );
+      inform( QLatin1Literal( "Moved " ) + QString::number( imapIds.size() ) + QLatin1Literal( " orphan items to collection " ) + QString::number( col ) );
     } else {
       inform( QLatin1Literal( "Error moving orphan items to collection " ) + QString::number( col ) + QLatin1Literal( " : " ) + qb.query().lastError().text() );
     }
   }
 }
 
-void StorageJanitor::findOrphanedParts()
+void StorageJanitor::findOrphanedParts( qint64 first, qint64 last )
 {
-  SelectQueryBuilder<Part> qb;
+  QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
+  qb.addColumn( Part::idFullColumnName() );
   qb.addJoin( QueryBuilder::LeftJoin, PimItem::tableName(), Part::pimItemIdFullColumnName(), PimItem::idFullColumnName() );
   qb.addValueCondition( PimItem::idFullColumnName(), Query::Is, QVariant() );
-
-  qb.exec();
-  const Part::List orphans = qb.result();
-  if ( orphans.size() > 0 ) {
-    inform( QLatin1Literal( "Found " ) + QString::number( orphans.size() ) + QLatin1Literal( " orphan parts." ) );
+  qb.addValueCondition( Part::idFullColumnName(), Query::GreaterOrEqual, first );
+  qb.addValueCondition( Part::idFullColumnName(), Query::LessOrEqual, last );
+  if ( !qb.exec() ) {
+    akError() << "Error:" << qb.query().lastError().text();
+    return;
+  }
+  while ( qb.query().next() ) {
+    ++m_checkFindings;
     // TODO: create lost+found items for those? delete?
   }
 }
 
-void StorageJanitor::findOrphanedPimItemFlags()
+void StorageJanitor::findOrphanedPimItemFlags( qint64 first, qint64 last )
 {
   QueryBuilder sqb( PimItemFlagRelation::tableName(), QueryBuilder::Select );
   sqb.addColumn( PimItemFlagRelation::leftFullColumnName() );
   sqb.addJoin( QueryBuilder::LeftJoin, PimItem::tableName(), PimItemFlagRelation::leftFullColumnName(), PimItem::idFullColumnName() );
   sqb.addValueCondition( PimItem::idFullColumnName(), Query::Is, QVariant() );
+  sqb.addValueCondition( PimItemFlagRelation::leftFullColumnName(), Query::GreaterOrEqual, first );
+  sqb.addValueCondition( PimItemFlagRelation::leftFullColumnName(), Query::LessOrEqual, last );
   if ( !sqb.exec() ) {
       akError() << "Error:" << sqb.query().lastError().text();
       return;
@@ -314,8 +528,9 @@ void StorageJanitor::findOrphanedPimItemFlags()
   int count = 0;
   while ( sqb.query().next() ) {
     ++count;
-    imapIds.append( sqb.query().value( 0 ).toInt() );
+    imapIds.append( sqb.query().value( 0 ).toLongLong() );
   }
+  sqb.query().finish();
 
   if ( count > 0 ) {
     ImapSet set;
@@ -327,7 +542,7 @@ void StorageJanitor::findOrphanedPimItemFlags()
       return;
     }
 
-    inform( QLatin1Literal( "Found and deleted " ) + QString::number( count ) + QLatin1Literal( " orphan pim item flags." ) );
+    m_checkFindings += count;
   }
 }
 
@@ -354,51 +569,92 @@ void StorageJanitor::findOverlappingParts()
   }
 }
 
-void StorageJanitor::verifyExternalParts()
+void StorageJanitor::beginVerifyExternalParts()
 {
-  QSet<QString> existingFiles;
-  QSet<QString> usedFiles;
+  m_externalFiles = m_externalFileScan.result();
+  m_usedExternalFiles.clear();
+  inform( QLatin1Literal( "Found " ) + QString::number( m_externalFiles.size() ) + QLatin1Literal( " external files." ) );
 
-  // list all files
-  const QString dataDir = AkStandardDirs::saveDir( "data", QLatin1String( "file_db_data" ) );
-  QDirIterator it( dataDir );
-  while ( it.hasNext() ) {
-    existingFiles.insert( it.next() );
-  }
-  existingFiles.remove( dataDir + QDir::separator() + QLatin1String( "." ) );
-  existingFiles.remove( dataDir + QDir::separator() + QLatin1String( ".." ) );
-  inform( QLatin1Literal( "Found " ) + QString::number( existingFiles.size() ) + QLatin1Literal( " external files." ) );
+  // Unreferenced files are only known once all parts were seen, so this
+  // step always starts over
+  m_checkPosition = 0;
+}
 
+void StorageJanitor::verifyExternalParts( qint64 first, qint64 last )
+{
   // list all parts from the db which claim to have an associated file
   QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
   qb.addColumn( Part::dataColumn() );
-  qb.addColumn( Part::pimItemIdColumn() );
   qb.addColumn( Part::idColumn() );
   qb.addValueCondition( Part::externalColumn(), Query::Equals, true );
   qb.addValueCondition( Part::dataColumn(), Query::IsNot, QVariant() );
-  qb.exec();
+  qb.addValueCondition( Part::idColumn(), Query::GreaterOrEqual, first );
+  qb.addValueCondition( Part::idColumn(), Query::LessOrEqual, last );
+  if ( !qb.exec() ) {
+    akError() << "Error:" << qb.query().lastError().text();
+    return;
+  }
+
+  QVariantList missingParts;
   while ( qb.query().next() ) {
-    QString partPath = PartHelper::resolveAbsolutePath( qb.query().value( 0 ).toByteArray() );
-    const Entity::Id pimItemId = qb.query().value( 1 ).value<Entity::Id>();
-    const Entity::Id id = qb.query().value( 2 ).value<Entity::Id>();
-    if ( existingFiles.contains( partPath ) ) {
-      usedFiles.insert( partPath );
+    const QString partPath = PartHelper::resolveAbsolutePath( qb.query().value( 0 ).toByteArray() );
+    const Entity::Id id = qb.query().value( 1 ).value<Entity::Id>();
+    // The file might have been written after the payload directory was listed
+    if ( m_externalFiles.contains( partPath ) || QFile::exists( partPath ) ) {
+      m_usedExternalFiles.insert( partPath );
     } else {
-      inform( QLatin1Literal( "Cleaning up missing external file: " ) + partPath + QLatin1Literal( " for item: " ) + QString::number( pimItemId ) + QLatin1Literal( " on part: " ) + QString::number( id ) );
-
-      Part part;
-      part.setId( id );
-      part.setPimItemId( pimItemId );
-      part.setData( QByteArray() );
-      part.setDatasize( 0 );
-      part.setExternal( false );
-      part.update();
+      inform( QLatin1Literal( "Cleaning up missing external file: " ) + partPath + QLatin1Literal( " on part: " ) + QString::number( id ) );
+      missingParts << id;
     }
   }
-  inform( QLatin1Literal( "Found " ) + QString::number( usedFiles.size() ) + QLatin1Literal( " external parts." ) );
+  qb.query().finish();
+
+  if ( missingParts.isEmpty() ) {
+    return;
+  }
+
+  Transaction transaction( DataStore::self() );
+  QueryBuilder uqb( Part::tableName(), QueryBuilder::Update );
+  uqb.setColumnValue( Part::dataColumn(), QByteArray() );
+  uqb.setColumnValue( Part::datasizeColumn(), 0 );
+  uqb.setColumnValue( Part::externalColumn(), false );
+  uqb.addValueCondition( Part::idColumn(), Query::In, missingParts );
+  if ( !uqb.exec() || !transaction.commit() ) {
+    akError() << "Failed to clean up parts with missing external files:" << uqb.query().lastError().text();
+    return;
+  }
+  m_checkFindings += missingParts.count();
+}
+
+void StorageJanitor::finishVerifyExternalParts()
+{
+  inform( QLatin1Literal( "Found " ) + QString::number( m_usedExternalFiles.size() ) + QLatin1Literal( " external parts." ) );
 
   // see what's left and move it to lost+found
-  const QSet<QString> unreferencedFiles = existingFiles - usedFiles;
+  QSet<QString> unreferencedFiles = m_externalFiles - m_usedExternalFiles;
+  m_externalFiles.clear();
+  m_usedExternalFiles.clear();
+
+  // Files might have got a part after that part's chunk was checked
+  const QStringList candidates = unreferencedFiles.toList();
+  for ( int i = 0; i < candidates.size(); i += CheckChunkSize ) {
+    QVariantList names;
+    Q_FOREACH ( const QString &file, candidates.mid( i, CheckChunkSize ) ) {
+      names << QFileInfo( file ).fileName().toUtf8() << file.toUtf8();
+    }
+    QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
+    qb.addColumn( Part::dataColumn() );
+    qb.addValueCondition( Part::externalColumn(), Query::Equals, true );
+    qb.addValueCondition( Part::dataColumn(), Query::In, names );
+    if ( !qb.exec() ) {
+      akError() << "Error:" << qb.query().lastError().text();
+      return;
+    }
+    while ( qb.query().next() ) {
+      unreferencedFiles.remove( PartHelper::resolveAbsolutePath( qb.query().value( 0 ).toByteArray() ) );
+    }
+  }
+
   if ( !unreferencedFiles.isEmpty() ) {
     const QString lfDir = AkStandardDirs::saveDir( "data", QLatin1String( "file_lost+found" ) );
     Q_FOREACH ( const QString &file, unreferencedFiles ) {
@@ -412,7 +668,7 @@ void StorageJanitor::verifyExternalParts()
   }
 }
 
-void StorageJanitor::findDirtyObjects()
+void StorageJanitor::findRidLessCollections()
 {
   SelectQueryBuilder<Collection> cqb;
   cqb.setSubQueryMode( Query::Or );
@@ -425,27 +681,45 @@ void StorageJanitor::findDirtyObjects()
           + QLatin1Literal( ") has no RID." ) );
   }
   inform( QLatin1Literal( "Found " ) + QString::number( ridLessCols.size() ) + QLatin1Literal( " collections without RID." ) );
+}
 
-  SelectQueryBuilder<PimItem> iqb1;
-  iqb1.setSubQueryMode( Query::Or );
-  iqb1.addValueCondition( PimItem::remoteIdColumn(), Query::Is, QVariant() );
-  iqb1.addValueCondition( PimItem::remoteIdColumn(), Query::Equals, QString() );
-  iqb1.exec();
-  const PimItem::List ridLessItems = iqb1.result();
-  Q_FOREACH ( const PimItem &item, ridLessItems )
-    inform( QLatin1Literal( "Item \"" ) + QString::number( item.id() ) + QLatin1Literal( "\" has no RID." ) );
-  inform( QLatin1Literal( "Found " ) + QString::number( ridLessItems.size() ) + QLatin1Literal( " items without RID." ) );
+void StorageJanitor::findRidLessItems( qint64 first, qint64 last )
+{
+  QueryBuilder qb( PimItem::tableName(), QueryBuilder::Select );
+  qb.addColumn( PimItem::idColumn() );
+  qb.addValueCondition( PimItem::idColumn(), Query::GreaterOrEqual, first );
+  qb.addValueCondition( PimItem::idColumn(), Query::LessOrEqual, last );
+  Query::Condition rid( Query::Or );
+  rid.addValueCondition( PimItem::remoteIdColumn(), Query::Is, QVariant() );
+  rid.addValueCondition( PimItem::remoteIdColumn(), Query::Equals, QString() );
+  qb.addCondition( rid );
+  if ( !qb.exec() ) {
+    akError() << "Error:" << qb.query().lastError().text();
+    return;
+  }
+  while ( qb.query().next() ) {
+    ++m_checkFindings;
+    inform( QLatin1Literal( "Item \"" ) + qb.query().value( 0 ).toString() + QLatin1Literal( "\" has no RID." ) );
+  }
+}
 
-  SelectQueryBuilder<PimItem> iqb2;
-  iqb2.addValueCondition( PimItem::dirtyColumn(), Query::Equals, true );
-  iqb2.addValueCondition( PimItem::remoteIdColumn(), Query::IsNot, QVariant() );
-  iqb2.addSortColumn( PimItem::idFullColumnName() );
-  iqb2.exec();
-  const PimItem::List dirtyItems = iqb2.result();
-  Q_FOREACH ( const PimItem &item, dirtyItems ) {
-    inform( QLatin1Literal( "Item \"" ) + QString::number( item.id() ) + QLatin1Literal( "\" has RID and is dirty." ) );
+void StorageJanitor::findDirtyItems( qint64 first, qint64 last )
+{
+  QueryBuilder qb( PimItem::tableName(), QueryBuilder::Select );
+  qb.addColumn( PimItem::idColumn() );
+  qb.addValueCondition( PimItem::dirtyColumn(), Query::Equals, true );
+  qb.addValueCondition( PimItem::remoteIdColumn(), Query::IsNot, QVariant() );
+  qb.addValueCondition( PimItem::idColumn(), Query::GreaterOrEqual, first );
+  qb.addValueCondition( PimItem::idColumn(), Query::LessOrEqual, last );
+  qb.addSortColumn( PimItem::idColumn() );
+  if ( !qb.exec() ) {
+    akError() << "Error:" << qb.query().lastError().text();
+    return;
+  }
+  while ( qb.query().next() ) {
+    ++m_checkFindings;
+    inform( QLatin1Literal( "Item \"" ) + qb.query().value( 0 ).toString() + QLatin1Literal( "\" has RID and is dirty." ) );
   }
-  inform( QLatin1Literal( "Found " ) + QString::number( dirtyItems.size() ) + QLatin1Literal( " dirty items." ) );
 }
 
 void StorageJanitor::vacuum()
@@ -468,6 +742,19 @@ void StorageJanitor::vacuum()
       if ( !q.exec( queryStr ) ) {
         akError() << "failed to optimize table" << table << ":" << q.lastError().text();
       }
+      BackgroundTaskExecutor::throttle();
+    }
+    inform( "vacuum done" );
+  } else if ( dbType == DbType::Sqlite ) {
+    inform( "vacuuming database, that'll take some time and require a lot of temporary disk space..." );
+    QSqlQuery q( DataStore::self()->database() );
+    // Takes effect with the VACUUM, so the VacuumScheduler can give back
+    // free pages incrementally from then on
+    if ( !q.exec( QLatin1String( "PRAGMA auto_vacuum = INCREMENTAL" ) ) ) {
+      akError() << "failed to enable incremental vacuum:" << q.lastError().text();
+    }
+    if ( !q.exec( QLatin1String( "VACUUM" ) ) ) {
+      akError() << "failed to vacuum database:" << q.lastError().text();
     }
     inform( "vacuum done" );
   } else {
@@ -475,89 +762,117 @@ void StorageJanitor::vacuum()
   }
 }
 
-void StorageJanitor::checkSizeTreshold()
+void StorageJanitor::checkSizeTreshold( qint64 first, qint64 last )
 {
+  const qint64 threshold = DbConfig::configuredDatabase()->sizeThreshold();
+
   {
-    QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
-    qb.addColumn( Part::idFullColumnName() );
+    SelectQueryBuilder<Part> qb;
     qb.addValueCondition( Part::externalFullColumnName(), Query::Equals, false );
-    qb.addValueCondition( Part::datasizeFullColumnName(), Query::Greater, DbConfig::configuredDatabase()->sizeThreshold() );
+    qb.addValueCondition( Part::datasizeFullColumnName(), Query::Greater, threshold );
+    qb.addValueCondition( Part::idFullColumnName(), Query::GreaterOrEqual, first );
+    qb.addValueCondition( Part::idFullColumnName(), Query::LessOrEqual, last );
     qb.exec();
-
-    QSqlQuery query = qb.query();
-    inform( QString::fromLatin1( "Found %1 parts to be moved to external files" ).arg( query.size() ) );
-
-    while ( query.next() ) {
+    Part::List parts = qb.result();
+    if ( !parts.isEmpty() ) {
+      // Write all files first and then update all parts in a single transaction
+      QStringList writtenFiles;
       Transaction transaction( DataStore::self() );
-      Part part = Part::retrieveById( query.value( 0 ).toLongLong() );
-      const QByteArray name = PartHelper::fileNameForPart( &part ).toUtf8() + "_r" + QByteArray::number( part.version() );
-      const QString partPath = PartHelper::resolveAbsolutePath( name );
-      QFile f( partPath );
-      if ( f.exists() ) {
-        akDebug() << "External payload file" << name << "already exists";
-        // That however is not a critical issue, since the part is not external,
-        // so we can safely overwrite it
-      }
-      if ( !f.open( QIODevice::WriteOnly | QIODevice::Truncate ) ) {
-        akError() << "Failed to open file" << name << "for writing";
-        continue;
-      }
-      if ( f.write( part.data() ) != part.datasize() ) {
-        akError() << "Failed to write data to payload file" << name;
-        f.remove();
-        continue;
+      bool ok = true;
+      for ( Part::List::Iterator it = parts.begin(); it != parts.end() && ok; ++it ) {
+        Part &part = *it;
+        const QByteArray name = PartHelper::fileNameForPart( &part ).toUtf8() + "_r" + QByteArray::number( part.version() );
+        const QString partPath = PartHelper::resolveAbsolutePath( name );
+        QFile f( partPath );
+        if ( f.exists() ) {
+          akDebug() << "External payload file" << name << "already exists";
+          // That however is not a critical issue, since the part is not external,
+          // so we can safely overwrite it
+        }
+        if ( !f.open( QIODevice::WriteOnly | QIODevice::Truncate ) ) {
+          akError() << "Failed to open file" << name << "for writing";
+          continue;
+        }
+        if ( f.write( part.data() ) != part.datasize() ) {
+          akError() << "Failed to write data to payload file" << name;
+          f.remove();
+          continue;
+        }
+        writtenFiles << partPath;
+
+        part.setData( name );
+        part.setExternal( true );
+        if ( !part.update() ) {
+          akError() << "Failed to update database entry of part" << part.id();
+          ok = false;
+        }
       }
 
-      part.setData( name );
-      part.setExternal( true );
-      if ( !part.update() || !transaction.commit() ) {
-        akError() << "Failed to update database entry of part" << part.id();
-        f.remove();
-        continue;
+      if ( !writtenFiles.isEmpty() ) {
+        if ( ok && transaction.commit() ) {
+          m_checkFindings += writtenFiles.count();
+          inform( QString::fromLatin1( "Moved %1 parts from database into external files" ).arg( writtenFiles.count() ) );
+        } else {
+          akError() << "Failed to move parts into external files";
+          Q_FOREACH ( const QString &file, writtenFiles ) {
+            QFile::remove( file );
+          }
+        }
       }
-
-      inform( QString::fromLatin1( "Moved part %1 from database into external file %2" ).arg( part.id() ).arg( QString::fromLatin1( name ) ) );
     }
   }
 
   {
-    QueryBuilder qb( Part::tableName(), QueryBuilder::Select );
-    qb.addColumn( Part::idFullColumnName() );
+    SelectQueryBuilder<Part> qb;
     qb.addValueCondition( Part::externalFullColumnName(), Query::Equals, true );
-    qb.addValueCondition( Part::datasizeFullColumnName(), Query::Less, DbConfig::configuredDatabase()->sizeThreshold() );
+    qb.addValueCondition( Part::datasizeFullColumnName(), Query::Less, threshold );
+    qb.addValueCondition( Part::idFullColumnName(), Query::GreaterOrEqual, first );
+    qb.addValueCondition( Part::idFullColumnName(), Query::LessOrEqual, last );
     qb.exec();
-
-    QSqlQuery query = qb.query();
-    inform( QString::fromLatin1( "Found %1 parts to be moved to database" ).arg( query.size() ) );
-
-    while ( query.next() ) {
+    Part::List parts = qb.result();
+    if ( !parts.isEmpty() ) {
+      // Files are only removed once the transaction is committed
+      QStringList readFiles;
       Transaction transaction( DataStore::self() );
-      Part part = Part::retrieveById( query.value( 0 ).toLongLong() );
-      const QString partPath = PartHelper::resolveAbsolutePath( part.data() );
-      QFile f( partPath );
-      if ( !f.exists() ) {
-        akError() << "Part file" << part.data() << "does not exist";
-        continue;
-      }
-      if ( !f.open( QIODevice::ReadOnly ) ) {
-        akError() << "Failed to open part file" << part.data() << "for reading";
-        continue;
+      bool ok = true;
+      for ( Part::List::Iterator it = parts.begin(); it != parts.end() && ok; ++it ) {
+        Part &part = *it;
+        const QString partPath = PartHelper::resolveAbsolutePath( part.data() );
+        QFile f( partPath );
+        if ( !f.exists() ) {
+          akError() << "Part file" << part.data() << "does not exist";
+          continue;
+        }
+        if ( !f.open( QIODevice::ReadOnly ) ) {
+          akError() << "Failed to open part file" << part.data() << "for reading";
+          continue;
+        }
+
+        part.setExternal( false );
+        part.setData( f.readAll() );
+        if ( part.data().size() != part.datasize() ) {
+          akError() << "Sizes of" << part.id() << "data don't match";
+          continue;
+        }
+        if ( !part.update() ) {
+          akError() << "Failed to update database entry of part" << part.id();
+          ok = false;
+          continue;
+        }
+        readFiles << partPath;
       }
 
-      part.setExternal( false );
-      part.setData( f.readAll() );
-      if ( part.data().size() != part.datasize() ) {
-        akError() << "Sizes of" << part.id() << "data don't match";
-        continue;
-      }
-      if ( !part.update() || !transaction.commit() ) {
-        akError() << "Failed to update database entry of part" << part.id();
-        continue;
+      if ( !readFiles.isEmpty() ) {
+        if ( ok && transaction.commit() ) {
+          Q_FOREACH ( const QString &file, readFiles ) {
+            QFile::remove( file );
+          }
+          m_checkFindings += readFiles.count();
+          inform( QString::fromLatin1( "Moved %1 parts from external files into database" ).arg( readFiles.count() ) );
+        } else {
+          akError() << "Failed to move parts into database";
+        }
       }
-
-      f.close();
-      f.remove();
-      inform( QString::fromLatin1( "Moved part %1 from external file into database" ).arg( part.id() ) );
     }
   }
 }
@@ -20,26 +20,24 @@
 #ifndef STORAGEJANITOR_H
 #define STORAGEJANITOR_H
 
-#include <QThread>
+#include <QObject>
+#include <QElapsedTimer>
+#include <QFuture>
+#include <QSet>
 #include <qdbusmacros.h>
 #include <QtDBus/QDBusConnection>
 
+class QTimer;
+
 namespace Akonadi {
 namespace Server {
 
 class Collection;
 
-class StorageJanitorThread : public QThread
-{
-  Q_OBJECT
-  public:
-    explicit StorageJanitorThread( QObject *parent = 0 );
-  protected:
-    virtual void run();
-};
-
 /**
  * Various database checking/maintenance features.
+ *
+ * The janitor is run by the BackgroundTaskExecutor.
  */
 class StorageJanitor : public QObject
 {
@@ -50,21 +48,63 @@ class StorageJanitor : public QObject
     ~StorageJanitor();
 
   public Q_SLOTS:
-    /** Triggers a consistency check of the internal storage. */
+    /**
+     * Triggers a consistency check of the internal storage.
+     *
+     * Large tables are checked in chunks of id ranges, with a return to the
+     * event loop in between. The position of the check is recorded in a
+     * checkpoint file, so that a check interrupted by a shutdown continues
+     * where it stopped once the server runs again.
+     */
     Q_SCRIPTABLE Q_NOREPLY void check();
     /** Triggers a vacuuming of the database, that is compacting of unused space. */
     Q_SCRIPTABLE Q_NOREPLY void vacuum();
 
+    /** Continues a consistency check that was interrupted, if any. */
+    void resumeCheck();
+
   Q_SIGNALS:
     /** Sends informational messages to a possible UI for this. */
     Q_SCRIPTABLE void information( const QString &msg );
 
+    /**
+     * Reports the progress of a consistency check at most once a second:
+     * the current @p step out of @p steps, how much of the step is done in
+     * @p percent and how many rows were checked per second.
+     */
+    Q_SCRIPTABLE void progress( int step, int steps, int percent, int rowsPerSecond );
+
+  private Q_SLOTS:
+    void checkNextChunk();
+
   private:
+    struct CheckStep
+    {
+      const char *description;
+      /** Table whose rows the step is run in chunks on, 0 if it runs at once */
+      QString ( *table )();
+      void ( StorageJanitor::*run )();
+      void ( StorageJanitor::*runChunk )( qint64 first, qint64 last );
+      void ( StorageJanitor::*begin )();
+      void ( StorageJanitor::*finish )();
+      /** Summary of the step, %1 is replaced by the number of findings */
+      const char *summary;
+    };
+
+    static const CheckStep sCheckSteps[];
+    static const int sCheckStepCount;
+
     void inform( const char *msg );
     void inform( const QString &msg );
     /** Create a lost+found collection if necessary. */
     qint64 lostAndFoundCollection();
 
+    void startCheck( int step, qint64 position );
+    void beginCheckStep();
+    void saveCheckpoint();
+    void removeCheckpoint();
+    void reportProgress();
+
     /**
      * Look for resources in the DB not existing in reality.
      */
@@ -75,6 +115,11 @@ class StorageJanitor : public QObject
      */
     void findOrphanedCollections();
 
+    /**
+     * Verifies the path to the root of all collections.
+     */
+    void checkCollectionTree();
+
     /**
      * Verifies there is a path from @p col to the root of the collection tree
      * and that that everything along that path belongs to the same resource.
@@ -84,17 +129,17 @@ class StorageJanitor : public QObject
     /**
      * Look for items belonging to non-existing collections.
      */
-    void findOrphanedItems();
+    void findOrphanedItems( qint64 first, qint64 last );
 
     /**
      * Look for parts belonging to non-existing items.
      */
-    void findOrphanedParts();
+    void findOrphanedParts( qint64 first, qint64 last );
 
     /**
      * Look for item flags belonging to non-existing items.
      */
-    void findOrphanedPimItemFlags();
+    void findOrphanedPimItemFlags( qint64 first, qint64 last );
 
     /**
      * Look for parts referring to the same external file.
@@ -103,13 +148,28 @@ class StorageJanitor : public QObject
 
     /**
      * Verify fs and db part state.
+     *
+     * The payload directory is listed in parallel to the preceding steps,
+     * unreferenced files are moved to lost+found once all parts are checked.
      */
-    void verifyExternalParts();
+    void beginVerifyExternalParts();
+    void verifyExternalParts( qint64 first, qint64 last );
+    void finishVerifyExternalParts();
 
     /**
-     * Look for dirty objects.
+     * Look for collections without remote ID.
      */
-    void findDirtyObjects();
+    void findRidLessCollections();
+
+    /**
+     * Look for items without remote ID.
+     */
+    void findRidLessItems( qint64 first, qint64 last );
+
+    /**
+     * Look for dirty items.
+     */
+    void findDirtyItems( qint64 first, qint64 last );
 
     /**
      * Check whether part sizes match what's in database.
@@ -117,11 +177,24 @@ class StorageJanitor : public QObject
      * If SizeTreshold has change, it will move parts from or to database
      * where necessary.
      */
-    void checkSizeTreshold();
+    void checkSizeTreshold( qint64 first, qint64 last );
 
   private:
     QDBusConnection m_connection;
     qint64 m_lostFoundCollectionId;
+
+    QTimer *m_checkTimer;
+    int m_checkStep;
+    qint64 m_checkPosition;
+    qint64 m_checkEnd;
+    int m_checkFindings;
+    qint64 m_checkedRows;
+    QElapsedTimer m_checkDuration;
+    QElapsedTimer m_lastProgress;
+
+    QFuture<QSet<QString> > m_externalFileScan;
+    QSet<QString> m_externalFiles;
+    QSet<QString> m_usedExternalFiles;
 };
 
 } // namespace Server
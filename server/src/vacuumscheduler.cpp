@@ -0,0 +1,241 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include "vacuumscheduler.h"
+#include "backgroundtaskexecutor.h"
+#include "storage/datastore.h"
+#include "storage/dbtype.h"
+#include "storage/modseqhelper.h"
+#include "entities.h"
+#include "akdebug.h"
+
+#include <akstandarddirs.h>
+
+#include <QSet>
+#include <QSettings>
+#include <QTimer>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+
+using namespace Akonadi::Server;
+
+/// Tables with less reclaimable space are not worth maintaining, in bytes
+static const qint64 MinimumReclaimableBytes = 16 * 1024 * 1024;
+
+/// PostgreSQL tables with less dead tuples are not worth maintaining
+static const qint64 MinimumDeadTuples = 10000;
+
+/// Retry interval while clients are busy, in ms
+static const int RetryInterval = 60 * 1000;
+
+/// Number of pages freed at once by an incremental SQLite vacuum
+static const int IncrementalVacuumPages = 256;
+
+bool VacuumScheduler::TableStatistics::operator<( const TableStatistics &other ) const
+{
+  // Most reclaimable space first
+  return reclaimable > other.reclaimable;
+}
+
+VacuumScheduler::VacuumScheduler( QObject *parent )
+  : QObject( parent )
+{
+  const QSettings settings( AkStandardDirs::serverConfigFile(), QSettings::IniFormat );
+  mInterval = qMax( 1, settings.value( QLatin1String( "Maintenance/VacuumInterval" ), 60 ).toInt() ) * 60 * 1000;
+  mIdleTime = qMax( 0, settings.value( QLatin1String( "Maintenance/VacuumIdleTime" ), 300 ).toInt() );
+  mThreshold = qBound( 1, settings.value( QLatin1String( "Maintenance/VacuumThreshold" ), 20 ).toInt(), 100 );
+
+  mTimer = new QTimer( this );
+  mTimer->setSingleShot( true );
+  connect( mTimer, SIGNAL(timeout()),
+           this, SLOT(maintain()) );
+}
+
+VacuumScheduler::~VacuumScheduler()
+{
+}
+
+void VacuumScheduler::init()
+{
+  mTimer->start( mInterval );
+}
+
+void VacuumScheduler::maintain()
+{
+  if ( BackgroundTaskExecutor::idleTime() < mIdleTime ) {
+    mTimer->start( RetryInterval );
+    return;
+  }
+
+  // Old tombstones are the one thing that grows without bounds otherwise
+  ModSeqHelper::pruneTombstones();
+  BackgroundTaskExecutor::throttle();
+
+  QVector<TableStatistics> tables = fragmentedTables();
+  qSort( tables );
+  Q_FOREACH ( const TableStatistics &table, tables ) {
+    // Stop once clients are back, the remaining tables follow later
+    if ( BackgroundTaskExecutor::idleTime() < mIdleTime ) {
+      mTimer->start( RetryInterval );
+      return;
+    }
+
+    maintainTable( table );
+    BackgroundTaskExecutor::throttle();
+  }
+
+  mTimer->start( mInterval );
+}
+
+QVector<VacuumScheduler::TableStatistics> VacuumScheduler::fragmentedTables()
+{
+  QVector<TableStatistics> tables;
+
+  QSqlQuery query( DataStore::self()->database() );
+  qint64 minimum = MinimumReclaimableBytes;
+  switch ( DbType::type( DataStore::self()->database() ) ) {
+  case DbType::MySQL:
+    // data_free is the free space inside the InnoDB tablespace of the table
+    query.exec( QLatin1String( "SELECT table_name, data_length + index_length, data_free "
+                               "FROM information_schema.tables "
+                               "WHERE table_schema = DATABASE() AND engine = 'InnoDB'" ) );
+    break;
+  case DbType::PostgreSQL:
+    query.exec( QLatin1String( "SELECT relname, n_live_tup + n_dead_tup, n_dead_tup FROM pg_stat_user_tables" ) );
+    minimum = MinimumDeadTuples;
+    break;
+  case DbType::Sqlite: {
+    // SQLite keeps free pages for the whole database file, not per table
+    qint64 values[3];
+    const char *pragmas[] = { "PRAGMA page_size", "PRAGMA page_count", "PRAGMA freelist_count" };
+    for ( int i = 0; i < 3; ++i ) {
+      if ( !query.exec( QLatin1String( pragmas[i] ) ) || !query.next() ) {
+        akError() << "Failed to query database statistics:" << query.lastError().text();
+        return tables;
+      }
+      values[i] = query.value( 0 ).toLongLong();
+    }
+    TableStatistics statistics;
+    statistics.size = values[0] * values[1];
+    statistics.reclaimable = values[0] * values[2];
+    if ( statistics.reclaimable >= minimum && statistics.reclaimable * 100 >= statistics.size * mThreshold ) {
+      tables << statistics;
+    }
+    return tables;
+  }
+  default:
+    return tables;
+  }
+
+  if ( !query.isActive() ) {
+    akError() << "Failed to query table statistics:" << query.lastError().text();
+    return tables;
+  }
+
+  QSet<QString> ownTables;
+  Q_FOREACH ( const QString &table, allDatabaseTables() ) {
+    ownTables.insert( table.toLower() );
+  }
+
+  while ( query.next() ) {
+    TableStatistics statistics;
+    statistics.table = query.value( 0 ).toString();
+    statistics.size = query.value( 1 ).toLongLong();
+    statistics.reclaimable = query.value( 2 ).toLongLong();
+    if ( ownTables.contains( statistics.table.toLower() )
+         && statistics.reclaimable >= minimum
+         && statistics.reclaimable * 100 >= statistics.size * mThreshold ) {
+      tables << statistics;
+    }
+  }
+
+  return tables;
+}
+
+bool VacuumScheduler::maintainTable( const TableStatistics &statistics )
+{
+  QString statement;
+  switch ( DbType::type( DataStore::self()->database() ) ) {
+  case DbType::MySQL:
+    // Rebuilds the table in place while it stays readable and writable.
+    // Servers that cannot do that refuse the statement instead of locking.
+    statement = QString::fromLatin1( "ALTER TABLE %1 FORCE, ALGORITHM=INPLACE, LOCK=NONE" ).arg( statistics.table );
+    break;
+  case DbType::PostgreSQL:
+    // Unlike VACUUM FULL, plain VACUUM does not lock out readers and writers
+    statement = QString::fromLatin1( "VACUUM ANALYZE %1" ).arg( statistics.table );
+    break;
+  case DbType::Sqlite:
+    return incrementalVacuum();
+  default:
+    return false;
+  }
+
+  akDebug() << "Maintaining table" << statistics.table << ":" << statistics.reclaimable << "of" << statistics.size << "reclaimable";
+  QSqlQuery query( DataStore::self()->database() );
+  if ( !query.exec( statement ) ) {
+    akError() << "Failed to maintain table" << statistics.table << ":" << query.lastError().text();
+    return false;
+  }
+  return true;
+}
+
+bool VacuumScheduler::incrementalVacuum()
+{
+  QSqlQuery query( DataStore::self()->database() );
+  if ( !query.exec( QLatin1String( "PRAGMA auto_vacuum" ) ) || !query.next() ) {
+    akError() << "Failed to query auto vacuum mode:" << query.lastError().text();
+    return false;
+  }
+
+  const int mode = query.value( 0 ).toInt();
+  if ( mode == 1 ) {
+    // FULL, SQLite shrinks the file on every commit already
+    return true;
+  } else if ( mode == 0 ) {
+    // Databases created before incremental vacuuming was enabled would have
+    // to be rebuilt, which locks the whole database for a long time and
+    // needs twice its size on disk. Only "akonadictl vacuum" does that.
+    akDebug() << "Database does not support incremental vacuum, run \"akonadictl vacuum\" once to enable it";
+    return false;
+  }
+
+  // Free a few pages at a time, so that clients are never blocked for long
+  Q_FOREVER {
+    if ( !query.exec( QLatin1String( "PRAGMA freelist_count" ) ) || !query.next() ) {
+      akError() << "Failed to query free pages:" << query.lastError().text();
+      return false;
+    }
+    if ( query.value( 0 ).toLongLong() == 0 ) {
+      return true;
+    }
+    if ( BackgroundTaskExecutor::idleTime() < mIdleTime ) {
+      return true;
+    }
+
+    if ( !query.exec( QString::fromLatin1( "PRAGMA incremental_vacuum(%1)" ).arg( IncrementalVacuumPages ) ) ) {
+      akError() << "Failed to vacuum database:" << query.lastError().text();
+      return false;
+    }
+    // Each step of the statement frees one page
+    while ( query.next() ) {
+    }
+    BackgroundTaskExecutor::throttle();
+  }
+}
@@ -0,0 +1,93 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#ifndef AKONADI_VACUUMSCHEDULER_H
+#define AKONADI_VACUUMSCHEDULER_H
+
+#include <QObject>
+#include <QVector>
+
+class QTimer;
+
+namespace Akonadi {
+namespace Server {
+
+/**
+ * Compacts the database incrementally while the server is idle.
+ *
+ * Every Maintenance/VacuumInterval minutes the scheduler measures how much
+ * space each table could give back: free space inside InnoDB tables with
+ * MySQL, dead tuples with PostgreSQL and free pages with SQLite. Tables
+ * where at least Maintenance/VacuumThreshold percent could be reclaimed
+ * are then maintained one at a time, worst first, but only after clients
+ * have been idle for Maintenance/VacuumIdleTime seconds, and only as long
+ * as they stay idle.
+ *
+ * Unlike StorageJanitor::vacuum() this only uses online operations:
+ * ALTER TABLE ... FORCE with MySQL, plain VACUUM ANALYZE with PostgreSQL
+ * and PRAGMA incremental_vacuum with SQLite. SQLite databases created
+ * without incremental auto vacuum are left alone until they are converted
+ * by StorageJanitor::vacuum().
+ *
+ * Before measuring, tombstones that are too old to be asked for anymore are
+ * pruned, see ModSeqHelper::pruneTombstones().
+ *
+ * The scheduler is run by the BackgroundTaskExecutor.
+ */
+class VacuumScheduler : public QObject
+{
+  Q_OBJECT
+
+  public:
+    explicit VacuumScheduler( QObject *parent = 0 );
+    ~VacuumScheduler();
+
+  public Q_SLOTS:
+    /** Starts scheduling, in the thread the scheduler lives in. */
+    void init();
+
+    /** Maintains fragmented tables if the server is idle. */
+    void maintain();
+
+  private:
+    struct TableStatistics
+    {
+      QString table;
+      /** Size of the table in bytes, or in rows for PostgreSQL */
+      qint64 size;
+      /** Reclaimable space, in the same unit as the size */
+      qint64 reclaimable;
+
+      bool operator<( const TableStatistics &other ) const;
+    };
+
+    QVector<TableStatistics> fragmentedTables();
+    bool maintainTable( const TableStatistics &statistics );
+    bool incrementalVacuum();
+
+    QTimer *mTimer;
+    int mInterval;
+    int mIdleTime;
+    int mThreshold;
+};
+
+} // namespace Server
+} // namespace Akonadi
+
+#endif
@@ -0,0 +1,199 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtCore/QFile>
+#include <QtTest/QTest>
+
+#include "fakeakonadiserver.h"
+#include "aktest.h"
+#include "akdebug.h"
+#include "entities.h"
+#include "dbinitializer.h"
+#include "cachecleaner.h"
+#include "storage/parthelper.h"
+#include "storage/parttypehelper.h"
+#include "storage/transaction.h"
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+class CacheCleanerTest : public QObject
+{
+  Q_OBJECT
+
+  public:
+    CacheCleanerTest()
+      : QObject()
+    {
+      try {
+        FakeAkonadiServer::instance()->setPopulateDb( false );
+        FakeAkonadiServer::instance()->init();
+      } catch ( const FakeAkonadiServerException &e ) {
+        akError() << "Server exception: " << e.what();
+        akFatal() << "Fake Akonadi Server failed to start up, aborting test";
+      }
+    }
+
+    ~CacheCleanerTest()
+    {
+      FakeAkonadiServer::instance()->quit();
+    }
+
+  private:
+    QScopedPointer<DbInitializer> initializer;
+
+    Collection cachedCollection( const char *name, int timeout )
+    {
+      Collection col = initializer->createCollection( name );
+      col.setCachePolicyInherit( false );
+      col.setCachePolicyCacheTimeout( timeout );
+      col.setCachePolicyLocalParts( QLatin1String( "PLD:HEAD" ) );
+      if ( !col.update() ) {
+        akFatal() << "Failed to set the cache policy of" << col.name();
+      }
+      return col;
+    }
+
+    Part createPart( const Collection &col, const QDateTime &atime, const QByteArray &data, bool external = false )
+    {
+      PimItem item = initializer->createItem( "item", col );
+      item.setAtime( atime );
+      item.setDirty( false );
+      if ( !item.update() ) {
+        akFatal() << "Failed to update item" << item.id();
+      }
+
+      Part part;
+      part.setPimItemId( item.id() );
+      part.setPartType( PartTypeHelper::fromFqName( QLatin1String( "PLD:RFC822" ) ) );
+      part.setData( data );
+      part.setDatasize( data.size() );
+      part.setExternal( external );
+      if ( !part.insert() ) {
+        akFatal() << "Failed to insert part of item" << item.id();
+      }
+      return part;
+    }
+
+    static bool isCached( const Part &part )
+    {
+      const Part current = Part::retrieveById( part.id() );
+      return current.datasize() > 0 && !current.data().isEmpty();
+    }
+
+  private Q_SLOTS:
+    void init()
+    {
+      initializer.reset( new DbInitializer );
+      initializer->createResource( "testresource" );
+    }
+
+    void cleanup()
+    {
+      initializer.reset();
+    }
+
+    void testEvictionSkipsPinnedParts()
+    {
+      // The pinned parts come first in LRU order and fill more than one
+      // query window, so the eviction has to jump over them
+      const Collection pinned = initializer->createCollection( "pinned" );
+      const Collection cached = cachedCollection( "cached", 60 );
+
+      const QDateTime now = QDateTime::currentDateTime();
+      QVector<Part> pinnedParts;
+      QVector<Part> cachedParts;
+      {
+        Transaction transaction( DataStore::self() );
+        for ( int i = 0; i < 600; ++i ) {
+          pinnedParts << createPart( pinned, now.addDays( -2 ), "x" );
+        }
+        for ( int i = 0; i < 20; ++i ) {
+          cachedParts << createPart( cached, now.addDays( -1 ).addSecs( i * 60 ), QByteArray( 100, 'a' ) );
+        }
+        QVERIFY( transaction.commit() );
+      }
+      QCOMPARE( CacheCleaner::cacheSize(), qint64( 600 + 20 * 100 ) );
+
+      // Evicting down to 90% of the budget takes exactly the 8 oldest cached parts
+      CacheCleaner cleaner;
+      cleaner.setMaximumCacheSize( 2000 );
+      const qint64 evictedParts = CacheCleaner::evictedParts();
+      cleaner.evictLeastRecentlyUsed();
+
+      QCOMPARE( CacheCleaner::evictedParts() - evictedParts, qint64( 8 ) );
+      QCOMPARE( CacheCleaner::cacheSize(), qint64( 1800 ) );
+      for ( int i = 0; i < cachedParts.size(); ++i ) {
+        QCOMPARE( isCached( cachedParts.at( i ) ), i >= 8 );
+      }
+      Q_FOREACH ( const Part &part, pinnedParts ) {
+        QVERIFY( isCached( part ) );
+      }
+
+      // Nothing to do within the budget
+      cleaner.evictLeastRecentlyUsed();
+      QCOMPARE( CacheCleaner::evictedParts() - evictedParts, qint64( 8 ) );
+    }
+
+    void testBatchedExpiry()
+    {
+      // More parts than fit into a single transaction, one of them
+      // with its payload in an external file
+      Collection col = cachedCollection( "expiring", 60 );
+
+      const QDateTime now = QDateTime::currentDateTime();
+      QVector<Part> expired;
+      Part fresh;
+      Part external;
+      const QString fileName = PartHelper::storagePath() + QLatin1String( "cachecleanertest_r0" );
+      {
+        QFile file( fileName );
+        QVERIFY( file.open( QIODevice::WriteOnly ) );
+        file.write( QByteArray( 1000, 'b' ) );
+      }
+      {
+        Transaction transaction( DataStore::self() );
+        for ( int i = 0; i < 1100; ++i ) {
+          expired << createPart( col, now.addDays( -1 ), "data" );
+        }
+        external = createPart( col, now.addDays( -1 ), "cachecleanertest_r0", true );
+        fresh = createPart( col, now, "data" );
+        QVERIFY( transaction.commit() );
+      }
+
+      CacheCleaner cleaner;
+      const qint64 evictedParts = CacheCleaner::evictedParts();
+      DataStore::self()->activeCachePolicy( col );
+      cleaner.collectionExpired( col );
+
+      QCOMPARE( CacheCleaner::evictedParts() - evictedParts, qint64( expired.size() + 1 ) );
+      Q_FOREACH ( const Part &part, expired ) {
+        QVERIFY( !isCached( part ) );
+      }
+      QVERIFY( !isCached( external ) );
+      QVERIFY( !Part::retrieveById( external.id() ).external() );
+      QVERIFY( !QFile::exists( fileName ) );
+      QVERIFY( isCached( fresh ) );
+    }
+};
+
+AKTEST_FAKESERVER_MAIN( CacheCleanerTest )
+
+#include "cachecleanertest.moc"
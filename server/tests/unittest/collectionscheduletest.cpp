@@ -0,0 +1,134 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtTest/QTest>
+
+#include "aktest.h"
+#include "collectionscheduler.h"
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+static Collection collection( qint64 id )
+{
+  Collection col;
+  col.setId( id );
+  return col;
+}
+
+static QList<qint64> ids( const QVector<Collection> &collections )
+{
+  QList<qint64> list;
+  Q_FOREACH ( const Collection &col, collections ) {
+    list << col.id();
+  }
+  return list;
+}
+
+class CollectionScheduleTest : public QObject
+{
+  Q_OBJECT
+
+  private Q_SLOTS:
+    void testOrder()
+    {
+      CollectionSchedule schedule;
+      QCOMPARE( schedule.nextDue(), -1ll );
+
+      schedule.schedule( collection( 1 ), 300 );
+      schedule.schedule( collection( 2 ), 100 );
+      schedule.schedule( collection( 3 ), 200 );
+      schedule.schedule( collection( 4 ), 100 );
+      QCOMPARE( schedule.size(), 4 );
+      QCOMPARE( schedule.nextDue(), 100ll );
+
+      // Collections due at the same time are ordered by ID
+      QCOMPARE( ids( schedule.takeDue( 200, 100 ) ), QList<qint64>() << 2 << 4 << 3 );
+      QCOMPARE( schedule.size(), 1 );
+      QVERIFY( !schedule.contains( 2 ) );
+      QVERIFY( schedule.contains( 1 ) );
+      QCOMPARE( schedule.nextDue(), 300ll );
+    }
+
+    void testReschedule()
+    {
+      CollectionSchedule schedule;
+      schedule.schedule( collection( 1 ), 100 );
+      schedule.schedule( collection( 2 ), 200 );
+      schedule.schedule( collection( 3 ), 300 );
+
+      // Collections are only scheduled once
+      schedule.schedule( collection( 1 ), 400 );
+      QCOMPARE( schedule.size(), 3 );
+      QCOMPARE( schedule.nextDue(), 200ll );
+
+      schedule.schedule( collection( 3 ), 50 );
+      QCOMPARE( schedule.nextDue(), 50ll );
+
+      QVERIFY( schedule.remove( 3 ) );
+      QVERIFY( !schedule.remove( 3 ) );
+      QCOMPARE( ids( schedule.takeDue( 1000, 100 ) ), QList<qint64>() << 2 << 1 );
+      QVERIFY( schedule.isEmpty() );
+    }
+
+    void testBatchSize()
+    {
+      CollectionSchedule schedule;
+      for ( int i = 1; i <= 10; ++i ) {
+        schedule.schedule( collection( i ), 100 );
+      }
+      QCOMPARE( schedule.takeDue( 100, 4 ).size(), 4 );
+      QCOMPARE( schedule.size(), 6 );
+      QVERIFY( schedule.takeDue( 99, 4 ).isEmpty() );
+    }
+
+    void testRandomOperations()
+    {
+      CollectionSchedule schedule;
+      QMap<qint64, qint64> expected; // collection -> due
+      qsrand( 42 );
+      for ( int i = 0; i < 5000; ++i ) {
+        const qint64 id = qrand() % 500;
+        if ( qrand() % 4 == 0 ) {
+          QCOMPARE( schedule.remove( id ), expected.remove( id ) > 0 );
+        } else {
+          const qint64 due = qrand() % 10000;
+          schedule.schedule( collection( id ), due );
+          expected.insert( id, due );
+        }
+        QCOMPARE( schedule.size(), expected.size() );
+      }
+
+      qint64 last = -1;
+      while ( !schedule.isEmpty() ) {
+        const qint64 due = schedule.nextDue();
+        QVERIFY( due >= last );
+        Q_FOREACH ( const Collection &col, schedule.takeDue( due, 1 ) ) {
+          QCOMPARE( expected.take( col.id() ), due );
+        }
+        last = due;
+      }
+      QVERIFY( expected.isEmpty() );
+    }
+};
+
+AKTEST_MAIN( CollectionScheduleTest )
+
+#include "collectionscheduletest.moc"
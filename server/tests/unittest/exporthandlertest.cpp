@@ -0,0 +1,121 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+
+#include <imapstreamparser.h>
+#include <response.h>
+
+#include "fakeakonadiserver.h"
+#include "aktest.h"
+#include "akdebug.h"
+#include "entities.h"
+#include "dbinitializer.h"
+
+#include <QtTest/QTest>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+class ExportHandlerTest : public QObject
+{
+    Q_OBJECT
+
+public:
+    ExportHandlerTest()
+        : QObject()
+    {
+        qRegisterMetaType<Akonadi::Server::Response>();
+
+        try {
+            FakeAkonadiServer::instance()->setPopulateDb(false);
+            FakeAkonadiServer::instance()->init();
+        } catch (const FakeAkonadiServerException &e) {
+            akError() << "Server exception: " << e.what();
+            akFatal() << "Fake Akonadi Server failed to start up, aborting test";
+        }
+    }
+
+    ~ExportHandlerTest()
+    {
+        FakeAkonadiServer::instance()->quit();
+    }
+
+    QScopedPointer<DbInitializer> initializer;
+
+    static QByteArray itemResponse(const PimItem &item, const Collection &col)
+    {
+        return "S: * " + QByteArray::number(item.id()) + " FETCH (UID " + QByteArray::number(item.id()) + " REV 0 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col.id()) + ")";
+    }
+
+private Q_SLOTS:
+    void testExport_data()
+    {
+        initializer.reset(new DbInitializer);
+        Resource res = initializer->createResource("testresource");
+        Collection col1 = initializer->createCollection("col1");
+        Collection col2 = initializer->createCollection("col2");
+        PimItem item1 = initializer->createItem("item1", col1);
+        PimItem item2 = initializer->createItem("item2", col2);
+        PimItem item3 = initializer->createItem("item3", col1);
+
+        QTest::addColumn<QList<QByteArray> >("scenario");
+
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << "C: 2 EXPORT COLLECTION " + QByteArray::number(col1.id()) + " CACHEONLY (UID)"
+            << itemResponse(item1, col1)
+            << itemResponse(item3, col1)
+            << "S: 2 OK EXPORT completed";
+            QTest::newRow("collection") << scenario;
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << "C: 2 EXPORT RESOURCE \"testresource\" CHUNKSIZE 2 CACHEONLY (UID)"
+            << itemResponse(item1, col1)
+            << itemResponse(item2, col2)
+            << "S: * OK [NEXT " + QByteArray::number(item2.id()) + "]"
+            << itemResponse(item3, col1)
+            << "S: 2 OK EXPORT completed";
+            QTest::newRow("resource in chunks") << scenario;
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << "C: 2 EXPORT RESOURCE \"testresource\" CHUNKSIZE 2 AFTER " + QByteArray::number(item2.id()) + " PRIORITY BACKGROUND CACHEONLY (UID)"
+            << itemResponse(item3, col1)
+            << "S: 2 OK EXPORT completed";
+            QTest::newRow("resume") << scenario;
+        }
+    }
+
+    void testExport()
+    {
+        QFETCH(QList<QByteArray>, scenario);
+
+        FakeAkonadiServer::instance()->setScenario(scenario);
+        FakeAkonadiServer::instance()->runTest();
+    }
+};
+
+AKTEST_FAKESERVER_MAIN(ExportHandlerTest)
+
+#include "exporthandlertest.moc"
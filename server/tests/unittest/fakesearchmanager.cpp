@@ -55,6 +55,11 @@ QVector<Akonadi::AbstractSearchPlugin*> FakeSearchManager::searchPlugins() const
     return QVector<Akonadi::AbstractSearchPlugin*>();
 }
 
+void FakeSearchManager::indexNotifications(const NotificationMessageV3::List &notifications)
+{
+    Q_UNUSED(notifications);
+}
+
 void FakeSearchManager::scheduleSearchUpdate()
 {
 }
@@ -41,6 +41,7 @@ public:
     void updateSearch(const Collection& collection);
     void updateSearchAsync(const Collection &collection);
     QVector<AbstractSearchPlugin*> searchPlugins() const;
+    void indexNotifications(const NotificationMessageV3::List &notifications);
 
     void scheduleSearchUpdate();
 };
@@ -217,6 +217,125 @@ private Q_SLOTS:
         FakeAkonadiServer::instance()->runTest();
     }
 
+    void testFetchPaged_data()
+    {
+        initializer.reset(new DbInitializer);
+        Resource res = initializer->createResource("testresource");
+        Collection col = initializer->createCollection("root");
+        PimItem item1 = initializer->createItem("item1", col);
+        PimItem item2 = initializer->createItem("item2", col);
+        PimItem item3 = initializer->createItem("item3", col);
+        item1.setSize(30);
+        item1.update();
+        item2.setSize(10);
+        item2.update();
+        item3.setSize(20);
+        item3.update();
+
+        const QByteArray fetch = "C: 2 FETCH 1:* COLLECTIONID " + QByteArray::number(col.id()) + " CACHEONLY ";
+        QTest::addColumn<QList<QByteArray> >("scenario");
+
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << fetch + "SORT SIZE ASC LIMIT 2 (UID SIZE)"
+            << "S: * " + QByteArray::number(item2.id()) + " FETCH (UID " + QByteArray::number(item2.id()) + " REV 0 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col.id()) + " SIZE 10)"
+            << "S: * " + QByteArray::number(item3.id()) + " FETCH (UID " + QByteArray::number(item3.id()) + " REV 0 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col.id()) + " SIZE 20)"
+            << "S: * OK [NEXT 20:" + QByteArray::number(item3.id()) + "]"
+            << "S: 2 OK FETCH completed";
+            QTest::newRow("first page sorted by size") << scenario;
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << fetch + "SORT SIZE ASC LIMIT 2 AFTER 20:" + QByteArray::number(item3.id()) + " (UID SIZE)"
+            << "S: * " + QByteArray::number(item1.id()) + " FETCH (UID " + QByteArray::number(item1.id()) + " REV 0 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col.id()) + " SIZE 30)"
+            << "S: 2 OK FETCH completed";
+            QTest::newRow("last page sorted by size") << scenario;
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << fetch + "LIMIT 1 OFFSET 1 (UID)"
+            << "S: * " + QByteArray::number(item2.id()) + " FETCH (UID " + QByteArray::number(item2.id()) + " REV 0 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col.id()) + ")"
+            << "S: * OK [NEXT " + QByteArray::number(item2.id()) + "]"
+            << "S: 2 OK FETCH completed";
+            QTest::newRow("offset") << scenario;
+        }
+    }
+
+    void testFetchPaged()
+    {
+        QFETCH(QList<QByteArray>, scenario);
+
+        FakeAkonadiServer::instance()->setScenario(scenario);
+        FakeAkonadiServer::instance()->runTest();
+    }
+
+    void testFetchChangedSinceModSeq_data()
+    {
+        initializer.reset(new DbInitializer);
+        Resource res = initializer->createResource("testresource");
+        Collection col1 = initializer->createCollection("col1");
+        PimItem item1 = initializer->createItem("item1", col1);
+        PimItem item2 = initializer->createItem("item2", col1);
+        Collection col2 = initializer->createCollection("col2");
+        PimItem item3 = initializer->createItem("item3", col2);
+        PimItem item4 = initializer->createItem("item4", col2);
+
+        QTest::addColumn<QList<QByteArray> >("scenario");
+
+        {
+            // Modseqs and removals have to be recorded in the collection of
+            // each item, also when one command changes several collections
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << "C: 2 UID STORE " + QByteArray::number(item1.id()) + "," + QByteArray::number(item3.id()) + " NOREV (+FLAGS.SILENT (\\SEEN))"
+            << "S: IGNORE 1"
+            << "C: 3 UID REMOVE " + QByteArray::number(item2.id()) + "," + QByteArray::number(item4.id())
+            << "S: 3 OK REMOVE complete"
+            << "C: 4 FETCH 1:* COLLECTIONID " + QByteArray::number(col1.id()) + " CACHEONLY CHANGEDSINCE MODSEQ 1 (UID)"
+            << "S: * VANISHED " + QByteArray::number(item2.id())
+            << "S: * " + QByteArray::number(item1.id()) + " FETCH (UID " + QByteArray::number(item1.id()) + " REV 1 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col1.id()) + " MODSEQ 2)"
+            << "S: * OK [HIGHESTMODSEQ 3]"
+            << "S: 4 OK FETCH completed"
+            << "C: 5 FETCH 1:* COLLECTIONID " + QByteArray::number(col2.id()) + " CACHEONLY CHANGEDSINCE MODSEQ 1 (UID)"
+            << "S: * VANISHED " + QByteArray::number(item4.id())
+            << "S: * " + QByteArray::number(item3.id()) + " FETCH (UID " + QByteArray::number(item3.id()) + " REV 1 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col2.id()) + " MODSEQ 2)"
+            << "S: * OK [HIGHESTMODSEQ 3]"
+            << "S: 5 OK FETCH completed"
+            << "C: 6 FETCH 1:* COLLECTIONID " + QByteArray::number(col2.id()) + " CACHEONLY CHANGEDSINCE MODSEQ 3 (UID)"
+            << "S: * OK [HIGHESTMODSEQ 3]"
+            << "S: 6 OK FETCH completed"
+            << "C: 7 FETCH 1:* COLLECTIONID " + QByteArray::number(col1.id()) + " CACHEONLY CHANGEDSINCE MODSEQ 1 LIMIT 1 (UID)"
+            << "S: * VANISHED " + QByteArray::number(item2.id())
+            << "S: * " + QByteArray::number(item1.id()) + " FETCH (UID " + QByteArray::number(item1.id()) + " REV 1 MIMETYPE \"test\" COLLECTIONID " + QByteArray::number(col1.id()) + " MODSEQ 2)"
+            << "S: * OK [NEXT " + QByteArray::number(item1.id()) + "]"
+            << "S: * OK [HIGHESTMODSEQ 3]"
+            << "S: 7 OK FETCH completed"
+            << "C: 8 FETCH 1:* COLLECTIONID " + QByteArray::number(col1.id()) + " CACHEONLY CHANGEDSINCE MODSEQ 2 LIMIT 1 (UID)"
+            << "S: * VANISHED " + QByteArray::number(item2.id())
+            << "S: * OK [HIGHESTMODSEQ 3]"
+            << "S: 8 OK FETCH completed";
+            QTest::newRow("changes in two collections") << scenario;
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+            << "C: 2 UID FETCH " + QByteArray::number(item1.id()) + "," + QByteArray::number(item3.id()) + " CHANGEDSINCE MODSEQ 1 (UID)"
+            << "S: 2 NO CHANGEDSINCE MODSEQ requires a collection context";
+            QTest::newRow("no collection context") << scenario;
+        }
+    }
+
+    void testFetchChangedSinceModSeq()
+    {
+        QFETCH(QList<QByteArray>, scenario);
+
+        FakeAkonadiServer::instance()->setScenario(scenario);
+        FakeAkonadiServer::instance()->runTest();
+    }
+
     void testList_data()
     {
         QElapsedTimer timer;
@@ -125,6 +125,88 @@ class FetchScopeTest : public QObject
       QCOMPARE( fs.remoteIdRequested(), remoteIdRequested );
       QCOMPARE( fs.gidRequested(), gidRequested );
     }
+
+    void testModSeqParsing_data()
+    {
+      QTest::addColumn<QString>( "input" );
+      QTest::addColumn<qint64>( "changedSinceModSeq" );
+      QTest::addColumn<QDateTime>( "changedSince" );
+      QTest::addColumn<bool>( "modSeqRequested" );
+
+      QTest::newRow( "no modseq" )
+        << "CACHEONLY (REMOTEID)\n"
+        << qint64( -1 ) << QDateTime() << false;
+      QTest::newRow( "modseq requested" )
+        << "CACHEONLY (MODSEQ REMOTEID)\n"
+        << qint64( -1 ) << QDateTime() << true;
+      QTest::newRow( "changed since modseq" )
+        << "CACHEONLY CHANGEDSINCE MODSEQ 4242 (REMOTEID)\n"
+        << qint64( 4242 ) << QDateTime() << true;
+      QTest::newRow( "changed since timestamp" )
+        << "CHANGEDSINCE 1374150376 (REMOTEID)\n"
+        << qint64( -1 ) << QDateTime::fromTime_t( 1374150376 ) << false;
+    }
+
+    void testModSeqParsing()
+    {
+      QFETCH( QString, input );
+      QFETCH( qint64, changedSinceModSeq );
+      QFETCH( QDateTime, changedSince );
+      QFETCH( bool, modSeqRequested );
+
+      QByteArray ba( input.toLatin1() );
+      QBuffer buffer( &ba, this );
+      buffer.open( QIODevice::ReadOnly );
+      ImapStreamParser parser( &buffer );
+
+      FetchScope fs( &parser );
+      QCOMPARE( fs.changedSinceModSeq(), changedSinceModSeq );
+      QCOMPARE( fs.changedSince(), changedSince );
+      QCOMPARE( fs.modSeqRequested(), modSeqRequested );
+      QVERIFY( fs.remoteIdRequested() );
+    }
+
+    void testPagingParsing()
+    {
+      QByteArray ba( "SORT DATETIME ASC LIMIT 50 AFTER 42 (UID)\n" );
+      QBuffer buffer( &ba, this );
+      buffer.open( QIODevice::ReadOnly );
+      ImapStreamParser parser( &buffer );
+
+      FetchScope fs( &parser );
+      QCOMPARE( fs.sortKey(), FetchScope::SortByDatetime );
+      QCOMPARE( fs.sortOrder(), Qt::AscendingOrder );
+      QCOMPARE( fs.limit(), 50 );
+      QCOMPARE( fs.offset(), -1 );
+      QCOMPARE( fs.continuationToken(), QByteArray( "42" ) );
+    }
+
+    void testInvalidPaging_data()
+    {
+      QTest::addColumn<QByteArray>( "input" );
+
+      QTest::newRow( "sort without limit" ) << QByteArray( "SORT SIZE DESC (UID)\n" );
+      QTest::newRow( "invalid sort key" ) << QByteArray( "SORT FOO DESC LIMIT 5 (UID)\n" );
+      QTest::newRow( "offset without limit" ) << QByteArray( "OFFSET 5 (UID)\n" );
+      QTest::newRow( "offset and after" ) << QByteArray( "LIMIT 5 OFFSET 5 AFTER 42 (UID)\n" );
+    }
+
+    void testInvalidPaging()
+    {
+      QFETCH( QByteArray, input );
+
+      QBuffer buffer( &input, this );
+      buffer.open( QIODevice::ReadOnly );
+      ImapStreamParser parser( &buffer );
+
+      bool thrown = false;
+      try {
+        FetchScope fs( &parser );
+      } catch ( const HandlerException & ) {
+        thrown = true;
+      }
+      QVERIFY( thrown );
+    }
 };
 
 QTEST_MAIN( FetchScopeTest )
@@ -29,6 +29,8 @@
 #include "entities.h"
 #include "dbinitializer.h"
 #include <storage/storagedebugger.h>
+#include <storage/querybuilder.h>
+#include <storage/modseqhelper.h>
 
 #include <QtTest/QTest>
 
@@ -236,6 +238,85 @@ private Q_SLOTS:
         res2.remove();
     }
 
+    void testListChangedSince()
+    {
+        initializer.reset(new DbInitializer);
+        Resource res = initializer->createResource("testresource");
+        Collection col1 = initializer->createCollection("col1");
+        Collection col2 = initializer->createCollection("col2", col1);
+        Collection col3 = initializer->createCollection("col3");
+
+        col2.setTreeRevision(5);
+        QVERIFY(col2.update());
+
+        CollectionTombstone tombstone;
+        tombstone.setCollectionId(4242);
+        tombstone.setResourceId(res.id());
+        tombstone.setTreeRevision(4);
+        QVERIFY(tombstone.insert());
+
+        QueryBuilder qb(CollectionTreeRevision::tableName(), QueryBuilder::Update);
+        qb.setColumnValue(CollectionTreeRevision::revisionColumn(), 5);
+        QVERIFY(qb.exec());
+
+        {
+            // col1 is unchanged, but needed to connect col2 to the tree
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+                     << "C: 2 LIST 0 INF (RESOURCE \"testresource\") (CHANGEDSINCE 3)"
+                     << initializer->listResponse(col1)
+                     << initializer->listResponse(col2)
+                     << "S: * VANISHED 4242"
+                     << "S: * OK [TREEREVISION 5]"
+                     << "S: 2 OK List completed";
+            FakeAkonadiServer::instance()->setScenario(scenario);
+            FakeAkonadiServer::instance()->runTest();
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+                     << "C: 2 LIST 0 INF (RESOURCE \"testresource\") (CHANGEDSINCE 5)"
+                     << "S: * OK [TREEREVISION 5]"
+                     << "S: 2 OK List completed";
+            FakeAkonadiServer::instance()->setScenario(scenario);
+            FakeAkonadiServer::instance()->runTest();
+        }
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+                     << "C: 2 LIST 0 INF (RESOURCE \"testresource\") (CHANGEDSINCE 0)"
+                     << initializer->listResponse(col1)
+                     << initializer->listResponse(col2)
+                     << initializer->listResponse(col3)
+                     << "S: * OK [TREEREVISION 5]"
+                     << "S: 2 OK List completed";
+            FakeAkonadiServer::instance()->setScenario(scenario);
+            FakeAkonadiServer::instance()->runTest();
+        }
+
+        // Revisions beyond the horizon get everything, the tombstones may be gone
+        QueryBuilder horizonQb(CollectionTreeRevision::tableName(), QueryBuilder::Update);
+        horizonQb.setColumnValue(CollectionTreeRevision::revisionColumn(), 20005);
+        QVERIFY(horizonQb.exec());
+        QCOMPARE(ModSeqHelper::treeRevisionHorizon(), qint64(10005));
+        {
+            QList<QByteArray> scenario;
+            scenario << FakeAkonadiServer::defaultScenario()
+                     << "C: 2 LIST 0 INF (RESOURCE \"testresource\") (CHANGEDSINCE 3)"
+                     << "S: * OK [FULLSYNC]"
+                     << initializer->listResponse(col1)
+                     << initializer->listResponse(col2)
+                     << initializer->listResponse(col3)
+                     << "S: * OK [TREEREVISION 20005]"
+                     << "S: 2 OK List completed";
+            FakeAkonadiServer::instance()->setScenario(scenario);
+            FakeAkonadiServer::instance()->runTest();
+        }
+
+        QVERIFY(ModSeqHelper::pruneTombstones());
+        QVERIFY(ModSeqHelper::removedCollections(0).isEmpty());
+    }
+
     void testListEnabled_data()
     {
         initializer.reset(new DbInitializer);
@@ -0,0 +1,278 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtCore/QFile>
+#include <QtSql/QSqlDatabase>
+#include <QtTest/QTest>
+
+#include "aktest.h"
+#include "search/localsearchplugin.h"
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+typedef QSet<qint64> IdSet;
+Q_DECLARE_METATYPE( IdSet )
+Q_DECLARE_METATYPE( QList<qint64> )
+
+static const QString indexFile = QLatin1String( "localsearchplugintest.index" );
+
+static QHash<QByteArray, QByteArray> payload( const QByteArray &name, const QByteArray &data )
+{
+  QHash<QByteArray, QByteArray> parts;
+  parts.insert( name, data );
+  return parts;
+}
+
+static QString term( const QString &key, const QString &value, int cond = 5, bool negated = false )
+{
+  return QString::fromLatin1( "{\"key\":\"%1\",\"value\":\"%2\",\"cond\":%3,\"negated\":%4}" )
+           .arg( key, value ).arg( cond ).arg( negated ? QLatin1String( "true" ) : QLatin1String( "false" ) );
+}
+
+static QString query( int rel, const QStringList &terms, int limit = -1 )
+{
+  return QString::fromLatin1( "{\"limit\":%1,\"negated\":false,\"rel\":%2,\"subTerms\":[%3]}" )
+           .arg( limit ).arg( rel ).arg( terms.join( QLatin1String( "," ) ) );
+}
+
+static IdSet ids( qint64 a, qint64 b = -1, qint64 c = -1 )
+{
+  IdSet set;
+  set << a;
+  if ( b >= 0 ) {
+    set << b;
+  }
+  if ( c >= 0 ) {
+    set << c;
+  }
+  return set;
+}
+
+class LocalSearchPluginTest : public QObject
+{
+  Q_OBJECT
+
+  private:
+    void populate( LocalSearchPlugin &plugin )
+    {
+      // A new index needs a rebuild, which does not get in the way here
+      QVERIFY( !plugin.open( indexFile ) );
+      plugin.indexItem( 1, 10, QLatin1String( "message/rfc822" ), 100, payload( "RFC822",
+        "From: Alice Example <alice@example.com>\r\n"
+        "To: bob@example.org\r\n"
+        "Subject: Quarterly report\r\n"
+        " for =?UTF-8?B?TcO8bmNoZW4=?=\r\n"
+        "\r\n"
+        "Please find the numbers attached.\r\n" ) );
+      plugin.indexItem( 2, 10, QLatin1String( "message/rfc822" ), 2000, payload( "HEAD",
+        "From: Bob <bob@example.org>\r\n"
+        "Subject: Re: Quarterly report\r\n" ) );
+      plugin.indexItem( 3, 20, QLatin1String( "text/directory" ), 300, payload( "VCARD",
+        "BEGIN:VCARD\r\n"
+        "VERSION:3.0\r\n"
+        "FN:Carol Numbers\r\n"
+        "NICKNAME:caro\r\n"
+        "EMAIL;TYPE=work:carol@example.net\r\n"
+        "END:VCARD\r\n" ) );
+    }
+
+  private Q_SLOTS:
+    void initTestCase()
+    {
+      if ( !QSqlDatabase::isDriverAvailable( QLatin1String( "QSQLITE3" ) )
+           && !QSqlDatabase::isDriverAvailable( QLatin1String( "QSQLITE" ) ) ) {
+        QSKIP( "No SQLite driver available", SkipAll );
+      }
+    }
+
+    void init()
+    {
+      QFile::remove( indexFile );
+    }
+
+    void cleanupTestCase()
+    {
+      QFile::remove( indexFile );
+    }
+
+    void testSearch_data()
+    {
+      QTest::addColumn<QString>( "query" );
+      QTest::addColumn<QList<qint64> >( "collections" );
+      QTest::addColumn<IdSet>( "expected" );
+
+      const QList<qint64> all = QList<qint64>() << 10 << 20;
+      QTest::newRow( "subject" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "report" ) ) ) << all << ids( 1, 2 );
+      QTest::newRow( "folded encoded subject" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QString::fromUtf8( "München" ) ) ) << all << ids( 1 );
+      QTest::newRow( "prefix" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "quart" ) ) ) << all << ids( 1, 2 );
+      QTest::newRow( "equal needs whole words" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "quart" ), 0 ) ) << all << IdSet();
+      QTest::newRow( "address" ) << query( 0, QStringList() << term( QLatin1String( "from" ), QLatin1String( "bob@example.org" ) ) ) << all << ids( 2 );
+      QTest::newRow( "body" ) << query( 0, QStringList() << term( QLatin1String( "body" ), QLatin1String( "numbers" ) ) ) << all << ids( 1 );
+      QTest::newRow( "all fields" ) << query( 0, QStringList() << term( QLatin1String( "all" ), QLatin1String( "numbers" ) ) ) << all << ids( 1, 3 );
+      QTest::newRow( "contact" ) << query( 0, QStringList() << term( QLatin1String( "email" ), QLatin1String( "carol" ) ) ) << all << ids( 3 );
+      QTest::newRow( "and" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "report" ) )
+                                                          << term( QLatin1String( "to" ), QLatin1String( "bob" ) ) ) << all << ids( 1 );
+      QTest::newRow( "or" ) << query( 1, QStringList() << term( QLatin1String( "nickname" ), QLatin1String( "caro" ) )
+                                                         << term( QLatin1String( "from" ), QLatin1String( "alice" ) ) ) << all << ids( 1, 3 );
+      QTest::newRow( "negated" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "re" ), 0, true ) ) << all << ids( 1, 3 );
+      QTest::newRow( "size" ) << query( 0, QStringList() << term( QLatin1String( "size" ), QLatin1String( "300" ), 1 ) ) << all << ids( 2, 3 );
+      QTest::newRow( "collections" ) << query( 0, QStringList() << term( QLatin1String( "all" ), QLatin1String( "numbers" ) ) ) << ( QList<qint64>() << 20 ) << ids( 3 );
+      QTest::newRow( "limit" ) << query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "report" ) ), 1 ) << all << ids( 2 );
+      QTest::newRow( "unknown key" ) << query( 0, QStringList() << term( QLatin1String( "unknown" ), QLatin1String( "report" ) ) ) << all << IdSet();
+      QTest::newRow( "invalid query" ) << QString::fromLatin1( "{\"rel\":" ) << all << IdSet();
+    }
+
+    void testSearch()
+    {
+      QFETCH( QString, query );
+      QFETCH( QList<qint64>, collections );
+      QFETCH( IdSet, expected );
+
+      LocalSearchPlugin plugin;
+      populate( plugin );
+      QCOMPARE( plugin.search( query, collections, QStringList() ), expected );
+    }
+
+    void testMimeTypes()
+    {
+      LocalSearchPlugin plugin;
+      populate( plugin );
+      const QString q = query( 0, QStringList() << term( QLatin1String( "all" ), QLatin1String( "numbers" ) ) );
+      QCOMPARE( plugin.search( q, QList<qint64>(), QStringList() << QLatin1String( "text/directory" ) ), ids( 3 ) );
+    }
+
+    void testMatch()
+    {
+      LocalSearchPlugin plugin;
+      populate( plugin );
+      const QString q = query( 0, QStringList() << term( QLatin1String( "all" ), QLatin1String( "numbers" ) ) );
+
+      QSet<qint64> matches;
+      QVERIFY( plugin.match( q, QList<qint64>(), QStringList(), QVector<qint64>() << 2 << 3 << 4, matches ) );
+      QCOMPARE( matches, ids( 3 ) );
+
+      matches.clear();
+      QVERIFY( plugin.match( q, QList<qint64>() << 10, QStringList(), QVector<qint64>() << 1 << 3, matches ) );
+      QCOMPARE( matches, ids( 1 ) );
+
+      // Limited queries can only be evaluated as a whole
+      const QString limited = query( 0, QStringList() << term( QLatin1String( "all" ), QLatin1String( "numbers" ) ), 1 );
+      QVERIFY( !plugin.match( limited, QList<qint64>(), QStringList(), QVector<qint64>() << 1, matches ) );
+    }
+
+    void testUpdate()
+    {
+      LocalSearchPlugin plugin;
+      populate( plugin );
+      const int terms = plugin.termCount();
+      const QString q = query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "report" ) ) );
+
+      plugin.indexItem( 2, 10, QLatin1String( "message/rfc822" ), 2000, payload( "HEAD", "Subject: Holidays\r\n" ) );
+      QCOMPARE( plugin.search( q, QList<qint64>(), QStringList() ), ids( 1 ) );
+      QCOMPARE( plugin.itemCount(), 3 );
+
+      plugin.removeItem( 1 );
+      QVERIFY( plugin.search( q, QList<qint64>(), QStringList() ).isEmpty() );
+      QCOMPARE( plugin.itemCount(), 2 );
+      QVERIFY( plugin.termCount() < terms );
+
+      // Words only used by removed items are gone
+      plugin.removeItem( 2 );
+      plugin.removeItem( 3 );
+      QCOMPARE( plugin.itemCount(), 0 );
+      QCOMPARE( plugin.termCount(), 0 );
+    }
+
+    void testKeptParts()
+    {
+      LocalSearchPlugin plugin;
+      populate( plugin );
+      QHash<QByteArray, QByteArray> parts = payload( "HEAD", "Subject: Budget\r\n" );
+      parts.insert( "BODY", "Draft numbers" );
+      plugin.indexItem( 4, 10, QLatin1String( "text/plain" ), 500, parts );
+
+      const QString body = query( 0, QStringList() << term( QLatin1String( "body" ), QLatin1String( "draft" ) ) );
+      const QString subject = query( 0, QStringList() << term( QLatin1String( "subject" ), QLatin1String( "budget" ) ) );
+      QCOMPARE( plugin.search( body, QList<qint64>(), QStringList() ), ids( 4 ) );
+
+      // The body is not in the cache anymore, only the headers changed
+      plugin.indexItem( 4, 10, QLatin1String( "text/plain" ), 500, payload( "HEAD", "Subject: Forecast\r\n" ),
+                        QSet<QByteArray>() << "BODY" );
+      QCOMPARE( plugin.search( body, QList<qint64>(), QStringList() ), ids( 4 ) );
+      QVERIFY( plugin.search( subject, QList<qint64>(), QStringList() ).isEmpty() );
+
+      plugin.indexItem( 4, 10, QLatin1String( "text/plain" ), 500, payload( "HEAD", "Subject: Forecast\r\n" ) );
+      QVERIFY( plugin.search( body, QList<qint64>(), QStringList() ).isEmpty() );
+    }
+
+    void testPersistence()
+    {
+      const QString q = query( 0, QStringList() << term( QLatin1String( "from" ), QLatin1String( "example" ) ) );
+      {
+        LocalSearchPlugin plugin;
+        QVERIFY( plugin.isComplete() );
+        // Without an index file everything has to be indexed again first
+        populate( plugin );
+        QVERIFY( !plugin.isComplete() );
+        QVERIFY( plugin.close() );
+      }
+
+      {
+        LocalSearchPlugin plugin;
+        QVERIFY( plugin.open( indexFile ) );
+        // The unfinished rebuild continues
+        QVERIFY( !plugin.isComplete() );
+        QCOMPARE( plugin.itemCount(), 3 );
+        QCOMPARE( plugin.search( q, QList<qint64>(), QStringList() ), ids( 1, 2 ) );
+
+        // Changes are written right away, but without close() the index is
+        // rebuilt on the next start
+        plugin.removeItem( 1 );
+      }
+
+      LocalSearchPlugin plugin;
+      QVERIFY( !plugin.open( indexFile ) );
+      QCOMPARE( plugin.itemCount(), 2 );
+      QCOMPARE( plugin.search( q, QList<qint64>(), QStringList() ), ids( 2 ) );
+
+      // Removing a loaded item has to clean up all its words
+      plugin.removeItem( 2 );
+      plugin.removeItem( 3 );
+      QCOMPARE( plugin.termCount(), 0 );
+    }
+
+    void testDamagedIndex()
+    {
+      QFile file( indexFile );
+      QVERIFY( file.open( QIODevice::WriteOnly ) );
+      file.write( "not an index" );
+      file.close();
+
+      LocalSearchPlugin plugin;
+      populate( plugin );
+      QCOMPARE( plugin.itemCount(), 3 );
+      QVERIFY( plugin.close() );
+    }
+};
+
+AKTEST_MAIN( LocalSearchPluginTest )
+
+#include "localsearchplugintest.moc"
@@ -0,0 +1,214 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtTest/QTest>
+
+#include "aktest.h"
+#include "notificationcompressor.h"
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+typedef QSet<QByteArray> Flags;
+
+static NotificationMessageV3 itemMessage( NotificationMessageV2::Operation op, const QList<qint64> &ids,
+                                          Collection::Id parent = 1, const QByteArray &session = "session" )
+{
+  NotificationMessageV3 msg;
+  msg.setType( NotificationMessageV2::Items );
+  msg.setOperation( op );
+  msg.setSessionId( session );
+  msg.setResource( "resource" );
+  msg.setParentCollection( parent );
+  Q_FOREACH ( qint64 id, ids ) {
+    msg.addEntity( id, QString(), QString(), QLatin1String( "message/rfc822" ) );
+  }
+  return msg;
+}
+
+static NotificationMessageV3 flagsMessage( const QList<qint64> &ids, const Flags &added, const Flags &removed )
+{
+  NotificationMessageV3 msg = itemMessage( NotificationMessageV2::ModifyFlags, ids );
+  msg.setAddedFlags( added );
+  msg.setRemovedFlags( removed );
+  return msg;
+}
+
+static NotificationMessageV3 collectionMessage( NotificationMessageV2::Operation op, qint64 id, const QSet<QByteArray> &parts = QSet<QByteArray>() )
+{
+  NotificationMessageV3 msg;
+  msg.setType( NotificationMessageV2::Collections );
+  msg.setOperation( op );
+  msg.setSessionId( "session" );
+  msg.setResource( "resource" );
+  msg.setParentCollection( 0 );
+  msg.addEntity( id );
+  msg.setItemParts( parts );
+  return msg;
+}
+
+// Applies flag changes the way a client with a cache would
+static void applyFlagChanges( QHash<qint64, Flags> &state, const NotificationMessageV3::List &msgs )
+{
+  Q_FOREACH ( const NotificationMessageV3 &msg, msgs ) {
+    Q_FOREACH ( qint64 id, msg.entities().keys() ) {
+      state[id] = ( state.value( id ) - msg.removedFlags() ) + msg.addedFlags();
+    }
+  }
+}
+
+class NotificationCompressorTest : public QObject
+{
+  Q_OBJECT
+  private Q_SLOTS:
+    void testMergeEntities()
+    {
+      NotificationCompressor compressor;
+      for ( int i = 1; i <= 10000; ++i ) {
+        compressor.append( flagsMessage( QList<qint64>() << i, Flags() << "\\SEEN", Flags() ) );
+      }
+      QCOMPARE( compressor.count(), 1 );
+      const NotificationMessageV3 msg = compressor.notifications().first();
+      QCOMPARE( msg.entities().count(), 10000 );
+      QCOMPARE( msg.addedFlags(), Flags() << "\\SEEN" );
+      QVERIFY( msg.removedFlags().isEmpty() );
+
+      // Different flags, sessions or collections are not merged
+      compressor.append( flagsMessage( QList<qint64>() << 10001, Flags() << "\\FLAGGED", Flags() ) );
+      compressor.append( itemMessage( NotificationMessageV2::Modify, QList<qint64>() << 1, 1, "otherSession" ) );
+      compressor.append( itemMessage( NotificationMessageV2::Modify, QList<qint64>() << 1, 2 ) );
+      QCOMPARE( compressor.count(), 4 );
+
+      compressor.clear();
+      QVERIFY( compressor.isEmpty() );
+    }
+
+    void testMaximumEntities()
+    {
+      NotificationCompressor compressor;
+      compressor.setMaximumEntities( 3 );
+      for ( int i = 1; i <= 7; ++i ) {
+        compressor.append( flagsMessage( QList<qint64>() << i, Flags() << "\\SEEN", Flags() ) );
+      }
+
+      // Chunks are filled up in order, but never beyond the maximum
+      QCOMPARE( compressor.count(), 3 );
+      QCOMPARE( compressor.notifications().at( 0 ).uids(), QList<qint64>() << 1 << 2 << 3 );
+      QCOMPARE( compressor.notifications().at( 1 ).uids(), QList<qint64>() << 4 << 5 << 6 );
+      QCOMPARE( compressor.notifications().at( 2 ).uids(), QList<qint64>() << 7 );
+    }
+
+    void testMergeChanges()
+    {
+      NotificationCompressor compressor;
+      compressor.append( flagsMessage( QList<qint64>() << 1 << 2, Flags() << "F1", Flags() << "F2" ) );
+      QVERIFY( !compressor.append( flagsMessage( QList<qint64>() << 1 << 2, Flags() << "F2" << "F3", Flags() << "F1" ) ) );
+      QCOMPARE( compressor.count(), 1 );
+      QCOMPARE( compressor.notifications().first().addedFlags(), Flags() << "F2" << "F3" );
+      QCOMPARE( compressor.notifications().first().removedFlags(), Flags() << "F1" );
+
+      compressor.clear();
+      NotificationMessageV3 msg = itemMessage( NotificationMessageV2::Modify, QList<qint64>() << 1 );
+      msg.setItemParts( QSet<QByteArray>() << "PART1" );
+      compressor.append( msg );
+      msg.setItemParts( QSet<QByteArray>() << "PART2" );
+      compressor.append( msg );
+      QCOMPARE( compressor.count(), 1 );
+      QCOMPARE( compressor.notifications().first().itemParts(), QSet<QByteArray>() << "PART1" << "PART2" );
+
+      // Changes of different kinds are never merged
+      compressor.append( flagsMessage( QList<qint64>() << 1, Flags() << "F1", Flags() ) );
+      QCOMPARE( compressor.count(), 2 );
+    }
+
+    void testBarriers()
+    {
+      NotificationCompressor compressor;
+      compressor.append( flagsMessage( QList<qint64>() << 1, Flags() << "F1", Flags() ) );
+      compressor.append( itemMessage( NotificationMessageV2::Add, QList<qint64>() << 2 ) );
+      // Merging into the first notification would announce a change of an
+      // item before its creation
+      QVERIFY( compressor.append( flagsMessage( QList<qint64>() << 2, Flags() << "F1", Flags() ) ) );
+      QCOMPARE( compressor.count(), 3 );
+      QCOMPARE( compressor.notifications().at( 2 ).entities().keys(), QList<qint64>() << 2 );
+
+      // ...but later changes can still go into the last one
+      QVERIFY( !compressor.append( flagsMessage( QList<qint64>() << 3, Flags() << "F1", Flags() ) ) );
+      QCOMPARE( compressor.count(), 3 );
+      QCOMPARE( compressor.notifications().at( 2 ).entities().keys(), QList<qint64>() << 2 << 3 );
+    }
+
+    void testCollections()
+    {
+      // Same results as NotificationMessageV3::appendAndCompress()
+      NotificationMessageV3::List msgs;
+      msgs << collectionMessage( NotificationMessageV2::Modify, 1, QSet<QByteArray>() << "NAME" )
+           << collectionMessage( NotificationMessageV2::Modify, 1, QSet<QByteArray>() << "REMOTEID" )
+           << collectionMessage( NotificationMessageV2::Add, 2 )
+           << collectionMessage( NotificationMessageV2::Modify, 2, QSet<QByteArray>() << "NAME" )
+           << collectionMessage( NotificationMessageV2::Remove, 3 );
+
+      NotificationCompressor compressor;
+      NotificationMessageV3::List expected;
+      Q_FOREACH ( const NotificationMessageV3 &msg, msgs ) {
+        compressor.append( msg );
+        NotificationMessageV3::appendAndCompress( expected, msg );
+      }
+      QCOMPARE( compressor.notifications(), expected );
+      QCOMPARE( compressor.count(), 3 );
+    }
+
+    void testFlagStateEquivalence()
+    {
+      const QList<QByteArray> allFlags = QList<QByteArray>() << "\\SEEN" << "\\FLAGGED" << "$TODO";
+      NotificationMessageV3::List msgs;
+      qsrand( 42 );
+      for ( int i = 0; i < 2000; ++i ) {
+        QList<qint64> ids;
+        const int count = qrand() % 3 + 1;
+        for ( int j = 0; j < count; ++j ) {
+          ids << qrand() % 20 + 1;
+        }
+        const Flags added = Flags() << allFlags.at( qrand() % allFlags.count() );
+        Flags removed = Flags() << allFlags.at( qrand() % allFlags.count() );
+        removed -= added;
+        msgs << flagsMessage( ids, added, removed );
+        if ( qrand() % 10 == 0 ) {
+          msgs << itemMessage( NotificationMessageV2::Move, QList<qint64>() << ids.first() );
+        }
+      }
+
+      NotificationCompressor compressor;
+      Q_FOREACH ( const NotificationMessageV3 &msg, msgs ) {
+        compressor.append( msg );
+      }
+      QVERIFY( compressor.count() < msgs.count() );
+
+      QHash<qint64, Flags> expected;
+      applyFlagChanges( expected, msgs );
+      QHash<qint64, Flags> actual;
+      applyFlagChanges( actual, compressor.notifications() );
+      QCOMPARE( actual, expected );
+    }
+};
+
+AKTEST_MAIN( NotificationCompressorTest )
+
+#include "notificationcompressortest.moc"
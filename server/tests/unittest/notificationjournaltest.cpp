@@ -0,0 +1,213 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtCore/QFile>
+#include <QtTest/QTest>
+
+#include "aktest.h"
+#include "notificationjournal.h"
+#include <libs/notificationmessagev2_p_p.h>
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+static const QString journalFile = QLatin1String( "notificationjournaltest.journal" );
+
+static NotificationMessageV3::List itemMessages( qint64 first, int count )
+{
+  NotificationMessageV3::List list;
+  for ( int i = 0; i < count; ++i ) {
+    NotificationMessageV3 msg;
+    msg.setType( NotificationMessageV2::Items );
+    msg.setOperation( NotificationMessageV2::Add );
+    msg.setSessionId( "session" );
+    msg.setResource( "resource" );
+    msg.setParentCollection( 1 );
+    msg.addEntity( first + i, QString(), QString(), QLatin1String( "message/rfc822" ) );
+    list << msg;
+  }
+  return list;
+}
+
+class NotificationJournalTest : public QObject
+{
+  Q_OBJECT
+
+  private:
+    static QVector<QByteArray> metadata( const NotificationMessageV3 &msg )
+    {
+      return msg.d->metadata;
+    }
+
+  private Q_SLOTS:
+    void init()
+    {
+      QFile::remove( journalFile );
+      QFile::remove( journalFile + QLatin1String( ".old" ) );
+    }
+
+    void testAppendAndReplay()
+    {
+      NotificationJournal journal;
+      QVERIFY( journal.open( journalFile ) );
+      QCOMPARE( journal.lastSequence(), 0ll );
+
+      const NotificationMessageV3::List msgs = itemMessages( 1, 5 );
+      QCOMPARE( journal.append( msgs.mid( 0, 2 ) ), 2ll );
+      QCOMPARE( journal.append( msgs.mid( 2 ) ), 5ll );
+
+      NotificationMessageV3::List replayed;
+      QVERIFY( journal.replay( 0, replayed ) );
+      QCOMPARE( replayed, msgs );
+
+      replayed.clear();
+      QVERIFY( journal.replay( 3, replayed ) );
+      QCOMPARE( replayed, msgs.mid( 3 ) );
+
+      replayed.clear();
+      QVERIFY( journal.replay( 5, replayed ) );
+      QVERIFY( replayed.isEmpty() );
+
+      // Unknown sequence numbers require a full synchronization
+      QVERIFY( !journal.replay( 6, replayed ) );
+    }
+
+    void testMetadata()
+    {
+      NotificationMessageV3::List msgs = itemMessages( 1, 2 );
+      msgs[0].setType( NotificationMessageV2::Collections );
+      msgs[0].d->metadata << "DISABLED";
+
+      {
+        NotificationJournal journal;
+        QVERIFY( journal.open( journalFile ) );
+        journal.append( msgs );
+      }
+
+      // The metadata is kept across a restart
+      NotificationJournal journal;
+      QVERIFY( journal.open( journalFile ) );
+      NotificationMessageV3::List replayed;
+      QVERIFY( journal.replay( 0, replayed ) );
+      QCOMPARE( replayed, msgs );
+      QCOMPARE( metadata( replayed.at( 0 ) ), QVector<QByteArray>() << "DISABLED" );
+      QVERIFY( metadata( replayed.at( 1 ) ).isEmpty() );
+    }
+
+    void testBatchedRead()
+    {
+      NotificationJournal journal;
+      journal.setMaximumSize( 16384 );
+      QVERIFY( journal.open( journalFile ) );
+      for ( int i = 0; i < 20; ++i ) {
+        journal.append( itemMessages( i, 1 ) );
+      }
+
+      NotificationJournal::Cursor cursor;
+      QVERIFY( journal.seek( 10, cursor ) );
+      NotificationMessageV3::List replayed;
+      QVERIFY( journal.read( cursor, 4, replayed ) );
+      QCOMPARE( replayed, itemMessages( 10, 4 ) );
+      QCOMPARE( cursor.sequence, 14ll );
+
+      // Notifications appended in the meantime are read as well, also when
+      // the journal was rotated behind the cursor
+      for ( int i = 20; i < 60; ++i ) {
+        journal.append( itemMessages( i, 1 ) );
+      }
+      QVERIFY( QFile::exists( journalFile + QLatin1String( ".old" ) ) );
+      QVERIFY( journal.firstSequence() <= 15 );
+      replayed.clear();
+      while ( cursor.sequence < journal.lastSequence() ) {
+        QVERIFY( journal.read( cursor, 7, replayed ) );
+      }
+      QCOMPARE( replayed, itemMessages( 14, 46 ) );
+
+      // Reading at the end gives nothing
+      replayed.clear();
+      QVERIFY( journal.read( cursor, 7, replayed ) );
+      QVERIFY( replayed.isEmpty() );
+
+      // Once the notifications at the cursor are dropped, reading fails
+      QVERIFY( journal.seek( journal.firstSequence() - 1, cursor ) );
+      for ( int i = 60; i < 200; ++i ) {
+        journal.append( itemMessages( i, 1 ) );
+      }
+      QVERIFY( !journal.read( cursor, 7, replayed ) );
+    }
+
+    void testReopen()
+    {
+      const NotificationMessageV3::List msgs = itemMessages( 1, 3 );
+      {
+        NotificationJournal journal;
+        QVERIFY( journal.open( journalFile ) );
+        journal.append( msgs );
+      }
+
+      // Simulate a crash in the middle of writing a record
+      QFile file( journalFile );
+      QVERIFY( file.open( QIODevice::Append ) );
+      file.write( "\0\0\0\0\0\0\0\4garbage", 15 );
+      file.close();
+
+      NotificationJournal journal;
+      QVERIFY( journal.open( journalFile ) );
+      QCOMPARE( journal.lastSequence(), 3ll );
+      QCOMPARE( journal.append( itemMessages( 4, 1 ) ), 4ll );
+
+      NotificationMessageV3::List replayed;
+      QVERIFY( journal.replay( 2, replayed ) );
+      QCOMPARE( replayed, msgs.mid( 2 ) + itemMessages( 4, 1 ) );
+    }
+
+    void testRotation()
+    {
+      NotificationJournal journal;
+      journal.setMaximumSize( 4096 );
+      QVERIFY( journal.open( journalFile ) );
+
+      for ( int i = 0; i < 100; ++i ) {
+        journal.append( itemMessages( i, 1 ) );
+      }
+      QCOMPARE( journal.lastSequence(), 100ll );
+      QVERIFY( journal.firstSequence() > 1 );
+      QVERIFY( QFile( journalFile ).size() + QFile( journalFile + QLatin1String( ".old" ) ).size() <= 4096 + 1024 );
+
+      // Older notifications were dropped
+      NotificationMessageV3::List replayed;
+      QVERIFY( !journal.replay( 0, replayed ) );
+
+      const qint64 first = journal.firstSequence();
+      QVERIFY( journal.replay( first - 1, replayed ) );
+      QCOMPARE( replayed.count(), static_cast<int>( 100 - first + 1 ) );
+      QCOMPARE( replayed.last(), itemMessages( 99, 1 ).first() );
+
+      journal.close();
+      NotificationJournal reopened;
+      QVERIFY( reopened.open( journalFile ) );
+      QCOMPARE( reopened.lastSequence(), 100ll );
+      QCOMPARE( reopened.firstSequence(), first );
+    }
+};
+
+AKTEST_MAIN( NotificationJournalTest )
+
+#include "notificationjournaltest.moc"
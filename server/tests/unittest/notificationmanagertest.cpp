@@ -23,6 +23,7 @@
 #include "notificationmanager.h"
 #include "notificationsource.h"
 #include "clientcapabilityaggregator.h"
+#include "storage/notificationcollector.h"
 
 #include <QtCore/QObject>
 #include <QtTest/QTest>
@@ -256,6 +257,278 @@ class NotificationManagerTest : public QObject
         QCOMPARE( list.count(), accepted ? 1 : 0 );
       }
     }
+
+    void testSubscriptionIndex()
+    {
+      ClientCapabilities caps;
+      caps.setNotificationMessageVersion( 3 );
+      ClientCapabilityAggregator::addSession( caps );
+
+      NotificationManager mgr;
+      NotificationSource *colSource = new NotificationSource( QLatin1String( "colSource" ), QString(), &mgr );
+      NotificationSource *itemSource = new NotificationSource( QLatin1String( "itemSource" ), QString(), &mgr );
+      NotificationSource *tagSource = new NotificationSource( QLatin1String( "tagSource" ), QString(), &mgr );
+      Q_FOREACH ( NotificationSource *source, NSList() << colSource << itemSource << tagSource ) {
+        source->setServerSideMonitorEnabled( true );
+        mgr.registerSource( source );
+      }
+
+      colSource->setMonitoredCollection( 1, true );
+      colSource->setMonitoredType( NotificationMessageV2::Items, true );
+      itemSource->setMonitoredItem( 10, true );
+      itemSource->setMonitoredType( NotificationMessageV2::Items, true );
+      tagSource->setMonitoredTag( 5, true );
+      tagSource->setMonitoredType( NotificationMessageV2::Tags, true );
+
+      NotificationMessageV3 itemMsg;
+      itemMsg.setType( NotificationMessageV2::Items );
+      itemMsg.setOperation( NotificationMessageV2::Modify );
+      itemMsg.setParentCollection( 1 );
+      itemMsg.setSessionId( "kmail" );
+      itemMsg.addEntity( 10, QString(), QString(), QLatin1String( "message/rfc822" ) );
+
+      QSet<NotificationSource *> candidates = mgr.mSubscriptionIndex.candidates( itemMsg );
+      QCOMPARE( candidates, QSet<NotificationSource *>() << colSource << itemSource );
+
+      NotificationMessageV3 tagMsg;
+      tagMsg.setType( NotificationMessageV2::Tags );
+      tagMsg.setOperation( NotificationMessageV2::Add );
+      tagMsg.addEntity( 5 );
+      candidates = mgr.mSubscriptionIndex.candidates( tagMsg );
+      QCOMPARE( candidates, QSet<NotificationSource *>() << tagSource );
+
+      // Changing the filters updates the index
+      colSource->setMonitoredCollection( 1, false );
+      itemSource->setIgnoredSession( "kmail", true );
+      QVERIFY( mgr.mSubscriptionIndex.candidates( itemMsg ).isEmpty() );
+
+      QSignalSpy tagSpy( tagSource, SIGNAL(notifyV3(Akonadi::NotificationMessageV3::List)) );
+      QSignalSpy itemSpy( itemSource, SIGNAL(notifyV3(Akonadi::NotificationMessageV3::List)) );
+      mgr.slotNotify( NotificationMessageV3::List() << itemMsg << tagMsg );
+      mgr.emitPendingNotifications();
+      QCOMPARE( tagSpy.count(), 1 );
+      QCOMPARE( itemSpy.count(), 0 );
+
+      colSource->setAllMonitored( true );
+      QCOMPARE( mgr.mSubscriptionIndex.candidates( itemMsg ), QSet<NotificationSource *>() << colSource );
+
+      mgr.unregisterSource( colSource );
+      QVERIFY( !mgr.mSubscriptionIndex.contains( colSource ) );
+      QVERIFY( mgr.mSubscriptionIndex.candidates( itemMsg ).isEmpty() );
+    }
+
+    void testSharedPayloads()
+    {
+      ClientCapabilities caps;
+      caps.setNotificationMessageVersion( 3 );
+      ClientCapabilityAggregator::addSession( caps );
+
+      NotificationManager mgr;
+      NSList sources;
+      for ( int i = 0; i < 3; ++i ) {
+        NotificationSource *source = new NotificationSource( QString::fromLatin1( "source%1" ).arg( i ), QString(), &mgr );
+        source->setServerSideMonitorEnabled( true );
+        mgr.registerSource( source );
+        source->setMonitoredCollection( 1, true );
+        sources << source;
+      }
+      sources.at( 2 )->setMonitoredCollection( 2, true );
+
+      NotificationMessageV3::List msgs;
+      for ( int col = 1; col <= 2; ++col ) {
+        NotificationMessageV3 msg;
+        msg.setType( NotificationMessageV2::Items );
+        msg.setOperation( NotificationMessageV2::Add );
+        msg.setParentCollection( col );
+        msg.addEntity( col * 10, QString(), QString(), QLatin1String( "message/rfc822" ) );
+        msgs << msg;
+      }
+
+      QList<QSignalSpy *> spies;
+      Q_FOREACH ( NotificationSource *source, sources ) {
+        spies << new QSignalSpy( source, SIGNAL(notifyV3(Akonadi::NotificationMessageV3::List)) );
+      }
+      mgr.slotNotify( msgs );
+      mgr.emitPendingNotifications();
+
+      QList<NotificationMessageV3::List> received;
+      Q_FOREACH ( QSignalSpy *spy, spies ) {
+        QCOMPARE( spy->count(), 1 );
+        received << spy->at( 0 ).at( 0 ).value<NotificationMessageV3::List>();
+      }
+      qDeleteAll( spies );
+
+      QCOMPARE( received.at( 0 ), NotificationMessageV3::List() << msgs.at( 0 ) );
+      QCOMPARE( received.at( 1 ), received.at( 0 ) );
+      QCOMPARE( received.at( 2 ), msgs );
+    }
+
+    void testAdaptiveFlush()
+    {
+      ClientCapabilities caps;
+      caps.setNotificationMessageVersion( 3 );
+      ClientCapabilityAggregator::addSession( caps );
+
+      NotificationManager mgr;
+      NotificationSource *source = new NotificationSource( QLatin1String( "source" ), QString(), &mgr );
+      source->setServerSideMonitorEnabled( true );
+      source->setAllMonitored( true );
+      mgr.registerSource( source );
+      QSignalSpy spy( source, SIGNAL(notifyV3(Akonadi::NotificationMessageV3::List)) );
+
+      NotificationMessageV3::List msgs;
+      for ( int i = 1; i <= 3; ++i ) {
+        NotificationMessageV3 msg;
+        msg.setType( NotificationMessageV2::Items );
+        msg.setOperation( NotificationMessageV2::Add );
+        msg.setParentCollection( 1 );
+        msg.addEntity( i );
+        msgs << msg;
+      }
+
+      // An isolated change is emitted right away
+      mgr.slotNotify( msgs.mid( 0, 1 ) );
+      QCoreApplication::processEvents();
+      QCOMPARE( spy.count(), 1 );
+
+      // Under high load notifications are batched...
+      mgr.mBurstRate = 0;
+      mgr.mMaximumBatchSize = 2;
+      mgr.mTimer.setInterval( 60 * 1000 );
+      mgr.slotNotify( msgs.mid( 1, 1 ) );
+      QCoreApplication::processEvents();
+      QCOMPARE( spy.count(), 1 );
+      QVERIFY( mgr.mTimer.isActive() );
+
+      // ...until the batch is full
+      mgr.slotNotify( msgs.mid( 2, 1 ) );
+      QCoreApplication::processEvents();
+      QCOMPARE( spy.count(), 2 );
+      QCOMPARE( spy.at( 1 ).at( 0 ).value<NotificationMessageV3::List>(), msgs.mid( 1 ) );
+      QVERIFY( !mgr.mTimer.isActive() );
+      QCOMPARE( mgr.mLastBatchSize, 2 );
+      QCOMPARE( mgr.mFlushCount, 2ll );
+    }
+
+    void testEntityBatches()
+    {
+      ClientCapabilities caps;
+      caps.setNotificationMessageVersion( 3 );
+      ClientCapabilityAggregator::addSession( caps );
+
+      NotificationManager mgr;
+      NotificationSource *source = new NotificationSource( QLatin1String( "source" ), QString(), &mgr );
+      source->setServerSideMonitorEnabled( true );
+      source->setAllMonitored( true );
+      mgr.registerSource( source );
+      QSignalSpy spy( source, SIGNAL(notifyV3(Akonadi::NotificationMessageV3::List)) );
+
+      // Changes of 1.5 times the maximum entities in three collections
+      const int entities = NotificationCollector::maximumEntities() / 2;
+      NotificationMessageV3::List msgs;
+      for ( int col = 1; col <= 3; ++col ) {
+        NotificationMessageV3 msg;
+        msg.setType( NotificationMessageV2::Items );
+        msg.setOperation( NotificationMessageV2::Add );
+        msg.setParentCollection( col );
+        for ( int i = 0; i < entities; ++i ) {
+          msg.addEntity( col * entities + i );
+        }
+        msgs << msg;
+      }
+
+      // A full batch is emitted right away, without waiting for the timer
+      mgr.mBurstRate = 0;
+      mgr.mTimer.setInterval( 60 * 1000 );
+      mgr.slotNotify( msgs );
+      QCOMPARE( spy.count(), 2 );
+      QCOMPARE( spy.at( 0 ).at( 0 ).value<NotificationMessageV3::List>(), msgs.mid( 0, 2 ) );
+      QCOMPARE( spy.at( 1 ).at( 0 ).value<NotificationMessageV3::List>(), msgs.mid( 2 ) );
+      QVERIFY( !mgr.mTimer.isActive() );
+      QCOMPARE( mgr.mPendingEntities, 0 );
+    }
+
+    void testAttachConnection()
+    {
+      NotificationManager mgr;
+      NotificationSource *source = new NotificationSource( QLatin1String( "source" ), QString(), &mgr );
+      mgr.registerSource( source );
+
+      QCOMPARE( mgr.attachConnection( QLatin1String( "unknown" ), 0 ), NotificationManager::UnknownSource );
+      // The queue of an attached source is only bounded by invalidation hints
+      QCOMPARE( mgr.attachConnection( QLatin1String( "source" ), 0 ), NotificationManager::InvalidationHintsRequired );
+      source->setInvalidationHintsSupported( true );
+      QCOMPARE( mgr.attachConnection( QLatin1String( "source" ), 0 ), NotificationManager::Attached );
+    }
+
+    void testQueueCoalescing()
+    {
+      ClientCapabilities caps;
+      caps.setNotificationMessageVersion( 3 );
+      ClientCapabilityAggregator::addSession( caps );
+
+      NotificationManager mgr;
+      NotificationSource *source = new NotificationSource( QLatin1String( "slowSource" ), QString(), &mgr );
+      source->setServerSideMonitorEnabled( true );
+      source->setAllMonitored( true );
+      source->setQueueLimit( 3 );
+      mgr.registerSource( source );
+
+      NotificationMessageV3 colMsg;
+      colMsg.setType( NotificationMessageV2::Collections );
+      colMsg.setOperation( NotificationMessageV2::Add );
+      colMsg.setParentCollection( 0 );
+      colMsg.addEntity( 2 );
+
+      NotificationMessageV3::List msgs;
+      msgs << colMsg;
+      for ( int i = 0; i < 4; ++i ) {
+        NotificationMessageV3 msg;
+        msg.setType( NotificationMessageV2::Items );
+        msg.setOperation( i % 2 ? NotificationMessageV2::Add : NotificationMessageV2::Remove );
+        msg.setParentCollection( 1 + i % 2 );
+        msg.setResource( "res" );
+        msg.addEntity( 10 + i );
+        msgs << msg;
+      }
+
+      QSignalSpy spy( source, SIGNAL(notifyV3(Akonadi::NotificationMessageV3::List)) );
+
+      // Clients that don't know about invalidation hints get everything
+      source->emitNotification( msgs );
+      QCOMPARE( spy.count(), 1 );
+      QCOMPARE( spy.at( 0 ).at( 0 ).value<NotificationMessageV3::List>(), msgs );
+      QCOMPARE( source->coalescedCount(), 0ll );
+      spy.clear();
+
+      source->setInvalidationHintsSupported( true );
+      source->emitNotification( msgs );
+      QCOMPARE( spy.count(), 1 );
+      const NotificationMessageV3::List received = spy.at( 0 ).at( 0 ).value<NotificationMessageV3::List>();
+
+      // The collection change is kept, item changes become one hint per collection
+      QCOMPARE( received.count(), 3 );
+      QCOMPARE( received.at( 0 ), colMsg );
+      for ( int i = 1; i < 3; ++i ) {
+        QCOMPARE( received.at( i ).type(), NotificationMessageV2::Collections );
+        QCOMPARE( received.at( i ).operation(), NotificationMessageV2::Modify );
+        QCOMPARE( received.at( i ).uids(), QList<NotificationMessageV2::Id>() << i );
+        QCOMPARE( received.at( i ).resource(), QByteArray( "res" ) );
+        QVERIFY( received.at( i ).itemParts().contains( "INVALIDATE" ) );
+      }
+
+      QCOMPARE( source->queueDepth(), 0 );
+      QCOMPARE( source->maximumQueueDepth(), 5 );
+      QCOMPARE( source->coalescedCount(), 4ll );
+      QCOMPARE( source->deliveredCount(), 8ll );
+      QCOMPARE( mgr.queueStatistics().count(), 1 );
+
+      // Small batches are delivered as they are
+      spy.clear();
+      source->emitNotification( NotificationMessageV3::List() << colMsg );
+      QCOMPARE( spy.count(), 1 );
+      QCOMPARE( spy.at( 0 ).at( 0 ).value<NotificationMessageV3::List>(), NotificationMessageV3::List() << colMsg );
+    }
 };
 
 AKTEST_MAIN( NotificationManagerTest )
@@ -100,6 +100,21 @@ void QueryBuilderTest::testQueryBuilder_data()
   mBuilders << qb;
   QTest::newRow( "SELECT with LIMIT" ) << mBuilders.count() << QString( "SELECT col1 FROM table LIMIT 1" ) << QList<QVariant>();
 
+  qb = QueryBuilder( "table", QueryBuilder::Select );
+  qb.setDatabaseType( DbType::MySQL );
+  qb.addColumn( "col1" );
+  qb.setLimit( 10 );
+  qb.setOffset( 20 );
+  mBuilders << qb;
+  QTest::newRow( "SELECT with LIMIT and OFFSET" ) << mBuilders.count() << QString( "SELECT col1 FROM table LIMIT 10 OFFSET 20" ) << QList<QVariant>();
+
+  qb = QueryBuilder( "table", QueryBuilder::Select );
+  qb.setDatabaseType( DbType::MySQL );
+  qb.addColumn( "col1" );
+  qb.setOffset( 20 );
+  mBuilders << qb;
+  QTest::newRow( "SELECT with OFFSET only" ) << mBuilders.count() << QString( "SELECT col1 FROM table" ) << QList<QVariant>();
+
   qb = QueryBuilder( "table", QueryBuilder::Update );
   qb.setColumnValue( "col1", QString( "bla" ) );
   bindVals.clear();
@@ -0,0 +1,288 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtCore/QFile>
+#include <QtSql/QSqlDatabase>
+#include <QtSql/QSqlError>
+#include <QtSql/QSqlQuery>
+#include <QtSql/QSqlRecord>
+#include <QtTest/QTest>
+
+#include "aktest.h"
+
+#ifdef QT_STATICPLUGIN
+#include <QtPlugin>
+
+Q_IMPORT_PLUGIN( qsqlite3 )
+#endif
+
+static const QString connectionName = QLatin1String( "sqlitedrivertest" );
+static const QString databaseFile = QLatin1String( "sqlitedrivertest.db" );
+
+/// Rows in the table used for reading and benchmarking
+static const int RowCount = 2000;
+
+/// Size of the payload of each row
+static const int PayloadSize = 4096;
+
+static QString rowName( int row )
+{
+  return QString::fromUtf8( "Quarterly report for München #%1" ).arg( row );
+}
+
+static QByteArray rowPayload( int row )
+{
+  return QByteArray( PayloadSize, char( 'a' + row % 26 ) );
+}
+
+/**
+ * Tests the QSQLITE3 driver: streaming of forward-only results and
+ * binding of strings.
+ */
+class SqliteDriverTest : public QObject
+{
+  Q_OBJECT
+
+  private:
+    QSqlDatabase database() const
+    {
+      return QSqlDatabase::database( connectionName );
+    }
+
+  private Q_SLOTS:
+    void initTestCase()
+    {
+      if ( !QSqlDatabase::isDriverAvailable( QLatin1String( "QSQLITE3" ) ) ) {
+        QSKIP( "QSQLITE3 driver not available", SkipAll );
+      }
+
+      QFile::remove( databaseFile );
+      QSqlDatabase db = QSqlDatabase::addDatabase( QLatin1String( "QSQLITE3" ), connectionName );
+      db.setDatabaseName( databaseFile );
+      QVERIFY2( db.open(), qPrintable( db.lastError().text() ) );
+
+      QSqlQuery query( db );
+      QVERIFY( query.exec( QLatin1String( "CREATE TABLE PartTable (id INTEGER PRIMARY KEY, name TEXT, data BLOB)" ) ) );
+      QVERIFY( db.transaction() );
+      QVERIFY( query.prepare( QLatin1String( "INSERT INTO PartTable (id, name, data) VALUES (?, ?, ?)" ) ) );
+      for ( int i = 1; i <= RowCount; ++i ) {
+        query.bindValue( 0, i );
+        query.bindValue( 1, rowName( i ) );
+        // every 10th row has no payload
+        query.bindValue( 2, i % 10 == 0 ? QVariant( QVariant::ByteArray ) : QVariant( rowPayload( i ) ) );
+        QVERIFY2( query.exec(), qPrintable( query.lastError().text() ) );
+      }
+      QVERIFY( db.commit() );
+    }
+
+    void cleanupTestCase()
+    {
+      QSqlDatabase::removeDatabase( connectionName );
+      QFile::remove( databaseFile );
+    }
+
+    void testBindStrings_data()
+    {
+      QTest::addColumn<QVariant>( "value" );
+      QTest::addColumn<bool>( "isNull" );
+      QTest::addColumn<int>( "length" );
+
+      QTest::newRow( "null variant" ) << QVariant( QVariant::String ) << true << 0;
+      QTest::newRow( "null string" ) << QVariant( QString() ) << true << 0;
+      QTest::newRow( "empty string" ) << QVariant( QString::fromLatin1( "" ) ) << false << 0;
+      QTest::newRow( "ascii" ) << QVariant( QString::fromLatin1( "report" ) ) << false << 6;
+      QTest::newRow( "non-ascii" ) << QVariant( QString::fromUtf8( "Müller ✓" ) ) << false << 8;
+    }
+
+    void testBindStrings()
+    {
+      QFETCH( QVariant, value );
+      QFETCH( bool, isNull );
+      QFETCH( int, length );
+
+      QSqlQuery query( database() );
+      QVERIFY( query.prepare( QLatin1String( "SELECT ? IS NULL, length(?), ?" ) ) );
+      for ( int i = 0; i < 3; ++i ) {
+        query.bindValue( i, value );
+      }
+      QVERIFY2( query.exec(), qPrintable( query.lastError().text() ) );
+      QVERIFY( query.next() );
+      QCOMPARE( query.value( 0 ).toBool(), isNull );
+      if ( !isNull ) {
+        // length() counts characters, so the text was bound with the right size
+        QCOMPARE( query.value( 1 ).toInt(), length );
+      }
+      QCOMPARE( query.isNull( 2 ), isNull );
+      QCOMPARE( query.value( 2 ).toString(), value.toString() );
+    }
+
+    void testRebindStrings()
+    {
+      // The UTF-8 copies of bound strings must survive until the statement
+      // is executed again
+      QSqlQuery query( database() );
+      QVERIFY( query.prepare( QLatin1String( "SELECT id FROM PartTable WHERE name = ? OR name = ?" ) ) );
+      for ( int i = 1; i <= 3; ++i ) {
+        query.bindValue( 0, rowName( i ) );
+        query.bindValue( 1, rowName( i + 100 ) );
+        QVERIFY( query.exec() );
+        QList<int> ids;
+        while ( query.next() ) {
+          ids << query.value( 0 ).toInt();
+        }
+        QCOMPARE( ids, QList<int>() << i << i + 100 );
+      }
+    }
+
+    void testRead_data()
+    {
+      QTest::addColumn<bool>( "forwardOnly" );
+
+      QTest::newRow( "forward-only" ) << true;
+      QTest::newRow( "scrollable" ) << false;
+    }
+
+    void testRead()
+    {
+      QFETCH( bool, forwardOnly );
+
+      QSqlQuery query( database() );
+      query.setForwardOnly( forwardOnly );
+      QVERIFY( query.exec( QLatin1String( "SELECT id, name, data FROM PartTable ORDER BY id" ) ) );
+      QVERIFY( query.isSelect() );
+      QCOMPARE( query.at(), int( QSql::BeforeFirstRow ) );
+      QCOMPARE( query.record().count(), 3 );
+      QCOMPARE( query.record().fieldName( 1 ), QString::fromLatin1( "name" ) );
+
+      int row = 0;
+      while ( query.next() ) {
+        ++row;
+        QCOMPARE( query.at(), row - 1 );
+        // read the columns out of order and some of them twice
+        QCOMPARE( query.value( 2 ).toByteArray(), row % 10 == 0 ? QByteArray() : rowPayload( row ) );
+        QCOMPARE( query.isNull( 2 ), row % 10 == 0 );
+        QCOMPARE( query.value( 0 ).toInt(), row );
+        QCOMPARE( query.value( 1 ).toString(), rowName( row ) );
+        QCOMPARE( query.value( 0 ).toInt(), row );
+        QVERIFY( !query.value( 3 ).isValid() );
+      }
+      QCOMPARE( row, RowCount );
+      QVERIFY( !query.isValid() );
+      QVERIFY( !query.next() );
+    }
+
+    void testLast_data()
+    {
+      testRead_data();
+    }
+
+    void testLast()
+    {
+      QFETCH( bool, forwardOnly );
+
+      QSqlQuery query( database() );
+      query.setForwardOnly( forwardOnly );
+      QVERIFY( query.exec( QLatin1String( "SELECT id, name FROM PartTable WHERE id <= 10 ORDER BY id" ) ) );
+      QVERIFY( query.next() );
+      QCOMPARE( query.value( 0 ).toInt(), 1 );
+      QVERIFY( query.last() );
+      QCOMPARE( query.at(), 9 );
+      QCOMPARE( query.value( 0 ).toInt(), 10 );
+      QCOMPARE( query.value( 1 ).toString(), rowName( 10 ) );
+      QVERIFY( query.last() );
+      QCOMPARE( query.value( 0 ).toInt(), 10 );
+      // the statement must not be run again after the end of the results
+      QVERIFY( !query.next() );
+      QVERIFY( !query.next() );
+
+      // last() straight after exec()
+      QVERIFY( query.exec() );
+      QVERIFY( query.last() );
+      QCOMPARE( query.value( 0 ).toInt(), 10 );
+      QCOMPARE( query.first(), !forwardOnly );
+    }
+
+    void testSeek()
+    {
+      QSqlQuery query( database() );
+      query.setForwardOnly( true );
+      QVERIFY( query.exec( QLatin1String( "SELECT id FROM PartTable ORDER BY id" ) ) );
+      QVERIFY( query.seek( 4 ) );
+      QCOMPARE( query.value( 0 ).toInt(), 5 );
+      QVERIFY( !query.previous() );
+      QVERIFY( !query.seek( 2 ) );
+      QVERIFY( !query.seek( RowCount ) );
+      QVERIFY( !query.next() );
+    }
+
+    void testEmptyResult_data()
+    {
+      testRead_data();
+    }
+
+    void testEmptyResult()
+    {
+      QFETCH( bool, forwardOnly );
+
+      QSqlQuery query( database() );
+      query.setForwardOnly( forwardOnly );
+      QVERIFY( query.exec( QLatin1String( "SELECT id, name FROM PartTable WHERE id < 0" ) ) );
+      QVERIFY( query.isSelect() );
+      QCOMPARE( query.record().count(), 2 );
+      QVERIFY( !query.next() );
+      QVERIFY( !query.last() );
+      QVERIFY( !query.value( 0 ).isValid() );
+    }
+
+    void benchmarkRead_data()
+    {
+      QTest::addColumn<bool>( "forwardOnly" );
+      QTest::addColumn<bool>( "readPayload" );
+
+      QTest::newRow( "forward-only, id" ) << true << false;
+      QTest::newRow( "forward-only, all columns" ) << true << true;
+      QTest::newRow( "scrollable, id" ) << false << false;
+      QTest::newRow( "scrollable, all columns" ) << false << true;
+    }
+
+    void benchmarkRead()
+    {
+      QFETCH( bool, forwardOnly );
+      QFETCH( bool, readPayload );
+
+      QBENCHMARK {
+        QSqlQuery query( database() );
+        query.setForwardOnly( forwardOnly );
+        QVERIFY( query.exec( QLatin1String( "SELECT id, name, data FROM PartTable" ) ) );
+        qint64 size = 0;
+        while ( query.next() ) {
+          size += query.value( 0 ).toLongLong();
+          if ( readPayload ) {
+            size += query.value( 1 ).toString().size() + query.value( 2 ).toByteArray().size();
+          }
+        }
+        QVERIFY( size > 0 );
+      }
+    }
+};
+
+AKTEST_MAIN( SqliteDriverTest )
+
+#include "sqlitedrivertest.moc"
@@ -0,0 +1,131 @@
+/*
+    Copyright (c) 2014 The Akonadi Developers
+
+    This library is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Library General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or (at your
+    option) any later version.
+
+    This library is distributed in the hope that it will be useful, but WITHOUT
+    ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+    FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Library General Public
+    License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to the
+    Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301, USA.
+*/
+
+#include <QObject>
+#include <QtTest/QTest>
+
+#include "aktest.h"
+#include "storage/syncscheduler.h"
+
+using namespace Akonadi;
+using namespace Akonadi::Server;
+
+static SyncQueue::Key key( const char *resource, qint64 collectionId )
+{
+  return SyncQueue::Key( QLatin1String( resource ), collectionId );
+}
+
+static QList<SyncQueue::Key> keys( const QList<SyncQueue::Request> &requests )
+{
+  QList<SyncQueue::Key> list;
+  Q_FOREACH ( const SyncQueue::Request &request, requests ) {
+    list << request.key;
+  }
+  return list;
+}
+
+class SyncQueueTest : public QObject
+{
+  Q_OBJECT
+
+  private Q_SLOTS:
+    void testMerge()
+    {
+      SyncQueue queue( 4, 1 );
+      QVERIFY( queue.enqueue( key( "res1", 1 ), SyncQueue::Interval, 0 ) );
+      QVERIFY( queue.enqueue( key( "res1", 2 ), SyncQueue::Interval, 0 ) );
+      QVERIFY( !queue.enqueue( key( "res1", 1 ), SyncQueue::Interval, 10 ) );
+      QCOMPARE( keys( queue.queued() ), QList<SyncQueue::Key>() << key( "res1", 1 ) << key( "res1", 2 ) );
+
+      // Requests for running synchronizations are dropped
+      QCOMPARE( keys( queue.start( 100 ) ), QList<SyncQueue::Key>() << key( "res1", 1 ) );
+      QVERIFY( !queue.enqueue( key( "res1", 1 ), SyncQueue::OnDemand, 110 ) );
+      QCOMPARE( keys( queue.queued() ), QList<SyncQueue::Key>() << key( "res1", 2 ) );
+
+      // ...but can be queued again once they are done
+      QCOMPARE( keys( queue.finish( QLatin1String( "res1" ) ) ), QList<SyncQueue::Key>() << key( "res1", 1 ) );
+      QVERIFY( queue.enqueue( key( "res1", 1 ), SyncQueue::Interval, 120 ) );
+      QCOMPARE( queue.queued().count(), 2 );
+    }
+
+    void testPriority()
+    {
+      SyncQueue queue( 1, 1 );
+      queue.enqueue( key( "res1", 1 ), SyncQueue::Interval, 0 );
+      queue.enqueue( key( "res2", 2 ), SyncQueue::Interval, 0 );
+      queue.enqueue( key( "res3", 3 ), SyncQueue::Interval, 0 );
+      queue.enqueue( key( "res4", 4 ), SyncQueue::OnDemand, 0 );
+
+      // An on-demand request moves a queued interval check up
+      QVERIFY( !queue.enqueue( key( "res3", 3 ), SyncQueue::OnDemand, 0 ) );
+      const QList<SyncQueue::Request> queued = queue.queued();
+      QCOMPARE( keys( queued ), QList<SyncQueue::Key>() << key( "res4", 4 ) << key( "res3", 3 )
+                                                       << key( "res1", 1 ) << key( "res2", 2 ) );
+      QCOMPARE( queued.at( 1 ).priority, SyncQueue::OnDemand );
+      QCOMPARE( queued.at( 1 ).queued, 0ll );
+
+      // On-demand requests are not limited by the total limit, interval checks are
+      QCOMPARE( keys( queue.start( 10 ) ), QList<SyncQueue::Key>() << key( "res4", 4 ) << key( "res3", 3 ) );
+      QCOMPARE( queue.runningCount(), 2 );
+      QVERIFY( queue.start( 10 ).isEmpty() );
+
+      queue.finish( QLatin1String( "res4" ) );
+      QVERIFY( queue.start( 20 ).isEmpty() );
+      queue.finish( QLatin1String( "res3" ) );
+      QCOMPARE( keys( queue.start( 30 ) ), QList<SyncQueue::Key>() << key( "res1", 1 ) );
+      QCOMPARE( queue.runningCount(), 1 );
+    }
+
+    void testResourceLimit()
+    {
+      SyncQueue queue( 4, 1 );
+      queue.enqueue( key( "res1", 1 ), SyncQueue::Interval, 0 );
+      queue.enqueue( key( "res1", 2 ), SyncQueue::OnDemand, 0 );
+      queue.enqueue( key( "res2", 3 ), SyncQueue::Interval, 0 );
+
+      // One at a time per resource, even on demand
+      QCOMPARE( keys( queue.start( 0 ) ), QList<SyncQueue::Key>() << key( "res1", 2 ) << key( "res2", 3 ) );
+      QCOMPARE( keys( queue.queued() ), QList<SyncQueue::Key>() << key( "res1", 1 ) );
+      QCOMPARE( queue.finish( QLatin1String( "res2" ) ).count(), 1 );
+      QVERIFY( queue.start( 0 ).isEmpty() );
+      QCOMPARE( queue.finish( QLatin1String( "res1" ) ).count(), 1 );
+      QCOMPARE( keys( queue.start( 0 ) ), QList<SyncQueue::Key>() << key( "res1", 1 ) );
+      QVERIFY( queue.finish( QLatin1String( "res3" ) ).isEmpty() );
+    }
+
+    void testTimeout()
+    {
+      SyncQueue queue( 4, 1 );
+      queue.enqueue( key( "res1", 1 ), SyncQueue::Interval, 0 );
+      queue.enqueue( key( "res2", 2 ), SyncQueue::Interval, 0 );
+      queue.start( 1000 );
+      QVERIFY( queue.expired( 1500, 1000 ).isEmpty() );
+
+      // Signs of life restart the timeout
+      queue.touch( QLatin1String( "res1" ), 1800 );
+      QCOMPARE( queue.expired( 2500, 1000 ), QStringList() << QLatin1String( "res2" ) );
+      queue.finish( QLatin1String( "res2" ) );
+      QVERIFY( queue.expired( 2500, 1000 ).isEmpty() );
+      QCOMPARE( queue.expired( 3000, 1000 ), QStringList() << QLatin1String( "res1" ) );
+    }
+};
+
+AKTEST_MAIN( SyncQueueTest )
+
+#include "syncqueuetest.moc"